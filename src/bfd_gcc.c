@@ -43,6 +43,21 @@ struct BFD_sym_tab {
        const char *name;       /* no strdup(). free() in bfd_close().  */
      };
 
+/*
+ * An address to line-number entry. Built once for each module from all the
+ * symbols in 'BFD_table::sym_tab[]'. Sorted on 'addr'.
+ * The 'func_id' and 'file_id' are indices into 'BFD_str_tab[]'.
+ *
+ * There is one entry per function symbol; not per line-record. So 'line' is
+ * where the function starts, not the line of an address inside it.
+ */
+struct BFD_line {
+       bfd_vma   addr;         /* absolute address of the function */
+       unsigned  file_id;
+       unsigned  line;         /* the function's first line */
+       unsigned  func_id;
+     };
+
 struct BFD_table {
        const char         *module;     /* from stkwalk.c. free() it there. */
        DWORD               base_addr;  /* it's base address */
@@ -52,8 +67,29 @@ struct BFD_table {
        unsigned            sym_count;  /* # of elements from above */
        struct BFD_sym_tab *sym;        /* some of the symbols copied from bfd_symbol_info() */
        unsigned            sym_top;    /* # of elements in above array */
+       struct BFD_line    *lines;      /* from build_line_table() */
+       unsigned            line_top;   /* # of elements in above array */
+     };
+
+/*
+ * The interned file- and function-names for all 'BFD_line' entries.
+ */
+#define BFD_STR_HASH_SIZE 1024   /* a power of 2 */
+#define BFD_STR_UNKNOWN   0      /* the id of "?" */
+
+struct BFD_str {
+       struct BFD_str *next;     /* the next entry in this 'BFD_str_hash[]' bucket */
+       DWORD           hash;
+       unsigned        id;
+       const char     *str;
      };
 
+static struct BFD_str  *BFD_str_hash [BFD_STR_HASH_SIZE];
+static const char     **BFD_str_tab = NULL;  /* growable array; id -> string */
+static unsigned         BFD_str_top = 0;
+static unsigned         BFD_str_max = 0;
+static struct arena    *BFD_arena   = NULL;  /* for the strings and 'BFD_str' entries */
+
 struct find_data {
        const char   *name;
        const char   *module;
@@ -70,6 +106,8 @@ static struct BFD_table *BFD_table = NULL;    /* growable array of all local dat
 static unsigned          BFD_table_top = 0;   /* top-index in above array */
 
 static void        sort_symbol_table (struct BFD_table *BFD);
+static void        build_line_table (struct BFD_table *BFD);
+static unsigned    intern_string (const char *str);
 static const char *get_flavour (bfd *b);
 static const char *get_file_flags (flagword flags);
 static const char *get_sym_flags (flagword flags);
@@ -78,6 +116,8 @@ static const char *get_sec_flags (flagword flags);
 void BFD_init (void)
 {
   bfd_init();
+  BFD_arena = arena_new ("BFD", 32*1024);
+  intern_string ("?");    /* == BFD_STR_UNKNOWN */
 }
 
 void BFD_dump (void)
@@ -92,9 +132,11 @@ void BFD_dump (void)
 
   for (i = 0; i < BFD_table_top; i++, BFD++)
       TRACE (4, "module: %-15.15s, base_addr: 0x%08lX, mod_size: %7lu, BFD: 0x%p, BFD->BFD: 0x%p, "
-                "sym_count: %4u, sym: 0x%p, sym_top: %4u, sym_tab: 0x%p\n",
+                "sym_count: %4u, sym: 0x%p, sym_top: %4u, sym_tab: 0x%p, line_top: %4u\n",
              basename(BFD->module), BFD->base_addr, BFD->mod_size, BFD, BFD->BFD,
-             BFD->sym_count, BFD->sym, BFD->sym_top, BFD->sym_tab);
+             BFD->sym_count, BFD->sym, BFD->sym_top, BFD->sym_tab, BFD->line_top);
+
+  TRACE (4, "%u interned file/function names.\n", BFD_str_top);
 }
 
 int BFD_load_debug_symbols (const char *fname, bfd_vma base_addr, DWORD mod_size)
@@ -207,6 +249,7 @@ int BFD_load_debug_symbols (const char *fname, bfd_vma base_addr, DWORD mod_size
    * Hence sort only the entries we added for this module.
    */
   sort_symbol_table (BFD);
+  build_line_table (BFD);
   BFD_table_top++;
   return (1);
 }
@@ -227,7 +270,10 @@ void BFD_unload_debug_symbols (const char *module)
   {
     free (BFD->sym);
     free (BFD->sym_tab);
-    BFD->sym_top = 0;
+    free (BFD->lines);
+    BFD->lines    = NULL;
+    BFD->line_top = 0;
+    BFD->sym_top  = 0;
     bfd_close (BFD->BFD);
     BFD->BFD = NULL;
   }
@@ -243,6 +289,13 @@ void BFD_unload_all_symbols (void)
   free (BFD_table);
   BFD_table = NULL;
   BFD_table_top = 0;
+
+  free (BFD_str_tab);
+  arena_free (BFD_arena);
+  memset (&BFD_str_hash, '\0', sizeof(BFD_str_hash));
+  BFD_str_tab = NULL;
+  BFD_str_top = BFD_str_max = 0;
+  BFD_arena   = NULL;
 }
 
 int BFD_demangle (const char *module, const char *raw_name, char *und_name, size_t und_size)
@@ -284,6 +337,140 @@ static void sort_symbol_table (struct BFD_table *BFD)
   }
 }
 
+/*
+ * Return the id of 'str' in 'BFD_str_tab[]'. Add a copy of it if not found.
+ */
+static unsigned intern_string (const char *str)
+{
+  struct BFD_str *e;
+  const BYTE     *p;
+  DWORD           hash = 2166136261U;   /* FNV-1a */
+  unsigned        idx;
+
+  if (!str || !*str || !BFD_arena)
+     return (BFD_STR_UNKNOWN);
+
+  for (p = (const BYTE*)str; *p; p++)
+      hash = (hash ^ *p) * 16777619U;
+
+  idx = hash & (BFD_STR_HASH_SIZE-1);
+  for (e = BFD_str_hash[idx]; e; e = e->next)
+      if (e->hash == hash && !strcmp(e->str,str))
+         return (e->id);
+
+  if (BFD_str_top == BFD_str_max)
+  {
+    unsigned     max = BFD_str_max ? 2*BFD_str_max : 512;
+    const char **tab = realloc (BFD_str_tab, max * sizeof(*tab));
+
+    if (!tab)
+       return (BFD_STR_UNKNOWN);
+    BFD_str_tab = tab;
+    BFD_str_max = max;
+  }
+
+  e = arena_alloc (BFD_arena, sizeof(*e));
+  if (!e)
+     return (BFD_STR_UNKNOWN);
+
+  e->str  = arena_strdup (BFD_arena, str);
+  if (!e->str)
+     return (BFD_STR_UNKNOWN);
+  e->hash = hash;
+  e->id   = BFD_str_top++;
+  e->next = BFD_str_hash [idx];
+  BFD_str_hash [idx] = e;
+  BFD_str_tab [e->id] = e->str;
+  return (e->id);
+}
+
+static int compare_line (const struct BFD_line *a,
+                         const struct BFD_line *b)
+{
+  if (a->addr < b->addr)
+     return (-1);
+  if (a->addr > b->addr)
+     return (1);
+  return (0);
+}
+
+/*
+ * Build the sorted 'BFD->lines[]' table from all named symbols in an
+ * allocated section. This does the 'bfd_find_line()' calls once here
+ * instead of in each 'BFD_get_function_name()'.
+ */
+static void build_line_table (struct BFD_table *BFD)
+{
+  struct BFD_line *line;
+  unsigned         i, j;
+
+  BFD->lines    = calloc (BFD->sym_count ? BFD->sym_count : 1, sizeof(*BFD->lines));
+  BFD->line_top = 0;
+  if (!BFD->lines)
+     return;
+
+  for (i = 0; i < BFD->sym_count; i++)
+  {
+    struct bfd_symbol  *sym = BFD->sym_tab[i];
+    struct bfd_section *sec;
+    const char         *file = NULL;
+    unsigned int        line_no = 0;
+
+    if (!sym || !sym->name || sym->name[0] == '.')
+       continue;
+
+    sec = bfd_get_section (sym);
+    if (!sec || !(bfd_get_section_flags(BFD->BFD,sec) & SEC_ALLOC))
+       continue;
+
+    bfd_find_line (BFD->BFD, BFD->sym_tab, sym, &file, &line_no);
+
+    line = BFD->lines + BFD->line_top++;
+    line->addr    = bfd_get_section_vma (BFD->BFD, sec) + sym->value;
+    line->func_id = intern_string (bfd_asymbol_name(sym));
+    line->file_id = intern_string (file);
+    line->line    = line_no;
+  }
+
+  qsort (BFD->lines, BFD->line_top, sizeof(*BFD->lines), (CompareFunc)compare_line);
+
+  /* Drop aliases; keep the first symbol at an address.
+   */
+  for (i = j = 0; i < BFD->line_top; i++)
+  {
+    if (j > 0 && BFD->lines[j-1].addr == BFD->lines[i].addr)
+       continue;
+    BFD->lines[j++] = BFD->lines[i];
+  }
+  BFD->line_top = j;
+
+  TRACE (2, "built a line-table of %4u entries for module %-20.20s.\n",
+         BFD->line_top, basename(BFD->module));
+}
+
+/*
+ * Binary search for the entry with the nearest lower address.
+ */
+static const struct BFD_line *find_line_by_addr (const struct BFD_table *BFD, bfd_vma address)
+{
+  const struct BFD_line *found = NULL;
+  unsigned lo = 0, hi = BFD->line_top;
+
+  while (lo < hi)
+  {
+    unsigned mid = lo + (hi - lo) / 2;
+
+    if (BFD->lines[mid].addr <= address)
+    {
+      found = BFD->lines + mid;
+      lo = mid + 1;
+    }
+    else
+      hi = mid;
+  }
+  return (found);
+}
+
 #ifdef NOT_USED
 /*
  * Find the BFD for an virtual address. The address in the
@@ -479,9 +666,11 @@ static const char *get_sec_flags (flagword flags)
   return flags_decode (flags, sec_flgs, DIM(sec_flgs));
 }
 
+#ifdef NOT_USED
 /*
  * Loop over all symbols in this section and find the closest
  * (nearest lower) address specified in 'find->address'.
+ * Superseded by 'build_line_table()' and 'find_line_by_addr()'.
  */
 static int find_address_in_section (struct BFD_table   *BFD,
                                     struct bfd_section *sec,
@@ -559,40 +748,44 @@ static int find_address_in_section (struct BFD_table   *BFD,
 #endif
   return (0);
 }
+#endif  /* NOT_USED */
 
 int BFD_get_function_name (bfd_vma address, char *ret_buf, size_t buf_size)
 {
-  static char buf[300];
-  struct BFD_table *BFD = BFD_table;
-  int    i;
+  const struct BFD_table *BFD = BFD_table;
+  const struct BFD_line  *line;
+  int   i;
 
   *ret_buf = '\0';
 
   for (i = 0; i < BFD_table_top; BFD++, i++)
   {
-    struct find_data    find;
-    struct bfd_section *sec;
+    const char *module;
+    long        offset;
 
     if (address < BFD->base_addr || address >= (BFD->base_addr + BFD->mod_size))
        continue;
 
-    find.address = address;
-    find.offset  = 0;
-    find.line    = 0;
-    find.file    = "?";
+    /* Find the closest (nearest lower) address that has a public symbol
+     * in the prebuilt 'BFD->lines[]'.
+     */
+    line = find_line_by_addr (BFD, address);
+    if (!line)
+       continue;
 
-    /* Loop over all sections ('sec') in this BFD and find the closest
-     * (nearest lower) address that has a public symbol in 'BFD->sym_tab'.
+    module = shorten_path (BFD->module);
+    offset = (long) (address - line->addr);
+
+    /* 'line->line' is the start of the function. Say so, since the
+     * dbghelp path in stkwalk.c prints the line of 'address' itself.
      */
-    for (sec = BFD->BFD->sections; sec; sec = sec->next)
-    {
-      if (find_address_in_section(BFD,sec,&find))
-      {
-        snprintf (ret_buf, buf_size, VMA_X_FMT ": %s!%s+%lXh",
-                  address, find.module, find.name, find.offset);
-        return (0);
-      }
-    }
+    if (line->line > 0)
+         snprintf (ret_buf, buf_size, VMA_X_FMT ": %s!%s+%lXh ~2(function at %s(%u))~1",
+                   address, module, BFD_str_tab[line->func_id], offset,
+                   shorten_path(BFD_str_tab[line->file_id]), line->line);
+    else snprintf (ret_buf, buf_size, VMA_X_FMT ": %s!%s+%lXh",
+                   address, module, BFD_str_tab[line->func_id], offset);
+    return (0);
   }
   return (-1);
 }
@@ -60,26 +60,71 @@ struct file_name_entry {
        DWORD  crc32;
      };
 
-static smartlist_t *fname_list = NULL;
+static smartlist_t  *fname_list  = NULL;
+static struct arena *fname_arena = NULL;  /* the entries and their names */
 static const char  *fname_cache_get (const char *fname);
 static const char  *fname_cache_add (const char *fname);
 static void         fname_cache_free (void);
 static void         fname_cache_dump (void);
 
 static DWORD crc_bytes (const char *buf, size_t len);
+static void  bin_cache_unpublish (void);
 
 #define TRACE_BUF_SIZE (2*1024)
 
-static char *trace_ptr, *trace_end;
-static char  trace_buf [TRACE_BUF_SIZE];
+/*
+ * The state of the trace-line being formatted.
+ * Normally only 'trace_main' is used (protected by 'crit_sect').
+ * With 'g_cfg.trace_ring = 1', each thread formats into the line of
+ * it's own 'struct trace_ring'.
+ */
+struct trace_line {
+       char *ptr;
+       char *end;
+       BOOL  get_color;
+       BOOL  tilde_escape;
+       char  buf [TRACE_BUF_SIZE];
+     };
 
-static BOOL tilde_escape = TRUE;
+/*
+ * A per-thread single-producer / single-consumer ring-buffer.
+ * Only the owning thread advances 'head' and only the writer-thread
+ * advances 'tail'. Both are free-running counters; the offset into
+ * 'data' is 'counter & (size-1)'.
+ *
+ * A ring is never freed before 'trace_ring_exit()'. When it's thread
+ * exits, 'owner' is cleared and the ring is reused by the next new thread.
+ */
+struct trace_ring {
+       struct trace_ring *next;
+       volatile LONG      owner;
+       volatile LONG      head;
+       volatile LONG      tail;
+       DWORD              size;
+       char              *data;
+       struct trace_line  line;
+     };
+
+static struct trace_line           trace_main;
+static struct trace_ring *volatile ring_list = NULL;
+
+static BOOL          ring_active = FALSE;
+static DWORD         ring_size;
+static DWORD         ring_tls = TLS_OUT_OF_INDEXES;
+static HANDLE        ring_event, ring_done, ring_thread;
+static volatile LONG ring_stop, ring_busy, ring_waits;
+
+static void trace_line_reset (struct trace_line *l)
+{
+  l->ptr = l->buf;
+  l->end = l->buf + TRACE_BUF_SIZE - 1;
+  l->get_color    = FALSE;
+  l->tilde_escape = TRUE;
+}
 
 void common_init (void)
 {
-  tilde_escape = TRUE;
-  trace_ptr = trace_buf;
-  trace_end = trace_ptr + TRACE_BUF_SIZE - 1;
+  trace_line_reset (&trace_main);
 }
 
 void common_exit (void)
@@ -88,7 +133,8 @@ void common_exit (void)
      fname_cache_dump();
 
   fname_cache_free();
-  trace_ptr = trace_end = NULL;
+  bin_cache_unpublish();
+  trace_main.ptr = trace_main.end = NULL;
 }
 
 #define ADD_VALUE(code,str) { code, #code, str }
@@ -890,14 +936,15 @@ static const char *fname_cache_get (const char *fname)
 
   if (!fname_list)
   {
-    fname_list = smartlist_new();
+    fname_list  = smartlist_new();
+    fname_arena = arena_new ("fname_cache", 16*1024);
     return (NULL);
   }
-  max = smartlist_len (fname_list);
+  max = smartlist_len_fast (fname_list);
 
   for (i = 0; i < max; i++)
   {
-    fe = smartlist_get (fname_list, i);
+    fe = smartlist_get_fast (fname_list, i);
     if (crc32 == fe->crc32)
        return (fe->real_name ? fe->real_name : fe->orig_name);
   }
@@ -913,20 +960,23 @@ static const char *fname_cache_add (const char *fname)
   size_t fn_len = strlen (fname);
   char   buf [MAX_PATH];
 
-  fn = malloc (sizeof(*fn) + fn_len + 1);
+  fn = arena_alloc (fname_arena, sizeof(*fn) + fn_len + 1);
   if (!fn)
      return (NULL);
 
   fn->crc32     = crc_bytes (fname, fn_len);
   fn->orig_name = str_replace ('\\', '/', strcpy((char*)(fn+1), fname));
+  fn->real_name = NULL;
 
   if (GetLongPathName(fname, buf, sizeof(buf)))
   {
-    fn->real_name = str_replace ('\\', '/', strdup(buf));
-    _fix_drive (fn->real_name);
+    fn->real_name = arena_strdup (fname_arena, buf);
+    if (fn->real_name)
+    {
+      str_replace ('\\', '/', fn->real_name);
+      _fix_drive (fn->real_name);
+    }
   }
-  else
-    fn->real_name = NULL;
 
   smartlist_add (fname_list, fn);
   return (fn->real_name ? fn->real_name : fn->orig_name);
@@ -947,19 +997,12 @@ static void fname_cache_dump (void)
   }
 }
 
-static void fname_cache_free_one (void *e)
-{
-  struct file_name_entry *fn = (struct file_name_entry*) e;
-
-  free (fn->real_name);
-  free (fn);
-}
-
 static void fname_cache_free (void)
 {
-  if (fname_list)
-     smartlist_wipe (fname_list, fname_cache_free_one);
-  fname_list = NULL;
+  smartlist_free (fname_list);
+  arena_free (fname_arena);
+  fname_list  = NULL;
+  fname_arena = NULL;
 }
 
 /*
@@ -990,37 +1033,387 @@ void debug_printf (const char *file, unsigned line, const char *fmt, ...)
   LEAVE_CRIT();
 }
 
+/*
+ * Return the block of this thread in 'tls'. On the first use in a thread,
+ * take over a block in '*list' released by 'tls_block_release()' or add
+ * a new zeroed block of 'size' bytes. Then '*first' is set.
+ *
+ * The blocks are never freed before '*list' is; a thread using a block
+ * just sets it's 'owner'.
+ * The callers are mostly hooks where the caller wants the 'WSAGetLastError()'
+ * value of the real function. 'TlsGetValue()' clears it; hence keep it.
+ */
+void *tls_block_get (DWORD tls, void *volatile *list, size_t size, BOOL *first)
+{
+  struct tls_block *b, *next;
+  DWORD  err;
+  LONG   tid;
+
+  if (first)
+     *first = FALSE;
+
+  err = GetLastError();
+  b = TlsGetValue (tls);
+  if (b)
+  {
+    SetLastError (err);
+    return (b);
+  }
+
+  tid = (LONG) GetCurrentThreadId();
+
+  for (b = *list; b; b = b->next)
+      if (InterlockedCompareExchange(&b->owner, tid, 0) == 0)
+         break;
+
+  if (!b)
+  {
+    b = calloc (1, size);
+    if (!b)
+    {
+      SetLastError (err);
+      return (NULL);
+    }
+    b->owner = tid;
+    do
+    {
+      next = *list;
+      b->next = next;
+    }
+    while (InterlockedCompareExchangePointer(list, b, next) != next);
+  }
+
+  TlsSetValue (tls, b);
+  if (first)
+     *first = TRUE;
+  SetLastError (err);
+  return (b);
+}
+
+/*
+ * Called on 'DLL_THREAD_DETACH'. Let another thread reuse the block
+ * of this thread.
+ */
+void tls_block_release (DWORD tls)
+{
+  struct tls_block *b = TlsGetValue (tls);
+
+  if (b)
+  {
+    TlsSetValue (tls, NULL);
+    InterlockedExchange (&b->owner, 0);
+  }
+}
+
+/*
+ * Return the ring-buffer of the calling thread.
+ * Allocate a new one (or reuse a released one) on first use.
+ */
+static struct trace_ring *trace_ring_get (void)
+{
+  struct trace_ring *r;
+  BOOL   first;
+
+  r = tls_block_get (ring_tls, (void*volatile*)&ring_list, sizeof(*r), &first);
+  if (!r)
+     return (NULL);
+
+  if (!r->data)
+  {
+    r->data = malloc (ring_size);
+    if (!r->data)
+       return (NULL);
+    r->size = ring_size;
+    first = TRUE;
+  }
+  if (first)
+     trace_line_reset (&r->line);
+  return (r);
+}
+
+static __inline struct trace_line *trace_line_get (void)
+{
+  struct trace_ring *r;
+
+  if (!ring_active)
+     return (&trace_main);
+  r = trace_ring_get();
+  return (r ? &r->line : &trace_main);
+}
+
+/*
+ * Copy a formatted line into the calling thread's ring.
+ * This is the only work a traced call does in ring-mode; no file-I/O
+ * and no cross-thread locks. If the ring is full, wake the writer and
+ * wait for it.
+ */
+static void trace_ring_put (struct trace_ring *r, const char *buf, size_t len)
+{
+  DWORD head = (DWORD) r->head;
+  DWORD used, ofs, chunk;
+
+  while (1)
+  {
+    used = head - (DWORD) InterlockedCompareExchange (&r->tail, 0, 0);
+    if (r->size - used >= len)
+       break;
+    if (ring_stop)
+       return;
+    InterlockedIncrement (&ring_waits);
+    SetEvent (ring_event);
+    Sleep (1);
+  }
+
+  ofs   = head & (r->size - 1);
+  chunk = min ((DWORD)len, r->size - ofs);
+  memcpy (r->data + ofs, buf, chunk);
+  memcpy (r->data, buf + chunk, len - chunk);
+  InterlockedExchange (&r->head, (LONG)(head + len));
+
+  if (used + len >= r->size / 2)
+     SetEvent (ring_event);
+}
+
+/*
+ * Write to 'g_cfg.trace_stream' or to the gzip-stream on it.
+ * Set via a function-pointer since the programs sharing this file
+ * are not linked with 'trace_gz.c'.
+ */
+static size_t trace_stream_write (const void *buf, size_t len)
+{
+  if (g_cfg.trace_gz)
+     return (*g_cfg.trace_gz_write) (g_cfg.trace_gz, buf, len);
+  return fwrite (buf, 1, len, g_cfg.trace_stream);
+}
+
+/*
+ * Write out whatever is in all the rings.
+ * Only called by the writer-thread (or by 'trace_ring_exit()' when the
+ * writer-thread is gone). 'ring_busy' ensures only one does it.
+ */
+static size_t trace_ring_drain (void)
+{
+  struct trace_ring *r;
+  DWORD  head, tail, ofs, chunk;
+  size_t total = 0;
+
+  ws_sema_wait();
+
+  for (r = ring_list; r; r = r->next)
+  {
+    tail = (DWORD) r->tail;
+    head = (DWORD) InterlockedCompareExchange (&r->head, 0, 0);
+
+    while (tail != head)
+    {
+      ofs   = tail & (r->size - 1);
+      chunk = min (head - tail, r->size - ofs);
+      trace_stream_write (r->data + ofs, chunk);
+      tail  += chunk;
+      total += chunk;
+    }
+    InterlockedExchange (&r->tail, (LONG)tail);
+  }
+  if (total > 0 && !g_cfg.trace_gz)
+     fflush (g_cfg.trace_stream);
+
+  ws_sema_release();
+  return (total);
+}
+
+static DWORD WINAPI trace_ring_writer (void *arg)
+{
+  while (!ring_stop)
+  {
+    WaitForSingleObject (ring_event, 20);
+    if (InterlockedCompareExchange(&ring_busy, 1, 0) == 0)
+    {
+      trace_ring_drain();
+      InterlockedExchange (&ring_busy, 0);
+    }
+  }
+  SetEvent (ring_done);
+  ARGSUSED (arg);
+  return (0);
+}
+
+/*
+ * Start the ring-buffer mode and the writer-thread.
+ * 'size' is the size of each thread's ring in kBytes. Rounded up to
+ * a power of 2.
+ */
+BOOL trace_ring_init (DWORD size)
+{
+  DWORD tid;
+
+  if (ring_active || !g_cfg.trace_stream || g_cfg.trace_use_ods)
+     return (FALSE);
+
+  if (size == 0)
+     size = 64;
+  ring_size = 16*1024;
+  while (ring_size < 1024*size && ring_size < 0x10000000)
+     ring_size <<= 1;
+
+  ring_tls   = TlsAlloc();
+  ring_event = CreateEvent (NULL, FALSE, FALSE, NULL);
+  ring_done  = CreateEvent (NULL, TRUE, FALSE, NULL);
+  ring_stop  = ring_busy = ring_waits = 0;
+
+  if (ring_tls != TLS_OUT_OF_INDEXES && ring_event && ring_done)
+     ring_thread = CreateThread (NULL, 0, trace_ring_writer, NULL, 0, &tid);
+
+  if (!ring_thread)
+  {
+    TRACE (0, "Failed to start the trace-ring writer: %s.\n", win_strerror(GetLastError()));
+    trace_ring_exit();
+    return (FALSE);
+  }
+  ring_active = TRUE;
+  TRACE (2, "trace-rings of %lu bytes, writer thread-id: %lu.\n",
+         DWORD_CAST(ring_size), DWORD_CAST(tid));
+
+  /* Colours are set on the console when a line is formatted, but the
+   * line is written later by the writer-thread. Hence 'trace_color_set()'
+   * ignores them.
+   */
+  if (g_cfg.trace_stream == stdout && !g_cfg.stdout_redirected)
+     TRACE (1, "No colours with 'trace_ring = 1'.\n");
+  return (TRUE);
+}
+
+/*
+ * Stop the writer-thread, write out what's left and free all rings.
+ *
+ * Since this is called from 'DllMain()', we cannot wait for the thread
+ * handle. Wait for 'ring_done' instead. At process exit, the writer-thread
+ * could already be killed. Then just drain the rings here.
+ *
+ * The 'Sleep()' loop only runs if the writer-thread is alive but has not
+ * finished it's last drain within the 500 msec. It waits at most 500 msec
+ * more and does not need the loader-lock.
+ * If 'ring_busy' cannot be taken, the writer is still draining (or was
+ * killed while doing it). Then the rings are left alone; draining them
+ * too would mix or repeat the lines.
+ */
+void trace_ring_exit (void)
+{
+  struct trace_ring *r, *next;
+  DWORD  code;
+  BOOL   killed;
+  int    i;
+
+  if (ring_active)
+  {
+    trace_ring_thread_exit();
+    ring_stop = 1;
+    SetEvent (ring_event);
+
+    killed = (GetExitCodeThread(ring_thread, &code) && code != STILL_ACTIVE);
+    if (!killed)
+       WaitForSingleObject (ring_done, 500);
+
+    for (i = 0; InterlockedCompareExchange(&ring_busy, 1, 0) != 0; i++)
+    {
+      if (killed || i >= 50)
+      {
+        ring_active = FALSE;
+        return;
+      }
+      Sleep (10);
+    }
+    if (g_cfg.trace_stream)
+       trace_ring_drain();
+  }
+  ring_active = FALSE;
+
+  for (r = ring_list; r; r = next)
+  {
+    next = r->next;
+    free (r->data);
+    free (r);
+  }
+  ring_list = NULL;
+
+  if (ring_thread)
+     CloseHandle (ring_thread);
+  if (ring_event)
+     CloseHandle (ring_event);
+  if (ring_done)
+     CloseHandle (ring_done);
+  if (ring_tls != TLS_OUT_OF_INDEXES)
+     TlsFree (ring_tls);
+  ring_thread = ring_event = ring_done = NULL;
+  ring_tls = TLS_OUT_OF_INDEXES;
+}
+
+/*
+ * Called from DllMain(): dwReason == DLL_THREAD_DETACH.
+ * Push out any partial line and release the ring of this thread.
+ */
+void trace_ring_thread_exit (void)
+{
+  struct trace_ring *r;
+
+  if (!ring_active)
+     return;
+
+  r = TlsGetValue (ring_tls);
+  if (r && r->data && r->line.ptr > r->line.buf)
+     trace_ring_put (r, r->line.buf, r->line.ptr - r->line.buf);
+  tls_block_release (ring_tls);
+}
+
+/*
+ * Return the number of times a thread had to wait for room in it's ring.
+ */
+DWORD trace_ring_waits (void)
+{
+  return (DWORD) ring_waits;
+}
+
 /*
  * Indent a printed line to 'indent' spaces.
  */
 int trace_indent (size_t indent)
 {
-  int rc = 0;
-  int save = tilde_escape;
+  struct trace_line *l = trace_line_get();
+  int    rc = 0;
+  int    save = l->tilde_escape;
 
-  tilde_escape = FALSE;  /* never look for '~' now */
+  l->tilde_escape = FALSE;  /* never look for '~' now */
   while (indent--)
     rc += trace_putc (' ');
-  tilde_escape = save;
+  l->tilde_escape = save;
   return (rc);
 }
 
 /*
  * Write out the trace-buffer.
+ * In ring-mode, just copy it to the ring of this thread.
  */
 size_t trace_flush (void)
 {
-  size_t len = trace_ptr - trace_buf;
+  struct trace_ring *r = ring_active ? trace_ring_get() : NULL;
+  struct trace_line *l = r ? &r->line : &trace_main;
+  size_t len = l->ptr - l->buf;
   size_t written = len;
 
   assert (len <= TRACE_BUF_SIZE);
 
+  if (r)
+  {
+    trace_ring_put (r, l->buf, len);
+    l->ptr = l->buf;
+    return (written);
+  }
+
   ws_sema_wait();
 
   if (g_cfg.trace_use_ods)
   {
-    *trace_ptr = '\0';
-    OutputDebugStringA (trace_buf);
+    *l->ptr = '\0';
+    OutputDebugStringA (l->buf);
   }
   else if (g_cfg.trace_stream)
   {
@@ -1028,12 +1421,12 @@ size_t trace_flush (void)
      * Use 'fwrite()' (a bit slower than '_write()') so the Lua-output
      * written using 'io.write()' is in sync with our trace-output.
      */
-    written = (int) fwrite (trace_buf, 1, (size_t)len, g_cfg.trace_stream);
+    written = (int) trace_stream_write (l->buf, (size_t)len);
 #if defined(__WATCOMC__)
     fflush (g_cfg.trace_stream);
 #endif
   }
-  trace_ptr = trace_buf;   /* restart buffer */
+  l->ptr = l->buf;   /* restart buffer */
 
   ws_sema_release();
 
@@ -1051,9 +1444,12 @@ int trace_printf (const char *fmt, ...)
   l1 = trace_puts (buf);
 
   if (l1 < l2)
-    FATAL ("l1: %d, l2: %d. trace_buf: '%.*s',\nbuf: '%s'\n",
-           l1, l2, (int)(trace_ptr - trace_buf), trace_buf, buf);
+  {
+    const struct trace_line *l = trace_line_get();
 
+    FATAL ("l1: %d, l2: %d. trace_buf: '%.*s',\nbuf: '%s'\n",
+           l1, l2, (int)(l->ptr - l->buf), l->buf, buf);
+  }
   va_end (args);
   return (l2);
 }
@@ -1065,29 +1461,125 @@ int trace_vprintf (const char *fmt, va_list args)
 
   l1 = trace_puts (buf);
   if (l1 < l2)
-    FATAL ("l1: %d, l2: %d. trace_buf: '%.*s',\nbuf: '%s'\n",
-           l1, l2, (int)(trace_ptr - trace_buf), trace_buf, buf);
+  {
+    const struct trace_line *l = trace_line_get();
 
+    FATAL ("l1: %d, l2: %d. trace_buf: '%.*s',\nbuf: '%s'\n",
+           l1, l2, (int)(l->ptr - l->buf), l->buf, buf);
+  }
   return (l2);
 }
 
+/*
+ * Map a "~N" colour index to the 'g_cfg' colour it stands for.
+ * A NULL '*color' means the default colour.
+ */
+static BOOL trace_color_lookup (int col_idx, const WORD **color)
+{
+  switch (col_idx)
+  {
+    case 0:
+         *color = NULL;     /* restore to default colour */
+         return (TRUE);
+    case 1:
+         *color = &g_cfg.color_trace;
+         return (TRUE);
+    case 2:
+         *color = &g_cfg.color_file;
+         return (TRUE);
+    case 3:
+         *color = &g_cfg.color_time;
+         return (TRUE);
+    case 4:
+         *color = &g_cfg.color_data;
+         return (TRUE);
+    case 5:
+         *color = &g_cfg.color_func;
+         return (TRUE);
+    case 8:
+         *color = &g_cfg.lua.color_head;
+         return (TRUE);
+    case 9:
+         *color = &g_cfg.lua.color_body;
+         return (TRUE);
+  }
+  return (FALSE);
+}
+
+static void trace_color_set (const WORD *color)
+{
+  /* No colours in ring-mode; the writer-thread outputs the lines later.
+   */
+  if (!g_cfg.trace_use_ods && !ring_active)
+  {
+    trace_flush();
+    set_color (color);
+  }
+}
+
+/*
+ * Switch to colour 'col_idx'. The same as a "~N" in a string given
+ * to 'trace_putc()', but without the escape-parsing.
+ */
+void trace_color (int col_idx)
+{
+  const WORD *color;
+
+  if (g_cfg.test_trace)
+  {
+    trace_putc ('~');
+    trace_putc ('0' + col_idx);
+  }
+  else if (trace_color_lookup(col_idx, &color))
+    trace_color_set (color);
+}
+
+/*
+ * Return a pointer into the trace-buffer with room for 'len' bytes.
+ * Flushes the buffer first if needed. The caller formats straight into
+ * it and then calls 'trace_commit()' with the end of what it wrote.
+ * The text must not contain any '~' escapes or newlines.
+ *
+ * Returns NULL if there is no buffer or 'len' is too large.
+ */
+char *trace_reserve (size_t len)
+{
+  struct trace_line *l = trace_line_get();
+
+  if (!l->ptr || !l->end || len >= TRACE_BUF_SIZE - 2)
+     return (NULL);
+
+  if (l->ptr + len >= l->end - 1)
+     trace_flush();
+  return (l->ptr);
+}
+
+void trace_commit (const char *end)
+{
+  struct trace_line *l = trace_line_get();
+
+  assert (end >= l->ptr);
+  assert (end < l->end - 1);
+  l->ptr = (char*) end;
+}
+
 int trace_putc (int ch)
 {
-  static BOOL get_color = FALSE;  /* \todo: this must be a "Thread Local" value */
+  struct trace_line *l = trace_line_get();
   int    rc = 0;
 
-  if (!trace_ptr || !trace_end)
+  if (!l->ptr || !l->end)
      return (0);
 
-  assert (trace_ptr >= trace_buf);
-  assert (trace_ptr < trace_end-1);
+  assert (l->ptr >= l->buf);
+  assert (l->ptr < l->end-1);
 
-  if (tilde_escape && get_color && !g_cfg.test_trace)
+  if (l->tilde_escape && l->get_color && !g_cfg.test_trace)
   {
-    const WORD *color;
+    const WORD *color = NULL;
     int         col_idx;
 
-    get_color = FALSE;
+    l->get_color = FALSE;
 
     /* If we got "~~", print a single "~"
     */
@@ -1095,98 +1587,69 @@ int trace_putc (int ch)
        goto put_it;
 
     col_idx = ch - '0';
-    switch (col_idx)
+    if (!trace_color_lookup(col_idx, &color))
     {
-      case 0:
-           color = NULL;     /* restore to default colour */
-           break;
-      case 1:
-           color = &g_cfg.color_trace;
-           break;
-      case 2:
-           color = &g_cfg.color_file;
-           break;
-      case 3:
-           color = &g_cfg.color_time;
-           break;
-      case 4:
-           color = &g_cfg.color_data;
-           break;
-      case 5:
-           color = &g_cfg.color_func;
-           break;
-      case 8:
-           color = &g_cfg.lua.color_head;
-           break;
-      case 9:
-           color = &g_cfg.lua.color_body;
-           break;
-      default:
 #if defined(_DEBUG) || defined(__NO_INLINE__)
-          /*
-           * Some strangness with 'gcc -O0' or 'cl -MDd'
-           */
-           if (ch == ' ')
-              return (1);
+      /*
+       * Some strangness with 'gcc -O0' or 'cl -MDd'
+       */
+      if (ch == ' ')
+         return (1);
 #endif
-           trace_flush();
-           FATAL ("Illegal color index %d ('%c'/0x%02X) in trace_buf: '%.*s'\n",
-                  col_idx, ch, ch, (int)(trace_ptr - trace_buf), trace_buf);
-           break;
-    }
-
-    if (!g_cfg.trace_use_ods)
-    {
       trace_flush();
-      set_color (color);
+      FATAL ("Illegal color index %d ('%c'/0x%02X) in trace_buf: '%.*s'\n",
+             col_idx, ch, ch, (int)(l->ptr - l->buf), l->buf);
     }
+    trace_color_set (color);
     return (1);
   }
 
-  if (tilde_escape && ch == '~' && !g_cfg.test_trace)
+  if (l->tilde_escape && ch == '~' && !g_cfg.test_trace)
   {
-    get_color = TRUE;
+    l->get_color = TRUE;
     return (1);
   }
 
   if (ch == '\n' && (trace_binmode || g_cfg.trace_use_ods))
   {
-    if ((trace_ptr == trace_buf) ||
-        (trace_ptr > trace_buf && trace_ptr[-1] != '\r'))
+    if ((l->ptr == l->buf) ||
+        (l->ptr > l->buf && l->ptr[-1] != '\r'))
     {
-      *trace_ptr++ = '\r';
+      *l->ptr++ = '\r';
       rc++;
     }
   }
 
 put_it:
-  *trace_ptr++ = ch;
+  *l->ptr++ = ch;
   rc++;
 
-  if (ch == '\n' || trace_ptr >= trace_end)
+  if (ch == '\n' || l->ptr >= l->end)
      trace_flush();
   return (rc);
 }
 
 int trace_putc_raw (int ch)
 {
-  int  rc;
-  BOOL save = tilde_escape;
+  struct trace_line *l = trace_line_get();
+  int    rc;
+  BOOL   save = l->tilde_escape;
 
-  tilde_escape = FALSE;
+  l->tilde_escape = FALSE;
   rc = trace_putc (ch);
-  tilde_escape = save;
+  l->tilde_escape = save;
   return (rc);
 }
 
 int trace_puts_raw (const char *str)
 {
-  int  rc;
-  BOOL save = tilde_escape;
+  struct trace_line *l = trace_line_get();
+  int    rc;
+  BOOL   save = l->tilde_escape;
 
-  tilde_escape = FALSE;
+  l->tilde_escape = FALSE;
   rc = trace_puts (str);
-  tilde_escape = save;
+  l->tilde_escape = save;
   return (rc);
 }
 
@@ -1221,6 +1684,28 @@ int trace_level_save_restore (int pop)
   return (val);
 }
 
+/**
+ * Put the name of `file` with a "-<id>" inserted before it's extension
+ * in `buf`. E.g. "c:/temp/wstrace.txt" + 1234 -> "c:/temp/wstrace-1234.txt".
+ * For the `trace_file_split` setting.
+ */
+char *get_split_name (const char *file, DWORD id, char *buf, size_t size)
+{
+  const char *dot    = strrchr (file, '.');
+  const char *slash  = strrchr (file, '/');
+  const char *bslash = strrchr (file, '\\');
+  size_t      len;
+
+  if (bslash > slash)
+     slash = bslash;
+  if (!dot || (slash && dot < slash))
+     dot = strchr (file, '\0');
+
+  len = dot - file;
+  snprintf (buf, size, "%.*s-%lu%s", (int)len, file, DWORD_CAST(id), dot);
+  return (buf);
+}
+
 /**
  * Open an existing file (or create) in share-mode but deny other
  * processes to write to the file.
@@ -1618,6 +2103,558 @@ int file_exists (const char *fname)
   return (attr != INVALID_FILE_ATTRIBUTES || access(fname,0) == 0);
 }
 
+/*
+ * The binary cache-file written by 'bin_cache_write()'.
+ *
+ * A 'bin_cache_header' followed by 'num_sect' sections; each aligned
+ * to 'BIN_CACHE_ALIGN' bytes. The 'kind' is the caller's type and version
+ * of the data. The size and modification time of each source-file is
+ * recorded so a changed source makes the cache stale.
+ *
+ * The sections must not contain pointers since the file is mapped at a
+ * random address. And since the layout of the caller's structures can
+ * differ between compilers and CPUs, the 'builder' and 'ptr_size' must
+ * match too.
+ *
+ * The same image is also published in a named section shared by all
+ * traced programs. Similar to the "IP2location_Shm" in ip2loc.c.
+ * A small named section "Local\wsock_trace.<session>.<kind>.<crc>" holds
+ * the current generation 'N' of the image in section "<that name>.N".
+ * The session-ID keeps programs in other logon-sessions (services, other
+ * users) from publishing a section we would attach to. Since a section
+ * could still be written by someone else, all it's offsets and sizes are
+ * checked before use; like for the cache-file.
+ * A program that rebuilds the image (because a source-file was updated)
+ * publishes it under the next generation. Programs already attached to
+ * an older generation keep it until they exit.
+ */
+#define BIN_CACHE_MAGIC    0x43425357   /* "WSBC" */
+#define BIN_CACHE_VERSION  1
+#define BIN_CACHE_ALIGN    16
+#define BIN_CACHE_SHARED   8            /* max published sections in this program */
+
+struct bin_cache_header {
+       volatile LONG magic;             /* set last when published */
+       WORD          version;
+       WORD          ptr_size;
+       DWORD         kind;
+       DWORD         num_src;
+       DWORD         num_sect;
+       DWORD         reserved;
+       char          builder [32];
+       struct {
+         unsigned __int64 size;
+         unsigned __int64 mtime;
+       } src [BIN_CACHE_MAX_SRC];
+       struct {
+         DWORD  ofs;
+         DWORD  size;
+         DWORD  count;
+         DWORD  reserved;
+       } sect [BIN_CACHE_MAX_SECT];
+     };
+
+#define BIN_CACHE_ALIGNED(x)  (((x) + BIN_CACHE_ALIGN - 1) & ~(BIN_CACHE_ALIGN - 1))
+
+/*
+ * The named sections published by this program. Kept open until
+ * 'bin_cache_unpublish()' so they live as long as this program does.
+ */
+static HANDLE bin_cache_published [2*BIN_CACHE_SHARED];
+static int    bin_cache_num_published;
+
+/**
+ * Fill the header common to both `bin_cache_open()` and `bin_cache_write()`.
+ * The cache-file-name is the first non-NULL source-file with a `.cache` suffix.
+ * The `shm_name` is the name of the section with the current generation.
+ */
+static BOOL bin_cache_header_init (struct bin_cache_header *hdr, char *fname, size_t fname_len,
+                                   char *shm_name, size_t shm_name_len,
+                                   DWORD kind, const char **sources, int num_src, int num_sect)
+{
+  DWORD session;
+  int   i;
+
+  if (num_src <= 0 || num_src > BIN_CACHE_MAX_SRC || num_sect <= 0 || num_sect > BIN_CACHE_MAX_SECT)
+     return (FALSE);
+
+  memset (hdr, '\0', sizeof(*hdr));
+  hdr->magic    = BIN_CACHE_MAGIC;
+  hdr->version  = BIN_CACHE_VERSION;
+  hdr->ptr_size = sizeof(void*);
+  hdr->kind     = kind;
+  hdr->num_src  = num_src;
+  hdr->num_sect = num_sect;
+  _strlcpy (hdr->builder, get_builder(), sizeof(hdr->builder));
+
+  *fname = '\0';
+  for (i = 0; i < num_src; i++)
+  {
+    struct stat st;
+
+    if (!sources[i] || stat(sources[i], &st) != 0)
+       continue;
+    hdr->src[i].size  = (unsigned __int64) st.st_size;
+    hdr->src[i].mtime = (unsigned __int64) st.st_mtime;
+    if (!*fname)
+       snprintf (fname, fname_len, "%s.cache", sources[i]);
+  }
+  if (!*fname)
+     return (FALSE);
+
+  /* The section-name cannot contain any '\' after the namespace.
+   * Hence use a CRC of the file-name.
+   */
+  if (!ProcessIdToSessionId(GetCurrentProcessId(), &session))
+     session = 0;
+  snprintf (shm_name, shm_name_len, "Local\\wsock_trace.%lu.%08lX.%08lX",
+            DWORD_CAST(session), DWORD_CAST(kind),
+            DWORD_CAST(crc_bytes(fname, strlen(fname))));
+  return (TRUE);
+}
+
+/**
+ * Check the mapped header in `bc->view` against the expected `hdr`.
+ * And set the sections of `bc` if okay.
+ *
+ * Each section must be aligned, must not overlap the header and
+ * must be within the `size` bytes mapped.
+ */
+static BOOL bin_cache_check (struct bin_cache *bc, const struct bin_cache_header *hdr,
+                             size_t size, const char *what)
+{
+  const struct bin_cache_header *mapped = (const struct bin_cache_header*) bc->view;
+  DWORD i;
+
+  if (size < sizeof(*hdr) ||
+      mapped->magic != hdr->magic || mapped->version != hdr->version ||
+      mapped->ptr_size != hdr->ptr_size || mapped->kind != hdr->kind ||
+      mapped->num_src != hdr->num_src ||
+      mapped->num_sect == 0 || mapped->num_sect > BIN_CACHE_MAX_SECT ||
+      strncmp(mapped->builder, hdr->builder, sizeof(hdr->builder)) ||
+      memcmp(&mapped->src, &hdr->src, sizeof(hdr->src)))
+  {
+    TRACE (2, "Binary cache \"%s\" is stale.\n", what);
+    return (FALSE);
+  }
+
+  for (i = 0; i < mapped->num_sect; i++)
+  {
+    DWORD ofs = mapped->sect[i].ofs;
+
+    if (ofs < BIN_CACHE_ALIGNED(sizeof(*hdr)) || (ofs & (BIN_CACHE_ALIGN-1)) ||
+        ofs > size || mapped->sect[i].size > size - ofs)
+    {
+      TRACE (1, "Binary cache \"%s\" is truncated or has a bad section %lu.\n",
+             what, DWORD_CAST(i));
+      return (FALSE);
+    }
+    bc->sect[i].data  = bc->view + ofs;
+    bc->sect[i].size  = mapped->sect[i].size;
+    bc->sect[i].count = mapped->sect[i].count;
+  }
+  bc->num_sect = mapped->num_sect;
+  TRACE (2, "Mapped binary cache \"%s\" with %lu sections.\n", what, DWORD_CAST(bc->num_sect));
+  return (TRUE);
+}
+
+/**
+ * Attach read-only to the current generation of the published section.
+ */
+static BOOL bin_cache_open_shared (struct bin_cache *bc, const struct bin_cache_header *hdr,
+                                   const char *shm_name)
+{
+  MEMORY_BASIC_INFORMATION mbi;
+  char   name [100];
+  HANDLE gen_map;
+  const volatile LONG *gen;
+
+  gen_map = OpenFileMappingA (FILE_MAP_READ, FALSE, shm_name);
+  if (!gen_map)
+     return (FALSE);
+
+  gen = MapViewOfFile (gen_map, FILE_MAP_READ, 0, 0, sizeof(*gen));
+  if (gen)
+  {
+    bc->generation = *gen;
+    UnmapViewOfFile ((void*)gen);
+  }
+  CloseHandle (gen_map);
+  if (!gen || bc->generation == 0)
+     return (FALSE);
+
+  snprintf (name, sizeof(name), "%s.%lu", shm_name, DWORD_CAST(bc->generation));
+  bc->map = OpenFileMappingA (FILE_MAP_READ, FALSE, name);
+  if (bc->map)
+     bc->view = MapViewOfFile (bc->map, FILE_MAP_READ, 0, 0, 0);
+
+  /* A section still being written has no 'magic' yet.
+   */
+  if (bc->view && VirtualQuery(bc->view, &mbi, sizeof(mbi)) == sizeof(mbi) &&
+      bin_cache_check(bc, hdr, mbi.RegionSize, name))
+     return (TRUE);
+
+  bin_cache_close (bc);
+  return (FALSE);
+}
+
+/**
+ * Open and memory-map the binary cache for `sources`.
+ * Tries the published section first, then the cache-file.
+ *
+ * \param[out] bc       the mapped cache with it's sections.
+ * \param[in]  kind     the caller's type and version of the data.
+ * \param[in]  sources  the `num_src` source-files the cache was built from.
+ *                      A source can be NULL.
+ * \retval TRUE if the cache exists and is up to date.
+ */
+BOOL bin_cache_open (struct bin_cache *bc, DWORD kind, const char **sources, int num_src)
+{
+  struct bin_cache_header hdr;
+  char   fname [_MAX_PATH];
+  char   shm_name [60];
+  HANDLE file;
+  DWORD  size;
+
+  memset (bc, '\0', sizeof(*bc));
+
+  /* The number of sections is not known yet; use 1 for the checks.
+   */
+  if (!bin_cache_header_init(&hdr, fname, sizeof(fname), shm_name, sizeof(shm_name),
+                             kind, sources, num_src, 1))
+     return (FALSE);
+
+  if (bin_cache_open_shared(bc, &hdr, shm_name))
+     return (TRUE);
+
+  if (g_cfg.bin_cache == 2)   /* no cache-file; only the published section */
+     return (FALSE);
+
+  file = CreateFileA (fname, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE)
+  {
+    TRACE (2, "No binary cache \"%s\".\n", fname);
+    return (FALSE);
+  }
+
+  size = GetFileSize (file, NULL);
+  if (size != INVALID_FILE_SIZE && size >= sizeof(hdr))
+     bc->map = CreateFileMapping (file, NULL, PAGE_READONLY, 0, 0, NULL);
+  CloseHandle (file);   /* the mapping keeps the file open */
+
+  if (bc->map)
+     bc->view = MapViewOfFile (bc->map, FILE_MAP_READ, 0, 0, 0);
+  if (!bc->view)
+  {
+    TRACE (2, "Failed to map \"%s\": %s\n", fname, win_strerror(GetLastError()));
+    bin_cache_close (bc);
+    return (FALSE);
+  }
+  if (!bin_cache_check(bc, &hdr, size, fname))
+  {
+    bin_cache_close (bc);
+    return (FALSE);
+  }
+  return (TRUE);
+}
+
+/**
+ * Return the data of section `idx` in `bc` if it's elements are
+ * of `el_size` bytes. Otherwise NULL.
+ */
+const void *bin_cache_get (const struct bin_cache *bc, int idx, size_t el_size, DWORD *count)
+{
+  const struct bin_cache_sect *sect;
+
+  if (idx < 0 || (DWORD)idx >= bc->num_sect)
+     return (NULL);
+
+  sect = bc->sect + idx;
+  if (el_size == 0 || sect->count > sect->size / el_size ||
+      (size_t)sect->size != el_size * sect->count)
+     return (NULL);
+  *count = sect->count;
+  return (sect->data);
+}
+
+void bin_cache_close (struct bin_cache *bc)
+{
+  if (bc->view)
+     UnmapViewOfFile ((void*)bc->view);
+  if (bc->map)
+     CloseHandle (bc->map);
+  memset (bc, '\0', sizeof(*bc));
+}
+
+/**
+ * Copy the image of `hdr` and `sect` into a new generation of `shm_name`.
+ * The `magic` is set last; until then the new section is ignored by
+ * `bin_cache_open_shared()`.
+ */
+static BOOL bin_cache_publish (const struct bin_cache_header *hdr, DWORD total, const char *shm_name,
+                               const struct bin_cache_sect *sect, int num_sect)
+{
+  struct bin_cache_header *image;
+  volatile LONG *gen;
+  HANDLE gen_map, map = NULL;
+  char   name [100];
+  int    i;
+
+  if (bin_cache_num_published + 2 > DIM(bin_cache_published))
+     return (FALSE);
+
+  gen_map = CreateFileMappingA (INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(*gen), shm_name);
+  if (!gen_map)
+     return (FALSE);
+
+  gen = MapViewOfFile (gen_map, FILE_MAP_WRITE, 0, 0, sizeof(*gen));
+  if (!gen)
+  {
+    CloseHandle (gen_map);
+    return (FALSE);
+  }
+
+  /* If all users of 'shm_name' have exited, the generation restarts at 1.
+   * But a generation can still be used by another program. So skip those.
+   */
+  for (i = 0; i < 10 && !map; i++)
+  {
+    LONG next = InterlockedIncrement (gen);
+
+    snprintf (name, sizeof(name), "%s.%lu", shm_name, DWORD_CAST(next));
+    map = CreateFileMappingA (INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, total, name);
+    if (map && GetLastError() == ERROR_ALREADY_EXISTS)
+    {
+      CloseHandle (map);
+      map = NULL;
+    }
+  }
+  UnmapViewOfFile ((void*)gen);
+
+  image = map ? MapViewOfFile (map, FILE_MAP_WRITE, 0, 0, 0) : NULL;
+  if (!image)
+  {
+    if (map)
+       CloseHandle (map);
+    CloseHandle (gen_map);
+    return (FALSE);
+  }
+
+  memcpy (image, hdr, sizeof(*hdr));
+  image->magic = 0;
+  for (i = 0; i < num_sect; i++)
+      memcpy ((BYTE*)image + hdr->sect[i].ofs, sect[i].data, sect[i].size);
+  InterlockedExchange (&image->magic, hdr->magic);
+  UnmapViewOfFile (image);
+
+  bin_cache_published [bin_cache_num_published++] = gen_map;
+  bin_cache_published [bin_cache_num_published++] = map;
+  TRACE (2, "Published binary cache \"%s\" of %s bytes.\n", name, dword_str(total));
+  return (TRUE);
+}
+
+/**
+ * Close the sections published by this program.
+ * Called from `common_exit()`.
+ */
+static void bin_cache_unpublish (void)
+{
+  int i;
+
+  for (i = 0; i < bin_cache_num_published; i++)
+      CloseHandle (bin_cache_published[i]);
+  bin_cache_num_published = 0;
+}
+
+/**
+ * Publish the `num_sect` sections in `sect` and write them to the binary
+ * cache-file for `sources`.
+ *
+ * The file is written under a temporary name and then renamed. Thus
+ * another program never maps a partial file. This fails (harmlessly)
+ * if the directory of the first source-file is not writable or another
+ * program has the old cache mapped.
+ */
+BOOL bin_cache_write (DWORD kind, const char **sources, int num_src,
+                      const struct bin_cache_sect *sect, int num_sect)
+{
+  static const BYTE zeroes [BIN_CACHE_ALIGN];
+  struct bin_cache_header hdr;
+  char   fname [_MAX_PATH];
+  char   shm_name [60];
+  char   tmp_file [_MAX_PATH+20];
+  DWORD  ofs;
+  FILE  *f;
+  BOOL   rc;
+  int    i;
+
+  if (!bin_cache_header_init(&hdr, fname, sizeof(fname), shm_name, sizeof(shm_name),
+                             kind, sources, num_src, num_sect))
+     return (FALSE);
+
+  ofs = BIN_CACHE_ALIGNED (sizeof(hdr));
+  for (i = 0; i < num_sect; i++)
+  {
+    hdr.sect[i].ofs   = ofs;
+    hdr.sect[i].size  = sect[i].size;
+    hdr.sect[i].count = sect[i].count;
+    ofs += BIN_CACHE_ALIGNED (sect[i].size);
+  }
+
+  rc = bin_cache_publish (&hdr, ofs, shm_name, sect, num_sect);
+  if (g_cfg.bin_cache == 2)
+     return (rc);
+
+  snprintf (tmp_file, sizeof(tmp_file), "%s.%lu", fname, DWORD_CAST(GetCurrentProcessId()));
+  f = fopen (tmp_file, "wb");
+  if (!f)
+  {
+    TRACE (2, "Failed to create \"%s\"; errno: %d.\n", tmp_file, errno);
+    return (rc);
+  }
+
+  rc = (fwrite(&hdr, sizeof(hdr), 1, f) == 1);
+  ofs = sizeof(hdr);
+  for (i = 0; rc && i < num_sect; i++)
+  {
+    size_t pad = hdr.sect[i].ofs - ofs;
+
+    if (pad > 0 && fwrite(zeroes, pad, 1, f) != 1)
+       rc = FALSE;
+    else if (sect[i].size > 0 && fwrite(sect[i].data, sect[i].size, 1, f) != 1)
+       rc = FALSE;
+    ofs = hdr.sect[i].ofs + sect[i].size;
+  }
+  if (fclose(f) != 0)
+     rc = FALSE;
+
+  if (rc)
+     rc = MoveFileExA (tmp_file, fname, MOVEFILE_REPLACE_EXISTING);
+  if (!rc)
+  {
+    TRACE (2, "Failed to write binary cache \"%s\".\n", fname);
+    DeleteFileA (tmp_file);
+    return (FALSE);
+  }
+  TRACE (2, "Wrote binary cache \"%s\" of %s bytes.\n", fname, dword_str(ofs));
+  return (TRUE);
+}
+
+/*
+ * A simple bump-allocator for lookup-tables that are built once and
+ * freed all at once. Each 'arena_alloc()' carves from the current block;
+ * a new block is allocated when it is full. A request larger than a
+ * quarter of the block-size gets a block of it's own.
+ *
+ * Not thread-safe; the caller must serialise the use of an arena.
+ */
+#define ARENA_ALIGN  16
+#define ARENA_ALIGNED(x)  (((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena_block {
+       struct arena_block *next;
+       size_t              size;    /* usable size after the header */
+       size_t              used;
+     };
+
+#define ARENA_HDR_SIZE  ARENA_ALIGNED (sizeof(struct arena_block))
+
+struct arena *arena_new (const char *name, size_t block_size)
+{
+  struct arena *a = calloc (1, sizeof(*a));
+
+  if (!a)
+     return (NULL);
+  a->name       = name;
+  a->block_size = block_size < 4096 ? 4096 : block_size;
+  return (a);
+}
+
+/*
+ * Return 'size' zeroed bytes from 'a'. Or NULL if 'a' is NULL or malloc() fails.
+ */
+void *arena_alloc (struct arena *a, size_t size)
+{
+  struct arena_block *b;
+  BYTE  *ret;
+
+  if (!a)
+     return (NULL);
+
+  size = ARENA_ALIGNED (size);
+  b = a->blocks;
+
+  if (size > a->block_size / 4)
+  {
+    /* Insert a dedicated block after the current one.
+     */
+    struct arena_block *big = malloc (ARENA_HDR_SIZE + size);
+
+    if (!big)
+       return (NULL);
+    big->size = big->used = size;
+    if (b)
+    {
+      big->next = b->next;
+      b->next   = big;
+    }
+    else
+    {
+      big->next = NULL;
+      a->blocks = big;
+    }
+    ret = (BYTE*)big + ARENA_HDR_SIZE;
+  }
+  else
+  {
+    if (!b || b->used + size > b->size)
+    {
+      b = malloc (ARENA_HDR_SIZE + a->block_size);
+      if (!b)
+         return (NULL);
+      b->size   = a->block_size;
+      b->used   = 0;
+      b->next   = a->blocks;
+      a->blocks = b;
+    }
+    ret = (BYTE*)b + ARENA_HDR_SIZE + b->used;
+    b->used += size;
+  }
+  a->num_allocs++;
+  a->bytes_used += size;
+  memset (ret, '\0', size);
+  return (ret);
+}
+
+char *arena_strdup (struct arena *a, const char *str)
+{
+  size_t len = strlen (str);
+  char  *s = arena_alloc (a, len + 1);
+
+  if (s)
+     memcpy (s, str, len + 1);
+  return (s);
+}
+
+/*
+ * Release all blocks of 'a' and 'a' itself.
+ */
+void arena_free (struct arena *a)
+{
+  struct arena_block *b, *next;
+
+  if (!a)
+     return;
+
+  for (b = a->blocks; b; b = next)
+  {
+    next = b->next;
+    free (b);
+  }
+  free (a);
+}
+
 /*
  * Include the resource-file. This is the only place (besides the makefiles)
  * where the basenames for 'wsock_trace*.dll' is set. We use these here to
@@ -184,10 +184,31 @@ extern int    trace_puts     (const char *str);
 extern int    trace_puts_raw (const char *str);
 extern int    trace_putc     (int ch);
 extern int    trace_putc_raw (int ch);
+extern void   trace_color    (int col_idx);
+extern char  *trace_reserve  (size_t len);
+extern void   trace_commit   (const char *end);
 extern int    trace_indent   (size_t indent);
 extern size_t trace_flush    (void);
 extern int    trace_level_save_restore (int pop);
 
+/* Per-thread trace ring-buffers and the writer-thread.
+ */
+extern BOOL   trace_ring_init (DWORD size);
+extern void   trace_ring_exit (void);
+extern void   trace_ring_thread_exit (void);
+extern DWORD  trace_ring_waits (void);
+
+/* Per-thread blocks reused after their thread exits.
+ * A block must start with these 2 members.
+ */
+struct tls_block {
+       struct tls_block *next;
+       volatile LONG     owner;   /* thread-id using this block or 0 */
+     };
+
+extern void  *tls_block_get     (DWORD tls, void *volatile *list, size_t size, BOOL *first);
+extern void   tls_block_release (DWORD tls);
+
 /* Init/exit functions for stuff in common.c.
  */
 extern void common_init (void);
@@ -272,8 +293,57 @@ extern char * _utoa10w (int value, int width, char *buf);
 extern char * getenv_expand (const char *variable, char *buf, size_t size);
 extern int    _setenv (const char *env, const char *val, int overwrite);
 extern FILE * fopen_excl (const char *file, const char *mode);
+extern char * get_split_name (const char *file, DWORD id, char *buf, size_t size);
 extern int    file_exists (const char *fname);
 
+/*
+ * A versioned binary snapshot of some parsed lookup-tables.
+ * Written next to the first of it's source-files and published in a
+ * named section. Both are memory-mapped read-only by later programs
+ * if the sources have not changed.
+ */
+#define BIN_CACHE_MAX_SRC   4
+#define BIN_CACHE_MAX_SECT  8
+
+struct bin_cache_sect {
+       const void *data;
+       DWORD       size;     /* total size of 'data' */
+       DWORD       count;    /* number of elements in 'data' */
+     };
+
+struct bin_cache {
+       HANDLE                map;
+       const BYTE           *view;
+       LONG                  generation;   /* of the shared section or 0 */
+       DWORD                 num_sect;
+       struct bin_cache_sect sect [BIN_CACHE_MAX_SECT];
+     };
+
+extern BOOL        bin_cache_open  (struct bin_cache *bc, DWORD kind, const char **sources, int num_src);
+extern const void *bin_cache_get   (const struct bin_cache *bc, int idx, size_t el_size, DWORD *count);
+extern void        bin_cache_close (struct bin_cache *bc);
+extern BOOL        bin_cache_write (DWORD kind, const char **sources, int num_src,
+                                    const struct bin_cache_sect *sect, int num_sect);
+
+/*
+ * A bump-allocator for the nodes of a lookup-table. All nodes are
+ * released at once with 'arena_free()'.
+ */
+struct arena_block;
+
+struct arena {
+       const char         *name;
+       size_t              block_size;
+       struct arena_block *blocks;      /* the current block first */
+       DWORD               num_allocs;
+       size_t              bytes_used;
+     };
+
+extern struct arena *arena_new    (const char *name, size_t block_size);
+extern void         *arena_alloc  (struct arena *a, size_t size);
+extern char         *arena_strdup (struct arena *a, const char *str);
+extern void          arena_free   (struct arena *a);
+
 extern const char *get_dll_full_name (void);
 extern void        set_dll_full_name (HINSTANCE inst_dll);
 extern const char *get_dll_short_name (void);
@@ -4,6 +4,8 @@
  * \brief
  *  `cpu_init()` is for obtaining the number of CPU cores and the
  *  average CPU frequency.
+ *  The `latency_*()` functions keep per-thread histograms of the
+ *  time spent in the real WinSock functions.
  *
  * cpu.c - Part of Wsock-Trace.
  */
@@ -13,11 +15,17 @@
 #include <time.h>
 #include <windows.h>
 
+#if !defined(_MSC_VER) && (defined(__i386__) || defined(__x86_64__))
+  #include <cpuid.h>
+#endif
+
 #define IN_CPU_C
 
 #include "common.h"
 #include "init.h"
 #include "cpu.h"
+#include "wsock_trace.h"
+#include "shm_stats.h"
 
 #define MAX_CPUS 256
 
@@ -94,6 +102,33 @@ void cpu_init (void)
     TRACE (1, "CallNtPowerInformation() not present in \"powrprof.dll\".\n");
 }
 
+/*
+ * Return TRUE if the TSC runs at a constant rate in all P-, C- and T-states.
+ * Only then is RDTSC usable as a clock.
+ */
+BOOL cpu_has_invariant_tsc (void)
+{
+#if defined(HAVE_RDTSC) && defined(_MSC_VER)
+  int regs[4];
+
+  __cpuid (regs, 0x80000000);
+  if ((unsigned)regs[0] < 0x80000007)
+     return (FALSE);
+  __cpuid (regs, 0x80000007);
+  return ((regs[3] & (1 << 8)) != 0);
+
+#elif defined(HAVE_RDTSC)
+  unsigned eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+     return (FALSE);
+  return ((edx & (1 << 8)) != 0);
+
+#else
+  return (FALSE);
+#endif
+}
+
 /**
  * Print some times (and CPU cycle counts) for a thread.
  * I.e. the WinPcap receiver thread.
@@ -292,3 +327,265 @@ void print_perf_times (void)
     trace_printf ("  InterruptCount: %18s\n", dword_str(info[i].InterruptCount));
   }
 }
+
+/*
+ * Per-function latency histograms of the time spent inside the real
+ * `p_xxx()` WinSock function. Enabled by `latency_stats = 1`.
+ *
+ * Each thread counts into it's own `struct lat_thread` (found via TLS),
+ * so the hot path takes no locks. The blocks are never freed until exit;
+ * one left by a dead thread is reused by a new thread (the counts are
+ * cumulative anyway). All blocks are merged only in `latency_report()`.
+ *
+ * The histograms are log2-bucketed with `LAT_SUB` linear sub-buckets
+ * per power of 2 (like a HDR-histogram with 2 significant bits). The
+ * values are in QPC ticks; converted to usec only in the report.
+ * With `shm_stats = 1`, the buckets are also counted in the shared
+ * memory block of shm_stats.c.
+ */
+
+struct func_latency {
+       uint64  calls;
+       uint64  sum;
+       uint64  max;
+       DWORD   buckets [LAT_BUCKETS];
+     };
+
+struct lat_thread {
+       struct lat_thread    *next;
+       volatile LONG         owner;    /* thread-id using this block or 0 */
+       uint64                start;    /* QPC at 'latency_start()' */
+       struct func_latency **funcs;    /* indexed by 'ws2_func_slot()'; allocated on 1st call */
+     };
+
+static struct lat_thread *volatile lat_list = NULL;
+static DWORD lat_tls    = TLS_OUT_OF_INDEXES;
+static int   lat_funcs  = 0;
+static BOOL  lat_active = FALSE;
+
+static unsigned lat_bucket (uint64 v)
+{
+  uint64   x = v;
+  unsigned e = 0, b;
+
+  if (v < LAT_SUB)
+     return (unsigned) v;
+
+  /* 'e' = index of the highest bit set.
+   */
+  if (x >> 32) { x >>= 32; e += 32; }
+  if (x >> 16) { x >>= 16; e += 16; }
+  if (x >> 8)  { x >>= 8;  e += 8;  }
+  if (x >> 4)  { x >>= 4;  e += 4;  }
+  if (x >> 2)  { x >>= 2;  e += 2;  }
+  if (x >> 1)  {           e += 1;  }
+
+  b = LAT_SUB + LAT_SUB * (e - LAT_SUB_BITS) +
+      (unsigned) ((v >> (e - LAT_SUB_BITS)) & (LAT_SUB - 1));
+  return min (b, LAT_BUCKETS - 1);
+}
+
+/*
+ * The highest value that falls in bucket 'b'.
+ */
+static uint64 lat_bucket_high (unsigned b)
+{
+  unsigned octave, sub;
+
+  if (b < LAT_SUB)
+     return (b);
+  octave = (b - LAT_SUB) / LAT_SUB;
+  sub    = (b - LAT_SUB) % LAT_SUB;
+  return ((uint64)(LAT_SUB + sub + 1) << octave) - 1;
+}
+
+static struct lat_thread *lat_thread_get (void)
+{
+  struct lat_thread *t;
+
+  t = tls_block_get (lat_tls, (void*volatile*)&lat_list, sizeof(*t), NULL);
+  if (t && !t->funcs)
+  {
+    t->funcs = calloc (lat_funcs, sizeof(*t->funcs));
+    if (!t->funcs)
+       return (NULL);
+  }
+  return (t);
+}
+
+void latency_init (void)
+{
+  lat_funcs = ws2_func_num();
+  lat_tls = TlsAlloc();
+  lat_active = (lat_tls != TLS_OUT_OF_INDEXES && lat_funcs > 0);
+}
+
+void latency_exit (void)
+{
+  struct lat_thread *t, *next;
+  int    i;
+
+  if (!lat_active)
+     return;
+
+  lat_active = FALSE;
+  for (t = lat_list; t; t = next)
+  {
+    next = t->next;
+    for (i = 0; i < lat_funcs; i++)
+        free (t->funcs[i]);
+    free (t->funcs);
+    free (t);
+  }
+  lat_list = NULL;
+  TlsFree (lat_tls);
+  lat_tls = TLS_OUT_OF_INDEXES;
+}
+
+/*
+ * Called from DllMain(): dwReason == DLL_THREAD_DETACH.
+ * Let another thread reuse this block.
+ */
+void latency_thread_exit (void)
+{
+  if (lat_active)
+     tls_block_release (lat_tls);
+}
+
+/*
+ * Called from `INIT_PTR()` just before the real function is called.
+ */
+void latency_start (void)
+{
+  struct lat_thread *t;
+  LARGE_INTEGER      now;
+
+  if (!lat_active)
+     return;
+
+  t = lat_thread_get();
+  if (t)
+  {
+    QueryPerformanceCounter (&now);
+    t->start = now.QuadPart;
+  }
+}
+
+/*
+ * Called just after the real function at 'slot' returned.
+ * Keeps the 'WSAGetLastError()' value of it.
+ */
+void latency_end (int slot)
+{
+  struct lat_thread   *t;
+  struct func_latency *fl;
+  LARGE_INTEGER        now;
+  uint64               ticks;
+  DWORD                err;
+  unsigned             b;
+
+  if (!lat_active || slot < 0 || slot >= lat_funcs)
+     return;
+
+  QueryPerformanceCounter (&now);
+
+  err = GetLastError();
+  t = TlsGetValue (lat_tls);
+  if (!t || t->start == 0)
+     goto quit;
+
+  ticks = (uint64)now.QuadPart - t->start;
+  t->start = 0;
+
+  fl = t->funcs [slot];
+  if (!fl)
+  {
+    fl = calloc (1, sizeof(*fl));
+    if (!fl)
+       goto quit;
+    t->funcs [slot] = fl;
+  }
+  fl->calls++;
+  fl->sum += ticks;
+  if (ticks > fl->max)
+     fl->max = ticks;
+  b = lat_bucket (ticks);
+  fl->buckets [b]++;
+
+  if (g_cfg.shm_stats)
+     shm_stats_latency (slot, b);
+
+quit:
+  SetLastError (err);
+}
+
+/*
+ * Return the (upper) value in usec at percentile 'pct'.
+ */
+static double lat_percentile (const struct func_latency *fl, double pct)
+{
+  uint64   want = (uint64) ((double)fl->calls * pct / 100.0 + 0.5);
+  uint64   sum = 0;
+  unsigned b;
+
+  if (want == 0)
+     want = 1;
+
+  for (b = 0; b < LAT_BUCKETS; b++)
+  {
+    sum += fl->buckets[b];
+    if (sum >= want)
+       break;
+  }
+  if (b >= LAT_BUCKETS)
+     b = LAT_BUCKETS - 1;
+  return ((double) min(lat_bucket_high(b), fl->max) / (double)g_cfg.clocks_per_usec);
+}
+
+/*
+ * Merge the blocks of all threads and print the calls and
+ * p50/p99/p999/max latencies (in usec) for each function called.
+ */
+void latency_report (void)
+{
+  struct func_latency      sum;
+  const struct lat_thread *t;
+  BOOL     header = FALSE;
+  double   usec;
+  int      i;
+  unsigned b;
+
+  if (!lat_active || g_cfg.clocks_per_usec == 0)
+     return;
+
+  for (i = 0; i < lat_funcs; i++)
+  {
+    memset (&sum, '\0', sizeof(sum));
+    for (t = lat_list; t; t = t->next)
+    {
+      const struct func_latency *fl = t->funcs [i];
+
+      if (!fl)
+         continue;
+      sum.calls += fl->calls;
+      sum.sum   += fl->sum;
+      if (fl->max > sum.max)
+         sum.max = fl->max;
+      for (b = 0; b < LAT_BUCKETS; b++)
+          sum.buckets[b] += fl->buckets[b];
+    }
+    if (sum.calls == 0)
+       continue;
+
+    if (!header)
+    {
+      trace_puts ("  Latency (usec):              calls       avg       p50       p99      p999       max\n");
+      header = TRUE;
+    }
+    usec = (double)sum.sum / (double)sum.calls / (double)g_cfg.clocks_per_usec;
+    trace_printf ("    %-22.22s %11s %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                  ws2_func_name(i), qword_str(sum.calls), usec,
+                  lat_percentile(&sum, 50.0), lat_percentile(&sum, 99.0),
+                  lat_percentile(&sum, 99.9), (double)sum.max / (double)g_cfg.clocks_per_usec);
+  }
+}
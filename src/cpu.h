@@ -71,9 +71,39 @@ CPU_FUNC (NTSTATUS, CallNtPowerInformation,
                      void    *output_buf,
                      ULONG    output_buf_len));
 
+/*
+ * The CPU time-stamp counter for 'trace_tsc = 1'.
+ */
+#if (defined(_MSC_VER) && (_MSC_VER >= 1400) && (defined(_M_IX86) || defined(_M_X64))) || \
+    (defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)))
+  #if defined(_MSC_VER)
+    #include <intrin.h>
+  #else
+    #include <x86intrin.h>
+  #endif
+  #define HAVE_RDTSC
+  #define get_rdtsc()  __rdtsc()
+#endif
+
 extern void cpu_init (void);
+extern BOOL cpu_has_invariant_tsc (void);
 extern void print_thread_times (HANDLE thread);
 extern void print_process_times (void);
 extern void print_perf_times (void);
 
+/*
+ * The buckets of the latency-histograms in cpu.c and shm_stats.c.
+ */
+#define LAT_SUB_BITS  2
+#define LAT_SUB       (1 << LAT_SUB_BITS)
+#define LAT_OCTAVES   40      /* 2^42 QPC ticks at 10 MHz is ~5 days */
+#define LAT_BUCKETS   (LAT_SUB + LAT_SUB * LAT_OCTAVES)
+
+extern void latency_init        (void);
+extern void latency_exit        (void);
+extern void latency_thread_exit (void);
+extern void latency_start       (void);
+extern void latency_end         (int slot);
+extern void latency_report      (void);
+
 #endif /* _CPU_H */
@@ -0,0 +1,406 @@
+/**\file    dns_stats.c
+ * \ingroup Main
+ *
+ * \brief
+ *   Resolver latency statistics (`dns_stats = 1`).
+ *
+ *   The time blocked in `getaddrinfo()`, `gethostbyname()`, `gethostbyaddr()`
+ *   and `getnameinfo()` is added up for each queried name (or address for the
+ *   reverse lookups). The names are kept in an open-addressing hash-table
+ *   keyed on a hash of the lower-cased name. An entry counts the lookups,
+ *   failures, the total and max latency and how often the number of
+ *   addresses in the answer changed.
+ *
+ *   A forward lookup is also checked against the hosts-file with
+ *   `hosts_file_check_list()` to give the hosts-file hit-rate.
+ *
+ *   `dns_stats_report()` prints the `DNS_TOP_MAX` names with the most time
+ *   blocked. It is called from `trace_report()`.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "init.h"
+#include "hosts.h"
+#include "dns_stats.h"
+
+#define DNS_MIN_SLOTS  256      /* initial slots; a power of 2 */
+#define DNS_MAX_NAMES  10000    /* names kept; others are only in the totals */
+#define DNS_MAX_ADDR   16       /* addresses in an answer checked against the hosts-file */
+#define DNS_TOP_MAX    10       /* number of slowest names to report */
+
+struct dns_name {
+       char   *name;
+       DWORD   hash;
+       DWORD   lookups;
+       DWORD   failures;
+       DWORD   addr_changes;    /* times 'num_addr' changed */
+       int     num_addr;        /* addresses in the last successful answer; -1 if none yet */
+       uint64  total;           /* ticks blocked */
+       uint64  max;
+     };
+
+static struct dns_name **dns_slots;
+static DWORD             dns_size;          /* number of slots; a power of 2 */
+static DWORD             dns_used;
+static DWORD             dns_lookups;
+static DWORD             dns_failures;
+static DWORD             dns_not_kept;      /* lookups of names not kept */
+static DWORD             dns_hosts_checked; /* forward lookups checked against the hosts-file */
+static DWORD             dns_hosts_hits;
+static uint64            dns_total;
+static CRITICAL_SECTION  dns_lock;
+static BOOL              dns_active = FALSE;
+
+/*
+ * FNV-1a of the lower-cased name. The name is copied to 'key'.
+ */
+static DWORD dns_hash (const char *name, char *key, size_t size)
+{
+  DWORD  hash = 2166136261U;
+  size_t i;
+
+  for (i = 0; name[i] && i < size-1; i++)
+  {
+    key[i] = (char) tolower ((int)(BYTE)name[i]);
+    hash = (hash ^ (BYTE)key[i]) * 16777619U;
+  }
+  key[i] = '\0';
+  return (hash);
+}
+
+/*
+ * Rehash the table into 'new_size' slots.
+ */
+static BOOL dns_resize (DWORD new_size)
+{
+  struct dns_name **slots = calloc (new_size, sizeof(*slots));
+  DWORD  i, j, mask = new_size - 1;
+
+  if (!slots)
+     return (FALSE);
+
+  for (i = 0; i < dns_size; i++)
+  {
+    struct dns_name *dn = dns_slots[i];
+
+    if (!dn)
+       continue;
+    for (j = dn->hash & mask; slots[j]; j = (j + 1) & mask)
+        ;
+    slots[j] = dn;
+  }
+  free (dns_slots);
+  dns_slots = slots;
+  dns_size  = new_size;
+  return (TRUE);
+}
+
+/*
+ * Return the entry for 'key'. Add a new one if not found.
+ * Returns NULL if the table is full. With 'dns_lock' held.
+ */
+static struct dns_name *dns_get (const char *key, DWORD hash)
+{
+  struct dns_name *dn;
+  DWORD  i, mask;
+
+  if (dns_slots)
+  {
+    mask = dns_size - 1;
+    for (i = hash & mask; dns_slots[i]; i = (i + 1) & mask)
+    {
+      dn = dns_slots[i];
+      if (dn->hash == hash && !strcmp(dn->name, key))
+         return (dn);
+    }
+  }
+
+  if (dns_used >= DNS_MAX_NAMES)
+     return (NULL);
+
+  /* Keep the load below 50%.
+   */
+  if (2 * (dns_used + 1) > dns_size && !dns_resize(dns_size ? 2 * dns_size : DNS_MIN_SLOTS))
+     return (NULL);
+
+  dn = calloc (1, sizeof(*dn));
+  if (!dn)
+     return (NULL);
+
+  dn->name = strdup (key);
+  if (!dn->name)
+  {
+    free (dn);
+    return (NULL);
+  }
+  dn->hash = hash;
+  dn->num_addr = -1;
+
+  mask = dns_size - 1;
+  for (i = hash & mask; dns_slots[i]; i = (i + 1) & mask)
+      ;
+  dns_slots[i] = dn;
+  dns_used++;
+  return (dn);
+}
+
+/*
+ * Add one lookup of 'name' taking 'ticks'. 'num_addr' is the
+ * number of addresses in the answer or -1 if it failed.
+ * 'in_hosts' is -1 if not checked against the hosts-file.
+ */
+static void dns_stats_add (const char *name, uint64 ticks, int num_addr, int in_hosts)
+{
+  struct dns_name *dn;
+  char   key [MAX_HOST_LEN];
+  DWORD  hash;
+
+  if (!dns_active || !name || !*name)
+     return;
+
+  hash = dns_hash (name, key, sizeof(key));
+
+  EnterCriticalSection (&dns_lock);
+
+  dns_lookups++;
+  dns_total += ticks;
+  if (num_addr < 0)
+     dns_failures++;
+  if (in_hosts >= 0)
+  {
+    dns_hosts_checked++;
+    if (in_hosts > 0)
+       dns_hosts_hits++;
+  }
+
+  dn = dns_get (key, hash);
+  if (!dn)
+     dns_not_kept++;
+  else
+  {
+    dn->lookups++;
+    dn->total += ticks;
+    if (ticks > dn->max)
+       dn->max = ticks;
+    if (num_addr < 0)
+       dn->failures++;
+    else
+    {
+      if (dn->num_addr >= 0 && dn->num_addr != num_addr)
+         dn->addr_changes++;
+      dn->num_addr = num_addr;
+    }
+  }
+  LeaveCriticalSection (&dns_lock);
+}
+
+/*
+ * Add 'addr' of 'family' to the 'num' addresses in 'addrs[]' unless
+ * it's already there. Return the new number.
+ */
+static int dns_addr_add (int num, int *families, const void **addrs, int family, const void *addr)
+{
+  int i, size = (family == AF_INET) ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+
+  for (i = 0; i < num; i++)
+      if (families[i] == family && !memcmp(addrs[i], addr, size))
+         return (num);
+
+  if (num < DNS_MAX_ADDR)
+  {
+    families[num] = family;
+    addrs[num]    = addr;
+    num++;
+  }
+  return (num);
+}
+
+/*
+ * Return the number of 'num' addresses for 'name' in the hosts-file.
+ * Or -1 if the hosts-file is still being loaded by 'lazy_init = 1'.
+ */
+static int dns_hosts_check (const char *name, int num, const int *families, const void **addrs)
+{
+  BOOL found [DNS_MAX_ADDR];
+
+  if (!lazy_init_ready(LAZY_HOSTS))
+     return (-1);
+  if (num == 0)
+     return (0);
+  return hosts_file_check_list (name, num, families, addrs, found);
+}
+
+/**
+ * Called from `gethostbyname()` with the answer `he` or NULL.
+ */
+void dns_stats_hostent (const char *name, uint64 ticks, const struct hostent *he)
+{
+  const void *addrs [DNS_MAX_ADDR];
+  int         families [DNS_MAX_ADDR];
+  int         i, num = 0;
+
+  if (!dns_active)
+     return;
+
+  if (!he)
+  {
+    dns_stats_add (name, ticks, -1, -1);
+    return;
+  }
+
+  if (he->h_addrtype == AF_INET || he->h_addrtype == AF_INET6)
+     for (i = 0; he->h_addr_list[i]; i++)
+        num = dns_addr_add (num, families, addrs, he->h_addrtype, he->h_addr_list[i]);
+
+  dns_stats_add (name, ticks, num, dns_hosts_check(name, num, families, addrs));
+}
+
+/**
+ * Called from `getaddrinfo()` with the answer `ai` or NULL if it failed.
+ * There can be an entry for each socket-type of an address; these are
+ * counted once.
+ */
+void dns_stats_addrinfo (const char *name, uint64 ticks, const struct addrinfo *ai)
+{
+  const void *addrs [DNS_MAX_ADDR];
+  int         families [DNS_MAX_ADDR];
+  int         num = 0;
+
+  if (!dns_active)
+     return;
+
+  if (!ai)
+  {
+    dns_stats_add (name, ticks, -1, -1);
+    return;
+  }
+
+  for ( ; ai; ai = ai->ai_next)
+  {
+    if (ai->ai_family == AF_INET && ai->ai_addr)
+       num = dns_addr_add (num, families, addrs, AF_INET,
+                           &((const struct sockaddr_in*)ai->ai_addr)->sin_addr);
+    else if (ai->ai_family == AF_INET6 && ai->ai_addr)
+       num = dns_addr_add (num, families, addrs, AF_INET6,
+                           &((const struct sockaddr_in6*)ai->ai_addr)->sin6_addr);
+  }
+  dns_stats_add (name, ticks, num, dns_hosts_check(name, num, families, addrs));
+}
+
+/**
+ * Called from `gethostbyaddr()` and `getnameinfo()`.
+ * The `addr` is the address as a string.
+ */
+void dns_stats_reverse (const char *addr, uint64 ticks, BOOL ok)
+{
+  dns_stats_add (addr, ticks, ok ? 1 : -1, -1);
+}
+
+void dns_stats_init (void)
+{
+  InitializeCriticalSection (&dns_lock);
+  dns_slots = NULL;
+  dns_size = dns_used = 0;
+  dns_active = TRUE;
+}
+
+void dns_stats_exit (void)
+{
+  DWORD i;
+
+  if (!dns_active)
+     return;
+
+  dns_active = FALSE;
+  for (i = 0; i < dns_size; i++)
+  {
+    if (!dns_slots[i])
+       continue;
+    free (dns_slots[i]->name);
+    free (dns_slots[i]);
+  }
+  free (dns_slots);
+  dns_slots = NULL;
+  dns_size = dns_used = 0;
+  DeleteCriticalSection (&dns_lock);
+}
+
+static double dns_msec (uint64 ticks)
+{
+  return ((double)ticks / (double)g_cfg.ts_clocks_per_usec / 1000.0);
+}
+
+/*
+ * Called from 'trace_report()'. Print the totals and the names with
+ * the most time blocked in the resolver.
+ */
+void dns_stats_report (void)
+{
+  const struct dns_name *sorted [DNS_TOP_MAX];
+  struct dns_name        top [DNS_TOP_MAX];
+  char                   names [DNS_TOP_MAX][MAX_HOST_LEN];
+  int    i, num = 0;
+  DWORD  k;
+
+  if (!dns_active || dns_lookups == 0 || g_cfg.ts_clocks_per_usec == 0)
+     return;
+
+  EnterCriticalSection (&dns_lock);
+
+  /* Insertion-sort on the total time into 'sorted[]'.
+   */
+  for (k = 0; k < dns_size; k++)
+  {
+    const struct dns_name *dn = dns_slots[k];
+
+    if (!dn)
+       continue;
+    for (i = num; i > 0 && sorted[i-1]->total < dn->total; i--)
+        if (i < DNS_TOP_MAX)
+           sorted[i] = sorted[i-1];
+    if (i >= DNS_TOP_MAX)
+       continue;
+    sorted[i] = dn;
+    if (num < DNS_TOP_MAX)
+       num++;
+  }
+
+  /* Print from a copy since the hooks adds to the table with the 'crit_sect' held.
+   */
+  for (i = 0; i < num; i++)
+  {
+    top[i] = *sorted[i];
+    _strlcpy (names[i], sorted[i]->name, sizeof(names[i]));
+    top[i].name = names[i];
+  }
+
+  trace_printf ("  DNS lookups: %s lookups of %s names, %s failures, %.3f msec blocked.\n",
+                dword_str(dns_lookups), dword_str(dns_used), dword_str(dns_failures),
+                dns_msec(dns_total));
+  if (dns_not_kept > 0)
+     trace_printf ("    %s lookups of names beyond the first %d.\n",
+                   dword_str(dns_not_kept), DNS_MAX_NAMES);
+  if (dns_hosts_checked > 0)
+     trace_printf ("    hosts-file: %s hits in %s lookups (%.1f%%).\n",
+                   dword_str(dns_hosts_hits), dword_str(dns_hosts_checked),
+                   100.0 * (double)dns_hosts_hits / (double)dns_hosts_checked);
+
+  LeaveCriticalSection (&dns_lock);
+
+  if (num == 0)
+     return;
+
+  trace_puts ("    Slowest names (msec):          lookups  fails      total        avg        max  addr-changes\n");
+  for (i = 0; i < num; i++)
+  {
+    const struct dns_name *dn = top + i;
+
+    trace_printf ("      %-30.30s %7lu %6lu %10.3f %10.3f %10.3f  %lu\n",
+                  dn->name, DWORD_CAST(dn->lookups), DWORD_CAST(dn->failures),
+                  dns_msec(dn->total), dns_msec(dn->total) / (double)dn->lookups,
+                  dns_msec(dn->max), DWORD_CAST(dn->addr_changes));
+  }
+}
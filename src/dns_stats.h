@@ -0,0 +1,21 @@
+/**\file    dns_stats.h
+ * \ingroup Main
+ */
+#ifndef _DNS_STATS_H
+#define _DNS_STATS_H
+
+/*
+ * The 'get_ts_ticks()' before a resolver call and the ticks it took.
+ */
+#define DNS_STATS_START()       (g_cfg.dns_stats ? get_ts_ticks() : 0)
+#define DNS_STATS_TICKS(start)  (g_cfg.dns_stats ? get_ts_ticks() - (start) : 0)
+
+extern void dns_stats_init   (void);
+extern void dns_stats_exit   (void);
+extern void dns_stats_report (void);
+
+extern void dns_stats_hostent  (const char *name, uint64 ticks, const struct hostent *he);
+extern void dns_stats_addrinfo (const char *name, uint64 ticks, const struct addrinfo *ai);
+extern void dns_stats_reverse  (const char *addr, uint64 ticks, BOOL ok);
+
+#endif /* _DNS_STATS_H */
@@ -8,6 +8,11 @@
  *   Used in dump.c to print the SBL (Spamhaus Block Reference)
  *   if found in the `DNSBL_list` smartlist.
  *
+ *   The lookups are done in a path-compressed binary radix-trie for each
+ *   address-family. These are built once from `DNSBL_list` in `DNSBL_init()`.
+ *   A lookup returns the longest (most specific) matching prefix and visits
+ *   at most one node for each address-bit.
+ *
  * Ref:
  *   http://www.spamhaus.org/drop/
  *
@@ -48,10 +53,23 @@ struct DNSBL_info {
 
 static smartlist_t *DNSBL_list = NULL;
 
+/**
+ * The entries of `DNSBL_list` unless mapped from the binary cache.
+ */
+static struct arena *DNSBL_arena = NULL;
+
+/**
+ * The binary cache of `DNSBL_list` and the tries when `g_cfg.bin_cache = 1`.
+ * If mapped, `DNSBL_list` and the trie-nodes points into this.
+ */
+static struct bin_cache DNSBL_bin_cache;
+
+#define DNSBL_BIN_CACHE  0x44420001   /* "DB", version 1 */
+
 static int           DNSBL_update_files (void);
-static void MS_CDECL DNSBL_parse_DROP   (smartlist_t *sl, const char *line);
-static void MS_CDECL DNSBL_parse_DROPv6 (smartlist_t *sl, const char *line);
-static void MS_CDECL DNSBL_parse_EDROP  (smartlist_t *sl, const char *line);
+static void MS_CDECL DNSBL_parse_DROP   (smartlist_t *sl, const char *line, void *arena);
+static void MS_CDECL DNSBL_parse_DROPv6 (smartlist_t *sl, const char *line, void *arena);
+static void MS_CDECL DNSBL_parse_EDROP  (smartlist_t *sl, const char *line, void *arena);
 
 static const char *DNSBL_type_name (DNSBL_type type)
 {
@@ -61,16 +79,13 @@ static const char *DNSBL_type_name (DNSBL_type type)
 }
 
 /**
- * `smartlist_sort()` helper; compare on network.
+ * `DNSBL_sort()` helper; compare on network.
  *
  * This compares both `DNSBL_info*` nodes with `family == AF_INET`
  * and `family == AF_INET6`.
  */
-static int DNSBL_compare_net (const void **_a, const void **_b)
+static __inline int DNSBL_compare_net (const struct DNSBL_info *a, const struct DNSBL_info *b)
 {
-  const struct DNSBL_info *a = *_a;
-  const struct DNSBL_info *b = *_b;
-
   if (a->family != b->family)
   {
     /* This will force all AF_INET6 addresses after
@@ -99,102 +114,378 @@ static int DNSBL_compare_net (const void **_a, const void **_b)
   return (0);
 }
 
+SMARTLIST_SORT_FUNC (static, DNSBL_sort, struct DNSBL_info, DNSBL_compare_net)
+
+/**
+ * A node in the radix-trie.
+ * The `addr` is the prefix (on network order) masked to `bits`.
+ * The `info` is the index into `DNSBL_list` if this node is a prefix from
+ * a DNSBL file. A node with `info == -1` is a branch-node only.
+ * No pointers here since the nodes can be mapped from a binary cache.
+ */
+struct DNSBL_node {
+       BYTE     addr [16];
+       unsigned bits;
+       int      child [2];   /* index into 'nodes[]' or -1 */
+       int      info;        /* index into 'DNSBL_list' or -1 */
+     };
+
+struct DNSBL_trie {
+       struct DNSBL_node *nodes;
+       int                num_nodes;
+       int                max_nodes;     /* 0 if 'nodes' are mapped */
+       int                root;          /* -1 if empty */
+       unsigned           max_bits;      /* 32 or 128 */
+     };
+
+static struct DNSBL_trie DNSBL_trie4 = { NULL, 0, 0, -1, 32 };
+static struct DNSBL_trie DNSBL_trie6 = { NULL, 0, 0, -1, 128 };
+
+/**
+ * Return bit number `bit` (0 = MSB) of an address on network order.
+ */
+static __inline int DNSBL_bit (const BYTE *addr, unsigned bit)
+{
+  return (addr [bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+/**
+ * Return the number of equal leading bits in `a` and `b`; at most `max_bits`.
+ */
+static unsigned DNSBL_common_bits (const BYTE *a, const BYTE *b, unsigned max_bits)
+{
+  unsigned i, bits = 0;
+
+  for (i = 0; bits < max_bits; i++, bits += 8)
+  {
+    BYTE diff = a[i] ^ b[i];
+
+    if (diff)
+    {
+      while (!(diff & 0x80))
+      {
+        diff <<= 1;
+        bits++;
+      }
+      break;
+    }
+  }
+  return (bits < max_bits ? bits : max_bits);
+}
+
 /**
- * `smartlist_bsearch()` helper; compare on IPv4 network range.
+ * Return the index of a new node for the prefix `addr / bits`.
+ * Returns -1 if out of memory.
  *
- * \note the `mask`, `start_ip` and `end_ip` are all on network order.
+ * \note This can move `trie->nodes`.
  */
-static int DNSBL_compare_is_on_net4 (const void *key, const void **member)
+static int DNSBL_trie_new_node (struct DNSBL_trie *trie, const BYTE *addr, unsigned bits, int info)
 {
-  const struct DNSBL_info *dnsbl = *member;
-  const struct in_addr    *ia    = key;
-  int   rc;
+  struct DNSBL_node *node;
+  unsigned           i;
 
-  if (dnsbl->family != AF_INET)
+  if (trie->num_nodes == trie->max_nodes)
   {
-    /* Since AF_INET6 networks are sorted last in 'DNSBL_list', force
-     * 'smartlist_bsearch_idx()' to look closer to index 0.
-     */
-    TRACE (3, "Wrong family\n");
-    return (-1);
+    int   max = trie->max_nodes ? 2 * trie->max_nodes : 1024;
+    void *mem = realloc (trie->nodes, max * sizeof(*trie->nodes));
+
+    if (!mem)
+       return (-1);
+    trie->nodes     = mem;
+    trie->max_nodes = max;
   }
 
-  rc = INET_util_range4cmp (ia, &dnsbl->u.ip4.network, dnsbl->bits);
+  node = trie->nodes + trie->num_nodes;
+  memset (node, '\0', sizeof(*node));
 
-  if (g_cfg.trace_level >= 3)
+  /* Store the prefix masked to 'bits'.
+   */
+  for (i = 0; i < bits / 8; i++)
+      node->addr[i] = addr[i];
+  if (bits & 7)
+     node->addr[i] = addr[i] & (BYTE) (0xFF << (8 - (bits & 7)));
+
+  node->bits     = bits;
+  node->child[0] = -1;
+  node->child[1] = -1;
+  node->info     = info;
+  return (trie->num_nodes++);
+}
+
+/**
+ * Point the `side` link of node `parent` (or the root if `parent == -1`)
+ * to node `idx`.
+ */
+static void DNSBL_trie_link (struct DNSBL_trie *trie, int parent, int side, int idx)
+{
+  if (parent == -1)
+       trie->root = idx;
+  else trie->nodes[parent].child[side] = idx;
+}
+
+/**
+ * Add the prefix `addr / bits` to the `trie`.
+ * If the same prefix is listed twice, the first one is kept.
+ */
+static void DNSBL_trie_add (struct DNSBL_trie *trie, const smartlist_t *list,
+                            const BYTE *addr, unsigned bits, int info)
+{
+  int parent = -1;
+  int side   = 0;
+  int idx    = trie->root;
+  int leaf, glue;
+
+  while (idx != -1)
   {
-    char  net_str     [MAX_IP4_SZ+1];
-    char  mask_str    [MAX_IP4_SZ+1];
-    char  ip_str      [MAX_IP4_SZ+1];
-    char  start_ip_str[MAX_IP4_SZ+1];
-    char  end_ip_str  [MAX_IP4_SZ+1];
-    DWORD mask     = dnsbl->u.ip4.mask.s_addr;
-    DWORD netw     = dnsbl->u.ip4.network.s_addr;
-    DWORD start_ip = netw & mask;
-    DWORD end_ip   = start_ip | ~mask;
-
-    _wsock_trace_inet_ntop (AF_INET, (const u_char*)&dnsbl->u.ip4.network, net_str, sizeof(net_str));
-    _wsock_trace_inet_ntop (AF_INET, (const u_char*)&dnsbl->u.ip4.mask, mask_str, sizeof(mask_str));
-    _wsock_trace_inet_ntop (AF_INET, (const u_char*)&ia->s_addr, ip_str, sizeof(ip_str));
-    _wsock_trace_inet_ntop (AF_INET, (const u_char*)&start_ip, start_ip_str, sizeof(start_ip_str));
-    _wsock_trace_inet_ntop (AF_INET, (const u_char*)&end_ip, end_ip_str, sizeof(end_ip_str));
-
-    TRACE (3, "ip: %-15s net: %-15s (%-12s - %-15s) mask: %-15s rc: %d\n",
-           ip_str, net_str, start_ip_str, end_ip_str, mask_str, rc);
+    struct DNSBL_node *node = trie->nodes + idx;
+    unsigned common = DNSBL_common_bits (node->addr, addr, min(node->bits, bits));
+
+    if (common < node->bits)
+    {
+      if (common == bits)
+      {
+        /* The new prefix is a parent of 'node'.
+         */
+        leaf = DNSBL_trie_new_node (trie, addr, bits, info);
+        if (leaf < 0)
+           return;
+        trie->nodes[leaf].child [DNSBL_bit(trie->nodes[idx].addr, bits)] = idx;
+        DNSBL_trie_link (trie, parent, side, leaf);
+        return;
+      }
+
+      /* The new prefix and 'node' differ at bit 'common'.
+       * Split here with a branch-node.
+       */
+      glue = DNSBL_trie_new_node (trie, addr, common, -1);
+      leaf = DNSBL_trie_new_node (trie, addr, bits, info);
+      if (glue < 0 || leaf < 0)
+         return;
+      trie->nodes[glue].child [DNSBL_bit(addr, common)] = leaf;
+      trie->nodes[glue].child [DNSBL_bit(trie->nodes[idx].addr, common)] = idx;
+      DNSBL_trie_link (trie, parent, side, glue);
+      return;
+    }
+
+    if (node->bits == bits)
+    {
+      if (node->info == -1)
+         node->info = info;
+      else if (node->info != info)
+         TRACE (3, "Duplicate prefix /%u; SBL%s and SBL%s.\n", bits,
+                ((const struct DNSBL_info*)smartlist_get(list, node->info))->SBL_ref,
+                ((const struct DNSBL_info*)smartlist_get(list, info))->SBL_ref);
+      return;
+    }
+    parent = idx;
+    side   = DNSBL_bit (addr, node->bits);
+    idx    = node->child [side];
   }
-  return (rc);
+
+  leaf = DNSBL_trie_new_node (trie, addr, bits, info);
+  if (leaf >= 0)
+     DNSBL_trie_link (trie, parent, side, leaf);
 }
 
 /**
- * `smartlist_bsearch()` helper; compare on IPv6 network range.
- *
- * \note the `mask`, `start_ip` and `end_ip` are all on network order.
+ * Return the longest prefix in the `trie` matching the address `addr`.
+ * Visits at most 1 node for each bit in the address.
  */
-static int DNSBL_compare_is_on_net6 (const void *key, const void **member)
+static const struct DNSBL_info *DNSBL_trie_lookup (const struct DNSBL_trie *trie, const BYTE *addr)
 {
-  const struct DNSBL_info *dnsbl = *member;
-  const struct in6_addr   *ia    = key;
-  int    rc = -1;
+  int best = -1;
+  int idx  = trie->root;
 
-  if (dnsbl->family != AF_INET6)
+  while (idx != -1)
   {
-    /* Since AF_INET6 networks are sorted last in 'DNSBL_list', force
-     * 'smartlist_bsearch_idx()' to look closer to the end-index.
-     */
-    TRACE (3, "Wrong family\n");
-    return (1);
+    const struct DNSBL_node *node = trie->nodes + idx;
+
+    if (DNSBL_common_bits(node->addr, addr, node->bits) < node->bits)
+       break;
+    if (node->info != -1)
+       best = node->info;
+    if (node->bits >= trie->max_bits)
+       break;
+    idx = node->child [DNSBL_bit(addr, node->bits)];
   }
+  return (best == -1 ? NULL : smartlist_get_fast(DNSBL_list, best));
+}
 
-  rc = INET_util_range6cmp (ia, &dnsbl->u.ip6.network, dnsbl->bits);
+static void DNSBL_trie_free (struct DNSBL_trie *trie)
+{
+  if (trie->max_nodes > 0)
+     free (trie->nodes);
+  trie->nodes     = NULL;
+  trie->num_nodes = trie->max_nodes = 0;
+  trie->root      = -1;
+}
 
-  if (g_cfg.trace_level >= 3)
+/**
+ * Build the IPv4 and IPv6 tries from the sorted `list`.
+ * Normally `DNSBL_list`, `DNSBL_trie4` and `DNSBL_trie6`.
+ */
+static void DNSBL_trie_build (const smartlist_t *list, struct DNSBL_trie *trie4, struct DNSBL_trie *trie6)
+{
+  int i, max = list ? smartlist_len(list) : 0;
+
+  for (i = 0; i < max; i++)
   {
-    struct in6_addr start_ip, end_ip;
-    char net_str     [MAX_IP6_SZ+1];
-    char mask_str    [MAX_IP6_SZ+1];
-    char ip_str      [MAX_IP6_SZ+1];
-    char start_ip_str[MAX_IP6_SZ+1];
-    char end_ip_str  [MAX_IP6_SZ+1];
-
-    _wsock_trace_inet_ntop (AF_INET6, (const u_char*)&dnsbl->u.ip6.network, net_str, sizeof(net_str));
-    _wsock_trace_inet_ntop (AF_INET6, (const u_char*)&dnsbl->u.ip6.mask, mask_str, sizeof(mask_str));
-    _wsock_trace_inet_ntop (AF_INET6, (const u_char*)&ia->s6_addr, ip_str, sizeof(ip_str));
-    _wsock_trace_inet_ntop (AF_INET6, (const u_char*)&start_ip, start_ip_str, sizeof(start_ip_str));
-    _wsock_trace_inet_ntop (AF_INET6, (const u_char*)&end_ip, end_ip_str, sizeof(end_ip_str));
-
-    TRACE (3, "ip: %-20s net: %-20s (%-20s - %-30s)\n"
-               "                mask: 0x%s, rc: %d\n",
-           ip_str, net_str, start_ip_str, end_ip_str, mask_str, rc);
+    const struct DNSBL_info *dnsbl = smartlist_get (list, i);
+
+    if (dnsbl->family == AF_INET)
+         DNSBL_trie_add (trie4, list, (const BYTE*)&dnsbl->u.ip4.network, dnsbl->bits, i);
+    else DNSBL_trie_add (trie6, list, (const BYTE*)&dnsbl->u.ip6.network, dnsbl->bits, i);
   }
-  return (rc);
+  TRACE (2, "Built DNSBL tries with %d IPv4 and %d IPv6 nodes from %d prefixes.\n",
+         trie4->num_nodes, trie6->num_nodes, max);
+}
+
+/**
+ * Free a `list` and it's tries. The entries are all in `arena`.
+ * Or if mapped from the binary cache, `arena` is NULL.
+ */
+static void DNSBL_free (smartlist_t *list, struct DNSBL_trie *trie4, struct DNSBL_trie *trie6, struct arena *arena)
+{
+  smartlist_free (list);
+  arena_free (arena);
+  DNSBL_trie_free (trie4);
+  DNSBL_trie_free (trie6);
 }
 
 /**
- * Do a binary search in the `DNSBL_list` to figure out if
+ * The sources of the binary cache. Any of these can be NULL.
+ */
+static void DNSBL_bin_cache_sources (const char **sources)
+{
+  sources[0] = g_cfg.DNSBL.drop_file;
+  sources[1] = g_cfg.DNSBL.edrop_file;
+  sources[2] = g_cfg.DNSBL.dropv6_file;
+}
+
+/**
+ * Check the mapped trie-nodes of a binary cache before use.
+ * Each child and info index must be -1 or within it's array. And a child
+ * must be a longer prefix than it's parent, or a lookup could loop forever.
+ */
+static BOOL DNSBL_check_bin_nodes (const struct DNSBL_node *nodes, DWORD num_nodes,
+                                   int root, DWORD num_info, unsigned max_bits)
+{
+  DWORD i;
+  int   j;
+
+  if (root < -1 || root >= (int)num_nodes)
+     return (FALSE);
+
+  for (i = 0; i < num_nodes; i++)
+  {
+    const struct DNSBL_node *node = nodes + i;
+
+    if (node->bits > max_bits || node->info < -1 || node->info >= (int)num_info)
+       return (FALSE);
+
+    for (j = 0; j < DIM(node->child); j++)
+    {
+      int child = node->child[j];
+
+      if (child == -1)
+         continue;
+      if (child < 0 || child >= (int)num_nodes || nodes[child].bits <= node->bits)
+         return (FALSE);
+    }
+  }
+  return (TRUE);
+}
+
+/**
+ * Map the sorted `DNSBL_list` and both tries from the binary cache.
+ * The 4th section holds the roots of `DNSBL_trie4` and `DNSBL_trie6`.
+ * Every index is checked first; a bad one rejects the whole cache.
+ */
+static BOOL DNSBL_load_bin_cache (void)
+{
+  const char *sources [3];
+  const void *list, *nodes4, *nodes6;
+  const int  *roots;
+  DWORD       num, num4, num6, num_roots;
+
+  DNSBL_bin_cache_sources (sources);
+  if (!bin_cache_open(&DNSBL_bin_cache, DNSBL_BIN_CACHE, sources, DIM(sources)))
+     return (FALSE);
+
+  list   = bin_cache_get (&DNSBL_bin_cache, 0, sizeof(struct DNSBL_info), &num);
+  nodes4 = bin_cache_get (&DNSBL_bin_cache, 1, sizeof(struct DNSBL_node), &num4);
+  nodes6 = bin_cache_get (&DNSBL_bin_cache, 2, sizeof(struct DNSBL_node), &num6);
+  roots  = bin_cache_get (&DNSBL_bin_cache, 3, sizeof(int), &num_roots);
+
+  if (!list || !nodes4 || !nodes6 || !roots || num == 0 || num_roots != 2)
+  {
+    bin_cache_close (&DNSBL_bin_cache);
+    return (FALSE);
+  }
+
+  if (!DNSBL_check_bin_nodes(nodes4, num4, roots[0], num, 32) ||
+      !DNSBL_check_bin_nodes(nodes6, num6, roots[1], num, 128))
+  {
+    TRACE (1, "Binary DNSBL cache has a bad trie-node; rejected.\n");
+    bin_cache_close (&DNSBL_bin_cache);
+    return (FALSE);
+  }
+
+  DNSBL_list = geoip_smartlist_fixed ((void*)list, sizeof(struct DNSBL_info), num);
+  DNSBL_trie4.nodes     = (struct DNSBL_node*) nodes4;
+  DNSBL_trie4.num_nodes = num4;
+  DNSBL_trie4.root      = roots[0];
+  DNSBL_trie6.nodes     = (struct DNSBL_node*) nodes6;
+  DNSBL_trie6.num_nodes = num6;
+  DNSBL_trie6.root      = roots[1];
+  TRACE (2, "Mapped %lu DNSBL prefixes with %lu IPv4 and %lu IPv6 trie-nodes.\n",
+         DWORD_CAST(num), DWORD_CAST(num4), DWORD_CAST(num6));
+  return (TRUE);
+}
+
+static void DNSBL_write_bin_cache (const smartlist_t *sl, const struct DNSBL_trie *trie4,
+                                   const struct DNSBL_trie *trie6)
+{
+  struct bin_cache_sect sect [4];
+  struct DNSBL_info    *list;
+  const char           *sources [3];
+  int                   roots [2];
+  int                   i, max = smartlist_len (sl);
+
+  list = malloc (max * sizeof(*list));
+  if (!list)
+     return;
+
+  for (i = 0; i < max; i++)
+      list[i] = *(const struct DNSBL_info*) smartlist_get (sl, i);
+
+  roots[0] = trie4->root;
+  roots[1] = trie6->root;
+
+  sect[0].data  = list;
+  sect[0].size  = max * sizeof(*list);
+  sect[0].count = max;
+  sect[1].data  = trie4->nodes;
+  sect[1].size  = trie4->num_nodes * sizeof(struct DNSBL_node);
+  sect[1].count = trie4->num_nodes;
+  sect[2].data  = trie6->nodes;
+  sect[2].size  = trie6->num_nodes * sizeof(struct DNSBL_node);
+  sect[2].count = trie6->num_nodes;
+  sect[3].data  = roots;
+  sect[3].size  = sizeof(roots);
+  sect[3].count = DIM(roots);
+
+  DNSBL_bin_cache_sources (sources);
+  bin_cache_write (DNSBL_BIN_CACHE, sources, DIM(sources), sect, DIM(sect));
+  free (list);
+}
+
+/**
+ * Do a longest-prefix match in the IPv4 or IPv6 trie to figure out if
  * `ip4` or `ip6` address is a member of a **spam group**.
  *
- * \note An IPv4/IPv6 address can have more than 1 SBL reference.
- *       This is currently unsupported.
+ * \note An IPv4/IPv6 address can be listed with more than 1 SBL reference.
+ *       Then the most specific prefix is returned.
  *       \eg{.}:
  *       Currently (as of August 2018), the IPv4 block `24.233.0.0/19`
  *       is listed in both `drop.txt` and `edrop.txt` as:
@@ -202,6 +493,7 @@ static int DNSBL_compare_is_on_net6 (const void *key, const void **member)
  *         24.233.0.0/19 ; SBL210084
  *         24.233.0.0/21 ; SBL356227
  *       ```
+ *       Hence `24.233.0.21` gives `SBL356227`.
  */
 static BOOL DNSBL_check_common (const struct in_addr *ip4, const struct in6_addr *ip6, const char **sbl_ref)
 {
@@ -213,9 +505,20 @@ static BOOL DNSBL_check_common (const struct in_addr *ip4, const struct in6_addr
   if (!DNSBL_list)
      return (FALSE);
 
-  dnsbl = smartlist_bsearch (DNSBL_list,
-                             ip4 ? (const void*)ip4         : (const void*)ip6,
-                             ip4 ? DNSBL_compare_is_on_net4 : DNSBL_compare_is_on_net6);
+  if (ip4)
+       dnsbl = DNSBL_trie_lookup (&DNSBL_trie4, (const BYTE*)ip4);
+  else dnsbl = DNSBL_trie_lookup (&DNSBL_trie6, (const BYTE*)ip6);
+
+  if (g_cfg.trace_level >= 3)
+  {
+    char addr [MAX_IP6_SZ+1];
+
+    _wsock_trace_inet_ntop (ip4 ? AF_INET : AF_INET6, ip4 ? (const u_char*)ip4 : (const u_char*)ip6,
+                            addr, sizeof(addr));
+    TRACE (3, "ip: %s -> SBL%s (/%u)\n",
+           addr, dnsbl ? dnsbl->SBL_ref : "<none>", dnsbl ? dnsbl->bits : 0);
+  }
+
   if (sbl_ref && dnsbl)
      *sbl_ref = dnsbl->SBL_ref;
 
@@ -304,7 +607,7 @@ int DNSBL_test (void)
   BOOL   rc;
   static const struct test_list tests[] = {
                     { AF_INET,  "108.166.224.2", "235333" },  /* in drop.txt */
-                    { AF_INET,  "24.233.0.21",   "210084" },
+                    { AF_INET,  "24.233.0.21",   "356227" },  /* the /21 in edrop.txt */
                     { AF_INET,  "8.8.8.8",       "<none>" },  /* Google's NS */
                     { AF_INET,  "193.25.48.3",   "211796" },
                     { AF_INET,  "120.46.4.1",    "262362" },  /* in edrop.txt */
@@ -371,11 +674,12 @@ int DNSBL_test (void)
   return (rc);
 }
 
-static void DNSBL_parse_and_add (smartlist_t **prev, const char *file, smartlist_parse_func parser)
+static void DNSBL_parse_and_add (smartlist_t **prev, const char *file,
+                                 smartlist_parse_arg_func parser, struct arena *arena)
 {
   if (file)
   {
-    smartlist_t *sl = smartlist_read_file (file, parser);
+    smartlist_t *sl = smartlist_read_file_arg (file, parser, arena);
 
     if (*prev)
     {
@@ -387,6 +691,32 @@ static void DNSBL_parse_and_add (smartlist_t **prev, const char *file, smartlist
   }
 }
 
+/**
+ * Parse and merge all the `*drop*.txt` files into a new sorted list.
+ * And build the tries for it. The entries are allocated from a new `*arena`.
+ */
+static smartlist_t *DNSBL_parse_all (struct DNSBL_trie *trie4, struct DNSBL_trie *trie6, struct arena **arena)
+{
+  smartlist_t *list = NULL;
+
+  *arena = arena_new ("DNSBL", 32*1024);
+  DNSBL_parse_and_add (&list, g_cfg.DNSBL.drop_file, DNSBL_parse_DROP, *arena);
+  DNSBL_parse_and_add (&list, g_cfg.DNSBL.edrop_file, DNSBL_parse_EDROP, *arena);
+  DNSBL_parse_and_add (&list, g_cfg.DNSBL.dropv6_file, DNSBL_parse_DROPv6, *arena);
+
+  /* Each of the 'drop.txt', 'edrop.txt' and 'dropv6.txt' are already sorted.
+   * But after merging them into one list, we must sort them ourself.
+   */
+  if (list)
+  {
+    DNSBL_sort (list);
+    DNSBL_trie_build (list, trie4, trie6);
+    if (g_cfg.bin_cache)
+       DNSBL_write_bin_cache (list, trie4, trie6);
+  }
+  return (list);
+}
+
 /**
  * Called from init.c / `wsock_trace_init()`.
  *
@@ -410,29 +740,79 @@ void DNSBL_init (BOOL update)
   if (update)
      DNSBL_update_files();
 
-  DNSBL_parse_and_add (&DNSBL_list, g_cfg.DNSBL.drop_file, DNSBL_parse_DROP);
-  DNSBL_parse_and_add (&DNSBL_list, g_cfg.DNSBL.edrop_file, DNSBL_parse_EDROP);
-  DNSBL_parse_and_add (&DNSBL_list, g_cfg.DNSBL.dropv6_file, DNSBL_parse_DROPv6);
+  if (g_cfg.bin_cache && DNSBL_load_bin_cache())
+     return;
 
-  /* Each of the 'drop.txt', 'edrop.txt' and 'dropv6.txt' are already sorted.
-   * But after merging them into one list, we must sort them ourself.
-   */
-  if (DNSBL_list)
-     smartlist_sort (DNSBL_list, DNSBL_compare_net);
+  DNSBL_list = DNSBL_parse_all (&DNSBL_trie4, &DNSBL_trie6, &DNSBL_arena);
 }
 
 void DNSBL_exit (void)
 {
-  struct DNSBL_info *dnsbl;
-  int    i, max = DNSBL_list ? smartlist_len(DNSBL_list) : 0;
+  DNSBL_free (DNSBL_list, &DNSBL_trie4, &DNSBL_trie6, DNSBL_arena);
+  DNSBL_list  = NULL;
+  DNSBL_arena = NULL;
+  bin_cache_close (&DNSBL_bin_cache);
+}
 
-  for (i = 0; i < max; i++)
+/**
+ * Called from the `update_async_thread()` in init.c when `g_cfg.update_async = 1`.
+ *
+ * Download the `*drop*.txt` files if older than `g_cfg.DNSBL.max_days`.
+ * Parse them outside the `crit_sect` and swap in the new `DNSBL_list` and tries.
+ * Unless `wsock_trace_exit()` has cleared `g_cfg.update_async` in the meantime.
+ */
+void DNSBL_update_async (void)
+{
+  struct DNSBL_trie trie4 = { NULL, 0, 0, -1, 32 };
+  struct DNSBL_trie trie6 = { NULL, 0, 0, -1, 128 };
+  struct DNSBL_trie old_trie4, old_trie6;
+  struct bin_cache  old_cache;
+  struct arena     *arena, *old_arena;
+  smartlist_t      *list, *old_list;
+  BOOL              swapped = FALSE;
+
+  if (!g_cfg.DNSBL.enable || DNSBL_update_files() == 0)
+     return;
+
+  list = DNSBL_parse_all (&trie4, &trie6, &arena);
+  if (!list)
   {
-    dnsbl = smartlist_get (DNSBL_list, i);
-    free (dnsbl);
+    arena_free (arena);
+    return;
   }
-  smartlist_free (DNSBL_list);
-  DNSBL_list = NULL;
+
+  old_list  = NULL;
+  old_arena = NULL;
+  memset (&old_cache, '\0', sizeof(old_cache));
+
+  ENTER_CRIT();
+  if (g_cfg.update_async)
+  {
+    old_list  = DNSBL_list;
+    old_trie4 = DNSBL_trie4;
+    old_trie6 = DNSBL_trie6;
+    old_cache = DNSBL_bin_cache;
+    old_arena = DNSBL_arena;
+    DNSBL_list  = list;
+    DNSBL_arena = arena;
+    DNSBL_trie4 = trie4;
+    DNSBL_trie6 = trie6;
+    memset (&DNSBL_bin_cache, '\0', sizeof(DNSBL_bin_cache));
+    geoip_cache_flush();
+    swapped = TRUE;
+  }
+  LEAVE_CRIT();
+
+  if (swapped)
+  {
+    int num = smartlist_len (list);
+
+    DNSBL_free (old_list, &old_trie4, &old_trie6, old_arena);
+    bin_cache_close (&old_cache);
+    TRACE (1, "Swapped in %d new DNSBL prefixes.\n", num);
+  }
+  else
+    DNSBL_free (list, &trie4, &trie6, arena);
 }
 
 /**
@@ -523,7 +903,7 @@ static int DNSBL_update_files (void)
   return (num);
 }
 
-static void DNSBL_parse4 (smartlist_t *sl, const char *line, DNSBL_type type)
+static void DNSBL_parse4 (smartlist_t *sl, const char *line, DNSBL_type type, struct arena *arena)
 {
   struct DNSBL_info *dnsbl;
   int                bits = 0;
@@ -535,7 +915,7 @@ static void DNSBL_parse4 (smartlist_t *sl, const char *line, DNSBL_type type)
   if (bits < 8 || bits > 32) /* Cannot happen */
      return;
 
-  dnsbl = malloc (sizeof(*dnsbl));
+  dnsbl = arena_alloc (arena, sizeof(*dnsbl));
   if (!dnsbl)
      return;
 
@@ -550,20 +930,20 @@ static void DNSBL_parse4 (smartlist_t *sl, const char *line, DNSBL_type type)
   smartlist_add (sl, dnsbl);
 }
 
-static void MS_CDECL DNSBL_parse_DROP (smartlist_t *sl, const char *line)
+static void MS_CDECL DNSBL_parse_DROP (smartlist_t *sl, const char *line, void *arena)
 {
-  DNSBL_parse4 (sl, line, DNSBL_DROP);
+  DNSBL_parse4 (sl, line, DNSBL_DROP, arena);
 }
 
-static void MS_CDECL DNSBL_parse_EDROP (smartlist_t *sl, const char *line)
+static void MS_CDECL DNSBL_parse_EDROP (smartlist_t *sl, const char *line, void *arena)
 {
-  DNSBL_parse4 (sl, line, DNSBL_EDROP);
+  DNSBL_parse4 (sl, line, DNSBL_EDROP, arena);
 }
 
 /*
  * Parse a "dropv6.txt" file.
  */
-static void DNSBL_parse_DROPv6 (smartlist_t *sl, const char *line)
+static void MS_CDECL DNSBL_parse_DROPv6 (smartlist_t *sl, const char *line, void *arena)
 {
   struct DNSBL_info *dnsbl;
   int                bits = 0;
@@ -575,7 +955,7 @@ static void DNSBL_parse_DROPv6 (smartlist_t *sl, const char *line)
   if (bits < 8)   /* Cannot happen */
      return;
 
-  dnsbl = malloc (sizeof(*dnsbl));
+  dnsbl = arena_alloc (arena, sizeof(*dnsbl));
   if (!dnsbl)
      return;
 
@@ -5,6 +5,7 @@
 
 extern void DNSBL_init (BOOL update);
 extern void DNSBL_exit (void);
+extern void DNSBL_update_async (void);
 extern int  DNSBL_test (void);
 extern BOOL DNSBL_check_ipv4 (const struct in_addr *ip4, const char **sbl_ref);
 extern BOOL DNSBL_check_ipv6 (const struct in6_addr *ip6, const char **sbl_ref);
@@ -1398,70 +1398,135 @@ const char *ioctlsocket_cmd_name (long cmd)
  * "<prefix> 0000: 47 45 54 20 2F 20 48 54 54 50 2F 31 2E 31 0D 0A  GET / HTTP/1.1..\n"
  *
  */
-#define CHECK_MAX_DATA(ofs) \
-        (g_cfg.max_data > 0 && (ofs) >= (unsigned)g_cfg.max_data-1)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+  #include <emmintrin.h>
+  #define HAVE_SSE2_DUMP 1
+#endif
+
+/*
+ * Convert the 16 bytes at 'src' to 32 hex-digits at 'hex' and 16
+ * characters at 'ascii'. A '.' is used for the non-printable characters.
+ */
+static __inline void dump_row16 (const BYTE *src, char *hex, char *ascii)
+{
+#if defined(HAVE_SSE2_DUMP)
+  __m128i v    = _mm_loadu_si128 ((const __m128i*)src);
+  __m128i mask = _mm_set1_epi8 (0x0F);
+  __m128i nine = _mm_set1_epi8 (9);
+  __m128i zero = _mm_set1_epi8 ('0');
+  __m128i gap  = _mm_set1_epi8 ('A' - '0' - 10);
+  __m128i hi   = _mm_and_si128 (_mm_srli_epi16(v, 4), mask);
+  __m128i lo   = _mm_and_si128 (v, mask);
+  __m128i dot;
+
+  hi = _mm_add_epi8 (_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), gap));
+  lo = _mm_add_epi8 (_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), gap));
+  _mm_storeu_si128 ((__m128i*)hex,      _mm_unpacklo_epi8(hi, lo));
+  _mm_storeu_si128 ((__m128i*)(hex+16), _mm_unpackhi_epi8(hi, lo));
+
+  /* A '.' for 0x00 - 0x1F and 0x7F. The bytes above 0x7F are
+   * negative here and are printed as they are.
+   */
+  dot = _mm_and_si128 (_mm_cmpgt_epi8(v, _mm_set1_epi8(-1)),
+                       _mm_cmplt_epi8(v, _mm_set1_epi8(' ')));
+  dot = _mm_or_si128 (dot, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F)));
+  v   = _mm_or_si128 (_mm_and_si128(dot, _mm_set1_epi8('.')), _mm_andnot_si128(dot, v));
+  _mm_storeu_si128 ((__m128i*)ascii, v);
+#else
+  static const char hex_chars[] = "0123456789ABCDEF";
+  int   i;
+
+  for (i = 0; i < 16; i++)
+  {
+    BYTE ch = src[i];
+
+    hex [2*i]   = hex_chars [ch >> 4];
+    hex [2*i+1] = hex_chars [ch & 15];
+    ascii [i]   = (ch < ' ' || ch == 0x7F) ? '.' : (char)ch;
+  }
+#endif
+}
 
+#define DUMP_ROW_LEN  (4+2+3*16+1+16)   /* "XXXX: " + "HH " * 16 + " " + ASCII */
+
+/*
+ * Dump 'data_len' bytes at 'data_p' in rows of 16 bytes like:
+ *  "0000: 48 54 54 50 2F 31 2E 31 20 32 30 30 20 4F 4B 0D  HTTP/1.1 200 OK."
+ *
+ * Each row is converted by 'dump_row16()' and written straight into the
+ * trace-buffer as one block. Not one 'trace_putc()' for each character.
+ */
 static void dump_data_internal (const void *data_p, unsigned data_len, const char *prefix)
 {
   const BYTE *data = (const BYTE*) data_p;
-  UINT  i = 0, j, ofs;
+  size_t      plen = prefix ? strlen (prefix) : 0;
+  unsigned    limit, ofs, n, k;
+  BYTE        tail [16];
+  char        hex [32], ascii [16];
+  const BYTE *src;
+  char       *p;
 
   if (data_len == 0)
      return;
 
-  trace_puts ("~4");
+  limit = data_len;
+  if (g_cfg.max_data > 0 && limit > (unsigned)g_cfg.max_data)
+     limit = g_cfg.max_data;
 
-  for (ofs = 0; ofs < data_len; ofs += 16)
+  trace_color (4);
+
+  for (ofs = 0; ofs < limit; ofs += 16)
   {
+    n = min (16, limit - ofs);
+    src = data + ofs;
+    if (n < 16)
+    {
+      memset (&tail, '\0', sizeof(tail));
+      memcpy (&tail, src, n);
+      src = tail;
+    }
+    dump_row16 (src, hex, ascii);
+
     trace_indent (g_cfg.trace_indent+2);
 
+    p = trace_reserve (plen + DUMP_ROW_LEN);
+    if (!p)
+       break;
+
     if (prefix)
     {
       if (ofs == 0)
-           trace_puts (prefix);
-      else trace_indent (strlen(prefix));
+           memcpy (p, prefix, plen);
+      else memset (p, ' ', plen);
+      p += plen;
     }
 
-    trace_puts (str_hex_word(ofs));
-    trace_puts (": ");
+    memcpy (p, str_hex_word((WORD)ofs), 4);
+    p[4] = ':';
+    p[5] = ' ';
+    p += 6;
 
-    for (i = j = 0; i < 16 && i+ofs < data_len; i++)
+    for (k = 0; k < n; k++, p += 3)
     {
-      trace_puts (str_hex_byte(data[i+ofs]));
-      trace_putc (' ');
-      j = i;
-      if (CHECK_MAX_DATA(ofs+i))
-         break;
+      p[0] = hex [2*k];
+      p[1] = hex [2*k+1];
+      p[2] = ' ';
     }
+    memset (p, ' ', 3*(16-n) + 1);    /* pad line to 16 positions */
+    p += 3*(16-n) + 1;
 
-    for ( ; j < 15; j++)     /* pad line to 16 positions */
-       trace_puts ("   ");
-    trace_putc (' ');
-
-    for (i = 0; i < 16 && i+ofs < data_len; i++)
-    {
-      int ch = data[i+ofs];
-
-      if (ch < ' ' || ch == 0x7F)    /* non-printable */
-           trace_putc ('.');
-      else trace_putc_raw (ch);
-
-      if (CHECK_MAX_DATA(ofs+i))
-         break;
-    }
+    memcpy (p, ascii, n);
+    trace_commit (p + n);
     trace_putc ('\n');
-
-    if (CHECK_MAX_DATA(ofs+i))
-       break;
   }
 
-  if (ofs + i < data_len - 1)
+  if (limit < data_len)
   {
     trace_indent (g_cfg.trace_indent+2);
 
-    trace_printf ("<%d more bytes...>\n", data_len-1-ofs-i);
+    trace_printf ("<%d more bytes...>\n", data_len-limit);
   }
-  trace_puts ("~0");
+  trace_color (0);
 }
 
 void dump_data (const void *data_p, unsigned data_len)
@@ -1572,12 +1637,15 @@ const char *get_addrinfo_hint (const struct addrinfo *hint, size_t indent)
   return (buf);
 }
 
-void dump_addrinfo (const char *name, const struct addrinfo *ai)
+void dump_addrinfo (const struct addrinfo *ai, const struct addr_notes *notes)
 {
-  for ( ; ai; ai = ai->ai_next)
+  int i;
+
+  for (i = 0; ai; ai = ai->ai_next, i++)
   {
     const int  *addr_len;
     const char *comment;
+    char        addr_buf [SOCKADDR_STR_SZ];
 
     trace_indent (g_cfg.trace_indent+2);
     trace_printf ("~4ai_flags: %s, ai_family: %s, ai_socktype: %s, ai_protocol: %s,\n",
@@ -1586,7 +1654,7 @@ void dump_addrinfo (const char *name, const struct addrinfo *ai)
                   socket_type(ai->ai_socktype),
                   protocol_name(ai->ai_protocol));
 
-    if (hosts_file_check_addrinfo(name, ai) > 0)
+    if (i < notes->num && notes->note[i].in_hosts)
          comment = " (in 'hosts' file)";
     else comment = "";
 
@@ -1594,7 +1662,7 @@ void dump_addrinfo (const char *name, const struct addrinfo *ai)
     addr_len = (const int*)&ai->ai_addrlen;
 
     trace_printf ("ai_canonname: %s, ai_addr: %s%s\n",
-                  ai->ai_canonname, sockaddr_str2(ai->ai_addr,addr_len),
+                  ai->ai_canonname, sockaddr_str2_r(ai->ai_addr, addr_len, addr_buf, sizeof(addr_buf)),
                   comment);
   }
   trace_puts ("~0");
@@ -1648,6 +1716,61 @@ fd_set *copy_fd_set_to (const fd_set *fd, fd_set *dst)
   return (dst);
 }
 
+/*
+ * The per-thread buffers for 'fd_set' copies in 'select()'. One for each
+ * 'FD_COPY_x' slot. They only grow and are reused by a new thread when a
+ * thread dies. So a 'select()' with large sets does not 'alloca()' these.
+ */
+struct fd_copies {
+       struct fd_copies *next;
+       volatile LONG     owner;     /* thread-id using this block or 0 */
+       fd_set           *set  [FD_COPY_MAX];
+       size_t            size [FD_COPY_MAX];
+     };
+
+static struct fd_copies *volatile fd_copies_list = NULL;
+static DWORD fd_copies_tls = TLS_OUT_OF_INDEXES;
+
+/*
+ * Return a buffer in 'slot' of this thread for a 'fd_set' of 'size' bytes.
+ */
+fd_set *fd_set_buf (int slot, size_t size)
+{
+  struct fd_copies *c;
+
+  if (slot < 0 || slot >= FD_COPY_MAX || fd_copies_tls == TLS_OUT_OF_INDEXES)
+     return (NULL);
+
+  c = tls_block_get (fd_copies_tls, (void*volatile*)&fd_copies_list, sizeof(*c), NULL);
+  if (!c)
+     return (NULL);
+
+  if (size > c->size[slot])
+  {
+    fd_set *set = realloc (c->set[slot], size);
+
+    if (!set)
+       return (NULL);
+    c->set [slot] = set;
+    c->size[slot] = size;
+  }
+  return (c->set[slot]);
+}
+
+/*
+ * As 'copy_fd_set()', but into the buffer in 'slot' of this thread.
+ */
+fd_set *copy_fd_set_buf (const fd_set *fd, int slot)
+{
+  size_t  size = size_fd_set (fd);
+  fd_set *dst;
+
+  if (size == 0)
+     return (NULL);
+  dst = fd_set_buf (slot, size);
+  return (dst ? copy_fd_set_to (fd, dst) : NULL);
+}
+
 /*
  * Called from 'dump_select()' to print a single 'fd_set'.
  * When e.g. 'g_cfg.max_fd_sets is 5, print it like this:
@@ -1733,6 +1856,199 @@ void dump_select (const fd_set *rd, const fd_set *wr, const fd_set *ex, int inde
   }
 }
 
+/*
+ * For 'dump_select = 2': the sockets found ready by the last 'select()'
+ * in each of the rd, wr and ex sets. A bitmap keyed on 'SOCKET / 4' (a
+ * socket is a multiple of 4) and a list of the same sockets. So clearing
+ * the bitmap costs no more than the size of the previous set.
+ */
+#define FD_BITMAP_MAX  (1 << 20)    /* max key; 128 kByte for each set */
+
+struct fd_ready {
+       DWORD  *bits;
+       DWORD   num_words;
+       SOCKET *list;
+       u_int   list_len;
+       u_int   list_size;
+     };
+
+static struct fd_ready fd_ready [3];
+
+static __inline BOOL fd_bit_test (const struct fd_ready *r, SOCKET s)
+{
+  UINT_PTR key = (UINT_PTR)s >> 2;
+
+  if (key / 32 >= r->num_words)
+     return (FALSE);
+  return ((r->bits[key/32] >> (key % 32)) & 1);
+}
+
+static void fd_bit_set (struct fd_ready *r, SOCKET s, BOOL on)
+{
+  UINT_PTR key = (UINT_PTR)s >> 2;
+  DWORD    mask = 1UL << (key % 32);
+
+  if (key >= FD_BITMAP_MAX)
+     return;
+
+  if (key / 32 >= r->num_words)
+  {
+    DWORD  num_words = (DWORD) (key / 32) + 64;
+    DWORD *bits;
+
+    if (!on)
+       return;
+    bits = realloc (r->bits, num_words * sizeof(*bits));
+    if (!bits)
+       return;
+    memset (bits + r->num_words, '\0', (num_words - r->num_words) * sizeof(*bits));
+    r->bits = bits;
+    r->num_words = num_words;
+  }
+  if (on)
+       r->bits [key/32] |= mask;
+  else r->bits [key/32] &= ~mask;
+}
+
+/*
+ * Remember the ready sockets in 'fd' for 'select_was_ready()'.
+ */
+static void fd_ready_set (struct fd_ready *r, const fd_set *fd)
+{
+  u_int i, count = fd ? fd->fd_count : 0;
+
+  for (i = 0; i < r->list_len; i++)
+      fd_bit_set (r, r->list[i], FALSE);
+  r->list_len = 0;
+
+  if (count > r->list_size)
+  {
+    SOCKET *list = realloc (r->list, count * sizeof(*list));
+
+    if (!list)
+       return;
+    r->list = list;
+    r->list_size = count;
+  }
+  for (i = 0; i < count; i++)
+  {
+    fd_bit_set (r, fd->fd_array[i], TRUE);
+    r->list[i] = fd->fd_array[i];
+  }
+  r->list_len = count;
+}
+
+/*
+ * For 'dump_select = 2': instead of the whole sets before and after,
+ * print the number of sockets in each set given to 'select()' (in 'count[]')
+ * and those that became ready since the last 'select()'. Like:
+ *
+ *  fd_ready  -> rd: 1000 in, 3 ready, 1 new: 600
+ */
+void dump_select_ready (const fd_set *rd, const fd_set *wr, const fd_set *ex,
+                        const u_int *count, int indent)
+{
+  static const char *which[3] = { " rd: ", " wr: ", " ex: " };
+  const fd_set *fd[3];
+  int   i;
+
+  fd[0] = rd;
+  fd[1] = wr;
+  fd[2] = ex;
+
+  for (i = 0; i < DIM(fd); i++)
+  {
+    trace_puts (which[i]);
+    if (!fd[i])
+       trace_puts ("<not set>\n");
+    else
+    {
+      fd_set *news = fd_set_buf (FD_COPY_NEWS, size_fd_set(fd[i]));
+      u_int   j, num_news = 0;
+
+      for (j = 0; news && j < fd[i]->fd_count; j++)
+          if (!fd_bit_test(fd_ready + i, fd[i]->fd_array[j]))
+             news->fd_array [num_news++] = fd[i]->fd_array[j];
+      if (news)
+         news->fd_count = num_news;
+
+      trace_printf ("%u in, %u ready, %u new", count[i], fd[i]->fd_count, num_news);
+      if (num_news > 0)
+      {
+        trace_puts (": ");
+        dump_one_fd_set (news, indent+5);
+      }
+      else
+        trace_putc ('\n');
+    }
+    fd_ready_set (fd_ready + i, fd[i]);
+
+    if (i < DIM(fd)-1)
+       trace_indent (indent);
+  }
+}
+
+/*
+ * For 'dump_select = 2': as above, but when 'select()' is not traced.
+ */
+void select_ready_update (const fd_set *rd, const fd_set *wr, const fd_set *ex)
+{
+  fd_ready_set (fd_ready + 0, rd);
+  fd_ready_set (fd_ready + 1, wr);
+  fd_ready_set (fd_ready + 2, ex);
+}
+
+/*
+ * For 'dump_select = 2': was 's' found ready in set 'which'
+ * (0 = rd, 1 = wr, 2 = ex) by the last 'select()'?
+ */
+BOOL select_was_ready (int which, SOCKET s)
+{
+  if (which < 0 || which >= DIM(fd_ready))
+     return (FALSE);
+  return fd_bit_test (fd_ready + which, s);
+}
+
+void dump_select_init (void)
+{
+  fd_copies_tls = TlsAlloc();
+}
+
+void dump_select_exit (void)
+{
+  struct fd_copies *c, *next;
+  int    i;
+
+  for (i = 0; i < DIM(fd_ready); i++)
+  {
+    free (fd_ready[i].bits);
+    free (fd_ready[i].list);
+    memset (fd_ready + i, '\0', sizeof(fd_ready[i]));
+  }
+
+  for (c = fd_copies_list; c; c = next)
+  {
+    next = c->next;
+    for (i = 0; i < FD_COPY_MAX; i++)
+        free (c->set[i]);
+    free (c);
+  }
+  fd_copies_list = NULL;
+  if (fd_copies_tls != TLS_OUT_OF_INDEXES)
+     TlsFree (fd_copies_tls);
+  fd_copies_tls = TLS_OUT_OF_INDEXES;
+}
+
+/*
+ * Called from DllMain(): dwReason == DLL_THREAD_DETACH.
+ * Let another thread reuse the 'fd_set' buffers of this thread.
+ */
+void dump_select_thread_exit (void)
+{
+  if (fd_copies_tls != TLS_OUT_OF_INDEXES)
+     tls_block_release (fd_copies_tls);
+}
+
 static const char *wsapollfd_event_decode (SHORT ev, char *buf)
 {
   if (ev == 0)
@@ -1770,6 +2086,400 @@ void dump_wsapollfd (const WSAPOLLFD *fd_array, ULONG fds, int indent)
      trace_puts ("<None>\n");
 }
 
+/*
+ * For 'dump_wsapoll = 2': the 'WSAPoll()' set and the
+ * 'WSAWaitForMultipleEvents()' events of the previous traced call in a
+ * thread. Found via TLS and reused by a new thread when a thread dies.
+ */
+struct poll_prev {
+       struct poll_prev *next;
+       volatile LONG     owner;      /* thread-id using this block or 0 */
+       WSAPOLLFD        *fds;        /* a copy of the last 'fd_array' after 'WSAPoll()' */
+       ULONG             num_fds;
+       ULONG             max_fds;
+       ULONG             valid_fds;  /* entries in 'fds' with 'fd != INVALID_SOCKET' */
+       WSAEVENT         *events;
+       DWORD             num_ev;
+       DWORD             max_ev;
+       DWORD             wait_rc;    /* the last 'WSAWaitForMultipleEvents()' result */
+     };
+
+static struct poll_prev *volatile poll_prev_list = NULL;
+static DWORD poll_prev_tls    = TLS_OUT_OF_INDEXES;
+static BOOL  poll_prev_active = FALSE;
+
+/*
+ * Get the block of this thread.
+ */
+static struct poll_prev *poll_prev_get (void)
+{
+  struct poll_prev *p;
+  BOOL   first;
+
+  if (!poll_prev_active)
+     return (NULL);
+
+  p = tls_block_get (poll_prev_tls, (void*volatile*)&poll_prev_list, sizeof(*p), &first);
+  if (p && first)
+  {
+    p->num_fds = p->valid_fds = 0;    /* forget what a dead thread had */
+    p->num_ev  = 0;
+    p->wait_rc = WSA_WAIT_FAILED;
+  }
+  return (p);
+}
+
+void poll_delta_init (void)
+{
+  poll_prev_tls = TlsAlloc();
+  poll_prev_active = (poll_prev_tls != TLS_OUT_OF_INDEXES);
+  if (!poll_prev_active)
+     g_cfg.dump_wsapoll = 1;
+}
+
+void poll_delta_exit (void)
+{
+  struct poll_prev *p, *next;
+
+  if (!poll_prev_active)
+     return;
+
+  poll_prev_active = FALSE;
+  for (p = poll_prev_list; p; p = next)
+  {
+    next = p->next;
+    free (p->fds);
+    free (p->events);
+    free (p);
+  }
+  poll_prev_list = NULL;
+  TlsFree (poll_prev_tls);
+  poll_prev_tls = TLS_OUT_OF_INDEXES;
+}
+
+/*
+ * Called from DllMain(): dwReason == DLL_THREAD_DETACH.
+ * Let another thread reuse this block.
+ */
+void poll_delta_thread_exit (void)
+{
+  if (poll_prev_active)
+     tls_block_release (poll_prev_tls);
+}
+
+/*
+ * Find socket 's' in the previous set. The set is mostly the same array
+ * as in the last call, so try the same index 'i' first.
+ */
+static const WSAPOLLFD *poll_prev_find (const struct poll_prev *p, ULONG i, SOCKET s)
+{
+  ULONG j;
+
+  if (i < p->num_fds && p->fds[i].fd == s)
+     return (p->fds + i);
+
+  for (j = 0; j < p->num_fds; j++)
+      if (p->fds[j].fd == s)
+         return (p->fds + j);
+  return (NULL);
+}
+
+static BOOL poll_fd_changed (const WSAPOLLFD *fd, const WSAPOLLFD *prev)
+{
+  return (!prev || prev->events != fd->events || prev->revents != fd->revents);
+}
+
+/*
+ * For 'dump_wsapoll = 2': the number of entries in 'fd_array' that are
+ * new or have other 'events' / 'revents' than in the previous traced
+ * 'WSAPoll()' of this thread. Plus the entries no longer in 'fd_array'.
+ * The sockets in a set are assumed to be unique.
+ */
+ULONG wsapoll_delta_count (const WSAPOLLFD *fd_array, ULONG fds)
+{
+  const struct poll_prev *p = poll_prev_get();
+  ULONG i, found = 0, changed = 0;
+
+  if (!p)
+     return (fds);
+
+  for (i = 0; i < fds; i++)
+  {
+    const WSAPOLLFD *fd = fd_array + i;
+    const WSAPOLLFD *prev;
+
+    if (fd->fd == INVALID_SOCKET)
+       continue;
+    prev = poll_prev_find (p, i, fd->fd);
+    if (prev)
+       found++;
+    if (poll_fd_changed(fd, prev))
+       changed++;
+  }
+  return (changed + (p->valid_fds - found));
+}
+
+/*
+ * For 'dump_wsapoll = 2': print only the changes since the previous
+ * traced 'WSAPoll()' of this thread. Like:
+ *
+ *  fd_delta  -> 1000 fds, 3 ready, 3 changed:
+ *               fd:  600, fd->revents: 0x0000 -> POLLIN
+ *               fd: 1234, new, fd->events: POLLIN, fd->revents: 0x0000
+ *               fd:  612, removed
+ *
+ * where 'changed' is from 'wsapoll_delta_count()'.
+ * And remember 'fd_array' for the next call.
+ */
+void dump_wsapoll_delta (const WSAPOLLFD *fd_array, ULONG fds, int ready, ULONG changed, int indent)
+{
+  struct poll_prev *p = poll_prev_get();
+  int    line = 0;
+  char   ev_buf1 [300];
+  char   ev_buf2 [300];
+  ULONG  i, valid = 0;
+
+  if (!p)
+  {
+    dump_wsapollfd (fd_array, fds, indent);
+    return;
+  }
+
+  for (i = 0; i < fds; i++)
+      if (fd_array[i].fd != INVALID_SOCKET)
+         valid++;
+
+  trace_printf ("%lu fds, %d ready, %lu changed%s", DWORD_CAST(valid), ready,
+                DWORD_CAST(changed), changed > 0 ? ":" : "");
+
+  for (i = 0; i < fds; i++)
+  {
+    const WSAPOLLFD *fd = fd_array + i;
+    const WSAPOLLFD *prev;
+
+    if (fd->fd == INVALID_SOCKET)
+       continue;
+
+    prev = poll_prev_find (p, i, fd->fd);
+    if (!poll_fd_changed(fd, prev))
+       continue;
+
+    trace_printf ("%*sfd: %4u, ", line++ > 0 ? indent : 1, "", (unsigned)fd->fd);
+    if (!prev)
+       trace_printf ("new, fd->events: %s, fd->revents: %s\n",
+                     wsapollfd_event_decode(fd->events,ev_buf1),
+                     wsapollfd_event_decode(fd->revents,ev_buf2));
+    else
+    {
+      if (prev->events != fd->events)
+         trace_printf ("fd->events: %s -> %s%s",
+                       wsapollfd_event_decode(prev->events,ev_buf1),
+                       wsapollfd_event_decode(fd->events,ev_buf2),
+                       prev->revents != fd->revents ? ", " : "");
+      if (prev->revents != fd->revents)
+         trace_printf ("fd->revents: %s -> %s",
+                       wsapollfd_event_decode(prev->revents,ev_buf1),
+                       wsapollfd_event_decode(fd->revents,ev_buf2));
+      trace_putc ('\n');
+    }
+  }
+
+  for (i = 0; i < p->num_fds; i++)
+  {
+    const WSAPOLLFD *prev = p->fds + i;
+    ULONG j;
+
+    if (prev->fd == INVALID_SOCKET)
+       continue;
+
+    if (i < fds && fd_array[i].fd == prev->fd)
+       continue;
+    for (j = 0; j < fds; j++)
+        if (fd_array[j].fd == prev->fd)
+           break;
+    if (j == fds)
+       trace_printf ("%*sfd: %4u, removed\n", line++ > 0 ? indent : 1, "", (unsigned)prev->fd);
+  }
+  if (line == 0)
+     trace_putc ('\n');
+
+  if (fds > p->max_fds)
+  {
+    WSAPOLLFD *more = realloc (p->fds, fds * sizeof(*more));
+
+    if (!more)
+    {
+      p->num_fds = p->valid_fds = 0;
+      return;
+    }
+    p->fds = more;
+    p->max_fds = fds;
+  }
+  if (fds > 0)
+     memcpy (p->fds, fd_array, fds * sizeof(*fd_array));
+  p->num_fds   = fds;
+  p->valid_fds = valid;
+}
+
+/*
+ * For 'dump_wsapoll = 2': is the result 'rc' or the events in 'ev'
+ * different from the previous traced 'WSAWaitForMultipleEvents()' of
+ * this thread? Remember them for the next call.
+ */
+BOOL wsawait_delta (DWORD num_ev, const WSAEVENT *ev, DWORD rc)
+{
+  struct poll_prev *p = poll_prev_get();
+  BOOL   changed;
+
+  if (!p)
+     return (TRUE);
+
+  changed = (rc != p->wait_rc || num_ev != p->num_ev ||
+             (num_ev > 0 && (!ev || memcmp(ev, p->events, num_ev * sizeof(*ev)))));
+  if (!changed)
+     return (FALSE);
+
+  p->wait_rc = rc;
+  p->num_ev  = 0;
+  if (num_ev > 0 && ev)
+  {
+    if (num_ev > p->max_ev)
+    {
+      WSAEVENT *more = realloc (p->events, num_ev * sizeof(*more));
+
+      if (!more)
+         return (TRUE);
+      p->events = more;
+      p->max_ev = num_ev;
+    }
+    memcpy (p->events, ev, num_ev * sizeof(*ev));
+    p->num_ev = num_ev;
+  }
+  return (TRUE);
+}
+
+/*
+ * For 'poll_stats = 1': the distribution of the time spent waiting
+ * and the number of ready sockets / events in each call of 'select()',
+ * 'WSAPoll()' and 'WSAWaitForMultipleEvents()'. Bucket 'b' of both
+ * histograms counts the values 'v' where '2^(b-1) <= v < 2^b'.
+ * Only called inside 'ENTER_CRIT()'.
+ */
+#define POLL_WAIT_BUCKETS   32      /* 2^31 usec is ~36 minutes */
+#define POLL_READY_BUCKETS  18      /* 2^17 sockets */
+
+struct poll_stats {
+       const char *name;
+       DWORD       calls;
+       DWORD       errors;
+       uint64      wait_usec;
+       uint64      wait_max;
+       uint64      fds;
+       uint64      ready;
+       DWORD       wait_hist  [POLL_WAIT_BUCKETS];
+       DWORD       ready_hist [POLL_READY_BUCKETS];
+     };
+
+static struct poll_stats poll_stats [POLL_MAX] = {
+                       { "select()" },
+                       { "WSAPoll()" },
+                       { "WSAWaitForMultipleEvents()" }
+                     };
+
+static unsigned poll_bucket (uint64 v, unsigned max)
+{
+  unsigned b = 0;
+
+  while (v > 0 && b < max-1)
+  {
+    v >>= 1;
+    b++;
+  }
+  return (b);
+}
+
+/*
+ * Add a call to 'which' that would wait for 'fds' sockets / events
+ * from QPC-time 'start' until now. 'ready < 0' for an error.
+ */
+void poll_stats_add (int which, const LARGE_INTEGER *start, ULONG fds, int ready)
+{
+  struct poll_stats *ps;
+  LARGE_INTEGER      now;
+  uint64             usec = 0;
+
+  if (which < 0 || which >= POLL_MAX)
+     return;
+
+  ps = poll_stats + which;
+  ps->calls++;
+
+  QueryPerformanceCounter (&now);
+  if (g_cfg.clocks_per_usec && now.QuadPart > start->QuadPart)
+     usec = (uint64)(now.QuadPart - start->QuadPart) / g_cfg.clocks_per_usec;
+
+  ps->wait_usec += usec;
+  if (usec > ps->wait_max)
+     ps->wait_max = usec;
+  ps->wait_hist [poll_bucket(usec, POLL_WAIT_BUCKETS)]++;
+
+  if (ready < 0)
+  {
+    ps->errors++;
+    return;
+  }
+  ps->fds   += fds;
+  ps->ready += ready;
+  ps->ready_hist [poll_bucket(ready, POLL_READY_BUCKETS)]++;
+}
+
+static void poll_hist_print (const char *what, const DWORD *hist, unsigned num, const char *unit)
+{
+  unsigned b;
+
+  trace_printf ("      %-6s", what);
+  for (b = 0; b < num; b++)
+  {
+    if (hist[b] == 0)
+       continue;
+    if (b <= 1)
+         trace_printf (" %u%s: %s", b, unit, dword_str(hist[b]));
+    else trace_printf (" %s-%s%s: %s", qword_str(1ULL << (b-1)), qword_str((1ULL << b) - 1),
+                       unit, dword_str(hist[b]));
+  }
+  trace_putc ('\n');
+}
+
+void poll_stats_report (void)
+{
+  int i;
+
+  if (!g_cfg.poll_stats)
+     return;
+
+  for (i = 0; i < POLL_MAX; i++)
+  {
+    const struct poll_stats *ps = poll_stats + i;
+    DWORD  ok;
+
+    if (ps->calls == 0)
+       continue;
+
+    ok = ps->calls - ps->errors;
+    trace_printf ("    %s: %s calls, %s errors, avg wait: %.1f usec, max wait: %s usec\n",
+                  ps->name, dword_str(ps->calls), dword_str(ps->errors),
+                  (double)ps->wait_usec / (double)ps->calls, qword_str(ps->wait_max));
+    if (ok > 0)
+       trace_printf ("      avg sockets: %.1f, avg ready: %.1f (%.1f%%), with 0 ready: %s\n",
+                     (double)ps->fds / (double)ok, (double)ps->ready / (double)ok,
+                     ps->fds ? 100.0 * (double)ps->ready / (double)ps->fds : 0.0,
+                     dword_str(ps->ready_hist[0]));
+    poll_hist_print ("wait:",  ps->wait_hist, POLL_WAIT_BUCKETS, "us");
+    if (ok > 0)
+       poll_hist_print ("ready:", ps->ready_hist, POLL_READY_BUCKETS, "");
+  }
+}
+
 static const char *proto_padding = "                   ";  /* Length of "WSAPROTOCOL_INFOx: " */
 
 void dump_one_proto_info (const char *prefix, const char *buf)
@@ -2043,90 +2753,197 @@ static void check_and_dump_idna (const char *name)
   else trace_printf ("failed for %s: %s\n", name, IDNA_strerror(_idna_errno));
 }
 
-void dump_countries (int type, const char **addresses)
+/*
+ * Sort-helper for 'annotate_lookup()'; order on family and then address.
+ */
+static int annotate_compare (const struct addr_note *a, const struct addr_note *b)
 {
-  int i;
+  if (a->family != b->family)
+     return (a->family - b->family);
+  return memcmp (a->addr, b->addr,
+                 a->family == AF_INET ? sizeof(struct in_addr) : sizeof(struct in6_addr));
+}
 
-  if (g_cfg.trace_level <= 0)
-     return;
+/*
+ * Fill in the hosts-file, geo-IP and DNSBL results for all addresses in 'notes'.
+ * Only the lookups in the 'which' mask are done.
+ *
+ * The hosts-file is searched once for 'name'. The other lookups are done in
+ * address-order so the range-searches in geoip.c and dnsbl.c walk their
+ * tables in one direction. The results stay in the original order.
+ */
+#define ANNOTATE_GEOIP  0x01
+#define ANNOTATE_DNSBL  0x02
+#define ANNOTATE_ALL    (ANNOTATE_GEOIP | ANNOTATE_DNSBL)
 
-  WSAERROR_PUSH();
+static void annotate_lookup (const char *name, struct addr_notes *notes, unsigned which)
+{
+  struct addr_note *sorted [MAX_ADDR_NOTES];
+  const void       *addrs [MAX_ADDR_NOTES];
+  int               families [MAX_ADDR_NOTES];
+  BOOL              found [MAX_ADDR_NOTES];
+  int               i, j;
 
-  trace_indent (g_cfg.trace_indent+2);
-  trace_printf ("~4geo-IP: ");
-  cc_last  = loc_last  = NULL;
-  cc_equal = loc_equal = FALSE;
+  for (i = 0; i < notes->num; i++)
+  {
+    struct addr_note *note = notes->note + i;
 
-  for (i = 0; addresses && addresses[i]; i++)
+    families[i] = note->family;
+    addrs[i]    = note->addr;
+    found[i]    = FALSE;
+
+    /* Insertion-sort; there are only a few addresses.
+     */
+    for (j = i; j > 0 && note->family && annotate_compare(note, sorted[j-1]) < 0; j--)
+        sorted[j] = sorted[j-1];
+    sorted[j] = note;
+  }
+
+  /* With 'lazy_init = 1', a table still loading is not waited for here
+   * (we're inside 'ENTER_CRIT()'). The hooks do 'LAZY_INIT_WAIT()' for that.
+   */
+  if (name && lazy_init_ready(LAZY_HOSTS) &&
+      hosts_file_check_list(name, notes->num, families, addrs, found) > 0)
   {
-    const struct in_addr  *a4  = NULL;
-    const struct in6_addr *a6  = NULL;
-    const char            *cc  = NULL;
-    const char            *loc = NULL;
+    for (i = 0; i < notes->num; i++)
+        notes->note[i].in_hosts = found[i];
+  }
 
-    if (type == AF_INET)
-    {
-      a4  = (const struct in_addr*) addresses[i];
-      cc  = geoip_get_country_by_ipv4 (a4);
-      loc = geoip_get_location_by_ipv4 (a4);
-    }
-    else if (type == AF_INET6)
-    {
-      a6  = (const struct in6_addr*) addresses[i];
-      cc  = geoip_get_country_by_ipv6 (a6);
-      loc = geoip_get_location_by_ipv6 (a6);
-    }
-    else
+  for (i = 0; i < notes->num; i++)
+  {
+    struct addr_note *note = sorted[i];
+    const char       *cc, *loc = NULL;
+
+    if (!note->family)
+       continue;
+
+    if ((which & ANNOTATE_GEOIP) && g_cfg.geoip_enable && lazy_init_ready(LAZY_GEOIP))
     {
-      trace_printf ("Unknown family: %d", type);
-      break;
+      cc = geoip_cache_get_country (note->family, note->addr, &loc);
+      if (cc)
+         _strlcpy (note->country, cc, sizeof(note->country));
+      if (loc)
+         _strlcpy (note->location, loc, sizeof(note->location));
     }
-    if (trace_printf_cc(cc, loc, a4, a6) && addresses[i+1])
-       trace_puts (", ");
+
+    /* 'DNSBL_check_ipv4/6()' skips a non-global address.
+     */
+    if ((which & ANNOTATE_DNSBL) && g_cfg.DNSBL.enable && lazy_init_ready(LAZY_DNSBL))
+       note->sbl_ref = geoip_cache_get_DNSBL (note->family, note->addr);
   }
-  if (i == 0)
-       trace_puts ("None!?~0\n");
-  else trace_puts ("~0\n");
+}
+
+static void annotate_add (struct addr_notes *notes, int family, const void *addr)
+{
+  struct addr_note *note;
+
+  if (notes->num >= DIM(notes->note))
+     return;
 
+  note = notes->note + notes->num++;
+  memset (note, '\0', sizeof(*note));
+  if (family == AF_INET || family == AF_INET6)
+  {
+    note->family = family;
+    note->addr   = addr;
+  }
+}
+
+/*
+ * Annotate all the addresses in a 'getaddrinfo()' result in one pass.
+ * There can be a mix of 'AF_INET/AF_INET6' types in a single 'addrinfo'.
+ * 'notes->note[i]' belongs to the i'th 'addrinfo' in the chain.
+ */
+void annotate_addrinfo (const char *name, const struct addrinfo *ai, struct addr_notes *notes)
+{
+  notes->num = 0;
+
+  for ( ; ai; ai = ai->ai_next)
+  {
+    const void *addr = NULL;
+
+    if (ai->ai_addr && ai->ai_family == AF_INET)
+       addr = &((const struct sockaddr_in*)ai->ai_addr)->sin_addr;
+    else if (ai->ai_addr && ai->ai_family == AF_INET6)
+       addr = &((const struct sockaddr_in6*)ai->ai_addr)->sin6_addr;
+    annotate_add (notes, addr ? ai->ai_family : 0, addr);
+  }
+  WSAERROR_PUSH();
+  annotate_lookup (name, notes, ANNOTATE_ALL);
   WSAERROR_POP();
 }
 
 /*
- * Can only be 1 address in a 'sockaddr', but use the plural
- * 'countries' here anyway.
+ * As above, but for an 'hostent::h_addr_list' or a single address.
  */
-void dump_countries_sockaddr (const struct sockaddr *sa)
+static void annotate_addresses_mask (const char *name, int type, const char **addresses,
+                                     struct addr_notes *notes, unsigned which)
 {
-  const char                *addr[2];
-  const struct sockaddr_in  *sa4;
-  const struct sockaddr_in6 *sa6;
+  int i;
 
-  if (!sa || g_cfg.trace_level <= 0)
-     return;
+  notes->num = 0;
+  for (i = 0; addresses && addresses[i]; i++)
+      annotate_add (notes, type, addresses[i]);
+
+  WSAERROR_PUSH();
+  annotate_lookup (name, notes, which);
+  WSAERROR_POP();
+}
+
+void annotate_addresses (const char *name, int type, const char **addresses, struct addr_notes *notes)
+{
+  annotate_addresses_mask (name, type, addresses, notes, ANNOTATE_ALL);
+}
+
+/*
+ * Annotate the single address in 'sa'. Returns FALSE for a family
+ * other than 'AF_INET' or 'AF_INET6'.
+ */
+static BOOL annotate_sockaddr (const struct sockaddr *sa, struct addr_notes *notes, unsigned which)
+{
+  const char *addr[2];
+
+  if (!sa)
+     return (FALSE);
 
   if (sa->sa_family == AF_INET)
-  {
-    sa4 = (const struct sockaddr_in*) sa;
-    addr[0] = (const char*) &sa4->sin_addr;
-    addr[1] = NULL;
-    dump_countries (AF_INET, addr);
-  }
+     addr[0] = (const char*) &((const struct sockaddr_in*)sa)->sin_addr;
   else if (sa->sa_family == AF_INET6)
-  {
-    sa6 = (const struct sockaddr_in6*) sa;
-    addr[0] = (const char*) &sa6->sin6_addr;
-    addr[1] = NULL;
-    dump_countries (AF_INET6, addr);
-  }
+     addr[0] = (const char*) &((const struct sockaddr_in6*)sa)->sin6_addr;
+  else
+     return (FALSE);
+
+  addr[1] = NULL;
+  annotate_addresses_mask (NULL, sa->sa_family, addr, notes, which);
+  return (TRUE);
 }
 
 /*
- * There can be a mix of 'AF_INET/AF_INET6' types in a single 'addrinfo'
- * structure.
+ * Print the geo-IP and DNSBL notes of the address in 'sa' from one lookup.
+ * For the hooks having one peer or local address.
  */
-void dump_countries_addrinfo (const struct addrinfo *ai)
+void dump_sockaddr_notes (const struct sockaddr *sa)
 {
-  int num;
+  struct addr_notes notes;
+  unsigned          which = 0;
+
+  if (g_cfg.geoip_enable && g_cfg.trace_level > 0)
+     which |= ANNOTATE_GEOIP;
+  if (g_cfg.DNSBL.enable)
+     which |= ANNOTATE_DNSBL;
+
+  if (!which || !annotate_sockaddr(sa, &notes, which))
+     return;
+
+  if (which & ANNOTATE_GEOIP)
+     dump_countries_notes (&notes);
+  if (which & ANNOTATE_DNSBL)
+     dump_DNSBL_notes (&notes);
+}
+
+void dump_countries_notes (const struct addr_notes *notes)
+{
+  int i;
 
   if (g_cfg.trace_level <= 0)
      return;
@@ -2138,42 +2955,55 @@ void dump_countries_addrinfo (const struct addrinfo *ai)
   cc_last  = loc_last  = NULL;
   cc_equal = loc_equal = FALSE;
 
-  for (num = 0; ai; ai = ai->ai_next, num++)
+  for (i = 0; i < notes->num; i++)
   {
-    const struct sockaddr_in  *sa4 = NULL;
-    const struct sockaddr_in6 *sa6 = NULL;
-    const char                *cc  = NULL;
-    const char                *loc = NULL;
+    const struct addr_note *note = notes->note + i;
+    const char             *cc   = note->country[0]  ? note->country  : NULL;
+    const char             *loc  = note->location[0] ? note->location : NULL;
 
-    if (ai->ai_family == AF_INET)
+    if (!note->family)
     {
-      sa4 = (const struct sockaddr_in*) ai->ai_addr;
-      cc  = geoip_get_country_by_ipv4 (&sa4->sin_addr);
-      loc = geoip_get_location_by_ipv4 (&sa4->sin_addr);
-    }
-    else if (ai->ai_family == AF_INET6)
-    {
-      sa6 = (const struct sockaddr_in6*) ai->ai_addr;
-      cc  = geoip_get_country_by_ipv6 (&sa6->sin6_addr);
-      loc = geoip_get_location_by_ipv6 (&sa6->sin6_addr);
-    }
-    else
-    {
-      trace_printf ("Unknown family: %d", ai->ai_family);
+      trace_puts ("Unknown family");
       break;
     }
     if (trace_printf_cc(cc, loc,
-                        sa4 ? &sa4->sin_addr  : NULL,
-                        sa6 ? &sa6->sin6_addr : NULL) && ai->ai_next)
-      trace_puts (", ");
+                        note->family == AF_INET  ? note->addr : NULL,
+                        note->family == AF_INET6 ? note->addr : NULL) && i < notes->num-1)
+       trace_puts (", ");
   }
-  if (num == 0)
+  if (i == 0)
        trace_puts ("None!?~0\n");
   else trace_puts ("~0\n");
 
   WSAERROR_POP();
 }
 
+void dump_countries (int type, const char **addresses)
+{
+  struct addr_notes notes;
+
+  if (g_cfg.trace_level <= 0)
+     return;
+
+  annotate_addresses_mask (NULL, type, addresses, &notes, ANNOTATE_GEOIP);
+  dump_countries_notes (&notes);
+}
+
+/*
+ * Can only be 1 address in a 'sockaddr', but use the plural
+ * 'countries' here anyway.
+ */
+void dump_countries_sockaddr (const struct sockaddr *sa)
+{
+  struct addr_notes notes;
+
+  if (g_cfg.trace_level <= 0)
+     return;
+
+  if (annotate_sockaddr(sa, &notes, ANNOTATE_GEOIP))
+     dump_countries_notes (&notes);
+}
+
 void dump_nameinfo (const char *host, const char *serv, DWORD flags)
 {
   trace_indent (g_cfg.trace_indent+2);
@@ -2183,13 +3013,17 @@ void dump_nameinfo (const char *host, const char *serv, DWORD flags)
   ARGSUSED (flags);
 }
 
-void dump_hostent (const char *name, const struct hostent *host)
+void dump_hostent (const struct hostent *host, const struct addr_notes *notes)
 {
-  const char *comment;
+  const char *comment = "";
+  int         i;
 
-  if (hosts_file_check_hostent(name, host) > 0)
-       comment = " (in 'hosts' file)";
-  else comment = "";
+  for (i = 0; i < notes->num; i++)
+      if (notes->note[i].in_hosts)
+      {
+        comment = " (in 'hosts' file)";
+        break;
+      }
 
   trace_indent (g_cfg.trace_indent+2);
   trace_printf ("~4name: %s, addrtype: %s, addr_list: %s%s\n",
@@ -2265,73 +3099,33 @@ void dump_events (const WSANETWORKEVENTS *in_events, const WSANETWORKEVENTS *out
   _dump_events (TRUE, out_events);
 }
 
-void dump_DNSBL (int type, const char **addresses)
+void dump_DNSBL_notes (const struct addr_notes *notes)
 {
   int i;
 
-  for (i = 0; addresses && addresses[i]; i++)
+  for (i = 0; i < notes->num; i++)
   {
-    const struct in_addr  *a4 = (const struct in_addr*) addresses[i];
-    const struct in6_addr *a6 = (const struct in6_addr*) addresses[i];
-    const char            *sbl_ref = NULL;
-
-    if (type == AF_INET)
-         DNSBL_check_ipv4 (a4, &sbl_ref);
-    else if (type == AF_INET6)
-         DNSBL_check_ipv6 (a6, &sbl_ref);
+    const char *sbl_ref = notes->note[i].sbl_ref;
+
     if (sbl_ref)
        trace_printf ("%*s~4DNSBL: SBL%s~0\n", g_cfg.trace_indent+2, "", sbl_ref);
   }
 }
 
-void dump_DNSBL_sockaddr (const struct sockaddr *sa)
+void dump_DNSBL (int type, const char **addresses)
 {
-  const char                *addr[2];
-  const struct sockaddr_in  *sa4;
-  const struct sockaddr_in6 *sa6;
+  struct addr_notes notes;
 
-  if (!sa)
-     return;
-
-  if (sa->sa_family == AF_INET)
-  {
-    sa4 = (const struct sockaddr_in*) sa;
-    addr[0] = (const char*) &sa4->sin_addr;
-    addr[1] = NULL;
-    dump_DNSBL (AF_INET, addr);
-  }
-  else if (sa->sa_family == AF_INET6)
-  {
-    sa6 = (const struct sockaddr_in6*) sa;
-    addr[0] = (const char*) &sa6->sin6_addr;
-    addr[1] = NULL;
-    dump_DNSBL (AF_INET6, addr);
-  }
+  annotate_addresses_mask (NULL, type, addresses, &notes, ANNOTATE_DNSBL);
+  dump_DNSBL_notes (&notes);
 }
 
-void dump_DNSBL_addrinfo (const struct addrinfo *ai)
+void dump_DNSBL_sockaddr (const struct sockaddr *sa)
 {
-  int num;
+  struct addr_notes notes;
 
-  for (num = 0; ai; ai = ai->ai_next, num++)
-  {
-    const struct sockaddr_in  *sa4;
-    const struct sockaddr_in6 *sa6;
-    const char                *sbl_ref = NULL;
-
-    if (ai->ai_family == AF_INET)
-    {
-      sa4 = (const struct sockaddr_in*) ai->ai_addr;
-      DNSBL_check_ipv4 (&sa4->sin_addr, &sbl_ref);
-    }
-    else if (ai->ai_family == AF_INET6)
-    {
-      sa6 = (const struct sockaddr_in6*) ai->ai_addr;
-      DNSBL_check_ipv6 (&sa6->sin6_addr, &sbl_ref);
-    }
-    if (sbl_ref)
-       trace_printf ("%*s~4DNSBL: SBL%s~0\n", g_cfg.trace_indent+2, "", sbl_ref);
-  }
+  if (annotate_sockaddr(sa, &notes, ANNOTATE_DNSBL))
+     dump_DNSBL_notes (&notes);
 }
 
 /*
@@ -9,16 +9,74 @@ extern size_t  size_fd_set    (const fd_set *fd);
 extern fd_set *copy_fd_set    (const fd_set *fd);
 extern fd_set *copy_fd_set_to (const fd_set *fd, fd_set *dst);
 
-extern void dump_addrinfo  (const char *name, const struct addrinfo *ai);
+/*
+ * The slots of the per-thread 'fd_set' buffers used in 'select()'.
+ */
+#define FD_COPY_NETEM   0    /* 0 - 2: the rd, wr and ex sets for '[netem]' */
+#define FD_COPY_DUMP    3    /* 3 - 5: the sets given for 'dump_select = 1' */
+#define FD_COPY_NEWS    6    /* the new ready sockets for 'dump_select = 2' */
+#define FD_COPY_MAX     7
+
+extern fd_set *fd_set_buf      (int slot, size_t size);
+extern fd_set *copy_fd_set_buf (const fd_set *fd, int slot);
+
+/*
+ * The results for each address in a 'getaddrinfo()' or 'gethostbyX()' result.
+ * Filled in one pass by 'annotate_addrinfo()' or 'annotate_addresses()'.
+ */
+#define MAX_ADDR_NOTES  32
+
+struct addr_note {
+       int         family;          /* AF_INET, AF_INET6 or 0 if unsupported */
+       const void *addr;            /* a 'struct in_addr*' or 'struct in6_addr*' */
+       BOOL        in_hosts;        /* found in the hosts-file */
+       const char *sbl_ref;         /* the DNSBL SBL-reference or NULL */
+       char        country [3];
+       char        location [100];
+     };
+
+struct addr_notes {
+       int              num;
+       struct addr_note note [MAX_ADDR_NOTES];
+     };
+
+extern void annotate_addrinfo  (const char *name, const struct addrinfo *ai, struct addr_notes *notes);
+extern void annotate_addresses (const char *name, int type, const char **addresses, struct addr_notes *notes);
+
+extern void dump_addrinfo  (const struct addrinfo *ai, const struct addr_notes *notes);
 extern void dump_data      (const void *data_p, unsigned data_len);
 extern void dump_wsabuf    (const WSABUF *bufs, DWORD num_bufs);
 
-extern void dump_hostent   (const char *name, const struct hostent *h);
+extern void dump_hostent   (const struct hostent *h, const struct addr_notes *notes);
 extern void dump_servent   (const struct servent *s);
 extern void dump_protoent  (const struct protoent *p);
 extern void dump_nameinfo  (const char *host, const char *serv, DWORD flags);
 extern void dump_select    (const fd_set *rd, const fd_set *wr, const fd_set *ex, int indent);
+extern void dump_select_ready (const fd_set *rd, const fd_set *wr, const fd_set *ex,
+                               const u_int *count, int indent);
+extern void dump_select_init  (void);
+extern void dump_select_exit  (void);
+extern void dump_select_thread_exit (void);
+extern void select_ready_update (const fd_set *rd, const fd_set *wr, const fd_set *ex);
+extern BOOL select_was_ready  (int which, SOCKET s);
 extern void dump_wsapollfd (const WSAPOLLFD *fd_array, ULONG fds, int indent);
+extern void dump_wsapoll_delta  (const WSAPOLLFD *fd_array, ULONG fds, int ready, ULONG changed, int indent);
+extern ULONG wsapoll_delta_count (const WSAPOLLFD *fd_array, ULONG fds);
+extern BOOL wsawait_delta       (DWORD num_ev, const WSAEVENT *ev, DWORD rc);
+extern void poll_delta_init     (void);
+extern void poll_delta_exit     (void);
+extern void poll_delta_thread_exit (void);
+
+/*
+ * For 'poll_stats = 1'.
+ */
+#define POLL_SELECT  0
+#define POLL_WSAPOLL 1
+#define POLL_WSAWAIT 2
+#define POLL_MAX     3
+
+extern void poll_stats_add    (int which, const LARGE_INTEGER *start, ULONG fds, int ready);
+extern void poll_stats_report (void);
 
 extern void dump_wsaprotocol_info (char ascii_or_wide, const void *proto_info, const void *provider_path_func);
 extern void dump_events           (const WSANETWORKEVENTS *in_events, const WSANETWORKEVENTS *out_events);
@@ -26,11 +84,13 @@ extern void dump_extension_funcs  (const GUID *guid, const void *out_buf);
 
 extern void dump_countries          (int type, const char **addresses);
 extern void dump_countries_sockaddr (const struct sockaddr *sa);
-extern void dump_countries_addrinfo (const struct addrinfo *ai);
+extern void dump_countries_notes    (const struct addr_notes *notes);
 
 extern void dump_DNSBL          (int type, const char **addresses);
 extern void dump_DNSBL_sockaddr (const struct sockaddr *sa);
-extern void dump_DNSBL_addrinfo (const struct addrinfo *ai);
+extern void dump_DNSBL_notes    (const struct addr_notes *notes);
+
+extern void dump_sockaddr_notes (const struct sockaddr *sa);
 
 extern const char *socket_family (int family);
 extern const char *socket_type (int type);
@@ -1478,6 +1478,31 @@ static char        *SpamHaus_URL = "https://www.spamhaus.org/sbl/query";
 #define MAX_DOMAIN_SZ    20
 #define MAX_ACCOUNT_SZ   30
 
+/**
+ * \def FW_RESOLVED
+ *  The name of a cache entry is valid.
+ *
+ * \def FW_PENDING
+ *  The name of a cache entry is being looked up by `fw_resolver_thread()`.
+ *
+ * \def FW_NEGATIVE
+ *  The lookup failed. Try again after `FW_NEGATIVE_TTL` msec.
+ */
+#define FW_RESOLVED      0
+#define FW_PENDING       1
+#define FW_NEGATIVE      2
+#define FW_NEGATIVE_TTL  60000
+
+/**
+ * \def FILTER_HASH_SIZE
+ *  Number of buckets in `filter_hash[]`; a power of 2.
+ *
+ * \def SID_HASH_SIZE
+ *  Number of buckets in `SID_hash[]` and `app_hash[]`; a power of 2.
+ */
+#define FILTER_HASH_SIZE 1024
+#define SID_HASH_SIZE    256
+
 /**
  * \struct SID_entry
  * A cache of SIDs for `print_user_id()` and `print_package_id()`.<br>
@@ -1488,10 +1513,36 @@ struct SID_entry {
        char *sid_str;                 /**< A string representing this SID */
        char  domain [MAX_DOMAIN_SZ];  /**< The `domain` name it belongs to */
        char  account[MAX_ACCOUNT_SZ]; /**< The `domain\\user` it belowngs to */
+       struct SID_entry *next;        /**< The next entry in this `SID_hash[]` bucket */
+       DWORD             hash;        /**< The hash of the `sid_copy` bytes */
+       volatile LONG     state;       /**< `FW_RESOLVED`, `FW_PENDING` or `FW_NEGATIVE` */
+       DWORD             retry;       /**< `GetTickCount()` when a `FW_NEGATIVE` entry can be retried */
      };
 
-static smartlist_t *SID_entries;             /**< A dynamic list of `SID_entry` items */
-static char         fw_logged_on_user [100]; /**< The name of the logged on user */
+static smartlist_t      *SID_entries;             /**< A dynamic list of `SID_entry` items */
+static struct SID_entry *SID_hash [SID_HASH_SIZE];
+static char              fw_logged_on_user [100]; /**< The name of the logged on user */
+
+/**
+ * \struct app_entry
+ * A cache of `appId` blobs and the program-names for `print_app_id()`.
+ */
+struct app_entry {
+       struct app_entry *next;        /**< The next entry in this `app_hash[]` bucket */
+       DWORD             hash;        /**< The hash of the `key` bytes */
+       UINT32            size;        /**< The size of `key` */
+       char             *name;        /**< The program-name; follows the `key` */
+       BYTE              key [1];     /**< A copy of the `appId` blob */
+     };
+
+static smartlist_t      *app_entries;  /**< A dynamic list of `struct app_entry` items */
+static struct app_entry *app_hash [SID_HASH_SIZE];
+
+/**
+ * Lookup statistics for the above caches and `filter_hash[]`.
+ */
+static DWORD fw_cache_hits   = 0;
+static DWORD fw_cache_misses = 0;
 
 /**
  * Stuff for checking if `%n` can be used in `*printf()` functions.
@@ -1542,9 +1593,25 @@ static void fw_check_n_format (BOOL init, BOOL push)
 struct filter_entry {
        UINT64 value;        /**< The filter-value of this item */
        char   name [50];    /**< The filter-name of this item */
+       struct filter_entry *next;   /**< The next entry in this `filter_hash[]` bucket */
+       volatile LONG        state;  /**< `FW_RESOLVED`, `FW_PENDING` or `FW_NEGATIVE` */
+       DWORD                retry;  /**< `GetTickCount()` when a `FW_NEGATIVE` entry can be retried */
      };
 
-static smartlist_t *filter_entries;  /**< A dynamic list of `struct filter_entry` items */
+static smartlist_t         *filter_entries;  /**< A dynamic list of `struct filter_entry` items */
+static struct filter_entry *filter_hash [FILTER_HASH_SIZE];
+
+/**
+ * The `SID_entry`, `filter_entry` and `app_entry` items are allocated from this.
+ * Released in `fw_exit()`.
+ */
+static struct arena *fw_arena;
+
+/**
+ * Set if the event-worker or the resolver did not stop in `fw_monitor_stop()`.
+ * Then `fw_exit()` cannot free what they could still use.
+ */
+static BOOL fw_thread_alive = FALSE;
 
 static char  fw_buf [2000];
 static char *fw_ptr  = fw_buf;
@@ -1672,11 +1739,12 @@ static void fw_add_long_line (const char *start, size_t indent, int brk_ch)
                              "-----------------------------------------\n"                                   \
                              "%s(): thr-id: %lu.\n",                                                         \
                              __FUNCTION__, DWORD_CAST(GetCurrentThreadId()));                                \
-            fw_event_callback (event->type,                                                                  \
-                               (const _FWPM_NET_EVENT_HEADER3*) &event->header,                              \
+            fw_event_dispatch (event->type,                                                                  \
+                               (const _FWPM_NET_EVENT_HEADER3*) &event->header, sizeof(event->header),       \
                                                                                                              \
                                event->type == _FWPM_NET_EVENT_TYPE_CLASSIFY_DROP ?                           \
                                  (const _FWPM_NET_EVENT_CLASSIFY_DROP2*) drop_member1 : NULL,                \
+                               sizeof(*drop_member1),                                                        \
                                                                                                              \
                                event->type == _FWPM_NET_EVENT_TYPE_CAPABILITY_DROP ?                         \
                                  (const _FWPM_NET_EVENT_CAPABILITY_DROP0*) drop_member2 : NULL,              \
@@ -1698,6 +1766,18 @@ static void CALLBACK fw_event_callback (const UINT
                                         const _FWPM_NET_EVENT_CLASSIFY_ALLOW0   *allow_event1,
                                         const _FWPM_NET_EVENT_CAPABILITY_ALLOW0 *allow_event2);
 
+static void fw_event_dispatch (const UINT                               event_type,
+                               const _FWPM_NET_EVENT_HEADER3           *header,
+                               size_t                                   header_size,
+                               const _FWPM_NET_EVENT_CLASSIFY_DROP2    *drop_event1,
+                               size_t                                   drop_size,
+                               const _FWPM_NET_EVENT_CAPABILITY_DROP0  *drop_event2,
+                               const _FWPM_NET_EVENT_CLASSIFY_ALLOW0   *allow_event1,
+                               const _FWPM_NET_EVENT_CAPABILITY_ALLOW0 *allow_event2);
+
+static BOOL fw_resolver_init (void);
+static void fw_resolver_exit (void);
+
 /**
  * These expands to:
  * \li `static void CALLBACK fw_event_callback0 (void *context, const _FWPM_NET_EVENT1 *event)`
@@ -1859,8 +1939,18 @@ BOOL fw_init (void)
    */
   api_version = FW_REDSTONE2_BINARY_VERSION;
 
+  /* The GeoIP and DNSBL tables are needed by the event-printing.
+   */
+  lazy_init_wait (LAZY_GEOIP | LAZY_DNSBL);
+
   SID_entries    = smartlist_new();
   filter_entries = smartlist_new();
+  app_entries    = smartlist_new();
+  fw_arena       = arena_new ("firewall", 16*1024);
+  memset (&SID_hash, '\0', sizeof(SID_hash));
+  memset (&app_hash, '\0', sizeof(app_hash));
+  memset (&filter_hash, '\0', sizeof(filter_hash));
+  fw_cache_hits = fw_cache_misses = 0;
   fw_num_rules   = 0;
 
   fw_have_ip2loc4 = (ip2loc_num_ipv4_entries() > 0);
@@ -1894,19 +1984,6 @@ BOOL fw_init (void)
   return (fw_errno == ERROR_SUCCESS);
 }
 
-/**
- * `smartlist_wipe()` helper.
- * Free an item `_e` in the `SID_entries` smartlist.
- */
-static void fw_SID_free (void *_e)
-{
-  struct SID_entry *e = (struct SID_entry*) _e;
-
-  if (e->sid_str)
-     LocalFree (e->sid_str);
-  free (e);
-}
-
 /**
  * This should be the last functions called in this module.
  */
@@ -1919,11 +1996,23 @@ void fw_exit (void)
 
   fw_monitor_stop (FALSE);
 
-  smartlist_wipe (SID_entries, fw_SID_free);
-  smartlist_wipe (filter_entries, free);
+  if (fw_thread_alive)
+  {
+    TRACE (1, "A firewall thread is still running; not freeing the caches.\n");
+    return;
+  }
+
+  smartlist_free (SID_entries);
+  smartlist_free (filter_entries);
+  smartlist_free (app_entries);
   smartlist_wipe (SBL_entries, free);
+  arena_free (fw_arena);
 
-  SID_entries = filter_entries = SBL_entries = NULL;
+  SID_entries = filter_entries = app_entries = SBL_entries = NULL;
+  fw_arena = NULL;
+  memset (&SID_hash, '\0', sizeof(SID_hash));
+  memset (&app_hash, '\0', sizeof(app_hash));
+  memset (&filter_hash, '\0', sizeof(filter_hash));
 
   unload_dynamic_table (fw_funcs, DIM(fw_funcs));
 }
@@ -2146,6 +2235,318 @@ static BOOL fw_check_sizes (void)
   return (TRUE);
 }
 
+/**
+ * \struct fw_event
+ * A copy of an event from the WFP callback waiting for the event-worker.
+ *
+ * The pointer fields in `header` (`appId`, `userId`, `packageSid` and `effectiveName`)
+ * are re-pointed into `data[]`. The other pointers are cleared since they
+ * are never printed.
+ */
+struct fw_event {
+       struct fw_event                *next;
+       UINT                            type;
+       _FWPM_NET_EVENT_HEADER3         header;
+       union {
+         _FWPM_NET_EVENT_CLASSIFY_DROP2    drop1;
+         _FWPM_NET_EVENT_CAPABILITY_DROP0  drop2;
+         _FWPM_NET_EVENT_CLASSIFY_ALLOW0   allow1;
+         _FWPM_NET_EVENT_CAPABILITY_ALLOW0 allow2;
+       } u;
+       BYTE                            data [1];
+     };
+
+/**
+ * The event-queue is a lock-free LIFO list pushed to by the WFP callback.
+ * The event-worker takes the whole list in one go and reverses it.
+ */
+static struct fw_event *volatile fw_queue_head  = NULL;
+static HANDLE                    fw_queue_event = NULL;  /**< Wakes up the worker */
+static HANDLE                    fw_queue_done  = NULL;  /**< Set when the worker exits */
+static HANDLE                    fw_queue_thread = NULL;
+static CRITICAL_SECTION          fw_queue_crit;          /**< Serialises calls to `fw_event_callback()` */
+static volatile LONG             fw_queue_stop  = 0;
+static volatile LONG             fw_queue_len   = 0;     /**< The current backlog */
+static volatile LONG             fw_queue_peak  = 0;     /**< The max backlog */
+static volatile LONG             fw_queue_drops = 0;     /**< Dropped since the queue was full */
+static DWORD                     fw_queue_batches = 0;
+static DWORD                     fw_queue_dequeued = 0;
+
+/**
+ * Return the size of the variable-length parts of `header` that
+ * `fw_event_enqueue()` must copy.
+ */
+static size_t fw_event_extra_size (const _FWPM_NET_EVENT_HEADER3 *header)
+{
+  size_t size = 0;
+
+  if ((header->flags & FWPM_NET_EVENT_FLAG_APP_ID_SET) && header->appId.data)
+     size += header->appId.size + sizeof(void*);
+
+  if ((header->flags & FWPM_NET_EVENT_FLAG_USER_ID_SET) && header->userId)
+     size += GetLengthSid (header->userId) + sizeof(void*);
+
+  if ((header->flags & FWPM_NET_EVENT_FLAG_PACKAGE_ID_SET) && header->packageSid)
+     size += GetLengthSid (header->packageSid) + sizeof(void*);
+
+  if ((header->flags & FWPM_NET_EVENT_FLAG_EFFECTIVE_NAME_SET) && header->effectiveName.data)
+     size += header->effectiveName.size + sizeof(void*);
+  return (size);
+}
+
+/**
+ * Copy `size` bytes from `src` to `*dst` and return the aligned start of it.
+ */
+static void *fw_event_copy (BYTE **dst, const void *src, size_t size)
+{
+  void *ret = memcpy (*dst, src, size);
+
+  *dst += (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  return (ret);
+}
+
+/**
+ * Called on the WFP callback thread.
+ * Only copy the raw event and push it to the queue; the printing, the GeoIP,
+ * DNSBL and SID lookups are all done later by `fw_event_worker()`.
+ *
+ * The lower API levels have smaller headers and `classifyDrop` members than
+ * the ones used here. Hence copy only what the callback gave us (`header_size`
+ * and `drop_size`) and leave the rest zero.
+ */
+static BOOL fw_event_enqueue (const UINT                               event_type,
+                              const _FWPM_NET_EVENT_HEADER3           *header,
+                              size_t                                   header_size,
+                              const void                              *sub_event,
+                              size_t                                   sub_size)
+{
+  struct fw_event *ev, *head;
+  BYTE            *data;
+  LONG             len, peak;
+
+  len = InterlockedIncrement (&fw_queue_len);
+  if (len > g_cfg.firewall.queue_max)
+  {
+    InterlockedDecrement (&fw_queue_len);
+    InterlockedIncrement (&fw_queue_drops);
+    return (FALSE);
+  }
+
+  ev = calloc (1, sizeof(*ev) + fw_event_extra_size(header));
+  if (!ev)
+  {
+    InterlockedDecrement (&fw_queue_len);
+    InterlockedIncrement (&fw_queue_drops);
+    return (FALSE);
+  }
+
+  ev->type = event_type;
+  memcpy (&ev->header, header, min(header_size, sizeof(ev->header)));
+  if (sub_event)
+     memcpy (&ev->u, sub_event, min(sub_size, sizeof(ev->u)));
+
+  data = ev->data;
+  ev->header.userId        = NULL;
+  ev->header.packageSid    = NULL;
+  ev->header.enterpriseId  = NULL;
+  if (event_type == _FWPM_NET_EVENT_TYPE_CLASSIFY_DROP)
+     memset (&ev->u.drop1.vSwitchId, '\0', sizeof(ev->u.drop1.vSwitchId));
+
+  if (!((header->flags & FWPM_NET_EVENT_FLAG_APP_ID_SET) && header->appId.data))
+     memset (&ev->header.appId, '\0', sizeof(ev->header.appId));
+  else ev->header.appId.data = fw_event_copy (&data, header->appId.data, header->appId.size);
+
+  if ((header->flags & FWPM_NET_EVENT_FLAG_USER_ID_SET) && header->userId)
+     ev->header.userId = fw_event_copy (&data, header->userId, GetLengthSid(header->userId));
+
+  if ((header->flags & FWPM_NET_EVENT_FLAG_PACKAGE_ID_SET) && header->packageSid)
+     ev->header.packageSid = fw_event_copy (&data, header->packageSid, GetLengthSid(header->packageSid));
+
+  if (!((header->flags & FWPM_NET_EVENT_FLAG_EFFECTIVE_NAME_SET) && header->effectiveName.data))
+     memset (&ev->header.effectiveName, '\0', sizeof(ev->header.effectiveName));
+  else ev->header.effectiveName.data = fw_event_copy (&data, header->effectiveName.data,
+                                                       header->effectiveName.size);
+
+  /* Record the max backlog.
+   */
+  do
+    peak = fw_queue_peak;
+  while (len > peak && InterlockedCompareExchange(&fw_queue_peak, len, peak) != peak);
+
+  do
+  {
+    head = fw_queue_head;
+    ev->next = head;
+  }
+  while (InterlockedCompareExchangePointer((void* volatile*)&fw_queue_head, ev, head) != head);
+
+  /* Wake up the worker only when the queue was empty.
+   */
+  if (!head)
+     SetEvent (fw_queue_event);
+  return (TRUE);
+}
+
+/**
+ * Print all events in the queue as one batch (in the order they arrived).
+ */
+static DWORD fw_queue_drain (void)
+{
+  struct fw_event *ev, *next, *fifo = NULL;
+  DWORD  num = 0;
+
+  ev = InterlockedExchangePointer ((void* volatile*)&fw_queue_head, NULL);
+  if (!ev)
+     return (0);
+
+  for ( ; ev; ev = next)
+  {
+    next = ev->next;
+    ev->next = fifo;
+    fifo = ev;
+  }
+
+  EnterCriticalSection (&fw_queue_crit);
+  for (ev = fifo; ev; ev = next)
+  {
+    next = ev->next;
+    fw_event_callback (ev->type, &ev->header,
+                       ev->type == _FWPM_NET_EVENT_TYPE_CLASSIFY_DROP    ? &ev->u.drop1  : NULL,
+                       ev->type == _FWPM_NET_EVENT_TYPE_CAPABILITY_DROP  ? &ev->u.drop2  : NULL,
+                       ev->type == _FWPM_NET_EVENT_TYPE_CLASSIFY_ALLOW   ? &ev->u.allow1 : NULL,
+                       ev->type == _FWPM_NET_EVENT_TYPE_CAPABILITY_ALLOW ? &ev->u.allow2 : NULL);
+    free (ev);
+    num++;
+  }
+  fw_queue_batches++;
+  fw_queue_dequeued += num;
+  LeaveCriticalSection (&fw_queue_crit);
+
+  InterlockedExchangeAdd (&fw_queue_len, -(LONG)num);
+  TRACE (3, "Printed a batch of %lu events.\n", DWORD_CAST(num));
+  return (num);
+}
+
+/**
+ * The event-worker thread.
+ * Sleeps until `fw_event_enqueue()` pushes to an empty queue.
+ */
+static DWORD WINAPI fw_event_worker (void *arg)
+{
+  while (!fw_queue_stop)
+  {
+    WaitForSingleObject (fw_queue_event, 1000);
+    fw_queue_drain();
+  }
+  fw_queue_drain();
+  SetEvent (fw_queue_done);
+  ARGSUSED (arg);
+  return (0);
+}
+
+static BOOL fw_queue_init (void)
+{
+  DWORD tid;
+
+  if (fw_queue_thread || g_cfg.firewall.queue_max <= 0)
+     return (FALSE);
+
+  InitializeCriticalSection (&fw_queue_crit);
+  fw_queue_event = CreateEvent (NULL, FALSE, FALSE, NULL);
+  fw_queue_done  = CreateEvent (NULL, TRUE, FALSE, NULL);
+  fw_queue_stop  = fw_queue_len = fw_queue_peak = fw_queue_drops = 0;
+  fw_queue_batches = fw_queue_dequeued = 0;
+
+  if (fw_queue_event && fw_queue_done)
+     fw_queue_thread = CreateThread (NULL, 0, fw_event_worker, NULL, 0, &tid);
+
+  if (!fw_queue_thread)
+  {
+    TRACE (0, "Failed to start the firewall event-worker: %s.\n", win_strerror(GetLastError()));
+    if (fw_queue_event)
+       CloseHandle (fw_queue_event);
+    if (fw_queue_done)
+       CloseHandle (fw_queue_done);
+    fw_queue_event = fw_queue_done = NULL;
+    DeleteCriticalSection (&fw_queue_crit);
+    return (FALSE);
+  }
+  TRACE (2, "Firewall event-worker thread-id: %lu, queue_max: %d.\n",
+         DWORD_CAST(tid), g_cfg.firewall.queue_max);
+  return (TRUE);
+}
+
+/*
+ * Since this could be called from 'DllMain()', we cannot wait for the thread
+ * handle. Wait for the 'done' event the thread sets as it's last action.
+ * At process exit, the thread could already be killed; then don't wait.
+ *
+ * Returns FALSE if the thread is still running.
+ */
+static BOOL fw_thread_stopped (HANDLE thread, HANDLE done)
+{
+  DWORD code;
+
+  if (GetExitCodeThread(thread, &code) && code != STILL_ACTIVE)
+     return (TRUE);
+  if (WaitForSingleObject(done, 2000) == WAIT_OBJECT_0)
+     return (TRUE);
+  return (GetExitCodeThread(thread, &code) && code != STILL_ACTIVE);
+}
+
+/*
+ * Stop the event-worker and print what's left in the queue.
+ * If it did not stop, leave it's queue, lock and events alone.
+ */
+static void fw_queue_exit (void)
+{
+  if (!fw_queue_thread)
+     return;
+
+  fw_queue_stop = 1;
+  SetEvent (fw_queue_event);
+  if (!fw_thread_stopped(fw_queue_thread, fw_queue_done))
+  {
+    TRACE (1, "The firewall event-worker did not stop.\n");
+    fw_thread_alive = TRUE;
+    return;
+  }
+  fw_queue_drain();
+
+  CloseHandle (fw_queue_thread);
+  CloseHandle (fw_queue_event);
+  CloseHandle (fw_queue_done);
+  fw_queue_thread = fw_queue_event = fw_queue_done = NULL;
+  DeleteCriticalSection (&fw_queue_crit);
+}
+
+/**
+ * Called from the `fw_event_callbackX()` functions.
+ * Queue the event if the event-worker is running. Otherwise print it now.
+ */
+static void fw_event_dispatch (const UINT                               event_type,
+                               const _FWPM_NET_EVENT_HEADER3           *header,
+                               size_t                                   header_size,
+                               const _FWPM_NET_EVENT_CLASSIFY_DROP2    *drop_event1,
+                               size_t                                   drop_size,
+                               const _FWPM_NET_EVENT_CAPABILITY_DROP0  *drop_event2,
+                               const _FWPM_NET_EVENT_CLASSIFY_ALLOW0   *allow_event1,
+                               const _FWPM_NET_EVENT_CAPABILITY_ALLOW0 *allow_event2)
+{
+  if (fw_queue_thread && !fw_queue_stop)
+  {
+    if (drop_event1)
+       fw_event_enqueue (event_type, header, header_size, drop_event1, drop_size);
+    else if (drop_event2)
+       fw_event_enqueue (event_type, header, header_size, drop_event2, sizeof(*drop_event2));
+    else if (allow_event1)
+       fw_event_enqueue (event_type, header, header_size, allow_event1, sizeof(*allow_event1));
+    else fw_event_enqueue (event_type, header, header_size, allow_event2, allow_event2 ? sizeof(*allow_event2) : 0);
+  }
+  else
+    fw_event_callback (event_type, header, drop_event1, drop_event2, allow_event1, allow_event2);
+}
+
 BOOL fw_monitor_start (void)
 {
   _FWPM_NET_EVENT_SUBSCRIPTION0  subscription   = { 0 };
@@ -2175,31 +2576,49 @@ BOOL fw_monitor_start (void)
   subscription.enumTemplate = NULL; /* Don't really need a template */
 #endif
 
+  /* Start the event-worker and resolver before any events can arrive.
+   */
+  fw_resolver_init();
+  fw_queue_init();
+
   /* Subscribe to the events.
    * With API level = `fw_api == FW_API_DEFAULT` if not user-defined.
    */
-  return fw_monitor_subscribe (&subscription);
+  if (fw_monitor_subscribe(&subscription))
+     return (TRUE);
+
+  fw_queue_exit();
+  fw_resolver_exit();
+  return (FALSE);
 }
 
 void fw_monitor_stop (BOOL force)
 {
-  if (force)
+  /* Stop the callbacks first.
+   */
+  if (fw_event_handle != INVALID_HANDLE_VALUE)
   {
-    if (fw_event_handle != INVALID_HANDLE_VALUE)
+    if (force)
        CloseHandle (fw_event_handle);
-    if (fw_engine_handle != INVALID_HANDLE_VALUE)
-       CloseHandle (fw_engine_handle);
-  }
-  else
-  {
-    if (fw_engine_handle != INVALID_HANDLE_VALUE &&
-        fw_event_handle  != INVALID_HANDLE_VALUE && p_FwpmNetEventUnsubscribe0)
+    else if (fw_engine_handle != INVALID_HANDLE_VALUE && p_FwpmNetEventUnsubscribe0)
        (*p_FwpmNetEventUnsubscribe0) (fw_engine_handle, fw_event_handle);
-
-    if (fw_engine_handle != INVALID_HANDLE_VALUE && p_FwpmEngineClose0)
-       (*p_FwpmEngineClose0) (fw_engine_handle);
   }
-  fw_event_handle = fw_engine_handle = INVALID_HANDLE_VALUE;
+  fw_event_handle = INVALID_HANDLE_VALUE;
+
+  /* Print the events still queued. The printing and the resolver
+   * uses 'fw_engine_handle'. Hence close it last.
+   */
+  fw_queue_exit();
+  fw_resolver_exit();
+
+  if (fw_engine_handle == INVALID_HANDLE_VALUE || fw_thread_alive)
+     return;
+
+  if (force)
+     CloseHandle (fw_engine_handle);
+  else if (p_FwpmEngineClose0)
+     (*p_FwpmEngineClose0) (fw_engine_handle);
+  fw_engine_handle = INVALID_HANDLE_VALUE;
 }
 
 /**
@@ -3295,39 +3714,238 @@ static const char *get_network_capability_id (int id)
 }
 
 /**
- * Lookup the entry for a `filter` value in the `filter_entries` cache.
- * If not found, add an entry for it.
+ * \struct fw_resolve_req
+ * A request for `fw_resolver_thread()` to lookup the name of a
+ * `filter_entry` or a `SID_entry`.
+ */
+struct fw_resolve_req {
+       struct fw_resolve_req *next;
+       struct filter_entry   *fe;
+       struct SID_entry      *se;
+     };
+
+static struct fw_resolve_req *volatile fw_resolve_head = NULL;
+static HANDLE                          fw_resolve_event  = NULL;
+static HANDLE                          fw_resolve_done   = NULL;
+static HANDLE                          fw_resolve_thread = NULL;
+static volatile LONG                   fw_resolve_stop   = 0;
+
+static void resolve_SID (struct SID_entry *se);
+
+/**
+ * Do the slow `FwpmFilterGetById0()` RPC for a `filter_entry`.
+ */
+static void resolve_filter (struct filter_entry *fe)
+{
+  FWPM_FILTER0 *filter_item;
+
+  if ((*p_FwpmFilterGetById0)(fw_engine_handle, fe->value, &filter_item) == ERROR_SUCCESS)
+  {
+    WideCharToMultiByte (fw_acp, 0, filter_item->displayData.name, -1, fe->name, (int)sizeof(fe->name), NULL, NULL);
+    (*p_FwpmFreeMemory0) ((void**)&filter_item);
+    InterlockedExchange (&fe->state, FW_RESOLVED);
+  }
+  else
+  {
+    fe->retry = GetTickCount() + FW_NEGATIVE_TTL;
+    InterlockedExchange (&fe->state, FW_NEGATIVE);
+  }
+}
+
+/**
+ * Take all pending requests and resolve them in FIFO order.
+ */
+static void fw_resolve_drain (void)
+{
+  struct fw_resolve_req *req, *next, *fifo = NULL;
+
+  req = InterlockedExchangePointer ((void* volatile*)&fw_resolve_head, NULL);
+  for ( ; req; req = next)
+  {
+    next = req->next;
+    req->next = fifo;
+    fifo = req;
+  }
+  for (req = fifo; req; req = next)
+  {
+    next = req->next;
+    if (req->fe)
+         resolve_filter (req->fe);
+    else resolve_SID (req->se);
+    free (req);
+  }
+}
+
+static DWORD WINAPI fw_resolver_thread (void *arg)
+{
+  while (!fw_resolve_stop)
+  {
+    WaitForSingleObject (fw_resolve_event, 1000);
+    if (!fw_resolve_stop)
+       fw_resolve_drain();
+  }
+  SetEvent (fw_resolve_done);
+  ARGSUSED (arg);
+  return (0);
+}
+
+/**
+ * Start the resolver-thread. Until this is called (or if it fails),
+ * the lookups are done by the caller of `fw_resolve_submit()`.
+ */
+static BOOL fw_resolver_init (void)
+{
+  DWORD tid;
+
+  if (fw_resolve_thread)
+     return (TRUE);
+
+  fw_resolve_event = CreateEvent (NULL, FALSE, FALSE, NULL);
+  fw_resolve_done  = CreateEvent (NULL, TRUE, FALSE, NULL);
+  fw_resolve_stop  = 0;
+
+  if (fw_resolve_event && fw_resolve_done)
+     fw_resolve_thread = CreateThread (NULL, 0, fw_resolver_thread, NULL, 0, &tid);
+
+  if (!fw_resolve_thread)
+  {
+    TRACE (0, "Failed to start the firewall resolver: %s.\n", win_strerror(GetLastError()));
+    if (fw_resolve_event)
+       CloseHandle (fw_resolve_event);
+    if (fw_resolve_done)
+       CloseHandle (fw_resolve_done);
+    fw_resolve_event = fw_resolve_done = NULL;
+    return (FALSE);
+  }
+  TRACE (2, "Firewall resolver thread-id: %lu.\n", DWORD_CAST(tid));
+  return (TRUE);
+}
+
+/**
+ * Stop the resolver-thread. The requests not done are just freed;
+ * their entries stays `FW_PENDING` and are printed as `"?"`.
+ */
+static void fw_resolver_exit (void)
+{
+  struct fw_resolve_req *req, *next;
+
+  if (!fw_resolve_thread)
+     return;
+
+  fw_resolve_stop = 1;
+  SetEvent (fw_resolve_event);
+  if (!fw_thread_stopped(fw_resolve_thread, fw_resolve_done))
+  {
+    /* It could be in a slow RPC with a 'fe' or 'se' from 'fw_arena'.
+     */
+    TRACE (1, "The firewall resolver did not stop.\n");
+    fw_thread_alive = TRUE;
+    return;
+  }
+
+  req = InterlockedExchangePointer ((void* volatile*)&fw_resolve_head, NULL);
+  for ( ; req; req = next)
+  {
+    next = req->next;
+    free (req);
+  }
+  CloseHandle (fw_resolve_thread);
+  CloseHandle (fw_resolve_event);
+  CloseHandle (fw_resolve_done);
+  fw_resolve_thread = fw_resolve_event = fw_resolve_done = NULL;
+}
+
+/**
+ * Resolve the name of `fe` or `se` on the resolver-thread if it is running.
+ * Otherwise resolve it now.
+ */
+static void fw_resolve_submit (struct filter_entry *fe, struct SID_entry *se)
+{
+  struct fw_resolve_req *req, *head;
+
+  req = fw_resolve_thread ? malloc (sizeof(*req)) : NULL;
+  if (!req)
+  {
+    if (fe)
+         resolve_filter (fe);
+    else resolve_SID (se);
+    return;
+  }
+
+  req->fe = fe;
+  req->se = se;
+  do
+  {
+    head = fw_resolve_head;
+    req->next = head;
+  }
+  while (InterlockedCompareExchangePointer((void* volatile*)&fw_resolve_head, req, head) != head);
+
+  if (!head)
+     SetEvent (fw_resolve_event);
+}
+
+/**
+ * Return TRUE if the name of a cache entry is valid.
+ * A `FW_NEGATIVE` entry is re-submitted when it's `retry` time is reached.
+ */
+static BOOL fw_cache_usable (struct filter_entry *fe, struct SID_entry *se)
+{
+  volatile LONG *state = fe ? &fe->state : &se->state;
+  DWORD          retry = fe ? fe->retry  : se->retry;
+
+  if (*state == FW_NEGATIVE && (LONG)(GetTickCount() - retry) >= 0 &&
+      InterlockedCompareExchange(state, FW_PENDING, FW_NEGATIVE) == FW_NEGATIVE)
+     fw_resolve_submit (fe, se);
+
+  return (*state == FW_RESOLVED);
+}
+
+/**
+ * Return the name of a `filter_entry` or `"?"` if it's not known (yet).
+ */
+static const char *filter_name (struct filter_entry *fe)
+{
+  return (fw_cache_usable(fe, NULL) ? fe->name : "?");
+}
+
+/**
+ * Lookup the entry for a `filter` value in the `filter_hash[]` cache.
+ * If not found, add an entry for it and let `fw_resolver_thread()` find it's name.
  *
  * \note a `filter == 0` is never valid.
  */
-static const struct filter_entry *lookup_or_add_filter (UINT64 filter)
+static struct filter_entry *lookup_or_add_filter (UINT64 filter)
 {
   static struct filter_entry null_filter = { 0, "NULL" };
   struct filter_entry *fe;
-  FWPM_FILTER0        *filter_item;
-  int                  i, max;
+  DWORD                idx;
 
   if (filter == 0UL)
      return (&null_filter);
 
-  max = smartlist_len (filter_entries);
-  for (i = 0; i < max; i++)
+  idx = ((DWORD)(filter ^ (filter >> 32)) * 2654435761U) % FILTER_HASH_SIZE;
+  for (fe = filter_hash[idx]; fe; fe = fe->next)
   {
-    fe = smartlist_get (filter_entries, i);
     if (filter == fe->value)
-       return (fe);
+    {
+      fw_cache_hits++;
+      return (fe);
+    }
   }
 
-  fe = calloc (sizeof(*fe), 1);
+  fw_cache_misses++;
+  fe = arena_alloc (fw_arena, sizeof(*fe));
+  if (!fe)
+     return (NULL);
   fe->value = filter;
+  fe->state = FW_PENDING;
   strcpy (fe->name, "?");
-
-  if ((*p_FwpmFilterGetById0)(fw_engine_handle, filter, &filter_item) == ERROR_SUCCESS)
-  {
-    WideCharToMultiByte (fw_acp, 0, filter_item->displayData.name, -1, fe->name, (int)sizeof(fe->name), NULL, NULL);
-    (*p_FwpmFreeMemory0) ((void**)&filter_item);
-  }
+  fe->next = filter_hash [idx];
+  filter_hash [idx] = fe;
   smartlist_add (filter_entries, fe);
+
+  fw_resolve_submit (fe, NULL);
   return (fe);
 }
 
@@ -3360,9 +3978,10 @@ static BOOL print_layer_item2 (const _FWPM_NET_EVENT_CAPABILITY_DROP0  *drop_eve
   fw_buf_add ("%-*slayer2:  ", INDENT_SZ, "");
   if (filter_id)
   {
-    const struct filter_entry *fe = lookup_or_add_filter (filter_id);
+    struct filter_entry *fe = lookup_or_add_filter (filter_id);
 
-    fw_buf_add ("(%" U64_FMT ") %s, ", fe->value, fe->name);
+    if (fe)
+       fw_buf_add ("(%" U64_FMT ") %s, ", fe->value, filter_name(fe));
   }
   fw_buf_add ("%s, isLoopback: %d\n", get_network_capability_id(capability_id), is_loopback);
   return (filter_id != 0);
@@ -3380,9 +3999,10 @@ static BOOL print_filter_rule (const _FWPM_NET_EVENT_CLASSIFY_DROP2  *drop_event
 
   if (filter_id)
   {
-    const struct filter_entry *fe = lookup_or_add_filter (filter_id);
+    struct filter_entry *fe = lookup_or_add_filter (filter_id);
 
-    fw_buf_add ("%-*sfilter:  (%" U64_FMT ") %s\n", INDENT_SZ, "", fe->value, fe->name);
+    if (fe)
+       fw_buf_add ("%-*sfilter:  (%" U64_FMT ") %s\n", INDENT_SZ, "", fe->value, filter_name(fe));
     return (TRUE);
   }
   return (FALSE);
@@ -3391,7 +4011,7 @@ static BOOL print_filter_rule (const _FWPM_NET_EVENT_CLASSIFY_DROP2  *drop_event
 static BOOL print_filter_rule2 (const _FWPM_NET_EVENT_CAPABILITY_DROP0  *drop_event,
                                 const _FWPM_NET_EVENT_CAPABILITY_ALLOW0 *allow_event)
 {
-  const struct filter_entry *fe = NULL;
+  struct filter_entry *fe = NULL;
 
   if (drop_event)
      fe = lookup_or_add_filter (drop_event->filterId);
@@ -3400,7 +4020,7 @@ static BOOL print_filter_rule2 (const _FWPM_NET_EVENT_CAPABILITY_DROP0  *drop_ev
 
   if (fe)
   {
-    fw_buf_add ("%-*sfilter:  (%" U64_FMT ") %s\n", INDENT_SZ, "", fe->value, fe->name);
+    fw_buf_add ("%-*sfilter:  (%" U64_FMT ") %s\n", INDENT_SZ, "", fe->value, filter_name(fe));
     return (TRUE);
   }
   return (FALSE);
@@ -3454,9 +4074,9 @@ static void print_DNSBL_info (const struct in_addr *ia4, const struct in6_addr *
   if (!SBL_entries)
      SBL_entries = smartlist_new();
 
-  max = smartlist_len (SBL_entries);
+  max = smartlist_len_fast (SBL_entries);
   for (i = 0; i < max && !found; i++)
-      if (!strcmp(smartlist_get(SBL_entries, i), sbl_ref))
+      if (!strcmp(smartlist_get_fast(SBL_entries, i), sbl_ref))
          found = TRUE;
 
   if (!found)
@@ -3688,22 +4308,30 @@ static const char *volume_to_path (const char *volume)
   return (volume);
 }
 
+static DWORD fw_cache_hash (const void *data, size_t size);
+
 /**
- * Process the `header->appId` field.
+ * Lookup the program-name for an `appId` blob in the `app_hash[]` cache.
+ * If not found, convert it and add an entry for it.
  */
-static BOOL print_app_id (const _FWPM_NET_EVENT_HEADER3 *header)
+static const char *lookup_or_add_app (const FWP_BYTE_BLOB *app_id)
 {
-  char    a_name [_MAX_PATH];
-  char   *a_base;
-  LPCWSTR w_name;
-  int     w_len;
+  struct app_entry *ae;
+  char              a_name [_MAX_PATH];
+  LPCWSTR           w_name = (LPCWSTR) app_id->data;
+  int               w_len  = app_id->size;
+  DWORD             hash   = fw_cache_hash (app_id->data, app_id->size);
 
-  if ((header->flags & FWPM_NET_EVENT_FLAG_APP_ID_SET) == 0 ||
-      !header->appId.data || header->appId.size == 0)
-     return (TRUE);    /* Can't exclude a `appId` based on this */
+  for (ae = app_hash[hash % SID_HASH_SIZE]; ae; ae = ae->next)
+  {
+    if (ae->hash == hash && ae->size == app_id->size && !memcmp(ae->key, app_id->data, ae->size))
+    {
+      fw_cache_hits++;
+      return (ae->name);
+    }
+  }
 
-  w_name = (LPCWSTR) header->appId.data;
-  w_len  = header->appId.size;
+  fw_cache_misses++;
 
 #if 1
   {
@@ -3714,7 +4342,7 @@ static BOOL print_app_id (const _FWPM_NET_EVENT_HEADER3 *header)
 
     if (WideCharToMultiByte(fw_acp, 0, w_name, w_len, a_buf, a_len, NULL, NULL) == 0)
          _strlcpy (a_name, "?", sizeof(a_name));
-    else _strlcpy (a_name, volume_to_path(a_buf), a_len);
+    else _strlcpy (a_name, volume_to_path(a_buf), min(a_len, (int)sizeof(a_name)));
   }
 #else
 
@@ -3723,6 +4351,36 @@ static BOOL print_app_id (const _FWPM_NET_EVENT_HEADER3 *header)
   else _strlcpy (a_name, volume_to_path(a_name), sizeof(a_name));
 #endif
 
+  ae = arena_alloc (fw_arena, sizeof(*ae) + app_id->size + strlen(a_name) + 1);
+  if (!ae)
+     return (NULL);
+
+  ae->hash = hash;
+  ae->size = app_id->size;
+  memcpy (ae->key, app_id->data, ae->size);
+  ae->name = strcpy ((char*)ae->key + ae->size, a_name);
+  ae->next = app_hash [hash % SID_HASH_SIZE];
+  app_hash [hash % SID_HASH_SIZE] = ae;
+  smartlist_add (app_entries, ae);
+  return (ae->name);
+}
+
+/**
+ * Process the `header->appId` field.
+ */
+static BOOL print_app_id (const _FWPM_NET_EVENT_HEADER3 *header)
+{
+  const char *a_name;
+  const char *a_base;
+
+  if ((header->flags & FWPM_NET_EVENT_FLAG_APP_ID_SET) == 0 ||
+      !header->appId.data || header->appId.size == 0)
+     return (TRUE);    /* Can't exclude a `appId` based on this */
+
+  a_name = lookup_or_add_app (&header->appId);
+  if (!a_name)
+     return (TRUE);
+
   a_base = basename (a_name);
 
   if (g_cfg.firewall.show_all == 0)
@@ -3818,32 +4476,78 @@ static BOOL lookup_account_SID (const SID *sid, const char *sid_str, char *accou
 }
 
 /**
- * Lookup the entry for the `sid` in the `SID_entries` cache.
- * If not found, add an entry for it.
+ * Do the slow `LookupAccountSid()` calls for a `SID_entry`.
+ */
+static void resolve_SID (struct SID_entry *se)
+{
+  if (lookup_account_SID(se->sid_copy, se->sid_str, se->account, se->domain))
+     InterlockedExchange (&se->state, FW_RESOLVED);
+  else
+  {
+    se->retry = GetTickCount() + FW_NEGATIVE_TTL;
+    InterlockedExchange (&se->state, FW_NEGATIVE);
+  }
+}
+
+/**
+ * A FNV-1a hash of `size` bytes for `SID_hash[]` and `app_hash[]`.
+ */
+static DWORD fw_cache_hash (const void *data, size_t size)
+{
+  const BYTE *p = (const BYTE*) data;
+  DWORD       hash = 2166136261UL;
+  size_t      i;
+
+  for (i = 0; i < size; i++)
+      hash = (hash ^ p[i]) * 16777619UL;
+  return (hash);
+}
+
+/**
+ * Lookup the entry for the `sid` in the `SID_hash[]` cache.
+ * If not found, add an entry for it and let `fw_resolver_thread()`
+ * find the account and domain.
  *
  * \retval `SID_entry` the found or newly allocated `SID_entry`.
  */
 static struct SID_entry *lookup_or_add_SID (SID *sid)
 {
   struct SID_entry *se;
-  DWORD  len;
-  int    i, max = smartlist_len (SID_entries);
+  char  *sid_str;
+  DWORD  len  = GetLengthSid (sid);
+  DWORD  hash = fw_cache_hash (sid, len);
 
-  for (i = 0; i < max; i++)
+  for (se = SID_hash[hash % SID_HASH_SIZE]; se; se = se->next)
   {
-    se = smartlist_get (SID_entries, i);
-    if (EqualSid(sid, se->sid_copy))
-       return (se);
+    if (se->hash == hash && EqualSid(sid, se->sid_copy))
+    {
+      fw_cache_hits++;
+      return (se);
+    }
   }
 
-  len = GetLengthSid (sid);
-  se  = calloc (sizeof(*se) + len, 1);
+  fw_cache_misses++;
+  se = arena_alloc (fw_arena, sizeof(*se) + len);
+  if (!se)
+     return (NULL);
   se->sid_copy = (SID*) (se + 1);
+  se->hash     = hash;
+  se->state    = FW_PENDING;
   CopySid (len, se->sid_copy, sid);
-  ConvertSidToStringSid (sid, &se->sid_str);
 
-  lookup_account_SID (sid, se->sid_str, se->account, se->domain);
+  /* Keep a copy in the arena; no 'LocalFree()' needed at exit.
+   */
+  if (ConvertSidToStringSid(sid, &sid_str))
+  {
+    se->sid_str = arena_strdup (fw_arena, sid_str);
+    LocalFree (sid_str);
+  }
+
+  se->next = SID_hash [hash % SID_HASH_SIZE];
+  SID_hash [hash % SID_HASH_SIZE] = se;
   smartlist_add (SID_entries, se);
+
+  fw_resolve_submit (NULL, se);
   return (se);
 }
 
@@ -3852,12 +4556,23 @@ static struct SID_entry *lookup_or_add_SID (SID *sid)
  */
 static BOOL print_user_id (const _FWPM_NET_EVENT_HEADER3 *header)
 {
-  const struct SID_entry *se;
+  struct SID_entry *se;
 
   if (!(header->flags & FWPM_NET_EVENT_FLAG_USER_ID_SET) || !header->userId)
      return (TRUE);
 
   se = lookup_or_add_SID (header->userId);
+  if (!se)
+     return (TRUE);
+
+  /* The account and domain are not known (yet). Print the event
+   * with an unknown user; the 'show_user = 1' filter cannot be applied.
+   */
+  if (!fw_cache_usable(NULL, se))
+  {
+    fw_buf_add ("%-*suser:    ?\\%s\n", INDENT_SZ, "", se->sid_str ? se->sid_str : "?");
+    return (TRUE);
+  }
 
   /* Show activity for logged-on user only
    */
@@ -3882,7 +4597,7 @@ static BOOL print_package_id (const _FWPM_NET_EVENT_HEADER3 *header)
 
   se = lookup_or_add_SID (header->packageSid);
 
-  if (se->sid_str && (g_cfg.firewall.show_all || strcmp(NULL_SID, se->sid_str)))
+  if (se && se->sid_str && (g_cfg.firewall.show_all || strcmp(NULL_SID, se->sid_str)))
   {
     fw_buf_add ("%-*spackage: %s\n", INDENT_SZ, "", se->sid_str);
     return (TRUE);
@@ -4083,6 +4798,16 @@ void fw_print_statistics (FWPM_STATISTICS *stats)
   {
     trace_printf ("Got %lu events, %lu ignored.\n", DWORD_CAST(fw_num_events), DWORD_CAST(fw_num_ignored));
 
+    if (fw_queue_batches > 0UL || fw_queue_len > 0 || fw_queue_drops > 0)
+       trace_printf ("Event queue: %lu events in %lu batches, backlog: %ld (max %ld), %ld dropped.\n",
+                     DWORD_CAST(fw_queue_dequeued), DWORD_CAST(fw_queue_batches),
+                     (long)fw_queue_len, (long)fw_queue_peak, (long)fw_queue_drops);
+
+    if (fw_cache_hits > 0UL || fw_cache_misses > 0UL)
+       trace_printf ("Caches: %d filters, %d SIDs, %d programs; %lu hits, %lu misses.\n",
+                     smartlist_len(filter_entries), smartlist_len(SID_entries), smartlist_len(app_entries),
+                     DWORD_CAST(fw_cache_hits), DWORD_CAST(fw_cache_misses));
+
     if (g_cfg.geoip_enable)
     {
       DWORD num_ip4, num_ip6;
@@ -55,9 +55,10 @@
 #include "init.h"
 #include "in_addr.h"
 #include "inet_util.h"
+#include "dnsbl.h"
 #include "geoip.h"
 
-/** Number of calls for `smartlist_bsearch()` to find an IPv4 entry. <br>
+/** Number of probes in `geoip_ipv4_search()` to find an IPv4 entry. <br>
  *  Used in `test_addr4()` only.
  */
 static DWORD num_4_compare;
@@ -67,13 +68,19 @@ static DWORD num_4_compare;
  */
 static DWORD num_6_compare;
 
-static int  geoip4_parse_entry (char *buf, unsigned *line, DWORD *num);
-static int  geoip6_parse_entry (char *buf, unsigned *line, DWORD *num);
-static int  geoip4_add_entry (DWORD low, DWORD high, const char *country);
-static int  geoip6_add_entry (const struct in6_addr *low, const struct in6_addr *high, const char *country);
+static int  geoip4_parse_entry (smartlist_t *sl, struct arena *arena, char *buf, unsigned *line, DWORD *num);
+static int  geoip6_parse_entry (smartlist_t *sl, struct arena *arena, char *buf, unsigned *line, DWORD *num);
+static int  geoip4_parse_node (char *buf, struct ipv4_node *node);
+static int  geoip6_parse_node (char *buf, struct ipv6_node *node);
+static int  geoip4_add_entry (smartlist_t *sl, struct arena *arena, DWORD low, DWORD high, const char *country);
+static int  geoip6_add_entry (smartlist_t *sl, struct arena *arena, const struct in6_addr *low, const struct in6_addr *high, const char *country);
 static void geoip_stats_init (void);
 static void geoip_stats_exit (void);
-static void geoip_stats_update (const char *country_A2, int flag);
+static void geoip_cache_init (void);
+static void geoip_cache_exit (void);
+static void geoip_stats_update (const char *country_A2, int flag, DWORD weight);
+static const char *geoip_lookup_ipv4 (const struct in_addr *addr, DWORD weight);
+static const char *geoip_lookup_ipv6 (const struct in6_addr *addr, DWORD weight);
 static int  geoip_get_num_addr (DWORD *num4, DWORD *num6);
 
 /**
@@ -107,6 +114,38 @@ static smartlist_t *geoip_ipv4_entries = NULL;
  */
 static smartlist_t *geoip_ipv6_entries = NULL;
 
+/**
+ * The binary caches of the above when `g_cfg.bin_cache = 1`.
+ * If mapped, the smartlists points into these.
+ */
+static struct bin_cache geoip4_bin_cache;
+static struct bin_cache geoip6_bin_cache;
+
+/**
+ * The arenas holding the entries of the above smartlists when parsed from
+ * a file.
+ */
+static struct arena *geoip4_arena = NULL;
+static struct arena *geoip6_arena = NULL;
+
+#define GEOIP4_BIN_CACHE  0x47340001   /* "G4", version 1 */
+#define GEOIP6_BIN_CACHE  0x47360001   /* "G6", version 1 */
+
+/**\struct geoip_ipv4_index
+ *
+ * A flat copy of the `low` and `high` keys in the sorted `geoip_ipv4_entries`.
+ * Searching these contiguous arrays avoids a compare-callback and a pointer-chase
+ * for each probe. Element `i` in these arrays is element `i` in `geoip_ipv4_entries`.
+ *
+ * Set directly from the generated `geoip-gen4.c` or built in `geoip_ipv4_index_build()`.
+ */
+static struct geoip_ipv4_index {
+       const DWORD *low;
+       const DWORD *high;
+       DWORD        num;
+       BOOL         allocated;
+     } geoip_ipv4_index;
+
 /**\struct geoip_stats
  *
  * Structure for counting countries found at run-time.
@@ -143,18 +182,15 @@ struct geoip_stats {
 static struct geoip_stats *geoip_stats_buf = NULL;
 
 /**
- * `smartlist_sort()` helper.
+ * `geoip_ipv4_sort()` helper.
  *
  *  Returns -1, 1, or 0 based on comparison of two `ipv4_node`s.
  *
- * \param[in] _a  the address to the first node for comparision.
- * \param[in] _b  the address to the second node for comparision.
+ * \param[in] a  the first node for comparision.
+ * \param[in] b  the second node for comparision.
  */
-static int geoip_ipv4_compare_entries (const void **_a, const void **_b)
+static __inline int geoip_ipv4_compare_entries (const struct ipv4_node *a, const struct ipv4_node *b)
 {
-  const struct ipv4_node *a = *_a;
-  const struct ipv4_node *b = *_b;
-
   if (a->low < b->low)
      return (-1);
   if (a->low > b->low)
@@ -163,58 +199,119 @@ static int geoip_ipv4_compare_entries (const void **_a, const void **_b)
 }
 
 /**
- * `smartlist_bsearch()` helper.
+ * Build the `index` from the sorted list `sl`.
+ * Not needed if the generated `geoip-gen4.c` has set the `geoip_ipv4_index` already.
+ */
+static void geoip_ipv4_index_build (const smartlist_t *sl, struct geoip_ipv4_index *index)
+{
+  DWORD *low, *high;
+  int    i, max;
+
+  if (index->low || !sl)
+     return;
+
+  max  = smartlist_len_fast (sl);
+  low  = malloc (max * sizeof(*low));
+  high = malloc (max * sizeof(*high));
+  if (!low || !high)
+  {
+    free (low);
+    free (high);
+    return;
+  }
+
+  for (i = 0; i < max; i++)
+  {
+    const struct ipv4_node *entry = smartlist_get_fast (sl, i);
+
+    low [i] = entry->low;
+    high[i] = entry->high;
+  }
+  index->low       = low;
+  index->high      = high;
+  index->num       = max;
+  index->allocated = TRUE;
+}
+
+static void geoip_ipv4_index_free (struct geoip_ipv4_index *index)
+{
+  if (index->allocated)
+  {
+    free ((void*)index->low);
+    free ((void*)index->high);
+  }
+  memset (index, '\0', sizeof(*index));
+}
+
+/**
+ * Called from the generated `geoip-gen4.c` to use its flat arrays directly.
  *
- * Returns -1, 1, or 0 based on comparison of an IP (a pointer
- * to a `DWORD` on host order) to a `struct ipv4_node` element.
+ * \param[in] low   the generated array of `low` keys.
+ * \param[in] high  the generated array of `high` keys.
+ * \param[in] num   the number of array elements.
+ */
+void geoip_ipv4_index_fixed (const DWORD *low, const DWORD *high, unsigned num)
+{
+  geoip_ipv4_index_free (&geoip_ipv4_index);
+  geoip_ipv4_index.low  = low;
+  geoip_ipv4_index.high = high;
+  geoip_ipv4_index.num  = num;
+}
+
+/**
+ * Search the `geoip_ipv4_index` for the block containing `addr`.
+ * A branchless binary search for the last `low` key <= `addr`;
+ * the loop-body compiles to a conditional move.
  *
- * \param[in] key    the IPv4 address to search for.
- * \param[in] member a pointer to the entry in `geoip_ipv4_entries` to test for range membership.
+ * \param[in] addr  the IPv4 address on host order.
+ * \retval the index in `geoip_ipv4_entries` or -1 if not found.
  */
-static int geoip_ipv4_compare_key_to_entry (const void *key, const void **member)
+static int geoip_ipv4_search (DWORD addr)
 {
-  const struct ipv4_node *entry = *member;
-  const DWORD             addr  = *(const DWORD*) key;
+  const DWORD *base = geoip_ipv4_index.low;
+  DWORD        num  = geoip_ipv4_index.num;
+  int          idx;
+
+  if (num == 0 || addr < base[0])
+     return (-1);
 
-  num_4_compare++;
+  while (num > 1)
+  {
+    DWORD half = num / 2;
 
-  if (addr < entry->low)
+    base = (base[half] <= addr) ? base + half : base;
+    num -= half;
+    num_4_compare++;
+  }
+  idx = (int) (base - geoip_ipv4_index.low);
+  if (addr > geoip_ipv4_index.high[idx])
      return (-1);
-  if (addr > entry->high)
-     return (1);
-  return (0);
+  return (idx);
 }
 
 /**
- * `smartlist_sort()` helper.
+ * `geoip_ipv6_sort()` helper.
  *
  * Returns -1, 1, or 0 based on comparison of two `struct ipv6_node` elements.
  *
- * \param[in] _a  the address to the first node for comparision.
- * \param[in] _b  the address to the second node for comparision.
+ * \param[in] a  the first node for comparision.
+ * \param[in] b  the second node for comparision.
  */
-static int geoip_ipv6_compare_entries (const void **_a, const void **_b)
+static __inline int geoip_ipv6_compare_entries (const struct ipv6_node *a, const struct ipv6_node *b)
 {
-  const struct ipv6_node *a = *_a;
-  const struct ipv6_node *b = *_b;
-
   return memcmp (a->low.s6_addr, b->low.s6_addr, sizeof(struct in6_addr));
 }
 
 /**
- * `smartlist_bsearch()` helper.
+ * `geoip_ipv6_bsearch()` helper.
  *
- * Returns -1, 1, or 0 based on comparison of an IPv6
- * (a pointer to an `struct in6_addr`) to a `struct ipv6_node`.
+ * Returns -1, 1, or 0 based on comparison of an IPv6 address to a `struct ipv6_node`.
  *
- * \param[in] key    the IPv6 address to search for.
- * \param[in] member a pointer to the entry in `geoip_ipv6_entries` to test for range membership.
+ * \param[in] addr   the IPv6 address to search for.
+ * \param[in] entry  the entry in `geoip_ipv6_entries` to test for range membership.
  */
-static int geoip_ipv6_compare_key_to_entry (const void *key, const void **member)
+static __inline int geoip_ipv6_compare_key_to_entry (const struct in6_addr *addr, const struct ipv6_node *entry)
 {
-  const struct ipv6_node *entry = *member;
-  const struct in6_addr  *addr  = key;
-
   num_6_compare++;
 
   if (memcmp(addr->s6_addr, entry->low.s6_addr, sizeof(struct in6_addr)) < 0)
@@ -224,12 +321,21 @@ static int geoip_ipv6_compare_key_to_entry (const void *key, const void **member
   return (0);
 }
 
+/*
+ * The typed sort and search functions for the GeoIP smartlists.
+ * These inline the above compare functions.
+ */
+SMARTLIST_SORT_FUNC (static, geoip_ipv4_sort, struct ipv4_node, geoip_ipv4_compare_entries)
+SMARTLIST_SORT_FUNC (static, geoip_ipv6_sort, struct ipv6_node, geoip_ipv6_compare_entries)
+SMARTLIST_BSEARCH_FUNC (static, geoip_ipv6_bsearch, struct ipv6_node, struct in6_addr, geoip_ipv6_compare_key_to_entry)
+
 /**
- * Add these special addresses to the `geoip_ipv4_entries` smartlist.
+ * Add these special addresses to the `geoip_ipv4_entries` smartlist `sl`.
+ * The entries are allocated from `arena`.
  * Ref:
  *  https://en.wikipedia.org/wiki/Private_network
  */
-void geoip_ipv4_add_specials (void)
+void geoip_ipv4_add_specials (smartlist_t *sl, struct arena *arena)
 {
   static const struct {
          const char *low;
@@ -251,16 +357,17 @@ void geoip_ipv4_add_specials (void)
 
     if (wsock_trace_inet_pton4(priv[i].low, (u_char*)&low) == 1 &&
         wsock_trace_inet_pton4(priv[i].high, (u_char*)&high) == 1)
-      geoip4_add_entry (swap32(low), swap32(high), priv[i].remark);
+      geoip4_add_entry (sl, arena, swap32(low), swap32(high), priv[i].remark);
     else
       TRACE (0, "Illegal low/high IPv4 address: %s/%s\n", priv[i].low, priv[i].high);
   }
 }
 
 /**
- * Add these special addresses to the `geoip_ipv6_entries` smartlist.
+ * Add these special addresses to the `geoip_ipv6_entries` smartlist `sl`.
+ * The entries are allocated from `arena`.
  */
-void geoip_ipv6_add_specials (void)
+void geoip_ipv6_add_specials (smartlist_t *sl, struct arena *arena)
 {
   static const struct {
          const char *low;
@@ -284,7 +391,7 @@ void geoip_ipv6_add_specials (void)
 
     wsock_trace_inet_pton6 (priv[i].low, (u_char*)&low);
     wsock_trace_inet_pton6 (priv[i].high, (u_char*)&high);
-    geoip6_add_entry (&low, &high, priv[i].remark);
+    geoip6_add_entry (sl, arena, &low, &high, priv[i].remark);
   }
 }
 
@@ -304,6 +411,7 @@ DWORD geoip_load_data (int family)
   {
     geoip_ipv4_entries = geoip_smartlist_fixed_ipv4();
     num = geoip_ipv4_entries ? smartlist_len (geoip_ipv4_entries) : 0;
+    geoip_ipv4_index_build (geoip_ipv4_entries, &geoip_ipv4_index);
     TRACE (2, "Using %lu fixed IPv4 records instead of parsing %s.\n",
            DWORD_CAST(num), g_cfg.geoip4_file);
   }
@@ -323,50 +431,117 @@ DWORD geoip_load_data (int family)
 }
 
 /**
- * Open and parse a GeoIP file.
+ * Load the `geoip_ipv4_entries` (and it's `geoip_ipv4_index`) or the
+ * `geoip_ipv6_entries` from the binary cache of `file`.
  *
- * \param[in] file   the file on CVS format to read and parse.
- * \param[in] family the address family of the file; `AF_INET` or `AF_INET6`.
+ * \retval the number of entries mapped. 0 if the cache is missing or stale.
  */
-static DWORD geoip_parse_file (const char *file, int family)
+static DWORD geoip_load_bin_cache (const char *file, int family)
 {
-  unsigned line = 0;
-  DWORD    num  = 0;
-  FILE    *f;
-
-  TRACE (4, "address-family: %d, file: %s.\n", family, file);
+  struct bin_cache *bc = (family == AF_INET) ? &geoip4_bin_cache : &geoip6_bin_cache;
+  const void       *nodes, *low, *high;
+  DWORD             num = 0, num_low = 0, num_high = 0;
 
-  if (!file || !file_exists(file))
-  {
-    TRACE (2, "Geoip-file \"%s\" does not exist.\n", file);
-    return (0);
-  }
+  if (!bin_cache_open(bc, family == AF_INET ? GEOIP4_BIN_CACHE : GEOIP6_BIN_CACHE, &file, 1))
+     return (0);
 
   if (family == AF_INET)
   {
-    assert (geoip_ipv4_entries == NULL);
-    geoip_ipv4_entries = smartlist_new();
-    geoip_ipv4_add_specials();
+    nodes = bin_cache_get (bc, 0, sizeof(struct ipv4_node), &num);
+    low   = bin_cache_get (bc, 1, sizeof(DWORD), &num_low);
+    high  = bin_cache_get (bc, 2, sizeof(DWORD), &num_high);
+    if (nodes && low && high && num > 0 && num_low == num && num_high == num)
+    {
+      geoip_ipv4_entries = geoip_smartlist_fixed ((void*)nodes, sizeof(struct ipv4_node), num);
+      geoip_ipv4_index_fixed (low, high, num);
+    }
+    else
+      num = 0;
   }
-  else if (family == AF_INET6)
+  else
   {
-    assert (geoip_ipv6_entries == NULL);
-    geoip_ipv6_entries = smartlist_new();
-    geoip_ipv6_add_specials();
+    nodes = bin_cache_get (bc, 0, sizeof(struct ipv6_node), &num);
+    if (nodes && num > 0)
+         geoip_ipv6_entries = geoip_smartlist_fixed ((void*)nodes, sizeof(struct ipv6_node), num);
+    else num = 0;
   }
+
+  if (num == 0)
+     bin_cache_close (bc);
   else
+     TRACE (2, "Mapped %s IPv%c records for \"%s\".\n",
+            dword_str(num), family == AF_INET ? '4' : '6', file);
+  return (num);
+}
+
+/**
+ * Save the sorted IPv4 entries in `sl` with it's `index` or the
+ * IPv6 entries in `sl` to the binary cache of `file`.
+ */
+static void geoip_write_bin_cache (const char *file, int family, const smartlist_t *sl,
+                                   const struct geoip_ipv4_index *index)
+{
+  struct bin_cache_sect sect [3];
+  size_t       el_size = (family == AF_INET) ? sizeof(struct ipv4_node) : sizeof(struct ipv6_node);
+  int          i, max  = smartlist_len (sl);
+  BYTE        *nodes;
+
+  if (family == AF_INET && index->num != (DWORD)max)
+     return;
+
+  nodes = malloc (max * el_size);
+  if (!nodes)
+     return;
+
+  for (i = 0; i < max; i++)
+      memcpy (nodes + i * el_size, smartlist_get(sl, i), el_size);
+
+  sect[0].data  = nodes;
+  sect[0].size  = (DWORD) (max * el_size);
+  sect[0].count = max;
+  if (family == AF_INET)
   {
-    TRACE (0, "Only address-families AF_INET and AF_INET6 supported.\n");
-    return (0);
+    sect[1].data  = index->low;
+    sect[2].data  = index->high;
+    sect[1].size  = sect[2].size  = max * sizeof(DWORD);
+    sect[1].count = sect[2].count = max;
+    bin_cache_write (GEOIP4_BIN_CACHE, &file, 1, sect, 3);
   }
+  else
+    bin_cache_write (GEOIP6_BIN_CACHE, &file, 1, sect, 1);
+  free (nodes);
+}
 
+/**
+ * Parse a GeoIP file a line at a time into a new sorted smartlist.
+ * The special addresses are added first.
+ *
+ * \param[in]  file   the file on CVS format to read and parse.
+ * \param[in]  family the address family of the file; `AF_INET` or `AF_INET6`.
+ * \param[out] num    the number of records parsed.
+ * \param[out] arena  the new arena holding the records.
+ */
+static smartlist_t *geoip_parse_lines (const char *file, int family, DWORD *num, struct arena **arena)
+{
+  smartlist_t *sl;
+  unsigned     line = 0;
+  FILE        *f;
+
+  *num   = 0;
+  *arena = NULL;
   f = fopen (file, "rt");
   if (!f)
   {
     TRACE (2, "Failed to open Geoip-file \"%s\". errno: %d\n", file, errno);
-    return (0);
+    return (NULL);
   }
 
+  *arena = arena_new ("geoip", 64*1024);
+  sl = smartlist_new();
+  if (family == AF_INET)
+       geoip_ipv4_add_specials (sl, *arena);
+  else geoip_ipv6_add_specials (sl, *arena);
+
   while (!feof(f))
   {
     char buf[512];
@@ -375,9 +550,9 @@ static DWORD geoip_parse_file (const char *file, int family)
     if (fgets(buf, (int)sizeof(buf), f) == NULL)
        break;
     if (family == AF_INET)
-         rc = geoip4_parse_entry (buf, &line, &num);
-    else rc = geoip6_parse_entry (buf, &line, &num);
-    if (rc < 0)  /* malloc() failed, give up */
+         rc = geoip4_parse_entry (sl, *arena, buf, &line, num);
+    else rc = geoip6_parse_entry (sl, *arena, buf, &line, num);
+    if (rc < 0)  /* arena_alloc() failed, give up */
        break;
   }
 
@@ -385,19 +560,503 @@ static DWORD geoip_parse_file (const char *file, int family)
 
   if (family == AF_INET)
   {
-    smartlist_sort (geoip_ipv4_entries, geoip_ipv4_compare_entries);
+    geoip_ipv4_sort (sl);
     TRACE (2, "Parsed %s IPv4 records from \"%s\".\n",
-           dword_str(num), file);
+           dword_str(*num), file);
   }
   else
   {
-    smartlist_sort (geoip_ipv6_entries, geoip_ipv6_compare_entries);
+    geoip_ipv6_sort (sl);
     TRACE (2, "Parsed %s IPv6 records from \"%s\".\n",
-           dword_str(num), file);
+           dword_str(*num), file);
   }
+  return (sl);
+}
+
+/**
+ * \def GEOIP_MAX_CHUNKS
+ *  The max number of threads (and chunks of a file) in `geoip_parse_bulk()`.
+ *
+ * \def GEOIP_MIN_CHUNK
+ *  The minimum size of a chunk. Smaller files uses fewer threads.
+ */
+#define GEOIP_MAX_CHUNKS  16
+#define GEOIP_MIN_CHUNK   (64*1024)
+
+/**
+ * \def GEOIP_INIT_THREADS
+ *  TRUE if `geoip_parse_file()` can start threads. Since `geoip_init()` is called
+ *  from `DllMain()` unless `g_cfg.lazy_init = 1`, no new threads will run before
+ *  it returns. Then the bulk-loader parses all chunks on the calling thread.
+ */
+#if defined(TEST_GEOIP)
+  #define GEOIP_INIT_THREADS  TRUE
+#else
+  #define GEOIP_INIT_THREADS  g_cfg.lazy_init
+#endif
+
+/**\struct geoip_chunk
+ * A part of a memory-mapped GeoIP file. Parsed by `geoip_chunk_parse()`
+ * into it's own part of the node-array.
+ */
+struct geoip_chunk {
+       const char *start;       /**< The first line of this chunk */
+       const char *end;         /**< After the last line of this chunk */
+       int         family;      /**< `AF_INET` or `AF_INET6` */
+       BYTE       *nodes;       /**< Where to store the parsed nodes */
+       DWORD       max_nodes;   /**< Number of lines in this chunk. Room for that many nodes */
+       DWORD       num_nodes;   /**< Number of nodes parsed */
+       DWORD       first_line;  /**< The line-number before `start` */
+     };
+
+static DWORD WINAPI geoip_chunk_parse (void *arg)
+{
+  struct geoip_chunk *c = (struct geoip_chunk*) arg;
+  size_t      el_size = (c->family == AF_INET) ? sizeof(struct ipv4_node) : sizeof(struct ipv6_node);
+  const char *p = c->start;
+  unsigned    line = c->first_line;
+
+  while (p < c->end && c->num_nodes < c->max_nodes)
+  {
+    const char *eol = memchr (p, '\n', c->end - p);
+    BYTE       *node = c->nodes + c->num_nodes * el_size;
+    char        buf [512];
+    size_t      len;
+    int         rc;
+
+    if (!eol)
+       eol = c->end;
+    len = min ((size_t)(eol - p), sizeof(buf) - 1);
+    if (len > 0 && p[len-1] == '\r')
+       len--;
+    memcpy (buf, p, len);
+    buf [len] = '\0';
+    p = eol + 1;
+    line++;
+
+    if (c->family == AF_INET)
+         rc = geoip4_parse_node (buf, (struct ipv4_node*)node);
+    else rc = geoip6_parse_node (buf, (struct ipv6_node*)node);
+
+    if (rc > 0)
+       c->num_nodes++;
+    else if (rc < 0)
+       TRACE (0, "Unable to parse line %u in GEOIP IPv%c file.\n",
+              line, c->family == AF_INET ? '4' : '6');
+  }
+  return (0);
+}
+
+/**
+ * Return the radix-sort digit for `pass` of the `low` key in a `node`.
+ * Pass 0 is the least significant byte.
+ */
+static __inline unsigned geoip_radix_digit (const BYTE *node, int family, int pass)
+{
+  if (family == AF_INET)
+     return (((const struct ipv4_node*)node)->low >> (8*pass)) & 0xFF;
+  return ((const struct ipv6_node*)node)->low.s6_bytes [15-pass];
+}
+
+/**
+ * A LSD radix-sort (8 bits per pass) of the `num` nodes in `nodes`
+ * on their 32-bit (IPv4) or 128-bit (IPv6) `low` key.
+ * A pass where all nodes have the same digit is skipped.
+ *
+ * \param[in] nodes  the nodes to sort.
+ * \param[in] tmp    a buffer of the same size.
+ * \retval    either `nodes` or `tmp`; the one with the sorted result.
+ */
+static BYTE *geoip_radix_sort (BYTE *nodes, BYTE *tmp, DWORD num, int family)
+{
+  size_t el_size = (family == AF_INET) ? sizeof(struct ipv4_node) : sizeof(struct ipv6_node);
+  int    pass, passes = (family == AF_INET) ? 4 : 16;
+  DWORD  i, d, sum, (*count)[256];
+
+  count = calloc (passes, sizeof(*count));
+  if (!count || num < 2)
+  {
+    free (count);
+    return (nodes);
+  }
+
+  /* All the histograms in one scan.
+   */
+  for (i = 0; i < num; i++)
+      for (pass = 0; pass < passes; pass++)
+          count [pass] [geoip_radix_digit(nodes + i*el_size, family, pass)]++;
+
+  for (pass = 0; pass < passes; pass++)
+  {
+    BYTE *swap;
+
+    if (count[pass][geoip_radix_digit(nodes, family, pass)] == num)
+       continue;
+
+    for (d = 0, sum = 0; d < 256; d++)
+    {
+      DWORD n = count[pass][d];
+
+      count[pass][d] = sum;
+      sum += n;
+    }
+    for (i = 0; i < num; i++)
+    {
+      const BYTE *node = nodes + i * el_size;
+
+      d = geoip_radix_digit (node, family, pass);
+      memcpy (tmp + el_size * count[pass][d]++, node, el_size);
+    }
+    swap  = nodes;
+    nodes = tmp;
+    tmp   = swap;
+  }
+  free (count);
+  return (nodes);
+}
+
+/**
+ * The bulk-loader; an alternative to `geoip_parse_lines()`.
+ *
+ * Memory-maps the `file` and splits it into chunks of whole lines.
+ * Each chunk is parsed on it's own thread into one preallocated node-array
+ * which is then radix-sorted. The returned smartlist points into this array
+ * which is allocated from the new `*arena`.
+ *
+ * \param[in]  file    the file on CVS format to read and parse.
+ * \param[in]  family  the address family of the file; `AF_INET` or `AF_INET6`.
+ * \param[out] num     the number of records parsed.
+ * \param[in]  use_threads if FALSE, parse all chunks on the calling thread.
+ *                         Always so in `DllMain()`; the threads could not run.
+ * \param[out] arena   the new arena holding the records.
+ */
+static smartlist_t *geoip_parse_bulk (const char *file, int family, DWORD *num, BOOL use_threads, struct arena **arena)
+{
+  struct geoip_chunk chunks [GEOIP_MAX_CHUNKS];
+  HANDLE       threads [GEOIP_MAX_CHUNKS];
+  SYSTEM_INFO  sys_info;
+  smartlist_t *specials;
+  size_t       el_size = (family == AF_INET) ? sizeof(struct ipv4_node) : sizeof(struct ipv6_node);
+  HANDLE       fh, map = NULL;
+  const char  *view = NULL, *p;
+  BYTE        *nodes, *tmp, *sorted;
+  DWORD        size = 0, total, used, lines;
+  int          i, j, num_chunks, num_threads = 0;
+
+  *num   = 0;
+  *arena = NULL;
+  if (ws_in_process_attach)
+     use_threads = FALSE;
+
+  fh = CreateFileA (file, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (fh != INVALID_HANDLE_VALUE)
+  {
+    size = GetFileSize (fh, NULL);
+    if (size != INVALID_FILE_SIZE && size > 0)
+       map = CreateFileMapping (fh, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle (fh);   /* the mapping keeps the file open */
+  }
+  if (map)
+     view = MapViewOfFile (map, FILE_MAP_READ, 0, 0, 0);
+  if (!view)
+  {
+    TRACE (2, "Failed to map Geoip-file \"%s\": %s\n", file, win_strerror(GetLastError()));
+    if (map)
+       CloseHandle (map);
+    return (NULL);
+  }
+
+  GetSystemInfo (&sys_info);
+  num_chunks = (int) sys_info.dwNumberOfProcessors;
+  if (num_chunks > (int)(size / GEOIP_MIN_CHUNK) + 1)
+     num_chunks = (int)(size / GEOIP_MIN_CHUNK) + 1;
+  num_chunks = max (1, min(num_chunks, GEOIP_MAX_CHUNKS));
+
+  /* Split on line boundaries and count the lines in each chunk.
+   */
+  memset (&chunks, '\0', sizeof(chunks));
+  for (i = 0, p = view, total = 0; i < num_chunks; i++)
+  {
+    struct geoip_chunk *c   = chunks + i;
+    const char         *end = view + (size_t)size * (i + 1) / num_chunks;
+
+    if (end < p)
+       end = p;
+    if (i == num_chunks - 1)
+       end = view + size;
+    else
+    {
+      end = memchr (end, '\n', view + size - end);
+      end = end ? end + 1 : view + size;
+    }
+    c->start      = p;
+    c->end        = end;
+    c->family     = family;
+    c->first_line = total;
+
+    for (lines = 0; p < end; lines++)
+    {
+      p = memchr (p, '\n', end - p);
+      p = p ? p + 1 : end;
+    }
+    c->max_nodes = lines;
+    total += lines;
+  }
+
+  /* The specials are copied after the parsed nodes below.
+   */
+  *arena = arena_new ("geoip", 64*1024);
+  specials = smartlist_new();
+  if (family == AF_INET)
+       geoip_ipv4_add_specials (specials, *arena);
+  else geoip_ipv6_add_specials (specials, *arena);
+
+  total += smartlist_len (specials);
+  nodes = arena_alloc (*arena, total * el_size);
+  tmp   = malloc (total * el_size);
+
+  if (!nodes || !tmp)
+  {
+    free (tmp);
+    smartlist_free (specials);
+    arena_free (*arena);
+    *arena = NULL;
+    UnmapViewOfFile (view);
+    CloseHandle (map);
+    return (NULL);
+  }
+
+  for (i = 0, used = 0; i < num_chunks; i++)
+  {
+    chunks[i].nodes = nodes + used * el_size;
+    used += chunks[i].max_nodes;
+  }
+
+  /* Chunk 0 is parsed on this thread.
+   */
+  for (i = 1; i < num_chunks; i++)
+  {
+    HANDLE th = use_threads ? CreateThread (NULL, 0, geoip_chunk_parse, chunks + i, 0, NULL) : NULL;
+
+    if (th)
+         threads [num_threads++] = th;
+    else geoip_chunk_parse (chunks + i);
+  }
+  geoip_chunk_parse (chunks + 0);
+
+  if (num_threads > 0)
+     WaitForMultipleObjects (num_threads, threads, TRUE, INFINITE);
+  for (i = 0; i < num_threads; i++)
+      CloseHandle (threads[i]);
+
+  UnmapViewOfFile (view);
+  CloseHandle (map);
+
+  /* Close the gaps left by comment-lines and add the specials at the end.
+   */
+  for (i = 0, used = 0; i < num_chunks; i++)
+  {
+    memmove (nodes + used * el_size, chunks[i].nodes, chunks[i].num_nodes * el_size);
+    used  += chunks[i].num_nodes;
+    *num  += chunks[i].num_nodes;
+  }
+  for (j = 0; j < smartlist_len(specials); j++)
+      memcpy (nodes + el_size * used++, smartlist_get(specials, j), el_size);
+  smartlist_free (specials);
+
+  /* The result must end up in the arena.
+   */
+  sorted = geoip_radix_sort (nodes, tmp, used, family);
+  if (sorted != nodes)
+     memcpy (nodes, sorted, used * el_size);
+  free (tmp);
+
+  TRACE (2, "Parsed %s IPv%c records from \"%s\" in %d chunks using %d threads.\n",
+         dword_str(*num), family == AF_INET ? '4' : '6', file, num_chunks, num_threads + 1);
+  return geoip_smartlist_fixed (nodes, el_size, used);
+}
+
+/**
+ * Parse a GeoIP file into a new sorted smartlist.
+ * With `g_cfg.geoip_bulk_load`, use the bulk-loader.
+ *
+ * \param[in]  file    the file on CVS format to read and parse.
+ * \param[in]  family  the address family of the file; `AF_INET` or `AF_INET6`.
+ * \param[out] num     the number of records parsed.
+ * \param[out] arena   the new arena holding the records.
+ * \param[in]  use_threads passed on to `geoip_parse_bulk()`.
+ */
+static smartlist_t *geoip_parse_list (const char *file, int family, DWORD *num, struct arena **arena, BOOL use_threads)
+{
+  smartlist_t *sl = NULL;
+
+  if (g_cfg.geoip_bulk_load)
+     sl = geoip_parse_bulk (file, family, num, use_threads, arena);
+  if (!sl)
+     sl = geoip_parse_lines (file, family, num, arena);
+  return (sl);
+}
+
+/**
+ * Open and parse a GeoIP file.
+ * Or with `g_cfg.bin_cache = 1`, load it's binary cache if up to date.
+ *
+ * \param[in] file   the file on CVS format to read and parse.
+ * \param[in] family the address family of the file; `AF_INET` or `AF_INET6`.
+ */
+static DWORD geoip_parse_file (const char *file, int family)
+{
+  DWORD num = 0;
+
+  TRACE (4, "address-family: %d, file: %s.\n", family, file);
+
+  if (!file || !file_exists(file))
+  {
+    TRACE (2, "Geoip-file \"%s\" does not exist.\n", file);
+    return (0);
+  }
+
+  if (family != AF_INET && family != AF_INET6)
+  {
+    TRACE (0, "Only address-families AF_INET and AF_INET6 supported.\n");
+    return (0);
+  }
+
+  if (g_cfg.bin_cache)
+  {
+    num = geoip_load_bin_cache (file, family);
+    if (num > 0)
+       return (num);
+  }
+
+  if (family == AF_INET)
+  {
+    assert (geoip_ipv4_entries == NULL);
+    geoip_ipv4_entries = geoip_parse_list (file, family, &num, &geoip4_arena, GEOIP_INIT_THREADS);
+    geoip_ipv4_index_build (geoip_ipv4_entries, &geoip_ipv4_index);
+  }
+  else
+  {
+    assert (geoip_ipv6_entries == NULL);
+    geoip_ipv6_entries = geoip_parse_list (file, family, &num, &geoip6_arena, GEOIP_INIT_THREADS);
+  }
+
+  if (g_cfg.bin_cache && num > 0)
+     geoip_write_bin_cache (file, family,
+                            family == AF_INET ? geoip_ipv4_entries : geoip_ipv6_entries,
+                            &geoip_ipv4_index);
   return (num);
 }
 
+/**
+ * Free a list of entries and the `arena` holding them.
+ * If mapped (generated or from a binary cache), `arena` is NULL.
+ */
+static void geoip_free_entries (smartlist_t *sl, struct arena *arena)
+{
+  smartlist_free (sl);
+  arena_free (arena);
+}
+
+/**
+ * Parse the updated `file` and swap in the new entries for `family`.
+ * Called from the `update_async_thread()` in init.c.
+ *
+ * The parsing is done outside the `crit_sect`. All lookups are done
+ * inside it, so only the swap (and a flush of the `geoip_cache`) holds it.
+ * Unless `wsock_trace_exit()` has cleared `g_cfg.update_async` in the meantime.
+ */
+static BOOL geoip_reload (const char *file, int family)
+{
+  struct geoip_ipv4_index index, old_index;
+  struct bin_cache        old_cache;
+  smartlist_t            *sl, *old_sl;
+  DWORD                   num;
+  struct arena           *arena, *old_arena;
+  BOOL                    swapped = FALSE;
+
+  sl = geoip_parse_list (file, family, &num, &arena, TRUE);  /* always on the 'update_async_thread()' */
+  if (!sl || num == 0)
+  {
+    geoip_free_entries (sl, arena);
+    return (FALSE);
+  }
+
+  memset (&index, '\0', sizeof(index));
+  if (family == AF_INET)
+     geoip_ipv4_index_build (sl, &index);
+
+  if (g_cfg.bin_cache)
+     geoip_write_bin_cache (file, family, sl, &index);
+
+  memset (&old_index, '\0', sizeof(old_index));
+  memset (&old_cache, '\0', sizeof(old_cache));
+  old_sl    = sl;
+  old_arena = arena;
+
+  ENTER_CRIT();
+  if (g_cfg.update_async)
+  {
+    if (family == AF_INET)
+    {
+      old_sl    = geoip_ipv4_entries;
+      old_arena = geoip4_arena;
+      old_index = geoip_ipv4_index;
+      old_cache = geoip4_bin_cache;
+      geoip_ipv4_entries = sl;
+      geoip_ipv4_index   = index;
+      geoip4_arena       = arena;
+      memset (&geoip4_bin_cache, '\0', sizeof(geoip4_bin_cache));
+    }
+    else
+    {
+      old_sl    = geoip_ipv6_entries;
+      old_arena = geoip6_arena;
+      old_cache = geoip6_bin_cache;
+      geoip_ipv6_entries = sl;
+      geoip6_arena       = arena;
+      memset (&geoip6_bin_cache, '\0', sizeof(geoip6_bin_cache));
+    }
+    geoip_cache_flush();
+    swapped = TRUE;
+  }
+  LEAVE_CRIT();
+
+  if (swapped)
+  {
+    geoip_free_entries (old_sl, old_arena);
+    geoip_ipv4_index_free (&old_index);
+    bin_cache_close (&old_cache);
+    TRACE (1, "Swapped in %s new IPv%c records from \"%s\".\n",
+           dword_str(num), family == AF_INET ? '4' : '6', file);
+  }
+  else
+  {
+    geoip_free_entries (sl, arena);
+    geoip_ipv4_index_free (&index);
+  }
+  return (swapped);
+}
+
+/**
+ * Called from the `update_async_thread()` in init.c when `g_cfg.update_async = 1`.
+ * Download the GeoIP files if older than `g_cfg.geoip_max_days` and swap
+ * in their new entries. Not for `g_cfg.geoip_use_generated`; those entries
+ * are compiled in.
+ */
+void geoip_update_async (void)
+{
+  if (!g_cfg.geoip_enable || g_cfg.geoip_use_generated)
+     return;
+
+  if (g_cfg.geoip4_file && geoip_update_file(AF_INET, FALSE) > 0)
+     geoip_reload (g_cfg.geoip4_file, AF_INET);
+
+  if (g_cfg.geoip6_file && geoip_update_file(AF_INET6, FALSE) > 0)
+     geoip_reload (g_cfg.geoip6_file, AF_INET6);
+}
+
 /**
  * The main init function for this module.
  * Normally called from `wsock_trace_init()`.
@@ -436,6 +1095,7 @@ int geoip_init (DWORD *_num4, DWORD *_num6)
      g_cfg.geoip_enable = FALSE;
 
   geoip_stats_init();
+  geoip_cache_init();
   ip2loc_init();
 
   return geoip_get_num_addr (_num4, _num6);
@@ -447,38 +1107,92 @@ int geoip_init (DWORD *_num4, DWORD *_num6)
  */
 void geoip_exit (void)
 {
-  if (g_cfg.geoip_use_generated)
+  geoip_free_entries (geoip_ipv4_entries, geoip4_arena);
+  geoip_free_entries (geoip_ipv6_entries, geoip6_arena);
+  geoip_ipv4_entries = geoip_ipv6_entries = NULL;
+  geoip4_arena = geoip6_arena = NULL;
+  geoip_ipv4_index_free (&geoip_ipv4_index);
+  bin_cache_close (&geoip4_bin_cache);
+  bin_cache_close (&geoip6_bin_cache);
+  geoip_stats_exit();
+  geoip_cache_exit();
+  ip2loc_exit();
+}
+
+/**
+ * Parse and add an IPv4 entry to the `geoip_ipv4_entries` smart-list `sl`.
+ *
+ * \param[in]     sl    the smart-list to add to.
+ * \param[in]     arena the arena to allocate the entry from.
+ * \param[in]     buf   the buffer from `fgets()` to parse.
+ * \param[in,out] line  the line-counter for the parsed line. Used in the below `TRACE()` only.
+ * \param[in,out] num   the counter that gets incremented if `buf` matches an IPv4 address.
+ */
+static int geoip4_parse_entry (smartlist_t *sl, struct arena *arena, char *buf, unsigned *line, DWORD *num)
+{
+  struct ipv4_node node;
+  int    rc = geoip4_parse_node (buf, &node);
+
+  (*line)++;
+  if (rc == 0)
+     return (1);
+
+  if (rc > 0)
   {
-    if (geoip_ipv4_entries)
-       smartlist_free (geoip_ipv4_entries);
-    if (geoip_ipv6_entries)
-       smartlist_free (geoip_ipv6_entries);
+    rc = geoip4_add_entry (sl, arena, node.low, node.high, node.country);
+    (*num)++;
   }
   else
   {
-    if (geoip_ipv4_entries)
-       smartlist_wipe (geoip_ipv4_entries, free);
-    if (geoip_ipv6_entries)
-       smartlist_wipe (geoip_ipv6_entries, free);
+    rc = 0;
+    TRACE (0, "Unable to parse line %u in GEOIP IPv4 file.\n", *line);
   }
+  return (rc);
+}
 
-  geoip_ipv4_entries = geoip_ipv6_entries = NULL;
-  geoip_stats_exit();
-  ip2loc_exit();
+/**
+ * Parse and add an IPv6 entry to the `geoip_ipv6_entries` smart-list `sl`.
+ *
+ * \param[in]     sl    the smart-list to add to.
+ * \param[in]     arena the arena to allocate the entry from.
+ * \param[in]     buf   the buffer from `fgets()` to parse.
+ * \param[in,out] line  the line-counter for the parsed line. Used in the below `TRACE()` only.
+ * \param[in,out] num   the counter that gets incremented if `buf` matches an IPv6 address.
+ */
+static int geoip6_parse_entry (smartlist_t *sl, struct arena *arena, char *buf, unsigned *line, DWORD *num)
+{
+  struct ipv6_node node;
+  int    rc = geoip6_parse_node (buf, &node);
+
+  (*line)++;
+  if (rc == 0)
+     return (1);
+
+  if (rc > 0)
+  {
+    rc = geoip6_add_entry (sl, arena, &node.low, &node.high, node.country);
+    (*num)++;
+  }
+  else
+  {
+    rc = 0;
+    TRACE (0, "Unable to parse line %u in GEOIP IPv6 file.\n", *line);
+  }
+  return (rc);
 }
 
 /**
- * Parse and add an IPv4 entry to the `geoip_ipv4_entries` smart-list.
+ * Parse a line from a GeoIP IPv4 file into a `node`.
+ * Shared by `geoip4_parse_entry()` and the bulk-loader.
  *
- * \param[in]     buf  the buffer from `fgets()` to parse.
- * \param[in,out] line the line-counter for the parsed line. Used in the below `TRACE()` only.
- * \param[in,out] num  the counter that gets incremented if `buf` matches an IPv4 address.
+ * \retval  1  `buf` was parsed into `node`.
+ * \retval  0  `buf` is a comment.
+ * \retval -1  `buf` failed to parse.
  */
-static int geoip4_parse_entry (char *buf, unsigned *line, DWORD *num)
+static int geoip4_parse_node (char *buf, struct ipv4_node *node)
 {
-  char       *p = buf;
-  char        country[3];
-  int         rc = 0;
+  char *p = buf;
+  char  country[3];
 #ifdef __CYGWIN__
   unsigned long low, high;
 #else
@@ -489,86 +1203,71 @@ static int geoip4_parse_entry (char *buf, unsigned *line, DWORD *num)
       p++;
 
   if (*p == '#' || *p == ';')
-  {
-    (*line)++;
-    return (1);
-  }
+     return (0);
 
   if (sscanf(buf,"%lu,%lu,%2s", &low, &high, country) == 3 ||
       sscanf(buf,"\"%lu\",\"%lu\",\"%2s\",", &low, &high, country) == 3)
   {
-    rc = geoip4_add_entry (low, high, country);
-    (*num)++;
+    node->low  = low;
+    node->high = high;
+    memcpy (&node->country, country, sizeof(node->country));
+    return (1);
   }
-  (*line)++;
-
-  if (rc == 0)
-     TRACE (0, "Unable to parse line %u in GEOIP IPv4 file.\n", *line);
-  return (rc);
+  return (-1);
 }
 
 /**
- * Parse and add an IPv6 entry to the `geoip_ipv6_entries` smart-list.
+ * Parse a line from a GeoIP IPv6 file into a `node`.
+ * Shared by `geoip6_parse_entry()` and the bulk-loader.
  *
- * \param[in]     buf   the buffer from `fgets()` to parse.
- * \param[in,out] line  the line-counter for the parsed line. Used in the below `TRACE()` only.
- * \param[in,out] num   the counter that gets incremented if `buf` matches an IPv6 address.
+ * \retval  1  `buf` was parsed into `node`.
+ * \retval  0  `buf` is a comment.
+ * \retval -1  `buf` failed to parse.
  */
-static int geoip6_parse_entry (char *buf, unsigned *line, DWORD *num)
+static int geoip6_parse_node (char *buf, struct ipv6_node *node)
 {
-  struct in6_addr low, high;
-  char           *p = buf;
-  char           *country, *low_str, *high_str, *strtok_state;
-  int             rc = 0;
+  char *p = buf;
+  char *country, *low_str, *high_str, *strtok_state;
 
   for ( ; *p && isspace((int)*p); )
       p++;
 
   if (*p == '#' || *p == ';')
-  {
-    (*line)++;
-    return (1);
-  }
+     return (0);
 
   low_str = _strtok_r (buf, ",", &strtok_state);
   if (!low_str)
-     goto fail;
+     return (-1);
 
   high_str = _strtok_r (NULL, ",", &strtok_state);
   if (!high_str)
-     goto fail;
+     return (-1);
 
   country = _strtok_r (NULL, "\n", &strtok_state);
-  if (!country)
-     goto fail;
-
-  if (strlen(country) == 2 &&
-      wsock_trace_inet_pton6(low_str, (u_char*)&low) == 1 &&
-      wsock_trace_inet_pton6(high_str, (u_char*)&high) == 1)
-  {
-    rc = geoip6_add_entry (&low, &high, country);
-    (*num)++;
-  }
+  if (!country || strlen(country) != 2)
+     return (-1);
 
-fail:
-  (*line)++;
+  if (wsock_trace_inet_pton6(low_str, (u_char*)&node->low) != 1 ||
+      wsock_trace_inet_pton6(high_str, (u_char*)&node->high) != 1)
+     return (-1);
 
-  if (rc == 0)
-     TRACE (0, "Unable to parse line %u in GEOIP IPv6 file.\n", *line);
-  return (rc);
+  memcpy (&node->country, country, sizeof(node->country));
+  return (1);
 }
 
 /**
- * Add an IPv4 entry to the `geoip_ipv4_entries` smart-list.
+ * Add an IPv4 entry to the `geoip_ipv4_entries` smart-list `sl`.
  *
+ * \param[in] sl       The smart-list to add to.
+ * \param[in] arena    The arena to allocate the entry from.
  * \param[in] low      The lowest address in the IPv4-block.
  * \param[in] high     The highest address in the IPv4-block.
  * \param[in] country  The short country associated with this IPv4-block. <br>
  *                     Or the `-X` remark if this IPv4-block is a special address.
  */
-static int geoip4_add_entry (DWORD low, DWORD high, const char *country)
+static int geoip4_add_entry (smartlist_t *sl, struct arena *arena, DWORD low, DWORD high, const char *country)
 {
-  struct ipv4_node *entry = malloc (sizeof(*entry));
+  struct ipv4_node *entry = arena_alloc (arena, sizeof(*entry));
 
   if (!entry)
      return (-1);
@@ -578,21 +1277,23 @@ static int geoip4_add_entry (DWORD low, DWORD high, const char *country)
   if (country)
        memcpy (&entry->country, country, sizeof(entry->country));
   else entry->country[0] = '\0';
-  smartlist_add (geoip_ipv4_entries, entry);
+  smartlist_add (sl, entry);
   return (1);
 }
 
 /**
- * Add an IPv6 entry to the `geoip_ipv6_entries` smart-list.
+ * Add an IPv6 entry to the `geoip_ipv6_entries` smart-list `sl`.
  *
+ * \param[in] sl       The smart-list to add to.
+ * \param[in] arena    The arena to allocate the entry from.
  * \param[in] low      The lowest address in the IPv6-block.
  * \param[in] high     The highest address in the IPv6-block.
  * \param[in] country  The short country associated with this IPv6-block. <br>
  *                     Or the `-X` remark if this IPv6-block is a special address.
  */
-static int geoip6_add_entry (const struct in6_addr *low, const struct in6_addr *high, const char *country)
+static int geoip6_add_entry (smartlist_t *sl, struct arena *arena, const struct in6_addr *low, const struct in6_addr *high, const char *country)
 {
-  struct ipv6_node *entry = malloc (sizeof(*entry));
+  struct ipv6_node *entry = arena_alloc (arena, sizeof(*entry));
 
   if (!entry)
      return (-1);
@@ -602,7 +1303,7 @@ static int geoip6_add_entry (const struct in6_addr *low, const struct in6_addr *
   if (country)
        memcpy (&entry->country, country, sizeof(entry->country));
   else entry->country[0] = '\0';
-  smartlist_add (geoip_ipv6_entries, entry);
+  smartlist_add (sl, entry);
   return (1);
 }
 
@@ -625,6 +1326,14 @@ static struct ip2loc_entry g_ip2loc_entry;
  * \param[in] addr  The IPv4 address to get the country for.
  */
 const char *geoip_get_country_by_ipv4 (const struct in_addr *addr)
+{
+  return geoip_lookup_ipv4 (addr, 1);
+}
+
+/**
+ * As above, but the address of the lookup was seen `weight` times.
+ */
+static const char *geoip_lookup_ipv4 (const struct in_addr *addr, DWORD weight)
 {
   struct ipv4_node *entry = NULL;
   char     buf [25];
@@ -641,7 +1350,7 @@ const char *geoip_get_country_by_ipv4 (const struct in_addr *addr)
   if (num > 0 && INET_util_addr_is_global(addr,NULL) && ip2loc_get_ipv4_entry(addr, &g_ip2loc_entry))
   {
     if (g_cfg.trace_report)
-       geoip_stats_update (g_ip2loc_entry.country_short, GEOIP_STAT_IPV4 | GEOIP_VIA_IP2LOC);
+       geoip_stats_update (g_ip2loc_entry.country_short, GEOIP_STAT_IPV4 | GEOIP_VIA_IP2LOC, weight);
     return (g_ip2loc_entry.country_short);
   }
 
@@ -649,13 +1358,13 @@ const char *geoip_get_country_by_ipv4 (const struct in_addr *addr)
    */
   if (geoip_ipv4_entries)
   {
-    DWORD ip_num = swap32 (addr->s_addr);
+    int idx = geoip_ipv4_search (swap32(addr->s_addr));
 
-    entry = smartlist_bsearch (geoip_ipv4_entries, &ip_num,
-                               geoip_ipv4_compare_key_to_entry);
+    if (idx >= 0)
+       entry = smartlist_get_fast (geoip_ipv4_entries, idx);
 
     if (g_cfg.trace_report && entry && entry->country[0])
-       geoip_stats_update (entry->country, GEOIP_STAT_IPV4);
+       geoip_stats_update (entry->country, GEOIP_STAT_IPV4, weight);
   }
   return (entry ? entry->country : NULL);
 }
@@ -670,6 +1379,14 @@ const char *geoip_get_country_by_ipv4 (const struct in_addr *addr)
  * \param[in] addr  The IPv6 address to get the country for.
  */
 const char *geoip_get_country_by_ipv6 (const struct in6_addr *addr)
+{
+  return geoip_lookup_ipv6 (addr, 1);
+}
+
+/**
+ * As above, but the address of the lookup was seen `weight` times.
+ */
+static const char *geoip_lookup_ipv6 (const struct in6_addr *addr, DWORD weight)
 {
   struct ipv6_node *entry = NULL;
   char     buf [MAX_IP6_SZ+1];
@@ -686,17 +1403,16 @@ const char *geoip_get_country_by_ipv6 (const struct in6_addr *addr)
   if (num > 0 && INET_util_addr_is_global(NULL,addr) && ip2loc_get_ipv6_entry(addr, &g_ip2loc_entry))
   {
     if (g_cfg.trace_report)
-       geoip_stats_update (g_ip2loc_entry.country_short, GEOIP_STAT_IPV6 | GEOIP_VIA_IP2LOC);
+       geoip_stats_update (g_ip2loc_entry.country_short, GEOIP_STAT_IPV6 | GEOIP_VIA_IP2LOC, weight);
     return (g_ip2loc_entry.country_short);
   }
 
   if (geoip_ipv6_entries)
   {
-    entry = smartlist_bsearch (geoip_ipv6_entries, addr,
-                               geoip_ipv6_compare_key_to_entry);
+    entry = geoip_ipv6_bsearch (geoip_ipv6_entries, addr);
 
     if (g_cfg.trace_report && entry && entry->country[0])
-       geoip_stats_update (entry->country, GEOIP_STAT_IPV6);
+       geoip_stats_update (entry->country, GEOIP_STAT_IPV6, weight);
   }
   return (entry ? entry->country : NULL);
 }
@@ -743,6 +1459,287 @@ const char *geoip_get_location_by_ipv6 (const struct in6_addr *ip6)
   return (NULL);
 }
 
+/**\struct geoip_cache
+ *
+ * A small LRU cache of the results for the most recently used addresses.
+ * A program normally talks to only a handful of peers. So the dump-functions
+ * in dump.c would otherwise redo the same ip2loc, geoip and DNSBL lookups
+ * for each traced call.
+ *
+ * Each thread has its own cache in a `tls_block_get()` block. So a hit
+ * needs no lock. Only a miss (and the `geoip_stats_update()` of a hit)
+ * goes into `ENTER_CRIT()` for the non-reentrant lookups.
+ */
+#define GEOIP_CACHE_SIZE 32
+
+struct geoip_cache {
+       int          family;         /**< `AF_INET` or `AF_INET6`. 0 if unused */
+       BYTE         addr [16];      /**< The `in_addr` or `in6_addr` */
+       DWORD        last_used;      /**< Value of `ticks` of the thread at last use */
+       BOOL         have_geoip;     /**< `country` and `location` are set */
+       BOOL         have_DNSBL;     /**< `sbl_ref` is set */
+       int          stat_flag;      /**< The flag for `geoip_stats_update()` on a hit */
+       char         country [3];
+       char         location [100];
+       const char  *sbl_ref;        /**< Points into the DNSBL lists */
+     };
+
+/**\struct geoip_cache_thread
+ * The cache of one thread. Must start like a `struct tls_block`.
+ */
+struct geoip_cache_thread {
+       struct geoip_cache_thread *next;
+       volatile LONG              owner;
+       LONG                       generation;   /**< The `geoip_cache_generation` when filled */
+       DWORD                      ticks;
+       volatile DWORD             hits;
+       volatile DWORD             misses;
+       struct geoip_cache         slot [GEOIP_CACHE_SIZE];
+     };
+
+static struct geoip_cache_thread *volatile geoip_cache_list = NULL;
+static DWORD                               geoip_cache_tls  = TLS_OUT_OF_INDEXES;
+
+/**
+ * Bumped by `geoip_cache_flush()`. A thread clears its cache on the next
+ * lookup when its `generation` differs.
+ */
+static volatile LONG geoip_cache_generation = 0;
+
+/**
+ * Get the cache of this thread. Cleared if a flush happened since last use.
+ */
+static struct geoip_cache_thread *geoip_cache_thread_get (void)
+{
+  struct geoip_cache_thread *t;
+  LONG   gen;
+
+  if (geoip_cache_tls == TLS_OUT_OF_INDEXES)
+     return (NULL);
+
+  t = tls_block_get (geoip_cache_tls, (void*volatile*)&geoip_cache_list, sizeof(*t), NULL);
+  if (!t)
+     return (NULL);
+
+  gen = InterlockedCompareExchange (&geoip_cache_generation, 0, 0);
+  if (t->generation != gen)
+  {
+    memset (&t->slot, '\0', sizeof(t->slot));
+    t->ticks      = 0;
+    t->generation = gen;
+  }
+  return (t);
+}
+
+/**
+ * Find (or make) the cache entry for an address in the cache of this thread.
+ * If not found, the least recently used entry is cleared and returned.
+ */
+static struct geoip_cache *geoip_cache_find (struct geoip_cache_thread *t, int family, const void *addr)
+{
+  struct geoip_cache *c, *lru = t->slot;
+  size_t size = (family == AF_INET) ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+  int    i;
+
+  t->ticks++;
+
+  for (i = 0, c = t->slot; i < GEOIP_CACHE_SIZE; i++, c++)
+  {
+    if (c->family == family && !memcmp(c->addr, addr, size))
+    {
+      c->last_used = t->ticks;
+      return (c);
+    }
+    if (c->last_used < lru->last_used)
+       lru = c;
+  }
+
+  memset (lru, '\0', sizeof(*lru));
+  lru->family    = family;
+  lru->last_used = t->ticks;
+  memcpy (lru->addr, addr, size);
+  return (lru);
+}
+
+/**
+ * The uncached `geoip_cache_get_country()`.
+ */
+static const char *geoip_lookup_country (int family, const void *addr, const char **location)
+{
+  const char *cc;
+
+  if (family == AF_INET)
+  {
+    cc = geoip_get_country_by_ipv4 (addr);
+    *location = geoip_get_location_by_ipv4 (addr);
+  }
+  else
+  {
+    cc = geoip_get_country_by_ipv6 (addr);
+    *location = geoip_get_location_by_ipv6 (addr);
+  }
+  return (cc);
+}
+
+/**
+ * A cached version of `geoip_get_country_by_ipv4()` + `geoip_get_location_by_ipv4()`
+ * or `geoip_get_country_by_ipv6()` + `geoip_get_location_by_ipv6()`.
+ *
+ * \param[in]  family    `AF_INET` or `AF_INET6`.
+ * \param[in]  addr      the `struct in_addr` or `struct in6_addr` to look up.
+ * \param[out] location  set to the location (or NULL).
+ * \retval     the country-code (or NULL).
+ */
+const char *geoip_cache_get_country (int family, const void *addr, const char **location)
+{
+  struct geoip_cache_thread *t = geoip_cache_thread_get();
+  struct geoip_cache        *c;
+  const char                *cc, *loc;
+
+  if (!t)
+  {
+    ENTER_CRIT();
+    cc = geoip_lookup_country (family, addr, location);
+    LEAVE_CRIT();
+    return (cc);
+  }
+
+  c = geoip_cache_find (t, family, addr);
+  if (c->have_geoip)
+  {
+    t->hits++;
+    if (g_cfg.trace_report && c->stat_flag)
+    {
+      ENTER_CRIT();
+      geoip_stats_update (c->country, c->stat_flag, 1);
+      LEAVE_CRIT();
+    }
+    *location = c->location[0] ? c->location : NULL;
+    return (c->country[0] ? c->country : NULL);
+  }
+
+  t->misses++;
+
+  /* 'g_ip2loc_entry' and the 'geoip_stats_buf' are shared.
+   * The country and location are copied before leaving.
+   */
+  ENTER_CRIT();
+  cc = geoip_lookup_country (family, addr, &loc);
+
+  c->have_geoip = TRUE;
+  if (cc)
+     _strlcpy (c->country, cc, sizeof(c->country));
+  if (loc)
+     _strlcpy (c->location, loc, sizeof(c->location));
+
+  if (cc && cc[0])
+  {
+    c->stat_flag = (family == AF_INET) ? GEOIP_STAT_IPV4 : GEOIP_STAT_IPV6;
+    if (IP2LOC_IS_GOOD())
+       c->stat_flag |= GEOIP_VIA_IP2LOC;
+  }
+  LEAVE_CRIT();
+
+  *location = loc ? c->location : NULL;
+  return (cc ? c->country : NULL);
+}
+
+/**
+ * A cached version of `DNSBL_check_ipv4()` or `DNSBL_check_ipv6()`.
+ *
+ * \param[in] family  `AF_INET` or `AF_INET6`.
+ * \param[in] addr    the `struct in_addr` or `struct in6_addr` to check.
+ * \retval    the SBL reference (or NULL).
+ */
+const char *geoip_cache_get_DNSBL (int family, const void *addr)
+{
+  struct geoip_cache_thread *t = geoip_cache_thread_get();
+  struct geoip_cache        *c;
+  const char                *sbl_ref = NULL;
+
+  if (!t)
+  {
+    if (family == AF_INET)
+         DNSBL_check_ipv4 (addr, &sbl_ref);
+    else DNSBL_check_ipv6 (addr, &sbl_ref);
+    return (sbl_ref);
+  }
+
+  c = geoip_cache_find (t, family, addr);
+  if (c->have_DNSBL)
+  {
+    t->hits++;
+    return (c->sbl_ref);
+  }
+
+  t->misses++;
+  if (family == AF_INET)
+       DNSBL_check_ipv4 (addr, &c->sbl_ref);
+  else DNSBL_check_ipv6 (addr, &c->sbl_ref);
+  c->have_DNSBL = TRUE;
+  return (c->sbl_ref);
+}
+
+/**
+ * Clear all entries in the `geoip_cache` of every thread.
+ * Must be called (inside `ENTER_CRIT()`) when new GeoIP or DNSBL
+ * tables are swapped in since the `sbl_ref` points into the old ones.
+ *
+ * Another thread may be using its cache. So just bump the generation.
+ * Each thread clears its own cache on its next lookup.
+ */
+void geoip_cache_flush (void)
+{
+  InterlockedIncrement (&geoip_cache_generation);
+}
+
+/**
+ * Return the hit and miss counts of the above caches summed over all threads.
+ */
+void geoip_cache_stats (DWORD *hits, DWORD *misses)
+{
+  const struct geoip_cache_thread *t;
+
+  *hits = *misses = 0;
+  for (t = geoip_cache_list; t; t = t->next)
+  {
+    *hits   += t->hits;
+    *misses += t->misses;
+  }
+}
+
+/**
+ * Called from DllMain(): dwReason == DLL_THREAD_DETACH.
+ * Let another thread reuse this cache.
+ */
+void geoip_cache_thread_exit (void)
+{
+  if (geoip_cache_tls != TLS_OUT_OF_INDEXES)
+     tls_block_release (geoip_cache_tls);
+}
+
+static void geoip_cache_init (void)
+{
+  geoip_cache_tls = TlsAlloc();
+}
+
+static void geoip_cache_exit (void)
+{
+  struct geoip_cache_thread *t, *next;
+
+  if (geoip_cache_tls == TLS_OUT_OF_INDEXES)
+     return;
+
+  TlsFree (geoip_cache_tls);
+  geoip_cache_tls = TLS_OUT_OF_INDEXES;
+  for (t = geoip_cache_list; t; t = next)
+  {
+    next = t->next;
+    free (t);
+  }
+  geoip_cache_list = NULL;
+}
+
 /**
  * Return the number of records of `AF_INET` and/or `AF_INET6` addresses.
  *
@@ -1149,8 +2146,9 @@ static void geoip_stats_exit (void)
  *
  * \param[in] country_A2  The 2-letter country to update the statistics for.
  * \param[in] flag        A flag describing what counter should be incremented.
+ * \param[in] weight      The number of times the address was seen.
  */
-static void geoip_stats_update (const char *country_A2, int flag)
+static void geoip_stats_update (const char *country_A2, int flag, DWORD weight)
 {
   struct geoip_stats *stats;
   int    c1, c2 = (int)country_A2[0] + ((int)country_A2[1] << 8);
@@ -1164,9 +2162,9 @@ static void geoip_stats_update (const char *country_A2, int flag)
     if (c1 == c2)
     {
       if (flag & GEOIP_STAT_IPV4)
-           stats->num4++;
+           stats->num4 += weight;
       else if (flag & GEOIP_STAT_IPV6)
-           stats->num6++;
+           stats->num6 += weight;
       stats->flag |= flag;
       break;
     }
@@ -1176,6 +2174,25 @@ static void geoip_stats_update (const char *country_A2, int flag)
   else TRACE (3, "geoip_stats_update() for \"%.2s\" at index: %d.\n", country_A2, (int)i);
 }
 
+/**
+ * Add the country of an address seen `count` times to the statistics.
+ * Used by `stats_merge()` for the addresses counted in `stats_only` mode.
+ *
+ * \param[in] family  The address family; `AF_INET` or `AF_INET6`.
+ * \param[in] addr    The `struct in_addr` or `struct in6_addr` to lookup.
+ * \param[in] count   The number of times `addr` was seen.
+ */
+void geoip_stats_add_addr (int family, const void *addr, DWORD count)
+{
+  if (count == 0)
+     return;
+
+  if (family == AF_INET)
+     geoip_lookup_ipv4 ((const struct in_addr*)addr, count);
+  else if (family == AF_INET6)
+     geoip_lookup_ipv6 ((const struct in6_addr*)addr, count);
+}
+
 /**
  * This function assumes the above `geoip_stats_update()` was called to update
  * `stats->num[46]`. Hence if `country_A2` is found and `stats->num[46] > 1`, the country
@@ -1350,8 +2367,9 @@ static DWORD update_file (const char *loc_file, const char *tmp_file, const char
  * \param[in] family        If `AF_INET`, check if `g_cfg.geoip4_file` needs to be updated.<br>
  *                          If `AF_INET6`, check if `g_cfg.geoip6_file` needs to be updated.
  * \param[in] force_update  If TRUE, download the `%TEMP%/geoip.tmp` / `%TEMP%/geoip6.tmp` regardless.
+ * \retval    the size of the updated file. 0 if no update was needed or it failed.
  */
-void geoip_update_file (int family, BOOL force_update)
+DWORD geoip_update_file (int family, BOOL force_update)
 {
   char        tmp_file [MAX_PATH];
   const char *env = getenv ("TEMP");
@@ -1359,15 +2377,15 @@ void geoip_update_file (int family, BOOL force_update)
   if (family == AF_INET)
   {
     snprintf (tmp_file, sizeof(tmp_file), "%s\\%s", env, "geoip.tmp");
-    update_file (g_cfg.geoip4_file, tmp_file, g_cfg.geoip4_url, force_update);
+    return update_file (g_cfg.geoip4_file, tmp_file, g_cfg.geoip4_url, force_update);
   }
-  else if (family == AF_INET6)
+  if (family == AF_INET6)
   {
     snprintf (tmp_file, sizeof(tmp_file), "%s\\%s", env, "geoip6.tmp");
-    update_file (g_cfg.geoip6_file, tmp_file, g_cfg.geoip6_url, force_update);
+    return update_file (g_cfg.geoip6_file, tmp_file, g_cfg.geoip6_url, force_update);
   }
-  else
-    TRACE (0, "Unknown address-family %d\n", family);
+  TRACE (0, "Unknown address-family %d\n", family);
+  return (0);
 }
 
 #if defined(TEST_GEOIP) && !defined(TEST_FIREWALL) /* If not used with firewall_test.exe */
@@ -1911,6 +2929,9 @@ static void test_addr6 (const char *ip6_addr, BOOL use_ip2loc)
  *   `static struct ipv4_node ipv4_gen_array [NNN]` and
  *   `static struct ipv6_node ipv6_gen_array [NNN]`.
  *
+ * For IPv4 the flat `ipv4_gen_low []` and `ipv4_gen_high []` arrays used by
+ * `geoip_ipv4_search()` are also generated.
+ *
  * These files are then compiled into normal obj-files and the arrays are
  * accessed via these functions (also generated):
  * ```
@@ -1918,6 +2939,23 @@ static void test_addr6 (const char *ip6_addr, BOOL use_ip2loc)
  *   smartlist_t *geoip_smartlist_fixed_ipv6 (void);
  * ```
  */
+static void geoip_generate_ipv4_keys (FILE *out, const char *which, int len)
+{
+  int i;
+
+  fprintf (out, "static const DWORD ipv4_gen_%s [%d] = {\n", which, len);
+  for (i = 0; i < len; i++)
+  {
+    const struct ipv4_node *entry = smartlist_get (geoip_ipv4_entries, i);
+
+    fprintf (out, "%s0x%08lX%s",
+             (i % 8) == 0 ? "  " : "",
+             DWORD_CAST(*which == 'l' ? entry->low : entry->high),
+             (i % 8) == 7 || i == len-1 ? ",\n" : ", ");
+  }
+  fprintf (out, "};\n\n");
+}
+
 static int geoip_generate_array (int family, const char *out_file)
 {
   int    len, fam;
@@ -1973,13 +3011,26 @@ static int geoip_generate_array (int family, const char *out_file)
        dump_ipv4_entries (out, 0, 1);
   else dump_ipv6_entries (out, 0, 1);
 
-  fprintf (out,
-           "};\n"
-           "\n"
-           "smartlist_t *geoip_smartlist_fixed_ipv%c (void)\n"
-           "{\n"
-           "  return geoip_smartlist_fixed (&ipv%c_gen_array, sizeof(ipv%c_gen_array[0]), %d);\n"
-           "}\n\n", fam, fam, fam, len);
+  if (family == AF_INET)
+  {
+    fprintf (out, "};\n\n");
+    geoip_generate_ipv4_keys (out, "low", len);
+    geoip_generate_ipv4_keys (out, "high", len);
+    fprintf (out,
+             "smartlist_t *geoip_smartlist_fixed_ipv4 (void)\n"
+             "{\n"
+             "  geoip_ipv4_index_fixed (ipv4_gen_low, ipv4_gen_high, %d);\n"
+             "  return geoip_smartlist_fixed (&ipv4_gen_array, sizeof(ipv4_gen_array[0]), %d);\n"
+             "}\n\n", len, len);
+  }
+  else
+    fprintf (out,
+             "};\n"
+             "\n"
+             "smartlist_t *geoip_smartlist_fixed_ipv%c (void)\n"
+             "{\n"
+             "  return geoip_smartlist_fixed (&ipv%c_gen_array, sizeof(ipv%c_gen_array[0]), %d);\n"
+             "}\n\n", fam, fam, fam, len);
   fclose (out);
   return (0);
 }
@@ -2016,9 +3067,17 @@ static void make_random_addr (struct in_addr *addr4, struct in6_addr *addr6)
   }
 }
 
+/*
+ * For the `--bench` test below.
+ */
+#define BENCH_ADDRESSES  (2*1000*1000)
+#define BENCH_HOT_ADDR   256
+
 static int show_help (const char *my_name)
 {
-  printf ("Usage: %s [-cdfGinruh] [-g file] <-4|-6> address(es)\n"
+  printf ("Usage: %s [-cdfGinrtuh] [-g file] [--bench[=N]] <-4|-6> address(es)\n"
+          "       --bench: lookup throughput test on 1 - N threads (default = #CPUs).\n"
+          "                With '-n #' addresses (default %d).\n"
           "       -c:      dump addresses on CIDR form.\n"
           "       -d:      dump address entries for countries and count of blocks.\n"
           "       -f:      force an update with the '-u' option.\n"
@@ -2027,11 +3086,12 @@ static int show_help (const char *my_name)
           "       -i:      do no use the IP2Location database.\n"
           "       -n #:    number of loops for random test.\n"
           "       -r:      random test for '-n' rounds (default 10).\n"
+          "       -t:      time the line- and bulk-loaders of the geoip files.\n"
           "       -u:      test updating of geoip files.\n"
           "       -4:      test IPv4 address(es).\n"
           "       -6:      test IPv6 address(es).\n"
           "       -h:      this help.\n",
-          my_name);
+          my_name, BENCH_ADDRESSES);
   printf ("   address(es) can also come from a response-file: '@file-with-addr'.\n"
           "   Or from 'stdin': \"geoip.exe -4 < file-with-addr\".\n"
           "   Built by %s\n", get_builder());
@@ -2176,12 +3236,299 @@ static int check_requirements (BOOL check_geoip4, BOOL check_geoip6)
   return (1);
 }
 
+/*
+ * Parse the IPv4 or IPv6 file with both loaders, print the time used
+ * and check they give the same (sorted) records.
+ */
+static int time_loaders (int family)
+{
+  const char   *file = (family == AF_INET) ? g_cfg.geoip4_file : g_cfg.geoip6_file;
+  smartlist_t  *lines, *bulk;
+  struct arena *lines_arena, *bulk_arena;
+  LARGE_INTEGER freq, t0, t1, t2;
+  DWORD         num_lines = 0, num_bulk = 0;
+  int           i, max, diff = 0;
+
+  QueryPerformanceFrequency (&freq);
+  QueryPerformanceCounter (&t0);
+  lines = geoip_parse_lines (file, family, &num_lines, &lines_arena);
+  QueryPerformanceCounter (&t1);
+  bulk = geoip_parse_bulk (file, family, &num_bulk, TRUE, &bulk_arena);
+  QueryPerformanceCounter (&t2);
+
+  printf ("IPv%c file \"%s\":\n", family == AF_INET ? '4' : '6', file);
+  printf ("  line-loader: %8s records, %8.2f msec.\n",
+          dword_str(num_lines), 1E3 * (double)(t1.QuadPart - t0.QuadPart) / (double)freq.QuadPart);
+  printf ("  bulk-loader: %8s records, %8.2f msec.\n",
+          dword_str(num_bulk), 1E3 * (double)(t2.QuadPart - t1.QuadPart) / (double)freq.QuadPart);
+
+  if (!lines || !bulk || smartlist_len(lines) != smartlist_len(bulk))
+  {
+    printf ("  The loaders gave %d and %d entries.\n",
+            lines ? smartlist_len(lines) : -1, bulk ? smartlist_len(bulk) : -1);
+    diff++;
+  }
+  else
+  {
+    max = smartlist_len (lines);
+    for (i = 0; i < max; i++)
+    {
+      if (family == AF_INET)
+      {
+        const struct ipv4_node *a = smartlist_get (lines, i);
+        const struct ipv4_node *b = smartlist_get (bulk, i);
+
+        if (a->low != b->low || a->high != b->high || strcmp(a->country, b->country))
+           diff++;
+      }
+      else
+      {
+        const struct ipv6_node *a = smartlist_get (lines, i);
+        const struct ipv6_node *b = smartlist_get (bulk, i);
+
+        if (memcmp(&a->low, &b->low, sizeof(a->low)) ||
+            memcmp(&a->high, &b->high, sizeof(a->high)) || strcmp(a->country, b->country))
+           diff++;
+      }
+    }
+    printf ("  %d entries differ.\n", diff);
+  }
+  geoip_free_entries (lines, lines_arena);
+  geoip_free_entries (bulk, bulk_arena);
+  return (diff);
+}
+
+/*
+ * The `--bench [N]` lookup throughput test.
+ *
+ * Pre-generate `BENCH_ADDRESSES` random addresses and a "realistic" set where
+ * 90% are from `BENCH_HOT_ADDR` hot addresses (like a program talking to a
+ * few servers). Then time each lookup engine on 1, 2, 4 .. N threads.
+ *
+ * `ip2loc_get_ipvX_entry()` and `DNSBL_check_ipvX()` are reentrant. But
+ * `geoip_get_country_by_ipvX()` is not, so it is called inside `ENTER_CRIT()`
+ * as wsock_trace.dll does. The `geoip_cache` is per-thread and takes the
+ * lock itself on a miss.
+ */
+enum bench_engine {
+     BENCH_GEOIP = 0,
+     BENCH_IP2LOC,
+     BENCH_DNSBL,
+     BENCH_CACHE
+   };
+
+static const char *bench_engine_names[] = {
+                  "geoip",
+                  "ip2loc",
+                  "DNSBL",
+                  "geoip_cache"
+                };
+
+struct bench_thread {
+       enum bench_engine engine;
+       int               family;
+       const BYTE       *addr;
+       size_t            addr_size;
+       size_t            num;
+       DWORD             found;
+       HANDLE            t_hnd;
+       HANDLE            start;
+     };
+
+static DWORD WINAPI bench_worker (void *arg)
+{
+  struct bench_thread *bt = (struct bench_thread*) arg;
+  struct ip2loc_entry  ent;
+  const char          *cc, *loc, *sbl_ref;
+  const void          *a;
+  size_t               i;
+  BOOL                 rc = FALSE;
+
+  WaitForSingleObject (bt->start, INFINITE);
+
+  for (i = 0; i < bt->num; i++)
+  {
+    a = bt->addr + i * bt->addr_size;
+    switch (bt->engine)
+    {
+      case BENCH_GEOIP:
+           ENTER_CRIT();
+           cc = (bt->family == AF_INET) ? geoip_get_country_by_ipv4 (a) :
+                                          geoip_get_country_by_ipv6 (a);
+           rc = (cc && *cc != '-');
+           LEAVE_CRIT();
+           break;
+      case BENCH_IP2LOC:
+           rc = (bt->family == AF_INET) ? ip2loc_get_ipv4_entry (a, &ent) :
+                                          ip2loc_get_ipv6_entry (a, &ent);
+           break;
+      case BENCH_DNSBL:
+           rc = (bt->family == AF_INET) ? DNSBL_check_ipv4 (a, &sbl_ref) :
+                                          DNSBL_check_ipv6 (a, &sbl_ref);
+           break;
+      case BENCH_CACHE:
+           cc = geoip_cache_get_country (bt->family, a, &loc);
+           rc = (cc && *cc != '-');
+           break;
+    }
+    if (rc)
+       bt->found++;
+  }
+  geoip_cache_thread_exit();   /* no 'DLL_THREAD_DETACH' here */
+  return (0);
+}
+
+/*
+ * Make the random and the "realistic" address sets for `family`.
+ */
+static void bench_make_addresses (int family, size_t num, BYTE **random_p, BYTE **real_p)
+{
+  size_t asize = (family == AF_INET) ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+  BYTE  *rnd  = malloc (num * asize);
+  BYTE  *real = malloc (num * asize);
+  BYTE  *hot  = malloc (BENCH_HOT_ADDR * asize);
+  size_t i;
+
+  for (i = 0; i < BENCH_HOT_ADDR; i++)
+      make_random_addr (family == AF_INET ? (struct in_addr*)(hot + i*asize) : NULL,
+                        family == AF_INET6 ? (struct in6_addr*)(hot + i*asize) : NULL);
+
+  for (i = 0; i < num; i++)
+  {
+    make_random_addr (family == AF_INET ? (struct in_addr*)(rnd + i*asize) : NULL,
+                      family == AF_INET6 ? (struct in6_addr*)(rnd + i*asize) : NULL);
+    if (rand_range(0, 99) < 90)
+         memcpy (real + i*asize, hot + rand_range(0, BENCH_HOT_ADDR-1) * asize, asize);
+    else memcpy (real + i*asize, rnd + i*asize, asize);
+  }
+  free (hot);
+  *random_p = rnd;
+  *real_p   = real;
+}
+
+/*
+ * Time one engine on `num_threads` threads. Each thread does a slice of `addr`.
+ */
+static void bench_run (enum bench_engine engine, int family, const char *set_name,
+                       const BYTE *addr, size_t num, int num_threads)
+{
+  struct bench_thread bt [MAXIMUM_WAIT_OBJECTS];
+  HANDLE              hnd [MAXIMUM_WAIT_OBJECTS];
+  HANDLE              start_ev = CreateEvent (NULL, TRUE, FALSE, NULL);
+  LARGE_INTEGER       freq, t0, t1;
+  size_t              asize = (family == AF_INET) ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+  size_t              slice = num / num_threads;
+  DWORD               found = 0, hits0, misses0, hits1, misses1;
+  double              sec;
+  int                 i;
+
+  if (engine == BENCH_CACHE)
+  {
+    ENTER_CRIT();
+    geoip_cache_flush();
+    LEAVE_CRIT();
+  }
+  geoip_cache_stats (&hits0, &misses0);
+
+  for (i = 0; i < num_threads; i++)
+  {
+    bt[i].engine    = engine;
+    bt[i].family    = family;
+    bt[i].addr      = addr + i * slice * asize;
+    bt[i].addr_size = asize;
+    bt[i].num       = (i == num_threads-1) ? num - i * slice : slice;
+    bt[i].found     = 0;
+    bt[i].start     = start_ev;
+    bt[i].t_hnd     = hnd[i] = CreateThread (NULL, 0, bench_worker, bt+i, 0, NULL);
+  }
+
+  QueryPerformanceFrequency (&freq);
+  QueryPerformanceCounter (&t0);
+  SetEvent (start_ev);
+  WaitForMultipleObjects (num_threads, hnd, TRUE, INFINITE);
+  QueryPerformanceCounter (&t1);
+
+  for (i = 0; i < num_threads; i++)
+  {
+    CloseHandle (bt[i].t_hnd);
+    found += bt[i].found;
+  }
+  CloseHandle (start_ev);
+
+  sec = (double)(t1.QuadPart - t0.QuadPart) / (double)freq.QuadPart;
+  printf ("  %-11s IPv%c %-9s %2d thread%s: %12s lookups/sec, %5.1f%% found",
+          bench_engine_names[engine], family == AF_INET ? '4' : '6', set_name,
+          num_threads, num_threads > 1 ? "s" : " ",
+          qword_str((uint64)(sec > 0.0 ? num / sec : 0.0)), 100.0 * found / num);
+
+  if (engine == BENCH_CACHE)
+  {
+    geoip_cache_stats (&hits1, &misses1);
+    hits1   -= hits0;
+    misses1 -= misses0;
+    printf (", %5.1f%% cache hits", hits1 + misses1 ? 100.0 * hits1 / (hits1 + misses1) : 0.0);
+  }
+  putchar ('\n');
+}
+
+static int bench_lookups (BOOL do_4, BOOL do_6, BOOL use_ip2loc, size_t num, int max_threads)
+{
+  static const int families[] = { AF_INET, AF_INET6 };
+  enum bench_engine engine;
+  BYTE *rnd, *real;
+  int   i, family, threads, save_report = g_cfg.trace_report;
+
+  max_threads = max (1, min(max_threads, MAXIMUM_WAIT_OBJECTS));
+  srand ((unsigned int)time(NULL));
+
+  /** Don't count the lookups in `geoip_stats_update()`.
+   */
+  g_cfg.trace_report = 0;
+
+  printf ("Benchmark of %s lookups on 1 - %d threads:\n", qword_str(num), max_threads);
+
+  for (i = 0; i < DIM(families); i++)
+  {
+    family = families[i];
+    if ((family == AF_INET && !do_4) || (family == AF_INET6 && !do_6))
+       continue;
+
+    bench_make_addresses (family, num, &rnd, &real);
+
+    for (engine = BENCH_GEOIP; engine <= BENCH_CACHE; engine++)
+    {
+      if (engine == BENCH_IP2LOC && (!use_ip2loc || ip2loc_num_ipv4_entries() == 0))
+         continue;
+
+      for (threads = 1; ; threads = min(2*threads, max_threads))
+      {
+        bench_run (engine, family, "random", rnd, num, threads);
+        bench_run (engine, family, "realistic", real, num, threads);
+        if (threads == max_threads)
+           break;
+      }
+    }
+    free (rnd);
+    free (real);
+  }
+
+  printf ("ip2loc index errors: %lu\n", DWORD_CAST(ip2loc_index_errors()));
+  g_cfg.trace_report = save_report;
+  return (0);
+}
+
+static const struct option long_opts[] = {
+                           { "bench", optional_argument, NULL, 'B' },
+                           { NULL,    0,                 NULL, 0   }
+                         };
+
 int main (int argc, char **argv)
 {
   int c, do_cidr = 0,  do_4 = 0, do_6 = 0, do_force = 0;
-  int do_update = 0, do_dump = 0, do_rand = 0, do_generate = 0;
+  int do_update = 0, do_dump = 0, do_rand = 0, do_generate = 0, do_time = 0;
+  int do_bench = 0;
   int  use_ip2loc = 1;
-  int loops = 10;
+  int loops = 10, loops_given = 0;
   int rc = 0;
   const char *my_name = argv[0];
   const char *g_file = NULL;
@@ -2189,9 +3536,21 @@ int main (int argc, char **argv)
   wsock_trace_init();
   g_cfg.trace_use_ods = g_cfg.DNSBL.test = FALSE;
 
-  while ((c = getopt (argc, argv, "h?cdfGg:in:ru46")) != EOF)
+  while ((c = getopt_long (argc, argv, "h?cdfGg:in:rtu46", long_opts, NULL)) != EOF)
     switch (c)
     {
+      case 'B':
+           if (optarg)
+              do_bench = atoi (optarg);
+           else
+           {
+             SYSTEM_INFO si;
+
+             GetSystemInfo (&si);
+             do_bench = (int) si.dwNumberOfProcessors;
+           }
+           do_bench = max (1, do_bench);
+           break;
       case '?':
       case 'h':
            return show_help (my_name);
@@ -2220,10 +3579,14 @@ int main (int argc, char **argv)
            break;
       case 'n':
            loops = atoi (optarg);
+           loops_given = 1;
            break;
       case 'r':
            do_rand = 1;
            break;
+      case 't':
+           do_time = 1;
+           break;
       case 'u':
            do_update = 1;
            break;
@@ -2255,6 +3618,29 @@ int main (int argc, char **argv)
        return (0);
   }
 
+  if (do_bench)
+  {
+    rc = bench_lookups (do_4, do_6, use_ip2loc,
+                        loops_given && loops > 0 ? (size_t)loops : BENCH_ADDRESSES, do_bench);
+    wsock_trace_exit();
+    return (rc);
+  }
+
+  if (do_time)
+  {
+    if (!check_requirements(do_4, do_6))
+       rc++;
+    else
+    {
+      if (do_4)
+         rc += time_loaders (AF_INET);
+      if (do_6)
+         rc += time_loaders (AF_INET6);
+    }
+    wsock_trace_exit();
+    return (rc);
+  }
+
   if (do_generate)
   {
     if (!check_requirements(do_4, do_6))
@@ -44,15 +44,24 @@ extern const char *geoip_get_long_name_by_id (int number);
 extern const char *geoip_get_long_name_by_A2 (const char *short_name);
 extern const char *geoip_get_location_by_ipv4 (const struct in_addr *ip4);
 extern const char *geoip_get_location_by_ipv6 (const struct in6_addr *ip6);
+extern const char *geoip_cache_get_country (int family, const void *addr, const char **location);
+extern const char *geoip_cache_get_DNSBL   (int family, const void *addr);
+extern void        geoip_cache_stats (DWORD *hits, DWORD *misses);
+extern void        geoip_cache_flush (void);
+extern void        geoip_cache_thread_exit (void);
 extern uint64      geoip_get_stats_by_idx    (int idx);
 extern uint64      geoip_get_stats_by_number (int number);
-extern void        geoip_ipv4_add_specials (void);
-extern void        geoip_ipv6_add_specials (void);
+extern void        geoip_ipv4_add_specials (smartlist_t *sl, struct arena *arena);
+extern void        geoip_ipv6_add_specials (smartlist_t *sl, struct arena *arena);
 extern DWORD       geoip_load_data (int family);
+extern DWORD       geoip_update_file (int family, BOOL force_update);
+extern void        geoip_update_async (void);
 
 extern void geoip_num_unique_countries (DWORD *num_ip4,     DWORD *num_ip6,
                                         DWORD *num_ip2loc4, DWORD *num_ip2loc6);
 
+extern void geoip_stats_add_addr (int family, const void *addr, DWORD count);
+
 /**
  * To build a version of `geoip.exe` that should support `g_cfg.geoip_use_generated`,
  * is bit of an "chicken and egg" problem. These 2 commands:
@@ -72,6 +81,7 @@ extern void geoip_num_unique_countries (DWORD *num_ip4,     DWORD *num_ip6,
  *  \li `geoip_smartlist_fixed_ipv6()` in `geoip-gen6.c`.
  */
 extern smartlist_t *geoip_smartlist_fixed (void *start, size_t el_size, unsigned num);
+extern void         geoip_ipv4_index_fixed (const DWORD *low, const DWORD *high, unsigned num);
 
 /** These generated functions are defined in `gen-geoip4.c` and `geoip-gen6.c`.
  */
@@ -6,6 +6,8 @@
  *
  * By Gisle Vanem <gvanem@yahoo.no> August 2017.
  */
+#include <assert.h>
+
 #include "common.h"
 #include "init.h"
 #include "smartlist.h"
@@ -14,22 +16,143 @@
 
 /**\struct host_entry
  * The structure for host-entries we read from a file.
+ * The names are interned in `hosts_names`; entries with the same
+ * name share the same `name_ofs`.
  */
 struct host_entry {
-       char   host_name [MAX_HOST_LEN];  /**< name of `etc/hosts` entry */
+       DWORD  name_ofs;                  /**< offset of the name in `hosts_names` */
+       DWORD  hash;                      /**< hash of the name */
+       int    next;                      /**< next entry in the same bucket or -1 */
        int    addr_type;                 /**< type AF_INET or AF_INET6 */
        char   addr [IN6ADDRSZ];          /**< the actual address */
      };
 
-static smartlist_t *hosts_list;
+static struct host_entry *hosts_entries;     /**< all entries in file-order */
+static int                hosts_num;
+static int                hosts_max;
+static int               *hosts_buckets;     /**< head entry of each bucket or -1 */
+static DWORD              hosts_num_buckets; /**< a power of 2 */
+static char              *hosts_names;       /**< the interned name arena */
+static size_t             hosts_names_len;
+static size_t             hosts_names_max;
+static int                hosts_duplicates;
+
+/**
+ * The binary cache of the above when `g_cfg.bin_cache = 1`.
+ * If mapped, the above arrays points into this and `hosts_max == 0`.
+ */
+static struct bin_cache hosts_bin_cache;
+
+#define HOSTS_BIN_CACHE  0x48530001   /* "HS", version 1 */
+
+/**
+ * A FNV-1a hash of `name`. Case-sensitive, like the `strcmp()` lookups.
+ */
+static DWORD hosts_hash (const char *name)
+{
+  DWORD hash = 2166136261UL;
+
+  while (*name)
+  {
+    hash ^= *(const BYTE*)name++;
+    hash *= 16777619UL;
+  }
+  return (hash);
+}
+
+static __inline const char *hosts_name (const struct host_entry *he)
+{
+  return (hosts_names + he->name_ofs);
+}
 
 /**
- * Add an entry to the given `smartlist_t` that becomes `hosts_list`.
+ * Return the first entry for `name` with the given `hash` or -1.
  */
-static void add_entry (smartlist_t *sl, const char *name, const void *addr, int af_type)
+static int hosts_find (const char *name, DWORD hash)
+{
+  int i;
+
+  if (!hosts_buckets)
+     return (-1);
+
+  for (i = hosts_buckets [hash & (hosts_num_buckets-1)]; i != -1; i = hosts_entries[i].next)
+  {
+    const struct host_entry *he = hosts_entries + i;
+
+    if (he->hash == hash && !strcmp(hosts_name(he), name))
+       return (i);
+  }
+  return (-1);
+}
+
+/**
+ * Double the number of buckets and rehash all entries on their stored hash.
+ */
+static BOOL hosts_grow_buckets (void)
+{
+  DWORD num = hosts_num_buckets ? 2 * hosts_num_buckets : 1024;
+  int  *buckets = malloc (num * sizeof(*buckets));
+  int   i;
+
+  if (!buckets)
+     return (FALSE);
+
+  memset (buckets, 0xFF, num * sizeof(*buckets));   /* all -1 */
+
+  /* Walk backwards so each bucket keeps the file-order.
+   */
+  for (i = hosts_num - 1; i >= 0; i--)
+  {
+    struct host_entry *he = hosts_entries + i;
+    DWORD  b = he->hash & (num - 1);
+
+    he->next   = buckets[b];
+    buckets[b] = i;
+  }
+  free (hosts_buckets);
+  hosts_buckets     = buckets;
+  hosts_num_buckets = num;
+  return (TRUE);
+}
+
+/**
+ * Append `name` to the `hosts_names` arena and return its offset.
+ * Returns `(DWORD)-1` if out of memory.
+ */
+static DWORD hosts_intern (const char *name)
+{
+  size_t len = strlen (name) + 1;
+  DWORD  ofs;
+
+  if (hosts_names_len + len > hosts_names_max)
+  {
+    size_t max = hosts_names_max ? 2 * hosts_names_max : 64*1024;
+    char  *mem;
+
+    while (max < hosts_names_len + len)
+       max *= 2;
+    mem = realloc (hosts_names, max);
+    if (!mem)
+       return ((DWORD)-1);
+    hosts_names     = mem;
+    hosts_names_max = max;
+  }
+  ofs = (DWORD) hosts_names_len;
+  memcpy (hosts_names + ofs, name, len);
+  hosts_names_len += len;
+  return (ofs);
+}
+
+/**
+ * Add an entry to the hashed `hosts_entries`.
+ * An entry with the same name, family and address is a duplicate.
+ */
+static void add_entry (const char *name, const void *addr, int af_type)
 {
   struct host_entry *he;
-  int    asize;
+  DWORD  hash = hosts_hash (name);
+  DWORD  name_ofs = (DWORD)-1;
+  int    i, asize;
 
   switch (af_type)
   {
@@ -41,46 +164,64 @@ static void add_entry (smartlist_t *sl, const char *name, const void *addr, int
          break;
     default:
          assert (0);
+         return;
   }
 
-  he = calloc (1, sizeof(*he));
-  if (he)
+  for (i = hosts_find(name, hash); i != -1; i = hosts_entries[i].next)
   {
-    he->addr_type = af_type;
-    _strlcpy (he->host_name, name, sizeof(he->host_name));
-    memcpy (&he->addr, addr, asize);
-    smartlist_add (sl, he);
+    he = hosts_entries + i;
+    if (he->hash != hash || strcmp(hosts_name(he), name))
+       continue;
+
+    name_ofs = he->name_ofs;
+    if (he->addr_type == af_type && !memcmp(&he->addr, addr, asize))
+    {
+      hosts_duplicates++;
+      return;
+    }
   }
-}
 
-/**
- * smartlist_sort() helper; compare on names.
- */
-static int hosts_compare_name (const void **_a, const void **_b)
-{
-  const struct host_entry *a = *_a;
-  const struct host_entry *b = *_b;
+  if (name_ofs == (DWORD)-1)
+  {
+    name_ofs = hosts_intern (name);
+    if (name_ofs == (DWORD)-1)
+       return;
+  }
 
-  if (a->addr_type == b->addr_type)
-     return strcmp (a->host_name, b->host_name);
+  if (hosts_num == hosts_max)
+  {
+    int   max = hosts_max ? 2 * hosts_max : 1024;
+    void *mem = realloc (hosts_entries, max * sizeof(*hosts_entries));
 
-  /* This will cause AF_INET6 addresses to come last.
-   */
-  return (a->addr_type - b->addr_type);
-}
+    if (!mem)
+       return;
+    hosts_entries = mem;
+    hosts_max     = max;
+  }
 
-/**
- * smartlist_bsearch() helper; compare on names.
- */
-static int hosts_bsearch_name (const void *key, const void **member)
-{
-  const struct host_entry *he = *member;
-  const char              *name = key;
-  int   rc = strcmp (name, he->host_name);
+  if ((DWORD)hosts_num >= hosts_num_buckets && !hosts_grow_buckets())
+     return;
+
+  he = hosts_entries + hosts_num;
+  memset (he, '\0', sizeof(*he));
+  he->name_ofs  = name_ofs;
+  he->hash      = hash;
+  he->addr_type = af_type;
+  memcpy (&he->addr, addr, asize);
 
-  TRACE (3, "key: %-30s he->host_name: %-30s he->addr_type: %d, rc: %d\n",
-         name, he->host_name, he->addr_type, rc);
-  return (rc);
+  /* Append to the end of the bucket to keep the file-order.
+   */
+  he->next = -1;
+  i = hosts_buckets [hash & (hosts_num_buckets-1)];
+  if (i == -1)
+     hosts_buckets [hash & (hosts_num_buckets-1)] = hosts_num;
+  else
+  {
+    while (hosts_entries[i].next != -1)
+       i = hosts_entries[i].next;
+    hosts_entries[i].next = hosts_num;
+  }
+  hosts_num++;
 }
 
 /**
@@ -92,7 +233,7 @@ static int hosts_bsearch_name (const void *key, const void **member)
  *       an IPv6-addresses to `wsock_trace_inet_pton4()` will call `WSASetLastError()`. <br>
  *       And vice-versa.
  */
-static void parse_hosts (smartlist_t *sl, const char *line)
+static void MS_CDECL parse_hosts (smartlist_t *sl, const char *line)
 {
   struct in_addr  in4;
   struct in6_addr in6;
@@ -102,150 +243,242 @@ static void parse_hosts (smartlist_t *sl, const char *line)
   char           *ip   = _strtok_r (p, " \t", &tok_buf);
   char           *name = _strtok_r (NULL, " \t", &tok_buf);
 
+  ARGSUSED (sl);
+
   if (!name || !ip)
   {
     TRACE (3, "Bogus, ip: '%s', name: '%s'\n", ip, name);
     return;
   }
 
-  if (_wsock_trace_inet_pton(AF_INET, ip, (u_char*)&in4) == 1)
+  /* An IPv6-address always has a ':'. No need to try both.
+   */
+  if (!strchr(ip, ':') && _wsock_trace_inet_pton(AF_INET, ip, (u_char*)&in4) == 1)
   {
     TRACE (3, "AF_INET:  '%s', name: '%s'\n", ip, name);
-    add_entry (sl, name, &in4, AF_INET);
+    add_entry (name, &in4, AF_INET);
   }
   else if (_wsock_trace_inet_pton(AF_INET6, ip, (u_char*)&in6) == 1)
   {
     TRACE (3, "AF_INET6: '%s', name: '%s'\n", ip, name);
-    add_entry (sl, name, &in6, AF_INET6);
+    add_entry (name, &in6, AF_INET6);
   }
   else
     TRACE (3, "Bogus, ip: '%s', name: '%s'\n", ip, name);
 }
 
 /**
- * Print the `hosts_list` if `g_cfg.trace_level >= 3`.
+ * Print the `hosts_entries` if `g_cfg.trace_level >= 3`.
  */
-static void hosts_file_dump (int max, int duplicates)
+static void hosts_file_dump (void)
 {
   int i;
 
-  trace_printf ("\n%d entries in \"%s\" sorted on name (%d duplicates):\n",
-                max, g_cfg.hosts_file, duplicates);
+  trace_printf ("\n%d entries in \"%s\" (%d duplicates, %lu buckets, %s bytes of names):\n",
+                hosts_num, g_cfg.hosts_file, hosts_duplicates,
+                DWORD_CAST(hosts_num_buckets), dword_str((DWORD)hosts_names_len));
 
-  for (i = 0; i < max; i++)
+  for (i = 0; i < hosts_num; i++)
   {
-    const struct host_entry *he = smartlist_get (hosts_list, i);
+    const struct host_entry *he = hosts_entries + i;
     char  buf [MAX_IP6_SZ+1];
 
     wsock_trace_inet_ntop (he->addr_type, he->addr, buf, sizeof(buf));
     trace_printf ("%3d: %-40s %-20s AF_INET%c\n",
-                  i+1, he->host_name, buf,
+                  i+1, hosts_name(he), buf,
                   (he->addr_type == AF_INET6) ? '6' : ' ');
   }
 }
 
 /**
- * Free the memory in `hosts_list` and free the list itself.
+ * Check the mapped entries and buckets of the binary cache before use.
+ * A `next` must be -1 or a later entry (as `add_entry()` made it), so a
+ * bucket-chain cannot loop. A `name_ofs` must be inside the `names` and
+ * the `names` must end in a 0.
  */
-void hosts_file_exit (void)
+static BOOL hosts_check_bin_cache (const struct host_entry *entries, DWORD num,
+                                   const int *buckets, DWORD num_buckets,
+                                   const char *names, DWORD names_len)
 {
-  if (hosts_list)
-     smartlist_wipe (hosts_list, free);
-  hosts_list = NULL;
+  DWORD i;
+
+  if (names_len == 0 || names[names_len-1] != '\0')
+     return (FALSE);
+
+  for (i = 0; i < num; i++)
+  {
+    const struct host_entry *he = entries + i;
+
+    if (he->name_ofs >= names_len ||
+        (he->next != -1 && (he->next <= (int)i || he->next >= (int)num)) ||
+        (he->addr_type != AF_INET && he->addr_type != AF_INET6))
+       return (FALSE);
+  }
+  for (i = 0; i < num_buckets; i++)
+      if (buckets[i] < -1 || buckets[i] >= (int)num)
+         return (FALSE);
+  return (TRUE);
 }
 
 /**
- * Build the `hosts_file` smartlist.
- *
- * \todo: support loading multiple `/etc/hosts` files.
+ * Map the hosts-file index from the binary cache.
+ * All the entries, buckets and names are used as-is once checked.
  */
-void hosts_file_init (void)
+static BOOL hosts_load_bin_cache (void)
 {
-  hosts_list = g_cfg.hosts_file ?
-                 smartlist_read_file (g_cfg.hosts_file, parse_hosts) : NULL;
-  if (hosts_list)
+  const struct host_entry *entries;
+  const int               *buckets;
+  const char              *names;
+  DWORD                    num, num_buckets, names_len;
+
+  if (!bin_cache_open(&hosts_bin_cache, HOSTS_BIN_CACHE, (const char**)&g_cfg.hosts_file, 1))
+     return (FALSE);
+
+  entries = bin_cache_get (&hosts_bin_cache, 0, sizeof(*entries), &num);
+  buckets = bin_cache_get (&hosts_bin_cache, 1, sizeof(*buckets), &num_buckets);
+  names   = bin_cache_get (&hosts_bin_cache, 2, 1, &names_len);
+
+  /* The number of buckets must be a power of 2.
+   */
+  if (!entries || !buckets || !names || num == 0 ||
+      num_buckets == 0 || (num_buckets & (num_buckets-1)))
   {
-    int dups, max;
+    bin_cache_close (&hosts_bin_cache);
+    return (FALSE);
+  }
+  if (!hosts_check_bin_cache(entries, num, buckets, num_buckets, names, names_len))
+  {
+    TRACE (1, "Binary hosts cache has a bad index; rejected.\n");
+    bin_cache_close (&hosts_bin_cache);
+    return (FALSE);
+  }
+  hosts_entries     = (struct host_entry*) entries;
+  hosts_num         = num;
+  hosts_buckets     = (int*) buckets;
+  hosts_num_buckets = num_buckets;
+  hosts_names       = (char*) names;
+  hosts_names_len   = names_len;
+  return (TRUE);
+}
 
-    smartlist_sort (hosts_list, hosts_compare_name);
-    dups = smartlist_make_uniq (hosts_list, hosts_compare_name, free);
+static void hosts_write_bin_cache (void)
+{
+  struct bin_cache_sect sect [3];
 
-    /* The new length after the duplicates were removed.
-     */
-    max = smartlist_len (hosts_list);
-    if (g_cfg.trace_level >= 3)
-       hosts_file_dump (max, dups);
+  sect[0].data  = hosts_entries;
+  sect[0].size  = hosts_num * sizeof(*hosts_entries);
+  sect[0].count = hosts_num;
+  sect[1].data  = hosts_buckets;
+  sect[1].size  = hosts_num_buckets * sizeof(*hosts_buckets);
+  sect[1].count = hosts_num_buckets;
+  sect[2].data  = hosts_names;
+  sect[2].size  = (DWORD) hosts_names_len;
+  sect[2].count = (DWORD) hosts_names_len;
+  bin_cache_write (HOSTS_BIN_CACHE, (const char**)&g_cfg.hosts_file, 1, sect, DIM(sect));
+}
+
+/**
+ * Free the memory of the hosts-file index.
+ */
+void hosts_file_exit (void)
+{
+  if (!hosts_bin_cache.view)
+  {
+    free (hosts_entries);
+    free (hosts_buckets);
+    free (hosts_names);
   }
+  bin_cache_close (&hosts_bin_cache);
+  hosts_entries     = NULL;
+  hosts_buckets     = NULL;
+  hosts_names       = NULL;
+  hosts_num         = hosts_max = hosts_duplicates = 0;
+  hosts_num_buckets = 0;
+  hosts_names_len   = hosts_names_max = 0;
 }
 
-/*
- * Check if one of the addresses for `name` is from the hosts-file.
+/**
+ * Build the hashed hosts-file index in one pass over the file.
+ * Or with `g_cfg.bin_cache = 1`, map it from the binary cache if up to date.
+ *
+ * \todo: support loading multiple `/etc/hosts` files.
  */
-int hosts_file_check_hostent (const char *name, const struct hostent *host)
+void hosts_file_init (void)
 {
-  const char              **addresses;
-  const struct host_entry  *he;
-  int                       i, asize, num = 0;
+  smartlist_t *sl;
 
-  addresses = (const char**) host->h_addr_list;
+  if (!g_cfg.hosts_file)
+     return;
 
-  if (!name || !hosts_list || !addresses)
-     return (0);
+  if (g_cfg.bin_cache && hosts_load_bin_cache())
+  {
+    TRACE (2, "Mapped %d entries for \"%s\".\n", hosts_num, g_cfg.hosts_file);
+    if (g_cfg.trace_level >= 3)
+       hosts_file_dump();
+    return;
+  }
 
-  /** Do a binary search in the `hosts_list`.
+  /* The parser adds to 'hosts_entries'; the returned list stays empty.
    */
-  he = smartlist_bsearch (hosts_list, name, hosts_bsearch_name);
+  sl = smartlist_read_file (g_cfg.hosts_file, parse_hosts);
+  if (!sl)
+     return;
+  smartlist_free (sl);
 
-  for (i = num = 0; he && addresses[i]; i++)
-  {
-    switch (he->addr_type)
-    {
-      case AF_INET:
-           asize = sizeof(struct in_addr);
-           break;
-      case AF_INET6:
-           asize = sizeof(struct in6_addr);
-           break;
-      default:
-           return (num);
-    }
-    if (he->addr_type == host->h_addrtype &&
-        !memcmp(addresses[i], &he->addr, asize))
-       num++;
-  }
-  return (num);
+  TRACE (2, "Hashed %d entries from \"%s\" (%d duplicates).\n",
+         hosts_num, g_cfg.hosts_file, hosts_duplicates);
+
+  if (g_cfg.bin_cache && hosts_num > 0)
+     hosts_write_bin_cache();
+
+  if (g_cfg.trace_level >= 3)
+     hosts_file_dump();
 }
 
 /**
- * As above, but for an `struct addrinfo *`.
+ * Check which of the `num` addresses for `name` are from the hosts-file.
+ * The index is probed only once for `name`.
+ *
+ * \param[in]  name      the host-name to look for.
+ * \param[in]  num       the number of addresses in `families[]` and `addresses[]`.
+ * \param[in]  families  the address-family of each address.
+ * \param[in]  addresses the `struct in_addr*` or `struct in6_addr*` for each address.
+ * \param[out] found     set to TRUE for an address matching the hosts-file.
+ * \retval     the number of matching addresses.
  */
-int hosts_file_check_addrinfo (const char *name, const struct addrinfo *ai)
+int hosts_file_check_list (const char *name, int num, const int *families,
+                           const void **addresses, BOOL *found)
 {
-  struct hostent he;
-  const struct sockaddr_in  *sa4;
-  const struct sockaddr_in6 *sa6;
-  char *addr_list [2];
+  DWORD hash;
+  int   i, j, first, matches = 0;
 
-  if (!ai || !ai->ai_addr || !name)
+  if (!name || !hosts_num || num <= 0)
      return (0);
 
-  addr_list[1]   = NULL;
-  he.h_aliases   = NULL;
-  he.h_addr_list = &addr_list[0];
-  he.h_addrtype  = ai->ai_family;
+  hash  = hosts_hash (name);
+  first = hosts_find (name, hash);
+  if (first == -1)
+     return (0);
 
-  if (ai->ai_family == AF_INET)
+  for (i = 0; i < num; i++)
   {
-    sa4 = (const struct sockaddr_in*) ai->ai_addr;
-    addr_list[0] = (char*) &sa4->sin_addr;
-    return hosts_file_check_hostent (name, &he);
-  }
+    found[i] = FALSE;
+    if (!addresses[i])
+       continue;
 
-  if (ai->ai_family == AF_INET6)
-  {
-    sa6 = (const struct sockaddr_in6*) ai->ai_addr;
-    addr_list[0] = (char*) &sa6->sin6_addr;
-    return hosts_file_check_hostent (name, &he);
+    /* All the entries for 'name' follow 'first' in the same bucket.
+     */
+    for (j = first; j != -1 && !found[i]; j = hosts_entries[j].next)
+    {
+      const struct host_entry *he = hosts_entries + j;
+      int   asize = (he->addr_type == AF_INET) ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+
+      if (he->hash == hash && he->addr_type == families[i] &&
+          !memcmp(addresses[i], &he->addr, asize) && !strcmp(hosts_name(he), name))
+         found[i] = TRUE;
+    }
+    if (found[i])
+       matches++;
   }
-  return (0);
+  return (matches);
 }
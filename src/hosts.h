@@ -6,7 +6,7 @@
 
 extern void hosts_file_init  (void);
 extern void hosts_file_exit  (void);
-extern int  hosts_file_check_hostent  (const char *name, const struct hostent *he);
-extern int  hosts_file_check_addrinfo (const char *name, const struct addrinfo *ai);
+extern int  hosts_file_check_list (const char *name, int num, const int *families,
+                                   const void **addresses, BOOL *found);
 
 #endif
@@ -37,6 +37,28 @@ static BOOL         using_winidn = FALSE;
 static UINT         cur_cp = CP_ACP;
 static smartlist_t *cp_list;
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+  #include <emmintrin.h>
+  #define HAVE_SSE2_IDNA 1
+#endif
+
+/*
+ * A small direct-mapped cache of recent 'IDNA_convert_to_ACE()' results.
+ * Only names needing a conversion are put here.
+ * Like the rest of this file, it relies on the caller holding 'crit_sect'.
+ */
+#define ACE_CACHE_SIZE  64     /* a power of 2 */
+
+struct ACE_cache {
+       DWORD  hash;             /* the FNV-1a hash of 'name'. 0 if unused */
+       char   name [MAX_HOST_LEN];
+       char   ace  [MAX_HOST_LEN];
+       size_t ace_len;
+     };
+
+static struct ACE_cache ace_cache [ACE_CACHE_SIZE];
+static DWORD            ace_cache_hits, ace_cache_misses;
+
 #if (USE_WINIDN)
   typedef int (WINAPI *func_IdnToAscii) (DWORD          flags,
                                          const wchar_t *unicode_chars,
@@ -246,6 +268,11 @@ BOOL IDNA_CheckCodePage (UINT cp)
 
 void IDNA_exit (void)
 {
+  TRACE (3, "IDNA ACE-cache: %lu hits, %lu misses.\n",
+         DWORD_CAST(ace_cache_hits), DWORD_CAST(ace_cache_misses));
+  memset (&ace_cache, '\0', sizeof(ace_cache));
+  ace_cache_hits = ace_cache_misses = 0;
+
 #if (USE_WINIDN)
   if (using_winidn)
      unload_dynamic_table (dyn_funcs, DIM(dyn_funcs));
@@ -282,6 +309,8 @@ BOOL IDNA_init (WORD cp, BOOL use_winidn)
     TRACE (0, "IDNA_init: %s\n", IDNA_strerror(_idna_errno));
     return (FALSE);
   }
+  if (cp != cur_cp)
+     memset (&ace_cache, '\0', sizeof(ace_cache));
   cur_cp = cp;
   TRACE (3, "IDNA_init: Using codepage %u\n", cp);
   return (TRUE);
@@ -295,6 +324,20 @@ BOOL IDNA_is_ASCII (const char *name)
 {
   const BYTE *ch = (const BYTE*) name;
 
+#if defined(HAVE_SSE2_IDNA)
+  /* Test 16 bytes at a time; the high-bit of each byte is 'movemask'.
+   */
+  size_t len = strlen (name);
+
+  for ( ; len >= 16; ch += 16, len -= 16)
+  {
+    __m128i v = _mm_loadu_si128 ((const __m128i*)ch);
+
+    if (_mm_movemask_epi8(v))
+       return (FALSE);
+  }
+#endif
+
   while (*ch)
   {
     if (*ch++ & 0x80)
@@ -303,6 +346,22 @@ BOOL IDNA_is_ASCII (const char *name)
   return (TRUE);
 }
 
+/*
+ * Return the cache-slot for 'name' and it's hash.
+ */
+static struct ACE_cache *ace_cache_slot (const char *name, DWORD *hash_p)
+{
+  const BYTE *p;
+  DWORD       hash = 2166136261U;   /* FNV-1a */
+
+  for (p = (const BYTE*)name; *p; p++)
+      hash = (hash ^ *p) * 16777619U;
+  if (hash == 0)
+     hash = 1;
+  *hash_p = hash;
+  return (ace_cache + (hash & (ACE_CACHE_SIZE-1)));
+}
+
 const char *IDNA_strerror (int err)
 {
   static char buf[200];
@@ -568,6 +627,9 @@ BOOL IDNA_convert_to_ACE (
   const  char *ace;
   char  *in_name = name;
   char **labels;
+  char   org_name [MAX_HOST_LEN];
+  struct ACE_cache *cache;
+  DWORD  hash;
   int    i;
   size_t len = 0;
   BOOL   rc = FALSE;
@@ -577,6 +639,35 @@ BOOL IDNA_convert_to_ACE (
      return win32_idn_to_ascii (name, size);
 #endif
 
+  /* Fast path for a plain US-ASCII name; nothing to convert.
+   * Except drop a trailing '.' as the label loop below does.
+   */
+  if (IDNA_is_ASCII(name) && !strstr(name,"xn--"))
+  {
+    len = strlen (name);
+    if (len >= *size)
+    {
+      TRACE (2, "input length exceeded\n");
+      return (FALSE);
+    }
+    if (len > 0 && name[len-1] == '.')
+       name [--len] = '\0';
+    *size = len;
+    return (TRUE);
+  }
+
+  cache = ace_cache_slot (name, &hash);
+  if (cache->hash == hash && !strcmp(cache->name,name) && cache->ace_len < *size)
+  {
+    ace_cache_hits++;
+    memcpy (name, cache->ace, cache->ace_len+1);
+    *size = cache->ace_len;
+    TRACE (2, "IDNA_convert_to_ACE() -> `%s', %u bytes (cached)\n", name, (unsigned)*size);
+    return (TRUE);
+  }
+  ace_cache_misses++;
+  _strlcpy (org_name, name, sizeof(org_name));
+
   labels = split_labels (name);
 
   for (i = 0; labels[i]; i++)
@@ -619,7 +710,7 @@ BOOL IDNA_convert_to_ACE (
       name += sprintf (name, "%s.", label);
     }
   }
-  if (in_name > name)   /* drop trailing '.' */
+  if (name > in_name)   /* drop trailing '.' */
      name--;
   len = name - in_name;
   *name = '\0';
@@ -627,6 +718,14 @@ BOOL IDNA_convert_to_ACE (
   TRACE (2, "IDNA_convert_to_ACE() -> `%s', %u bytes\n", in_name, (unsigned)len);
   rc = TRUE;
 
+  if (len < sizeof(cache->ace))
+  {
+    cache->hash    = hash;
+    cache->ace_len = len;
+    _strlcpy (cache->name, org_name, sizeof(cache->name));
+    memcpy (cache->ace, in_name, len+1);
+  }
+
 quit:
   return (rc);
 }
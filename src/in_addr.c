@@ -133,6 +133,64 @@ int _wsock_trace_inet_pton (int family, const char *addr, void *result)
   return (rc);
 }
 
+/**
+ * The decimal digit-pairs "00" ... "99" for the below `put_dec_u8()`.
+ */
+static const char dec_pairs [2*100+1] =
+  "00010203040506070809" "10111213141516171819" "20212223242526272829"
+  "30313233343536373839" "40414243444546474849" "50515253545556575859"
+  "60616263646566676869" "70717273747576777879" "80818283848586878889"
+  "90919293949596979899";
+
+/**
+ * Write the decimal value of a byte without leading zeroes.
+ * \retval the end of the written digits.
+ */
+static __inline char *put_dec_u8 (char *p, u_int val)
+{
+  if (val >= 100)
+  {
+    *p++ = (char) ('0' + val / 100);
+    val %= 100;
+    memcpy (p, dec_pairs + 2*val, 2);
+    return (p + 2);
+  }
+  if (val >= 10)
+  {
+    memcpy (p, dec_pairs + 2*val, 2);
+    return (p + 2);
+  }
+  *p++ = (char) ('0' + val);
+  return (p);
+}
+
+/**
+ * Write a 16-bit hex group with or without leading zeroes.
+ * \retval the end of the written digits.
+ */
+static __inline char *put_hex16 (char *p, u_int val, BOOL zeroes)
+{
+  if (zeroes || val >= 0x1000)
+     *p++ = hex_chars [(val >> 12) & 15];
+  if (zeroes || val >= 0x100)
+     *p++ = hex_chars [(val >> 8) & 15];
+  if (zeroes || val >= 0x10)
+     *p++ = hex_chars [(val >> 4) & 15];
+  *p++ = hex_chars [val & 15];
+  return (p);
+}
+
+static __inline char *put_ip4 (char *p, const u_char *src)
+{
+  p = put_dec_u8 (p, src[0]);
+  *p++ = '.';
+  p = put_dec_u8 (p, src[1]);
+  *p++ = '.';
+  p = put_dec_u8 (p, src[2]);
+  *p++ = '.';
+  return put_dec_u8 (p, src[3]);
+}
+
 /**
  * Format an IPv4 address, more or less like `inet_ntoa()`.
  *
@@ -145,78 +203,59 @@ int _wsock_trace_inet_pton (int family, const char *addr, void *result)
  */
 const char *wsock_trace_inet_ntop4 (const u_char *src, char *dst, size_t size)
 {
-  char tmp [sizeof("255.255.255.255")];
+  char   tmp [sizeof("255.255.255.255")];
+  size_t len = put_ip4 (tmp, src) - tmp;
 
-  if ((size_t)sprintf(tmp,"%u.%u.%u.%u",src[0],src[1],src[2],src[3]) > size)
+  if (len >= size)
   {
     if (call_WSASetLastError)
        WSASetLastError (WSAEINVAL);
     return (NULL);
   }
-  return strcpy (dst, tmp);
+  memcpy (dst, tmp, len);
+  dst [len] = '\0';
+  return (dst);
 }
 
 /**
  * Convert IPv6 binary address into presentation (printable) format.
  *
+ * The words are assembled and the longest run of 0x0000 words (the first
+ * one if several are equally long) is found in a single pass.
+ *
  * \author
  *  Paul Vixie, 1996.
  */
 const char *wsock_trace_inet_ntop6 (const u_char *src, char *dst, size_t size)
 {
-  /*
-   * Note that int32_t and int16_t need only be "at least" large enough
-   * to contain a value of the specified size.  On some systems, like
-   * Crays, there is no such thing as an integer variable with 16 bits.
-   * Keep this in mind if you think this function should have been coded
-   * to use pointer overlays.  All the world's not a VAX.
-   */
-  char  tmp [MAX_IP6_SZ+1];
-  char *tp;
-  struct {
-    long base;
-    long len;
-  } best, cur;
-  u_long words [IN6ADDRSZ / INT16SZ];
-  int    i;
-
-  /* Preprocess:
-   *  Copy the input (bytewise) array into a wordwise array.
-   *  Find the longest run of 0x00's in src[] for :: shorthanding.
-   */
-  memset (words, 0, sizeof(words));
-  for (i = 0; i < IN6ADDRSZ; i++)
-      words[i/2] |= (src[i] << ((1 - (i % 2)) << 3));
-
-  best.base = -1;
-  best.len  = 0;
-  cur.base  = -1;
-  cur.len   = 0;
+  char   tmp [MAX_IP6_SZ+1];
+  char  *tp;
+  u_int  words [IN6ADDRSZ / INT16SZ];
+  int    i, best_base = -1, best_len = 0, cur_base = -1, cur_len = 0;
+  size_t len;
 
   for (i = 0; i < (IN6ADDRSZ / INT16SZ); i++)
   {
-    if (words[i] == 0)
+    words[i] = (src[2*i] << 8) | src[2*i+1];
+    if (words[i] != 0)
     {
-      if (cur.base == -1)
-      {
-        cur.base = i;
-        cur.len = 1;
-      }
-      else
-        cur.len++;
+      cur_base = -1;
+      continue;
+    }
+    if (cur_base == -1)
+    {
+      cur_base = i;
+      cur_len  = 0;
     }
-    else if (cur.base != -1)
+    if (++cur_len > best_len)
     {
-      if (best.base == -1 || cur.len > best.len)
-         best = cur;
-      cur.base = -1;
+      best_base = cur_base;
+      best_len  = cur_len;
     }
   }
-  if ((cur.base != -1) && (best.base == -1 || cur.len > best.len))
-     best = cur;
 
-  if (best.base != -1 && best.len < 2)
-     best.base = -1;
+  if (best_len < 2)
+     best_base = -1;
 
   /* Format the result.
    */
@@ -225,9 +264,9 @@ const char *wsock_trace_inet_ntop6 (const u_char *src, char *dst, size_t size)
   {
     /* Are we inside the best run of 0x00's?
      */
-    if (best.base != -1 && i >= best.base && i < (best.base + best.len))
+    if (best_base != -1 && i >= best_base && i < (best_base + best_len))
     {
-      if (i == best.base)
+      if (i == best_base)
          *tp++ = ':';
       continue;
     }
@@ -239,31 +278,30 @@ const char *wsock_trace_inet_ntop6 (const u_char *src, char *dst, size_t size)
 
     /* Is this address an encapsulated IPv4?
      */
-    if (i == 6 && best.base == 0 &&
-        (best.len == 6 || (best.len == 5 && words[5] == 0xffff)))
+    if (i == 6 && best_base == 0 &&
+        (best_len == 6 || (best_len == 5 && words[5] == 0xffff)))
     {
-      if (!wsock_trace_inet_ntop4(src+12, tp, sizeof(tmp) - (tp - tmp)))
-         goto inval;
-      tp += strlen (tp);
+      tp = put_ip4 (tp, src+12);
       break;
     }
-    if (leading_zeroes)
-         tp += sprintf (tp, "%04lx", words[i]);
-    else tp += sprintf (tp, "%lx", words[i]);
+    tp = put_hex16 (tp, words[i], leading_zeroes);
   }
 
   /* Was it a trailing run of 0x00's?
    */
-  if (best.base != -1 && (best.base + best.len) == (IN6ADDRSZ / INT16SZ))
+  if (best_base != -1 && (best_base + best_len) == (IN6ADDRSZ / INT16SZ))
      *tp++ = ':';
-  *tp++ = '\0';
 
   /* Check for overflow, copy, and we're done.
    */
-  if ((size_t)(tp - tmp) <= size)
-     return strcpy (dst, tmp);
+  len = tp - tmp;
+  if (len < size)
+  {
+    memcpy (dst, tmp, len);
+    dst [len] = '\0';
+    return (dst);
+  }
 
-inval:
   if (call_WSASetLastError)
      WSASetLastError (WSAEINVAL);
   return (NULL);
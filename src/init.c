@@ -31,6 +31,14 @@
 #include "dnsbl.h"
 #include "in_addr.h"
 #include "init.h"
+#include "trace_bin.h"
+#include "trace_etw.h"
+#include "trace_gz.h"
+#include "sock_table.h"
+#include "stats.h"
+#include "dns_stats.h"
+#include "netem.h"
+#include "shm_stats.h"
 
 #define FREE(p)   (p ? (void) (free(p), p = NULL) : (void)0)
 
@@ -46,6 +54,11 @@ HANDLE      ws_sema;
 BOOL        ws_sema_inherited;
 const char *ws_sema_name = "Global\\wsock_trace-semaphore";
 
+/* TRUE while 'wsock_trace_init()' runs from 'DllMain (DLL_PROCESS_ATTACH)'.
+ * A new thread cannot run before it returns; so do not wait for one.
+ */
+BOOL ws_in_process_attach;
+
 /**
  * \typedef exclude
  *
@@ -60,8 +73,18 @@ typedef struct exclude {
       } exclude;
 
 /* Dynamic array of above exclude structure.
+ * The entries are allocated from 'exclude_arena'.
+ */
+static smartlist_t  *exclude_list  = NULL;
+static struct arena *exclude_arena = NULL;
+
+/* For 'EXCL_FUNCTION'; one bit for each 'dyn_funcs[]' slot in wsock_trace.c.
+ * Set if the function in that slot is excluded. 'exclude_slots[]' is the
+ * matching 'exclude_list' entry; used only for counting.
+ * Built once in '_exclude_list_add()'.
  */
-static smartlist_t *exclude_list = NULL;
+static DWORD           *exclude_bits  = NULL;
+static struct exclude **exclude_slots = NULL;
 
 /*
  * Wait on the global semaphore to get freed.
@@ -88,6 +111,12 @@ void ws_sema_release (void)
      ReleaseSemaphore (ws_sema, 1, NULL);
 }
 
+static DWORD ts_tls = TLS_OUT_OF_INDEXES;
+static BOOL  ts_use_rdtsc = FALSE;
+static DWORD ts_start_msec;      /* local time-of-day at 'g_cfg.ts_start_ticks' */
+
+static void init_tsc (void);
+
 /**
  * Get the `start-ticks` value for showing time-stamps.
  *
@@ -99,6 +128,7 @@ void ws_sema_release (void)
 static void init_timestamp (void)
 {
   LARGE_INTEGER rc;
+  SYSTEMTIME    now;
   uint64        frequency;
   double        MHz;
 
@@ -110,10 +140,190 @@ static void init_timestamp (void)
        TRACE (2, "QPC speed: %.3f GHz\n", MHz/1000.0);
   else TRACE (2, "QPC speed: %.0f MHz\n", MHz);
 
+  if (g_cfg.trace_tsc)
+     init_tsc();
+
+  GetLocalTime (&now);
   QueryPerformanceCounter (&rc);
   g_cfg.start_ticks = rc.QuadPart;
+  ts_start_msec = 1000 * (3600 * now.wHour + 60 * now.wMinute + now.wSecond) + now.wMilliseconds;
+
+  if (ts_use_rdtsc)
+     g_cfg.ts_start_ticks = get_ts_ticks();
+  else
+  {
+    g_cfg.ts_start_ticks     = g_cfg.start_ticks;
+    g_cfg.ts_clocks_per_usec = g_cfg.clocks_per_usec;
+  }
+}
+
+/*
+ * With 'trace_tsc = 1', the time-stamp of a traced call is taken at
+ * hook entry ('INIT_PTR()') and kept per thread until the trace-line
+ * (or binary record) is written. With an invariant TSC, the cheap RDTSC
+ * is used as the clock. Its rate is calibrated against QPC here.
+ * Otherwise the entry time-stamp is from QPC.
+ */
+static void init_tsc (void)
+{
+#if defined(HAVE_RDTSC)
+  LARGE_INTEGER freq, t0, t1;
+  uint64        tsc0, tsc1;
+#endif
+
+  if (ts_tls == TLS_OUT_OF_INDEXES)
+     ts_tls = TlsAlloc();
+
+  if (ts_tls == TLS_OUT_OF_INDEXES)
+  {
+    g_cfg.trace_tsc = FALSE;
+    return;
+  }
+
+#if defined(HAVE_RDTSC)
+  if (ts_use_rdtsc || !cpu_has_invariant_tsc())
+     return;
+
+  /* Spin for 10 msec. That gives the rate within 0.1%.
+   */
+  QueryPerformanceFrequency (&freq);
+  QueryPerformanceCounter (&t0);
+  tsc0 = get_rdtsc();
+  do
+    QueryPerformanceCounter (&t1);
+  while (t1.QuadPart - t0.QuadPart < freq.QuadPart / 100);
+  tsc1 = get_rdtsc();
+
+  g_cfg.ts_clocks_per_usec = (uint64) ((double)(tsc1 - tsc0) * (double)freq.QuadPart /
+                                       (double)(t1.QuadPart - t0.QuadPart) / 1E6);
+  ts_use_rdtsc = (g_cfg.ts_clocks_per_usec > 0);
+  TRACE (2, "TSC speed: %.3f GHz\n", (double)g_cfg.ts_clocks_per_usec / 1E3);
+#endif
+}
+
+static void exit_tsc (void)
+{
+  ts_thread_exit();
+  if (ts_tls != TLS_OUT_OF_INDEXES)
+     TlsFree (ts_tls);
+  ts_tls = TLS_OUT_OF_INDEXES;
+  ts_use_rdtsc = FALSE;
+}
+
+/*
+ * Return TRUE if the time-stamp clock is the TSC. Otherwise it's QPC.
+ */
+BOOL ts_is_rdtsc (void)
+{
+  return (ts_use_rdtsc);
+}
+
+/*
+ * Return the time-stamp clock now.
+ */
+uint64 get_ts_ticks (void)
+{
+  LARGE_INTEGER now;
+
+#if defined(HAVE_RDTSC)
+  if (ts_use_rdtsc)
+     return get_rdtsc();
+#endif
+  QueryPerformanceCounter (&now);
+  return (now.QuadPart);
+}
+
+/*
+ * Called from 'INIT_PTR()' with 'trace_tsc = 1'.
+ * Keep the time-stamp of the hook entry for this thread.
+ * Like 'latency_start()', the caller's error-code must be preserved.
+ */
+void ts_entry_set (void)
+{
+  uint64 *entry;
+  DWORD   err = GetLastError();
+
+  entry = TlsGetValue (ts_tls);
+  if (!entry)
+  {
+    entry = malloc (sizeof(*entry));
+    if (entry)
+       TlsSetValue (ts_tls, entry);
+  }
+  if (entry)
+     *entry = get_ts_ticks();
+  SetLastError (err);
+}
+
+/*
+ * Return (and clear) the hook entry time-stamp of this thread.
+ * Or the clock now if none was set.
+ */
+uint64 get_hook_ticks (void)
+{
+  uint64 *entry, ticks = 0;
+  DWORD   err;
+
+  if (g_cfg.trace_tsc)
+  {
+    err = GetLastError();
+    entry = TlsGetValue (ts_tls);
+    if (entry)
+    {
+      ticks  = *entry;
+      *entry = 0;
+    }
+    SetLastError (err);
+  }
+  return (ticks ? ticks : get_ts_ticks());
+}
+
+void ts_thread_exit (void)
+{
+  uint64 *entry;
+
+  if (ts_tls == TLS_OUT_OF_INDEXES)
+     return;
+
+  entry = TlsGetValue (ts_tls);
+  if (entry)
+  {
+    TlsSetValue (ts_tls, NULL);
+    free (entry);
+  }
 }
 
+#if !defined(TEST_GEOIP) && !defined(TEST_BACKTRACE) && !defined(TEST_NLM)
+/*
+ * Open the 'g_cfg.trace_file' for the binary records of 'trace_binary = 1'.
+ * The text from 'TRACE()' etc. then goes to stdout.
+ * With 'trace_file_split = 2', each thread opens it's own file later.
+ */
+static BOOL open_trace_binary (void)
+{
+  FILE *file = NULL;
+
+  if (g_cfg.trace_file && stricmp(g_cfg.trace_file,"stderr") && stricmp(g_cfg.trace_file,"$ODS"))
+  {
+    if (g_cfg.trace_file_split >= 2)
+    {
+      init_timestamp();
+      return trace_bin_init (NULL);
+    }
+    file = fopen_excl (g_cfg.trace_file, "w+b");
+  }
+
+  if (!file)
+  {
+    WARNING ("'trace_binary = 1' needs a 'trace_file' to write to. "
+             "Tracing as text.\n");
+    return (FALSE);
+  }
+  init_timestamp();
+  return trace_bin_init (file);
+}
+#endif
+
 static void set_time_format (TS_TYPE *ret, const char *val)
 {
   *ret = TS_NONE;
@@ -127,61 +337,105 @@ static void set_time_format (TS_TYPE *ret, const char *val)
   TRACE (4, "val: %s -> TS_TYPE: %d\n", val, *ret);
 }
 
+static void set_flow_format (FLOW_FORMAT *ret, const char *val)
+{
+  *ret = FLOW_TEXT;
+
+  if (!stricmp(val,"csv"))
+     *ret = FLOW_CSV;
+  else if (!stricmp(val,"json"))
+     *ret = FLOW_JSON;
+  TRACE (4, "val: %s -> FLOW_FORMAT: %d\n", val, *ret);
+}
+
 /*
- * Return the preferred time-stamp string.
- */
-#if defined(__CYGWIN__)
-  #if (CYGWIN_VERSION_DLL_COMBINED >= 2009000)
-    #define HAVE_FMODL
-  #endif
-#elif !defined(__WATCOMC__)
-  #define HAVE_FMODL
-#endif
+ * Put 'val' with at least 'width' digits at 'p'. Return the end.
+ */
+static char *put_dec (char *p, unsigned val, int width)
+{
+  char tmp [12];
+  int  i = 0;
 
-const char *get_timestamp (void)
+  do
+  {
+    tmp [i++] = (char) ('0' + val % 10);
+    val /= 10;
+  }
+  while (val > 0);
+
+  while (i < width)
+     tmp [i++] = '0';
+  while (i > 0)
+     *p++ = tmp [--i];
+  return (p);
+}
+
+/*
+ * Put 'val' with thousand separators at 'p'. Return the end.
+ */
+static char *put_u64_sep (char *p, uint64 val)
 {
-  static LARGE_INTEGER last = {{ S64_SUFFIX(0) }};
-  static char          buf [40];
-  SYSTEMTIME           now;
-  LARGE_INTEGER        ticks;
-  int64                clocks;
-  double               msec;
+  if (val < 1000)
+     return put_dec (p, (unsigned)val, 1);
+
+  p = put_u64_sep (p, val / 1000);
+  *p++ = ',';
+  return put_dec (p, (unsigned)(val % 1000), 3);
+}
+
+/*
+ * Format the time-stamp clock value 'ticks'.
+ * Integer maths only; no 'fmodl()' or 'sprintf()'.
+ */
+static const char *format_timestamp (uint64 ticks)
+{
+  static uint64 last = U64_SUFFIX(0);
+  static char   buf [40];
+  SYSTEMTIME    now;
+  uint64        base, clocks, msec;
+  char         *p;
 
   switch (g_cfg.trace_time_format)
   {
     case TS_RELATIVE:
     case TS_DELTA:
-         if (last.QuadPart == 0ULL)
-            last.QuadPart = g_cfg.start_ticks;
-
-         QueryPerformanceCounter (&ticks);
-         if (g_cfg.trace_time_format == TS_RELATIVE)
-              clocks = (int64) (ticks.QuadPart - g_cfg.start_ticks);
-         else clocks = (int64) (ticks.QuadPart - last.QuadPart);
-
-         last = ticks;
-         msec = (double)clocks / ((double)g_cfg.clocks_per_usec * 1000.0);
-
-#if !defined(HAVE_FMODL)    /* If no 'fmodl()', fake it */
-         sprintf (buf, "%.3f msec: ", msec);
-#else
-         {
-           int         dec = (int) fmodl (msec, 1000.0);
-           const char *sec = qword_str ((unsigned __int64) (msec/1000.0));
-           char *p;
-
-           strcpy (buf, sec);
-           p = strchr (buf, '\0');
-           *p++ = '.';
-           _utoa10w (dec, 3, p);
-           strcat (buf, " sec: ");
-         }
-#endif
+         if (last == U64_SUFFIX(0))
+            last = g_cfg.ts_start_ticks;
+
+         base = (g_cfg.trace_time_format == TS_RELATIVE) ? g_cfg.ts_start_ticks : last;
+
+         /* An entry time-stamp can be older than the last one printed
+          * by another thread.
+          */
+         clocks = (ticks > base) ? ticks - base : 0;
+         if (ticks > last)
+            last = ticks;
+
+         msec = g_cfg.ts_clocks_per_usec ? clocks / (1000 * g_cfg.ts_clocks_per_usec) : 0;
+         p = put_u64_sep (buf, msec / 1000);
+         *p++ = '.';
+         p = put_dec (p, (unsigned)(msec % 1000), 3);
+         strcpy (p, " sec: ");
          return (buf);
 
     case TS_ABSOLUTE:
-         GetLocalTime (&now);
-         sprintf (buf, "%02u:%02u:%02u.%03u: ", now.wHour, now.wMinute, now.wSecond, now.wMilliseconds);
+         if (!g_cfg.trace_tsc)
+         {
+           GetLocalTime (&now);
+           sprintf (buf, "%02u:%02u:%02u.%03u: ", now.wHour, now.wMinute, now.wSecond, now.wMilliseconds);
+           return (buf);
+         }
+         clocks = (ticks > g_cfg.ts_start_ticks) ? ticks - g_cfg.ts_start_ticks : 0;
+         msec = g_cfg.ts_clocks_per_usec ? clocks / (1000 * g_cfg.ts_clocks_per_usec) : 0;
+         msec = (ts_start_msec + msec) % (24*3600*1000);
+         p = put_dec (buf, (unsigned)(msec / 3600000), 2);
+         *p++ = ':';
+         p = put_dec (p, (unsigned)(msec / 60000) % 60, 2);
+         *p++ = ':';
+         p = put_dec (p, (unsigned)(msec / 1000) % 60, 2);
+         *p++ = '.';
+         p = put_dec (p, (unsigned)(msec % 1000), 3);
+         strcpy (p, ": ");
          return (buf);
 
     case TS_NONE:
@@ -190,6 +444,27 @@ const char *get_timestamp (void)
   return ("");
 }
 
+/*
+ * Return the preferred time-stamp string for now.
+ */
+const char *get_timestamp (void)
+{
+  if (g_cfg.trace_time_format == TS_NONE)
+     return ("");
+  return format_timestamp (get_ts_ticks());
+}
+
+/*
+ * Return the time-stamp string for the hook being traced.
+ * With 'trace_tsc = 1', that is the time at hook entry.
+ */
+const char *get_hook_timestamp (void)
+{
+  if (g_cfg.trace_time_format == TS_NONE)
+     return ("");
+  return format_timestamp (get_hook_ticks());
+}
+
 /*
  * Return only a TS_DELTA time-stamp as "xx.yyy usec".
  * Works independently of whether 'init_timestamp()' was called or not.
@@ -370,11 +645,11 @@ BOOL exclude_list_get (const char *fmt, unsigned exclude_which)
   if (exclude_which == EXCL_FUNCTION && g_cfg.trace_caller <= 0)
      return (TRUE);
 
-  max = exclude_list ? smartlist_len (exclude_list) : 0;
+  max = exclude_list ? smartlist_len_fast (exclude_list) : 0;
 
   for (i = 0; i < max; i++)
   {
-    struct exclude *ex = smartlist_get (exclude_list, i);
+    struct exclude *ex = smartlist_get_fast (exclude_list, i);
 
     len = strlen (ex->name);
     if ((ex->which & exclude_which) && !strnicmp(fmt, ex->name, len))
@@ -386,19 +661,103 @@ BOOL exclude_list_get (const char *fmt, unsigned exclude_which)
   return (FALSE);
 }
 
+/**
+ * Same as `exclude_list_get (name, EXCL_FUNCTION)`, but for a function
+ * with the `dyn_funcs[]` slot `slot`. Thus only a bit-test is needed.
+ * If `slot < 0`, it's not a function in `dyn_funcs[]` and the `exclude_list`
+ * is searched for `name`.
+ */
+BOOL exclude_func_get (int slot, const char *name)
+{
+  if (g_cfg.trace_caller <= 0)
+     return (TRUE);
+
+  if (slot < 0)
+     return exclude_list_get (name, EXCL_FUNCTION);
+
+  if (!exclude_bits || !(exclude_bits[slot/32] & (1UL << (slot % 32))))
+     return (FALSE);
+
+  exclude_slots[slot]->num_excludes++;
+  return (TRUE);
+}
+
+/**
+ * Same as `exclude_func_get()` for a `slot >= 0`, but without counting
+ * the exclude. Thus safe to call without `crit_sect`.
+ */
+BOOL exclude_func_peek (int slot)
+{
+  if (g_cfg.trace_caller <= 0)
+     return (TRUE);
+
+  if (slot < 0 || !exclude_bits)
+     return (FALSE);
+  return ((exclude_bits[slot/32] & (1UL << (slot % 32))) != 0);
+}
+
 BOOL exclude_list_free (void)
 {
-  if (exclude_list)
+  smartlist_free (exclude_list);
+  arena_free (exclude_arena);
+  exclude_list  = NULL;
+  exclude_arena = NULL;
+  free (exclude_bits);
+  free (exclude_slots);
+  exclude_bits  = NULL;
+  exclude_slots = NULL;
+  return (TRUE);
+}
+
+#if !defined(TEST_GEOIP) && !defined(TEST_BACKTRACE) && !defined(TEST_NLM)
+/*
+ * Set the bit of all 'dyn_funcs[]' slots matching 'ex->name'.
+ * Matches the same way as 'exclude_list_get()' does; the case-insensitive
+ * start of the function-name.
+ */
+static void exclude_slots_add (struct exclude *ex)
+{
+  size_t len = strlen (ex->name);
+  int    i, max = ws2_func_num();
+
+  if (!exclude_bits)
   {
-    smartlist_wipe (exclude_list, free);
-    exclude_list = NULL;
+    exclude_bits  = calloc ((max+31) / 32, sizeof(*exclude_bits));
+    exclude_slots = calloc (max, sizeof(*exclude_slots));
+    if (!exclude_bits || !exclude_slots)
+       FATAL ("calloc() failed.\n");
+  }
+
+  for (i = 0; i < max; i++)
+  {
+    if (strnicmp(ws2_func_name(i), ex->name, len))
+       continue;
+
+    /* The first 'exclude' to match a function takes the count.
+     */
+    if (!(exclude_bits[i/32] & (1UL << (i % 32))))
+    {
+      exclude_bits[i/32] |= (1UL << (i % 32));
+      exclude_slots[i] = ex;
+    }
+  }
+
+  /* 'FD_ISSET()' is an alias for '__WSAFDIsSet()'.
+   */
+  if (!strnicmp("FD_ISSET", ex->name, len))
+  {
+    i = ws2_func_slot ("FD_ISSET");
+    if (i >= 0 && !(exclude_bits[i/32] & (1UL << (i % 32))))
+    {
+      exclude_bits[i/32] |= (1UL << (i % 32));
+      exclude_slots[i] = ex;
+    }
   }
-  return (TRUE);
 }
+#endif
 
 /*
- * \todo: Make 'FD_ISSET' an alias for '__WSAFDIsSet'.
- *        Print a warning when trying to exclude an unknown Winsock function.
+ * \todo: Print a warning when trying to exclude an unknown Winsock function.
  */
 static BOOL _exclude_list_add (const char *name, unsigned exclude_which)
 {
@@ -444,13 +803,23 @@ static BOOL _exclude_list_add (const char *name, unsigned exclude_which)
   if (which != EXCL_NONE)
   {
     if (!exclude_list)
-       exclude_list = smartlist_new();
+    {
+      exclude_list  = smartlist_new();
+      exclude_arena = arena_new ("exclude", 4096);
+    }
 
-    ex = malloc (sizeof(*ex)+len+1);
+    ex = arena_alloc (exclude_arena, sizeof(*ex)+len+1);
+    if (!ex)
+       FATAL ("arena_alloc() failed.\n");
     ex->num_excludes = 0;
     ex->which        = which;
     ex->name         = _strlcpy ((char*)(ex+1), p, len+1);
     smartlist_add (exclude_list, ex);
+
+#if !defined(TEST_GEOIP) && !defined(TEST_BACKTRACE) && !defined(TEST_NLM)
+    if (which == EXCL_FUNCTION)
+       exclude_slots_add (ex);
+#endif
   }
 
   TRACE (3, "_exclude_list_add() of '%s', which: %s.\n",
@@ -559,9 +928,60 @@ static void parse_core_settings (const char *key, const char *val, unsigned line
   else if (!stricmp(key,"trace_file"))
      g_cfg.trace_file = strdup (val);
 
+  else if (!stricmp(key,"trace_file_split"))
+     g_cfg.trace_file_split = atoi (val);
+
   else if (!stricmp(key,"trace_binmode"))
      g_cfg.trace_binmode = atoi (val);
 
+  else if (!stricmp(key,"trace_binary"))
+     g_cfg.trace_binary = atoi (val);
+
+  else if (!stricmp(key,"trace_etw"))
+     g_cfg.trace_etw = atoi (val);
+
+  else if (!stricmp(key,"trace_ring"))
+     g_cfg.trace_ring = atoi (val);
+
+  else if (!stricmp(key,"trace_ring_size"))
+     g_cfg.trace_ring_size = atoi (val);
+
+  else if (!stricmp(key,"trace_compress"))
+     g_cfg.trace_compress = atoi (val);
+
+  else if (!stricmp(key,"latency_stats"))
+     g_cfg.latency_stats = atoi (val);
+
+  else if (!stricmp(key,"dns_stats"))
+     g_cfg.dns_stats = atoi (val);
+
+  else if (!stricmp(key,"shm_stats"))
+     g_cfg.shm_stats = atoi (val);
+
+  else if (!stricmp(key,"stats_only"))
+     g_cfg.stats_only = atoi (val);
+
+  else if (!stricmp(key,"trace_sample"))
+     g_cfg.trace_sample = atoi (val);
+
+  else if (!stricmp(key,"trace_first"))
+     g_cfg.trace_first = atoi (val);
+
+  else if (!stricmp(key,"trace_rate"))
+     g_cfg.trace_rate = min (atoi(val), 1000000);
+
+  else if (!stricmp(key,"trace_summary"))
+     g_cfg.trace_summary = atoi (val);
+
+  else if (!stricmp(key,"flow_enable"))
+     g_cfg.flow.enable = atoi (val);
+
+  else if (!stricmp(key,"flow_file"))
+     g_cfg.flow.file = strdup (val);
+
+  else if (!stricmp(key,"flow_format"))
+     set_flow_format (&g_cfg.flow.format, val);
+
   else if (!stricmp(key,"trace_caller"))
      g_cfg.trace_caller = atoi (val);
 
@@ -580,12 +1000,18 @@ static void parse_core_settings (const char *key, const char *val, unsigned line
   else if (!stricmp(key,"trace_time"))
      set_time_format (&g_cfg.trace_time_format, val);
 
+  else if (!stricmp(key,"trace_tsc"))
+     g_cfg.trace_tsc = atoi (val);
+
   else if (!stricmp(key,"pcap_enable"))
      g_cfg.pcap.enable = atoi (val);
 
   else if (!stricmp(key,"pcap_dump"))
     g_cfg.pcap.dump_fname = strdup (val);
 
+  else if (!stricmp(key,"pcap_compress"))
+     g_cfg.pcap.compress = atoi (val);
+
   else if (!stricmp(key,"show_caller"))
      g_cfg.show_caller = atoi (val);
 
@@ -622,6 +1048,9 @@ static void parse_core_settings (const char *key, const char *val, unsigned line
   else if (!stricmp(key,"poll_delay"))
      g_cfg.poll_delay = (DWORD) _atoi64 (val);
 
+  else if (!stricmp(key,"poll_stats"))
+     g_cfg.poll_stats = atoi (val);
+
   else if (!stricmp(key,"use_toolhlp32"))
      g_cfg.use_toolhlp32 = atoi (val);
 
@@ -652,6 +1081,9 @@ static void parse_core_settings (const char *key, const char *val, unsigned line
   else if (!stricmp(key,"dump_select"))
      g_cfg.dump_select = atoi (val);
 
+  else if (!stricmp(key,"dump_wsapoll"))
+     g_cfg.dump_wsapoll = atoi (val);
+
   else if (!stricmp(key,"dump_nameinfo"))
      g_cfg.dump_nameinfo = atoi (val);
 
@@ -706,6 +1138,15 @@ static void parse_core_settings (const char *key, const char *val, unsigned line
   else if (!stricmp(key,"hosts_file"))
      g_cfg.hosts_file = strdup (val);
 
+  else if (!stricmp(key,"bin_cache"))
+     g_cfg.bin_cache = atoi (val);
+
+  else if (!stricmp(key,"update_async"))
+     g_cfg.update_async = atoi (val);
+
+  else if (!stricmp(key,"lazy_init"))
+     g_cfg.lazy_init = atoi (val);
+
   else if (!stricmp(key,"use_winhttp"))
      g_cfg.use_winhttp = atoi (val);
 
@@ -736,6 +1177,9 @@ static void parse_lua_settings (const char *key, const char *val, unsigned line)
   else if (!stricmp(key,"lua_exit"))
        g_cfg.lua.exit_script = strdup (val);
 
+  else if (!stricmp(key,"per_thread"))
+       g_cfg.lua.per_thread = atoi (val);
+
   else TRACE (0, "%s (%u):\n   Unknown keyword '%s' = '%s'\n",
               fname, line, key, val);
 }
@@ -769,6 +1213,9 @@ static void parse_geoip_settings (const char *key, const char *val, unsigned lin
   else if (!stricmp(key,"max_days"))
        g_cfg.geoip_max_days = atoi (val);
 
+  else if (!stricmp(key,"bulk_load"))
+       g_cfg.geoip_bulk_load = atoi (val);
+
   else if (!stricmp(key,"ip2location_bin_file"))
   {
     if (g_cfg.ip2location_bin_file)
@@ -878,6 +1325,9 @@ static void parse_firewall_settings (const char *key, const char *val, unsigned
   else if (!stricmp(key,"api_level"))
        g_cfg.firewall.api_level = atoi (val);
 
+  else if (!stricmp(key,"queue_max"))
+       g_cfg.firewall.queue_max = atoi (val);
+
   else if (!stricmp(key,"console_title"))
        g_cfg.firewall.console_title = atoi (val);
 
@@ -900,6 +1350,37 @@ static void parse_firewall_settings (const char *key, const char *val, unsigned
               fname, line, key, val);
 }
 
+/*
+ * Handler for '[netem]' section.
+ */
+static void parse_netem_settings (const char *key, const char *val, unsigned line)
+{
+  if (!stricmp(key,"enable"))
+       g_cfg.netem.enable = atoi (val);
+
+  else if (!stricmp(key,"rate"))
+       g_cfg.netem.rate = (DWORD) _atoi64 (val);
+
+  else if (!stricmp(key,"delay"))
+       g_cfg.netem.delay = (DWORD) _atoi64 (val);
+
+  else if (!stricmp(key,"jitter"))
+       g_cfg.netem.jitter = (DWORD) _atoi64 (val);
+
+  else if (!stricmp(key,"loss"))
+       g_cfg.netem.loss = atof (val);
+
+  else if (!stricmp(key,"rule"))
+  {
+#if !defined(TEST_GEOIP) && !defined(TEST_BACKTRACE) && !defined(TEST_NLM)
+    netem_rule_add (val, line);
+#endif
+  }
+
+  else TRACE (0, "%s (%u):\n   Unknown keyword '%s' = '%s'\n",
+              fname, line, key, val);
+}
+
 enum cfg_sections {
      CFG_NONE = 0,
      CFG_CORE,
@@ -907,7 +1388,8 @@ enum cfg_sections {
      CFG_GEOIP,
      CFG_IDNA,
      CFG_DNSBL,
-     CFG_FIREWALL
+     CFG_FIREWALL,
+     CFG_NETEM
    };
 
 /*
@@ -927,6 +1409,8 @@ static enum cfg_sections lookup_section (const char *section)
      return (CFG_DNSBL);
   if (section && !stricmp(section,"firewall"))
      return (CFG_FIREWALL);
+  if (section && !stricmp(section,"netem"))
+     return (CFG_NETEM);
   return (CFG_NONE);
 }
 
@@ -983,6 +1467,10 @@ static int parse_config_file (FILE *file)
            parse_firewall_settings (key, val, line);
            strcpy (last_section, "firewall");
            break;
+      case CFG_NETEM:
+           parse_netem_settings (key, val, line);
+           strcpy (last_section, "netem");
+           break;
 
       /* \todo: handle more 'key' / 'val' here by extending lookup_section().
        */
@@ -1008,6 +1496,10 @@ static void trace_report (void)
   int          i, max;
   size_t       len, max_len = 0, max_digits = 0;
 
+  /* Must be done before clearing 'g_cfg.trace_report'; the GeoIP
+   * statistics are only updated while it is set.
+   */
+  stats_merge();
   g_cfg.trace_report = FALSE;
 
   trace_puts ("\n  Exclusions:~5");
@@ -1045,6 +1537,11 @@ static void trace_report (void)
      trace_printf ("  get_caller() reentered %lu times.\n",
                    DWORD_CAST(g_cfg.reentries));
 
+  if (g_cfg.counts.caller_cache_hits + g_cfg.counts.caller_cache_misses > 0)
+     trace_printf ("  get_caller() cache: %s hits, %s misses.\n",
+                   qword_str(g_cfg.counts.caller_cache_hits),
+                   qword_str(g_cfg.counts.caller_cache_misses));
+
 // if (g_cfg.counts.dll_attach > 0 || g_cfg.counts.dll_detach > 0)
   {
     trace_printf ("  DLL attach %" U64_FMT " times.\n", g_cfg.counts.dll_attach);
@@ -1086,13 +1583,21 @@ static void trace_report (void)
   trace_printf ("    Recv bytes:   %15s  (MSG_PEEK)\n", qword_str(g_cfg.counts.recv_peeked));
   trace_printf ("    Send bytes:   %15s",               qword_str(g_cfg.counts.send_bytes));
   trace_printf ("  Send errors:  %15s\n",               qword_str(g_cfg.counts.send_errors));
+  overlap_report();
+  sock_table_report();
+  latency_report();
+  dns_stats_report();
+  poll_stats_report();
 
   if (g_cfg.use_sema)
      trace_printf ("    Semaphore wait: %13s\n",        qword_str(g_cfg.counts.sema_waits));
 
+  if (g_cfg.trace_ring)
+     trace_printf ("    Trace-ring waits: %11s\n",      dword_str(trace_ring_waits()));
+
   if (g_cfg.geoip_enable)
   {
-    DWORD num_ip4, num_ip6, num_ip2loc4, num_ip2loc6;
+    DWORD num_ip4, num_ip6, num_ip2loc4, num_ip2loc6, hits, misses;
 
     geoip_num_unique_countries (&num_ip4, &num_ip6, &num_ip2loc4, &num_ip2loc6);
     trace_printf ("  # of unique countries (IPv4): %3lu, by ip2loc: %3lu.\n",
@@ -1103,15 +1608,292 @@ static void trace_report (void)
 
     trace_printf ("  # of IP2Location shared-mem index errors: %lu\n",
                   DWORD_CAST(ip2loc_index_errors()));
+
+    geoip_cache_stats (&hits, &misses);
+    trace_printf ("  geo-IP/DNSBL cache: %s hits, %s misses.\n",
+                  dword_str(hits), dword_str(misses));
   }
 }
 #endif /* !TEST_GEOIP && !TEST_BACKTRACE && !TEST_NLM */
 
+#if !defined(TEST_GEOIP) && !defined(TEST_BACKTRACE) && !defined(TEST_NLM)
+/*
+ * With 'update_async = 1', the GeoIP and DROP files are checked and
+ * downloaded by this low-priority thread instead of in 'wsock_trace_init()'.
+ * The new lookup-tables are parsed here too and swapped in while holding
+ * the 'crit_sect'. Hence no traced call waits for the network.
+ *
+ * This calls 'INET_util_download_file()' directly since 'download_threaded()'
+ * would just block this thread with a 3 sec timeout.
+ */
+static HANDLE update_thread;
+
+static DWORD WINAPI update_async_thread (void *arg)
+{
+  ARGSUSED (arg);
+  SetThreadPriority (GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+
+  /* Never swap in tables while 'lazy_init' still builds the first ones.
+   */
+  lazy_init_wait (LAZY_GEOIP | LAZY_DNSBL);
+  geoip_update_async();
+  DNSBL_update_async();
+  TRACE (2, "update_async_thread() done.\n");
+  return (0);
+}
+
+static void update_async_start (void)
+{
+  DWORD t_id;
+
+  if (!g_cfg.update_async)
+     return;
+
+  update_thread = CreateThread (NULL, 0, update_async_thread, NULL, 0, &t_id);
+  if (!update_thread)
+  {
+    TRACE (1, "Failed to start the update-thread: %s.\n", win_strerror(GetLastError()));
+    g_cfg.update_async = FALSE;
+  }
+}
+
+/*
+ * Prevent any swap after this point. We cannot wait for the thread here
+ * since we're called from 'DllMain()'. If it's still downloading,
+ * it will be killed at process exit.
+ */
+static void update_async_stop (void)
+{
+  if (!update_thread)
+     return;
+
+  ENTER_CRIT();
+  g_cfg.update_async = FALSE;
+  LEAVE_CRIT();
+  CloseHandle (update_thread);
+  update_thread = NULL;
+}
+#endif  /* !TEST_GEOIP && !TEST_BACKTRACE && !TEST_NLM */
+
+/*
+ * With 'lazy_init = 1', 'geoip_init()', 'DNSBL_init()' and 'hosts_file_init()'
+ * each runs on a worker-thread. Since we're called from 'DllMain()', these
+ * cannot start before it returns. Hence nothing waits for them until the
+ * first call that needs a table does 'LAZY_INIT_WAIT()'.
+ *
+ * The 'done' event is waited for instead of the thread handle; a thread
+ * needs the loader-lock to exit.
+ */
+struct lazy_task {
+       unsigned       mask;
+       const char    *name;
+       void         (*func) (void);
+       HANDLE         done;      /* NULL if not started; closed in 'lazy_init_exit()' */
+       DWORD          msec;      /* the time 'func' took */
+       BOOL           stuck;     /* still running at 'lazy_init_exit()' */
+       volatile LONG  waited;    /* 'done' was seen by 'lazy_init_wait()' */
+       volatile LONG  given_up;  /* not done within 'LAZY_INIT_TIMEOUT' */
+     };
+
+/*
+ * The max msec 'lazy_init_wait()' waits for a task.
+ */
+#define LAZY_INIT_TIMEOUT  10000
+
+static void lazy_geoip (void)
+{
+  geoip_init (NULL, NULL);
+}
+
+static void lazy_DNSBL (void)
+{
+  DNSBL_init (FALSE);
+}
+
+static struct lazy_task lazy_tasks[] = {
+                      { LAZY_GEOIP, "geoip_init",      lazy_geoip,      NULL, 0, FALSE, 0, 0 },
+                      { LAZY_DNSBL, "DNSBL_init",      lazy_DNSBL,      NULL, 0, FALSE, 0, 0 },
+#if !defined(TEST_GEOIP) && !defined(TEST_BACKTRACE) && !defined(TEST_NLM)
+                      { LAZY_HOSTS, "hosts_file_init", hosts_file_init, NULL, 0, FALSE, 0, 0 }
+#endif
+                    };
+
+volatile LONG lazy_init_pending = 0;
+
+static struct lazy_task *lazy_task_get (unsigned mask)
+{
+  int i;
+
+  for (i = 0; i < DIM(lazy_tasks); i++)
+      if (lazy_tasks[i].mask == mask)
+         return (lazy_tasks + i);
+  return (NULL);
+}
+
+static DWORD WINAPI lazy_init_thread (void *arg)
+{
+  struct lazy_task *t = (struct lazy_task*) arg;
+  DWORD  start = GetTickCount();
+
+  (*t->func)();
+  t->msec = GetTickCount() - start;
+  SetEvent (t->done);
+  return (0);
+}
+
+/*
+ * Run the init-function for 'mask' on a worker-thread if 'g_cfg.lazy_init' is set.
+ * Otherwise (or if that fails) run it now.
+ */
+static void lazy_init_run (unsigned mask)
+{
+  struct lazy_task *t = lazy_task_get (mask);
+  HANDLE th = NULL;
+  DWORD  t_id;
+
+#if !defined(TEST_GEOIP) && !defined(TEST_BACKTRACE) && !defined(TEST_NLM)
+  /* 'DNSBL_test()' needs the DNSBL tables in 'wsock_trace_init()'.
+   */
+  if (g_cfg.lazy_init && !(mask == LAZY_DNSBL && g_cfg.DNSBL.test))
+  {
+    t->done = CreateEvent (NULL, TRUE, FALSE, NULL);
+    if (t->done)
+       th = CreateThread (NULL, 0, lazy_init_thread, t, 0, &t_id);
+    if (th)
+    {
+      CloseHandle (th);
+      InterlockedIncrement (&lazy_init_pending);
+      return;
+    }
+    TRACE (1, "Failed to start a thread for %s(): %s.\n", t->name, win_strerror(GetLastError()));
+    if (t->done)
+       CloseHandle (t->done);
+    t->done = NULL;
+  }
+#endif
+  (*t->func)();
+}
+
+/*
+ * A task not done in time. The GeoIP or DNSBL tables are used without
+ * 'lazy_init_ready()' after a 'LAZY_INIT_WAIT()'; hence turn them off.
+ * The hosts-table is only used after a 'lazy_init_ready (LAZY_HOSTS)'.
+ */
+static void lazy_task_give_up (struct lazy_task *t, DWORD msec)
+{
+  if (InterlockedExchange(&t->given_up, 1) != 0)
+     return;
+
+  TRACE (1, "%s() not done within %lu msec; not used.\n", t->name, DWORD_CAST(msec));
+  if (t->mask == LAZY_GEOIP)
+     g_cfg.geoip_enable = FALSE;
+  else if (t->mask == LAZY_DNSBL)
+     g_cfg.DNSBL.enable = FALSE;
+}
+
+/*
+ * Wait for the worker-threads in 'tasks' to finish.
+ * Called at the first real use of these tables (before 'ENTER_CRIT()').
+ *
+ * A caller could hold the loader-lock (a hook called from another 'DllMain()')
+ * and a new thread cannot start before that is released. Hence the wait is
+ * bounded, and in our own 'DllMain()' it does not wait at all.
+ * The 'done' events are closed in 'lazy_init_exit()' only; other threads
+ * could be waiting on them here.
+ */
+void lazy_init_wait (unsigned tasks)
+{
+  int i;
+
+  for (i = 0; i < DIM(lazy_tasks); i++)
+  {
+    struct lazy_task *t = lazy_tasks + i;
+    DWORD  msec = ws_in_process_attach ? 0 : LAZY_INIT_TIMEOUT;
+
+    if (!(tasks & t->mask) || !t->done || t->waited || t->given_up)
+       continue;
+
+    if (WaitForSingleObject(t->done, msec) != WAIT_OBJECT_0)
+       lazy_task_give_up (t, msec);
+    else if (InterlockedExchange(&t->waited, 1) == 0)
+    {
+      InterlockedDecrement (&lazy_init_pending);
+      TRACE (2, "%s() took %lu msec on a worker-thread.\n", t->name, DWORD_CAST(t->msec));
+    }
+  }
+}
+
+/*
+ * Return TRUE if the tables in 'tasks' are ready to use. Never waits.
+ * For paths that already are inside 'ENTER_CRIT()'.
+ */
+BOOL lazy_init_ready (unsigned tasks)
+{
+  int i;
+
+  if (!lazy_init_pending)
+     return (TRUE);
+
+  for (i = 0; i < DIM(lazy_tasks); i++)
+  {
+    const struct lazy_task *t = lazy_tasks + i;
+    HANDLE done = t->done;
+
+    if ((tasks & t->mask) && done && !t->waited && WaitForSingleObject(done, 0) != WAIT_OBJECT_0)
+       return (FALSE);
+  }
+  return (TRUE);
+}
+
+/*
+ * Called first in 'wsock_trace_exit()'. Give the worker-threads some time
+ * to finish. A table that is still loading is not used or freed after this.
+ */
+static void lazy_init_exit (void)
+{
+  int i;
+
+  for (i = 0; i < DIM(lazy_tasks); i++)
+  {
+    struct lazy_task *t = lazy_tasks + i;
+    HANDLE done = t->done;
+
+    if (!done)
+       continue;
+
+    if (!t->waited && WaitForSingleObject(done, 3000) != WAIT_OBJECT_0)
+    {
+      TRACE (1, "%s() did not finish.\n", t->name);
+      t->stuck = TRUE;
+      if (t->mask == LAZY_GEOIP)
+         g_cfg.geoip_enable = FALSE;
+      else if (t->mask == LAZY_DNSBL)
+         g_cfg.DNSBL.enable = FALSE;
+    }
+    CloseHandle (done);
+    t->done = NULL;
+  }
+  lazy_init_pending = 0;
+}
+
+static BOOL lazy_init_stuck (unsigned mask)
+{
+  const struct lazy_task *t = lazy_task_get (mask);
+
+  return (t && t->stuck);
+}
+
 /*
  * Called from DllMain(): dwReason == DLL_PROCESS_DETACH
  */
 void wsock_trace_exit (void)
 {
+  lazy_init_exit();
+
+#if !defined(TEST_GEOIP) && !defined(TEST_BACKTRACE) && !defined(TEST_NLM)
+  update_async_stop();
+#endif
+
   set_color (NULL);
 
   if (fatal_error)
@@ -1124,13 +1906,28 @@ void wsock_trace_exit (void)
      g_cfg.trace_report = FALSE;
 #endif
 
+  /* The summary-lines of calls not traced belongs before the report.
+   */
+  sock_table_flush_suppressed();
+
   if (g_cfg.trace_report)
      trace_report();
 
   exclude_list_free();
   StackWalkExit();
   overlap_exit();
-  hosts_file_exit();
+  dump_select_exit();
+  poll_delta_exit();
+  sock_table_exit();
+  latency_exit();
+  dns_stats_exit();
+  netem_exit();
+  shm_stats_exit();
+  stats_exit();
+  if (!lazy_init_stuck(LAZY_HOSTS))
+     hosts_file_exit();
+  trace_bin_exit();
+  trace_etw_exit();
 
 #if 0
   if (g_cfg.trace_level >= 3)
@@ -1152,7 +1949,18 @@ void wsock_trace_exit (void)
 #endif
 #endif  /* !TEST_GEOIP && !TEST_BACKTRACE && !TEST_NLM */
 
+  trace_ring_exit();
+  write_pcap_exit();
   common_exit();
+  exit_tsc();
+
+#if !defined(TEST_GEOIP) && !defined(TEST_BACKTRACE) && !defined(TEST_NLM)
+  if (g_cfg.trace_gz)
+  {
+    trace_gz_close (g_cfg.trace_gz);
+    g_cfg.trace_gz = NULL;
+  }
+#endif
 
   if (g_cfg.trace_stream)
      fclose (g_cfg.trace_stream);
@@ -1163,6 +1971,7 @@ void wsock_trace_exit (void)
   FREE (g_cfg.trace_file);
   FREE (g_cfg.hosts_file);
   FREE (g_cfg.pcap.dump_fname);
+  FREE (g_cfg.flow.file);
   FREE (g_cfg.lua.init_script);
   FREE (g_cfg.lua.exit_script);
   FREE (g_cfg.geoip4_file);
@@ -1178,8 +1987,10 @@ void wsock_trace_exit (void)
   FREE (g_cfg.DNSBL.dropv6_url);
   FREE (g_cfg.DNSBL.edrop_url);
 
-  DNSBL_exit();
-  geoip_exit();
+  if (!lazy_init_stuck(LAZY_DNSBL))
+     DNSBL_exit();
+  if (!lazy_init_stuck(LAZY_GEOIP))
+     geoip_exit();
   IDNA_exit();
 
   if (ws_sema)
@@ -1224,6 +2035,9 @@ void wsock_trace_init (void)
     g_cfg.trace_level = 1;
 
   g_cfg.trace_max_len = 9999;      /* Infinite */
+  g_cfg.trace_summary = 10;        /* seconds */
+  g_cfg.dump_wsapoll  = 1;
+  g_cfg.firewall.queue_max = 10000;
   g_cfg.trace_stream  = stdout;
   g_cfg.trace_file_device = TRUE;
 
@@ -1253,6 +2067,21 @@ void wsock_trace_init (void)
   is_mingw  = image_opt_header_is_mingw (mod);
   is_cygwin = image_opt_header_is_cygwin (mod);
 
+  /* With 'trace_file_split', each process writes to it's own file with
+   * "-<pid>" put before the extension. E.g. "wstrace-1234.txt".
+   * No other process writes to it; hence no need for the semaphore.
+   */
+  if (g_cfg.trace_file_split > 0 && g_cfg.trace_file &&
+      stricmp(g_cfg.trace_file,"stderr") && stricmp(g_cfg.trace_file,"$ODS"))
+  {
+    char split_name [_MAX_PATH];
+
+    get_split_name (g_cfg.trace_file, GetCurrentProcessId(), split_name, sizeof(split_name));
+    free (g_cfg.trace_file);
+    g_cfg.trace_file = strdup (split_name);
+    g_cfg.use_sema   = FALSE;
+  }
+
   if (g_cfg.use_sema)
   {
     /* Check if we've already got an instance of ourself.
@@ -1278,7 +2107,31 @@ void wsock_trace_init (void)
     g_cfg.trace_level = g_cfg.trace_report = 0;
   }
 
-  if (g_cfg.trace_file && !stricmp(g_cfg.trace_file,"stderr"))
+#if !defined(TEST_GEOIP) && !defined(TEST_BACKTRACE) && !defined(TEST_NLM)
+  if (g_cfg.trace_binary && g_cfg.trace_level > 0)
+       g_cfg.trace_binary = open_trace_binary();
+  else g_cfg.trace_binary = FALSE;
+
+  /* An ETW sink takes precedence over a binary trace-file.
+   */
+  if (g_cfg.trace_etw && g_cfg.trace_level > 0 && trace_etw_init())
+  {
+    if (g_cfg.trace_binary)
+       trace_bin_exit();
+    g_cfg.trace_binary = TRUE;
+  }
+  else g_cfg.trace_etw = FALSE;
+#else
+  g_cfg.trace_binary = FALSE;
+  g_cfg.trace_etw    = FALSE;
+#endif
+
+  if (g_cfg.trace_binary)
+  {
+    g_cfg.trace_stream      = stdout;
+    g_cfg.trace_file_device = TRUE;
+  }
+  else if (g_cfg.trace_file && !stricmp(g_cfg.trace_file,"stderr"))
   {
     g_cfg.trace_stream      = stderr;
     g_cfg.trace_file_device = TRUE;
@@ -1292,7 +2145,7 @@ void wsock_trace_init (void)
   }
   else if (g_cfg.trace_file && g_cfg.trace_level > 0)
   {
-    g_cfg.trace_stream      = fopen_excl (g_cfg.trace_file, "at+");
+    g_cfg.trace_stream      = fopen_excl (g_cfg.trace_file, g_cfg.trace_compress > 0 ? "ab" : "at+");
     g_cfg.trace_file_okay   = (g_cfg.trace_stream != NULL);
     g_cfg.trace_file_device = FALSE;
 
@@ -1303,6 +2156,18 @@ void wsock_trace_init (void)
       g_cfg.trace_stream = stdout;
       g_cfg.trace_file = NULL;
     }
+#if !defined(TEST_GEOIP) && !defined(TEST_BACKTRACE) && !defined(TEST_NLM)
+    else if (g_cfg.trace_compress > 0)
+    {
+      /* Appending a gzip-member to an existing gzip-file is still a valid gzip-file.
+       * The file is opened in binary mode; add the '\r' as in text mode.
+       */
+      trace_binmode = 1;
+      g_cfg.trace_gz_write = trace_gz_write;
+      g_cfg.trace_gz = trace_gz_open (g_cfg.trace_stream, g_cfg.trace_compress, "trace_file");
+      TRACE (2, "Compressing the trace_file '%s' at level %d.\n", g_cfg.trace_file, g_cfg.trace_compress);
+    }
+#endif
   }
 
   if (g_cfg.trace_stream)
@@ -1317,9 +2182,18 @@ void wsock_trace_init (void)
     }
   }
 
+  if (g_cfg.trace_ring && g_cfg.trace_level > 0 && !trace_ring_init(g_cfg.trace_ring_size))
+     g_cfg.trace_ring = FALSE;
+
+  g_cfg.trace_sampling = (g_cfg.trace_sample > 1 || g_cfg.trace_first > 0 || g_cfg.trace_rate > 0);
+
   if (g_cfg.pcap.enable)
   {
     g_cfg.pcap.dump_stream = fopen_excl (g_cfg.pcap.dump_fname, "w+b");
+#if !defined(TEST_GEOIP) && !defined(TEST_BACKTRACE) && !defined(TEST_NLM)
+    if (g_cfg.pcap.dump_stream && g_cfg.pcap.compress > 0)
+       g_cfg.pcap.gz = trace_gz_open (g_cfg.pcap.dump_stream, g_cfg.pcap.compress, "pcap_dump");
+#endif
     write_pcap_header();
   }
 
@@ -1410,12 +2284,18 @@ void wsock_trace_init (void)
   if (g_cfg.trace_level == 0)
      g_cfg.dump_data = g_cfg.dump_select = 0;
 
-  if (g_cfg.trace_time_format != TS_NONE)
+  /* These needs 'g_cfg.clocks_per_usec' or 'get_ts_ticks()'.
+   */
+  if (g_cfg.trace_time_format != TS_NONE || g_cfg.flow.enable || g_cfg.dns_stats ||
+      g_cfg.netem.enable || g_cfg.latency_stats || g_cfg.shm_stats ||
+      g_cfg.poll_stats || g_cfg.trace_overlap)
      init_timestamp();
 
-  if (g_cfg.trace_level <= 0)
+  if (g_cfg.trace_level <= 0 || g_cfg.trace_binary)
   {
     g_cfg.dump_data     = FALSE;
+    g_cfg.dump_select   = FALSE;
+    g_cfg.dump_wsapoll  = FALSE;
     g_cfg.dump_hostent  = FALSE;
     g_cfg.dump_servent  = FALSE;
     g_cfg.dump_protoent = FALSE;
@@ -1432,20 +2312,36 @@ void wsock_trace_init (void)
             "                get_dll_build_date(): %s\n",
          curr_prog, curr_dir, prog_dir, get_builder(), get_dll_short_name(), get_dll_build_date());
 
-  geoip_init (NULL, NULL);
+  lazy_init_run (LAZY_GEOIP);
 
 #if defined(TEST_GEOIP) || defined(TEST_NLM)
   DNSBL_init (TRUE);
 
 #else
-  DNSBL_init (FALSE);
+  lazy_init_run (LAZY_DNSBL);
 
   if (g_cfg.trace_level >= 3)
      check_all_search_lists();
 
 #if !defined(TEST_BACKTRACE)
   load_ws2_funcs();
-  hosts_file_init();
+  lazy_init_run (LAZY_HOSTS);
+  update_async_start();
+  if (g_cfg.netem.enable)
+     netem_init();
+  sock_table_init();
+  if (g_cfg.shm_stats)
+     g_cfg.latency_stats = TRUE;   /* the shared memory has the histograms too */
+  if (g_cfg.latency_stats)
+     latency_init();
+  if (g_cfg.dns_stats)
+     dns_stats_init();
+  if (g_cfg.shm_stats)
+     shm_stats_init();
+  if (g_cfg.stats_only)
+     stats_init();
+  if (g_cfg.dump_wsapoll == 2)
+     poll_delta_init();
 #endif
 
 #if defined(USE_BFD)
@@ -1454,6 +2350,7 @@ void wsock_trace_init (void)
 
   StackWalkInit();
   overlap_init();
+  dump_select_init();
 
 #if defined(USE_LWIP)
   ws_lwip_init();
@@ -1645,8 +2542,13 @@ int get_column (void)
 #define DLT_RAW             12    /* raw IP */
 #define DLT_IPV4            228
 #define DLT_IPV6            229
+#define LINKTYPE_RAW        101   /* the 'DLT_RAW' value in a file; IPv4 or IPv6 */
 #define PROTO_TCP           6     /* on network order */
 #define PROTO_UDP           17    /* on network order */
+#define TH_PUSH             0x08
+#define TH_ACK              0x10
+#define PCAP_SNAP_LEN       (64*1024)
+#define PCAP_BUF_SIZE       (256*1024)
 
 #if defined(_MSC_VER) || defined(__CYGWIN__)
   #pragma pack(push,1)
@@ -1699,6 +2601,15 @@ struct ip_header {
        DWORD   ip_dst;         /* dest address */
      };
 
+struct ip6_header {
+       DWORD   ip6_flow;       /* version, class and flow-label */
+       WORD    ip6_plen;       /* payload length */
+       BYTE    ip6_nxt;        /* next header */
+       BYTE    ip6_hlim;       /* hop limit */
+       BYTE    ip6_src [16];   /* source address */
+       BYTE    ip6_dst [16];   /* dest address */
+     };
+
 /*
  * TCP header.
  * Per RFC 793, September, 1981.
@@ -1732,44 +2643,6 @@ struct udp_header {
   #pragma pack()
 #endif
 
-static const void *make_ip_hdr (size_t data_len)
-{
-  static struct ip_header ip;
-  static WORD   ip_id = 1;
-
-  data_len += sizeof(ip);
-  memset (&ip, 0, sizeof(ip));
-  ip.ip_ver  = 4;
-  ip.ip_hlen = sizeof(ip) / 4;
-  ip.ip_len  = swap16 ((WORD)data_len);
-  ip.ip_ttl  = 255;
-  ip.ip_id   = ip_id++;
-  ip.ip_p    = PROTO_TCP;
-  ip.ip_src  = 0x10203040;
-  ip.ip_dst  = 0x50607080;
-  return (&ip);
-}
-
-const void *make_udp_hdr (size_t data_len)
-{
-  static struct udp_header uh;
-
-  memset (&uh, 0xff, sizeof(uh));  /* \todo */
-  ARGSUSED (data_len);
-  return (&uh);
-}
-
-const void *make_tcp_hdr (size_t data_len)
-{
-  static struct tcp_header th;
-
-  memset (&th, 0xff, sizeof(th));  /* \todo */
-  th.th_flags = 0;
-  th.th_offx2 = 16 * (sizeof(th)/4);
-  ARGSUSED (data_len);
-  return (&th);
-}
-
 /*
  * Stolen and modified from APR (Apache Portable Runtime):
  * Number of micro-seconds between the beginning of the Windows epoch
@@ -1837,6 +2710,22 @@ static void _gettimeofday (struct pcap_timeval *tv)
   #define _timezone (*__get_timezone_ptr())
 #endif
 
+static BYTE  *pcap_buf;
+static size_t pcap_buf_len;
+static WORD   pcap_ip_id = 1;
+
+/*
+ * Write to the pcap-file or to the gzip-stream on it.
+ */
+static size_t pcap_write (const void *buf, size_t len)
+{
+#if !defined(TEST_GEOIP) && !defined(TEST_BACKTRACE) && !defined(TEST_NLM)
+  if (g_cfg.pcap.gz)
+     return trace_gz_write (g_cfg.pcap.gz, buf, len);
+#endif
+  return fwrite (buf, 1, len, g_cfg.pcap.dump_stream);
+}
+
 size_t write_pcap_header (void)
 {
   struct pcap_file_header pf_hdr;
@@ -1845,6 +2734,13 @@ size_t write_pcap_header (void)
   if (!g_cfg.pcap.dump_stream)
      return (-1);
 
+  /* All records are written as large blocks from 'pcap_buf'.
+   * No need for another buffer in the CRT.
+   */
+  pcap_buf = malloc (PCAP_BUF_SIZE);
+  pcap_buf_len = 0;
+  setvbuf (g_cfg.pcap.dump_stream, NULL, _IONBF, 0);
+
   memset (&pf_hdr, 0, sizeof(pf_hdr));
 
   pf_hdr.magic         = TCPDUMP_MAGIC;
@@ -1852,69 +2748,252 @@ size_t write_pcap_header (void)
   pf_hdr.version_minor = PCAP_VERSION_MINOR;
   pf_hdr.thiszone      = 60 * _timezone;
   pf_hdr.sigfigs       = 0;
-  pf_hdr.snap_len      = 64*1024;
-  pf_hdr.linktype      = DLT_IPV4;
+  pf_hdr.snap_len      = PCAP_SNAP_LEN;
+  pf_hdr.linktype      = LINKTYPE_RAW;
 
-  rc = fwrite (&pf_hdr, 1, sizeof(pf_hdr), g_cfg.pcap.dump_stream);
+  rc = pcap_write (&pf_hdr, sizeof(pf_hdr));
   return (rc == 0 ? -1 : rc);
 }
 
-size_t write_pcap_packet (SOCKET s, const void *pkt, size_t len, BOOL out)
+static void pcap_flush (void)
 {
-  struct pcap_pkt_header pc_hdr;
-  size_t rc, pcap_len;
+  if (pcap_buf_len > 0 && g_cfg.pcap.dump_stream)
+     pcap_write (pcap_buf, pcap_buf_len);
+  pcap_buf_len = 0;
+}
 
-  if (!g_cfg.pcap.dump_stream)
-     return (-1);
+/*
+ * Write out what's left and close the pcap-file.
+ */
+void write_pcap_exit (void)
+{
+  pcap_flush();
+#if !defined(TEST_GEOIP) && !defined(TEST_BACKTRACE) && !defined(TEST_NLM)
+  if (g_cfg.pcap.gz)
+     trace_gz_close (g_cfg.pcap.gz);
+  g_cfg.pcap.gz = NULL;
+#endif
+  if (g_cfg.pcap.dump_stream)
+     fclose (g_cfg.pcap.dump_stream);
+  g_cfg.pcap.dump_stream = NULL;
+  free (pcap_buf);
+  pcap_buf = NULL;
+}
 
-  pcap_len = len + sizeof(struct ip_header) + sizeof(struct tcp_header);
-  _gettimeofday (&pc_hdr.ts);
+#if !defined(TEST_GEOIP) && !defined(TEST_BACKTRACE) && !defined(TEST_NLM)
+static WORD ip_checksum (const void *ptr, size_t len)
+{
+  const WORD *w = (const WORD*) ptr;
+  DWORD       sum = 0;
+
+  for ( ; len > 1; len -= 2)
+      sum += *w++;
+  while (sum >> 16)
+      sum = (sum & 0xFFFF) + (sum >> 16);
+  return (WORD) ~sum;
+}
 
-  pc_hdr.len    = (DWORD) pcap_len;
-  pc_hdr.caplen = (DWORD) pcap_len;
+/*
+ * Return the family of 'sa' as it goes on the wire.
+ * An IPv4-mapped address on a dual-stack socket is IPv4.
+ */
+static int pcap_family (const struct sockaddr *sa)
+{
+  static const BYTE v4_mapped [12] = { 0,0,0,0,0,0,0,0,0,0,0xFF,0xFF };
+  const struct sockaddr_in6 *sa6 = (const struct sockaddr_in6*) sa;
 
-  fwrite (&pc_hdr, sizeof(pc_hdr), 1, g_cfg.pcap.dump_stream);
+  if (sa->sa_family == AF_INET6 && !memcmp(&sa6->sin6_addr, v4_mapped, sizeof(v4_mapped)))
+     return (AF_INET);
+  return (sa->sa_family);
+}
 
-#if 0
-  switch (lookup_sk_proto(s))
+/*
+ * Get the IPv4 address of 'sa' (plain or IPv4-mapped). 0 if none.
+ */
+static DWORD pcap_addr4 (const struct sockaddr *sa)
+{
+  const struct sockaddr_in  *sa4 = (const struct sockaddr_in*) sa;
+  const struct sockaddr_in6 *sa6 = (const struct sockaddr_in6*) sa;
+  DWORD  addr = 0;
+
+  if (sa->sa_family == AF_INET)
+     addr = sa4->sin_addr.s_addr;
+  else if (pcap_family(sa) == AF_INET)
+     memcpy (&addr, (const BYTE*)&sa6->sin6_addr + 12, sizeof(addr));
+  return (addr);
+}
+
+/*
+ * Build the IPv4 or IPv6 header and the TCP or UDP header in front of
+ * a payload of 'len' bytes. Return the length of the headers.
+ * The IP-version is that of the 'peer' of this packet; not of the socket.
+ * A 'src' or 'dst' of another family gets a 0 address.
+ * The TCP sequence-number advances by 'seq_len'; the untruncated length.
+ */
+static size_t pcap_make_headers (BYTE *p, SOCKET s, int type, int family,
+                                 const struct sockaddr *src,
+                                 const struct sockaddr *dst,
+                                 size_t len, size_t seq_len, BOOL out)
+{
+  const struct sockaddr_in  *src4 = (const struct sockaddr_in*) src;
+  const struct sockaddr_in  *dst4 = (const struct sockaddr_in*) dst;
+  const struct sockaddr_in6 *src6 = (const struct sockaddr_in6*) src;
+  const struct sockaddr_in6 *dst6 = (const struct sockaddr_in6*) dst;
+  BOOL   is_tcp = (type == SOCK_STREAM);
+  size_t ip_len, l4_len = is_tcp ? sizeof(struct tcp_header) : sizeof(struct udp_header);
+  WORD   sport, dport;
+
+  if (family == AF_INET6)
   {
-    case IPPROTO_TCP:
-         fwrite (make_ip_hdr(len + sizeof(struct tcp_header)), sizeof(struct ip_header), 1, g_cfg.pcap.dump_stream);
-         fwrite (make_tcp_hdr(len), sizeof(struct tcp_header), 1, g_cfg.pcap.dump_stream);
-         break;
-    case IPPROTO_UDP:
-         fwrite (make_ip_hdr(len + sizeof(struct udp_header)), sizeof(struct ip_header), 1, g_cfg.pcap.dump_stream);
-         fwrite (make_udp_hdr(len), sizeof(struct udp_header), 1, g_cfg.pcap.dump_stream);
-         break;
-    default:
-         return (0);
+    struct ip6_header *ip6 = (struct ip6_header*) p;
+
+    memset (ip6, '\0', sizeof(*ip6));
+    ip6->ip6_flow = swap32 (0x60000000);
+    ip6->ip6_plen = swap16 ((WORD)(l4_len + len));
+    ip6->ip6_nxt  = is_tcp ? PROTO_TCP : PROTO_UDP;
+    ip6->ip6_hlim = 128;
+    if (pcap_family(src) == AF_INET6)
+       memcpy (&ip6->ip6_src, &src6->sin6_addr, 16);
+    if (pcap_family(dst) == AF_INET6)
+       memcpy (&ip6->ip6_dst, &dst6->sin6_addr, 16);
+    ip_len = sizeof(*ip6);
+  }
+  else
+  {
+    struct ip_header *ip = (struct ip_header*) p;
+
+    memset (ip, '\0', sizeof(*ip));
+    ip->ip_ver  = 4;
+    ip->ip_hlen = sizeof(*ip) / 4;
+    ip->ip_len  = swap16 ((WORD)(sizeof(*ip) + l4_len + len));
+    ip->ip_id   = swap16 (pcap_ip_id++);
+    ip->ip_off  = swap16 (0x4000);   /* Don't Fragment */
+    ip->ip_ttl  = 128;
+    ip->ip_p    = is_tcp ? PROTO_TCP : PROTO_UDP;
+    ip->ip_src  = pcap_addr4 (src);
+    ip->ip_dst  = pcap_addr4 (dst);
+    ip->ip_sum  = ip_checksum (ip, sizeof(*ip));
+    ip_len = sizeof(*ip);
   }
 
-#else
-  fwrite (make_ip_hdr(len + sizeof(struct tcp_header)), sizeof(struct ip_header), 1, g_cfg.pcap.dump_stream);
-  fwrite (make_tcp_hdr(len), sizeof(struct tcp_header), 1, g_cfg.pcap.dump_stream);
+  /* 'sin_port' and 'sin6_port' are at the same offset.
+   */
+  sport = (src->sa_family == AF_INET || src->sa_family == AF_INET6) ? src4->sin_port : 0;
+  dport = (dst->sa_family == AF_INET || dst->sa_family == AF_INET6) ? dst4->sin_port : 0;
 
-  ARGSUSED (s);
-  ARGSUSED (out);
-#endif
+  if (is_tcp)
+  {
+    struct tcp_header *th = (struct tcp_header*) (p + ip_len);
+    DWORD  seq, ack;
+
+    sock_table_tcp_seq (s, (DWORD)seq_len, out, &seq, &ack);
+    memset (th, '\0', sizeof(*th));
+    th->th_sport = sport;
+    th->th_dport = dport;
+    th->th_seq   = swap32 (seq);
+    th->th_ack   = swap32 (ack);
+    th->th_offx2 = 16 * (sizeof(*th)/4);
+    th->th_flags = TH_PUSH | TH_ACK;
+    th->th_win   = swap16 (0xFFFF);
+  }
+  else
+  {
+    struct udp_header *uh = (struct udp_header*) (p + ip_len);
 
-  rc = fwrite (pkt, 1, len, g_cfg.pcap.dump_stream);
-  return (rc == 0 ? -1 : pcap_len);
+    uh->uh_sport = sport;
+    uh->uh_dport = dport;
+    uh->uh_ulen  = swap16 ((WORD)(sizeof(*uh) + len));
+    uh->uh_sum   = 0;
+  }
+  return (ip_len + l4_len);
 }
 
 /*
- * As above, but an array of packets.
- * \todo.
+ * Write a record for the 'len' bytes that were sent or received in the
+ * 'num_bufs' buffers 'bufs'. The buffers are gathered directly into the
+ * 'pcap_buf' behind the record-header. It's written out when full.
+ *
+ * The IP and TCP/UDP headers are made from the type and addresses of
+ * socket 's' in the socket-table. In 'sendto()' or 'recvfrom()', the 'peer'
+ * is the given address. The IP-version is that of this 'peer'; a dual-stack
+ * socket can have both. The TCP sequence-numbers simply counts the bytes in
+ * each direction. Checksums are only set in IPv4 headers.
+ *
+ * A payload above the snap-length is truncated. Then the record's 'caplen'
+ * is what was captured and 'len' the original length.
  */
-size_t write_pcap_packetv (SOCKET s, const WSABUF *bufs, DWORD num_bufs, BOOL out)
+size_t write_pcap_packetv (SOCKET s, const struct sockaddr *peer,
+                           const WSABUF *bufs, DWORD num_bufs, size_t len, BOOL out)
 {
-  ARGSUSED (s);
-  ARGSUSED (bufs);
-  ARGSUSED (num_bufs);
-  ARGSUSED (out);
-  return (0);
+  struct pcap_pkt_header *pc_hdr;
+  struct sock_info        si;
+  const struct sockaddr  *local;
+  size_t hdr_len, left, chunk, orig_len = len;
+  BYTE  *p;
+  DWORD  i;
+  int    family;
+
+  if (!g_cfg.pcap.dump_stream || !pcap_buf || len == 0)
+     return (0);
+
+  if (!sock_table_get(s, &si) || (si.type != SOCK_STREAM && si.type != SOCK_DGRAM))
+     return (0);
+
+  if (!peer || (peer->sa_family != AF_INET && peer->sa_family != AF_INET6))
+     peer = (const struct sockaddr*) &si.peer;
+  local = (const struct sockaddr*) &si.local;
+
+  family = pcap_family (peer);
+  if (family != AF_INET && family != AF_INET6)
+     family = pcap_family (local);
+
+  if (len > PCAP_SNAP_LEN - 100)
+     len = PCAP_SNAP_LEN - 100;     /* room for the headers; 'ip_len' is 16-bit */
+
+  if (pcap_buf_len + sizeof(*pc_hdr) + 100 + len > PCAP_BUF_SIZE)
+     pcap_flush();
+
+  p = pcap_buf + pcap_buf_len;
+  pc_hdr = (struct pcap_pkt_header*) p;
+  hdr_len = pcap_make_headers (p + sizeof(*pc_hdr), s, si.type, family,
+                               out ? local : peer, out ? peer : local, len, orig_len, out);
+
+  _gettimeofday (&pc_hdr->ts);
+  pc_hdr->len    = (DWORD) (hdr_len + orig_len);
+  pc_hdr->caplen = (DWORD) (hdr_len + len);
+
+  p += sizeof(*pc_hdr) + hdr_len;
+
+  for (i = 0, left = len; i < num_bufs && left > 0; i++)
+  {
+    chunk = min (bufs[i].len, left);
+    memcpy (p, bufs[i].buf, chunk);
+    p    += chunk;
+    left -= chunk;
+  }
+
+  /* If the buffers held less than 'len', that is all there was.
+   */
+  if (left > 0)
+  {
+    pc_hdr->caplen -= (DWORD) left;
+    pc_hdr->len     = pc_hdr->caplen;
+  }
+  pcap_buf_len = p - pcap_buf;
+  return (pc_hdr->caplen);
 }
 
+size_t write_pcap_packet (SOCKET s, const struct sockaddr *peer,
+                          const void *pkt, size_t len, BOOL out)
+{
+  WSABUF buf;
+
+  buf.buf = (char*) pkt;
+  buf.len = (ULONG) len;
+  return write_pcap_packetv (s, peer, &buf, 1, len, out);
+}
+#endif  /* !TEST_GEOIP && !TEST_BACKTRACE && !TEST_NLM */
+
 #if defined(_MSC_VER) || (__MSVCRT_VERSION__ >= 0x800)
 /*
  * Ripped from Gnulib:
@@ -21,6 +21,8 @@ struct statistics {
        uint64  dll_attach;
        uint64  dll_detach;
        uint64  sema_waits;
+       uint64  caller_cache_hits;
+       uint64  caller_cache_misses;
      };
 
 typedef enum TS_TYPE {  /* Time-Stamp enum type */
@@ -30,10 +32,35 @@ typedef enum TS_TYPE {  /* Time-Stamp enum type */
         TS_DELTA,
       } TS_TYPE;
 
+struct trace_gz;
+
 struct pcap_cfg {
+       BOOL             enable;
+       char            *dump_fname;
+       FILE            *dump_stream;
+       int              compress;    /* gzip level for 'dump_stream' (0 = none) */
+       struct trace_gz *gz;
+     };
+
+typedef enum FLOW_FORMAT {
+        FLOW_TEXT = 0,
+        FLOW_CSV,
+        FLOW_JSON
+      } FLOW_FORMAT;
+
+struct flow_cfg {
+       BOOL         enable;
+       char        *file;      /* 'flow_file'; to the 'trace_file' if not set */
+       FILE        *stream;
+       FLOW_FORMAT  format;
+     };
+
+struct netem_cfg {
        BOOL    enable;
-       char   *dump_fname;
-       FILE   *dump_stream;
+       DWORD   rate;      /* kbit/s; 0 is unlimited */
+       DWORD   delay;     /* msec */
+       DWORD   jitter;    /* msec */
+       double  loss;      /* percent */
      };
 
 struct lua_cfg {
@@ -48,6 +75,7 @@ struct lua_cfg {
         */
        char   *init_script;
        char   *exit_script;
+       BOOL    per_thread;    /* a 'lua_State' for each thread running a hook */
      };
 
 struct DNSBL_cfg {
@@ -75,6 +103,7 @@ struct firewall_cfg {
        BOOL    show_user;
        BOOL    console_title;
        int     api_level;
+       int     queue_max;
 
        struct {
          BOOL enable;
@@ -95,6 +124,23 @@ struct config_table {
        BOOL    trace_file_okay;
        BOOL    trace_file_device;
        BOOL    trace_use_ods;
+       BOOL    trace_binary;
+       BOOL    trace_etw;
+       BOOL    trace_ring;
+       DWORD   trace_ring_size;
+       int     trace_file_split; /* 1: a 'trace_file' per process, 2: per thread too */
+       int     trace_compress;   /* gzip level for 'trace_stream' (0 = none) */
+       struct trace_gz *trace_gz;
+       size_t (*trace_gz_write) (struct trace_gz *gz, const void *buf, size_t len);
+       BOOL    latency_stats;
+       BOOL    dns_stats;
+       BOOL    shm_stats;
+       BOOL    stats_only;
+       BOOL    trace_sampling;   /* any of the below is set */
+       DWORD   trace_sample;
+       DWORD   trace_first;
+       DWORD   trace_rate;
+       DWORD   trace_summary;
        int     trace_level;
        int     trace_overlap;
        int     trace_indent;
@@ -111,6 +157,7 @@ struct config_table {
        BOOL    start_new_line;
        BOOL    dump_data;
        BOOL    dump_select;
+       int     dump_wsapoll;
        BOOL    dump_nameinfo;
        BOOL    dump_hostent;
        BOOL    dump_servent;
@@ -129,6 +176,7 @@ struct config_table {
        DWORD   send_delay;
        DWORD   select_delay;
        DWORD   poll_delay;
+       BOOL    poll_stats;
        WORD    color_file;
        WORD    color_time;
        WORD    color_func;
@@ -137,6 +185,7 @@ struct config_table {
 
        BOOL    geoip_enable;
        BOOL    geoip_use_generated;
+       BOOL    geoip_bulk_load;
        int     geoip_max_days;
        char   *geoip4_file;
        char   *geoip6_file;
@@ -144,6 +193,9 @@ struct config_table {
        char   *geoip6_url;
        char   *ip2location_bin_file;
        char   *hosts_file;
+       BOOL    bin_cache;
+       BOOL    update_async;
+       BOOL    lazy_init;
        char   *geoip_proxy;
        BOOL    use_winhttp;
 
@@ -162,6 +214,8 @@ struct config_table {
 
        struct lua_cfg      lua;
        struct pcap_cfg     pcap;
+       struct flow_cfg     flow;
+       struct netem_cfg    netem;
        struct DNSBL_cfg    DNSBL;
        struct firewall_cfg firewall;
        struct statistics   counts;
@@ -170,6 +224,13 @@ struct config_table {
        TS_TYPE    trace_time_format;
        uint64     start_ticks;
        uint64     clocks_per_usec;
+
+       /* The clock of the trace time-stamps. RDTSC with 'trace_tsc = 1'
+        * (and an invariant TSC). Otherwise the same as the above QPC values.
+        */
+       BOOL       trace_tsc;
+       uint64     ts_start_ticks;
+       uint64     ts_clocks_per_usec;
      };
 
 extern struct config_table g_cfg;
@@ -179,6 +240,8 @@ extern HANDLE      ws_sema;
 extern BOOL        ws_sema_inherited;
 extern const char *ws_sema_name;
 
+extern BOOL        ws_in_process_attach;
+
 extern CONSOLE_SCREEN_BUFFER_INFO console_info;
 
 extern void wsock_trace_init (void);
@@ -194,6 +257,29 @@ extern int  get_column (void);
 
 extern void init_ptr (const void **ptr, const char *ptr_name);
 
+/*
+ * The tables loaded on worker-threads with 'lazy_init = 1'.
+ * Used as a bit-mask in 'lazy_init_wait()' and 'lazy_init_ready()'.
+ */
+#define LAZY_GEOIP   0x01
+#define LAZY_DNSBL   0x02
+#define LAZY_HOSTS   0x04
+#define LAZY_ALL     (LAZY_GEOIP | LAZY_DNSBL | LAZY_HOSTS)
+
+extern volatile LONG lazy_init_pending;
+
+extern void lazy_init_wait  (unsigned tasks);
+extern BOOL lazy_init_ready (unsigned tasks);
+
+/*
+ * Wait for the tables in 'tasks' before a call can use them.
+ * Must be done before 'ENTER_CRIT()' since the worker-threads use 'TRACE()'.
+ */
+#define LAZY_INIT_WAIT(tasks)  do {                            \
+                                 if (lazy_init_pending)         \
+                                    lazy_init_wait (tasks);     \
+                               } while (0)
+
 typedef enum exclude_type {
         EXCL_NONE     = 0x00,
         EXCL_FUNCTION = 0x01,
@@ -203,11 +289,19 @@ typedef enum exclude_type {
 
 extern BOOL exclude_list_add (const char *name, unsigned exclude_which);
 extern BOOL exclude_list_get (const char *fmt, unsigned exclude_which);
+extern BOOL exclude_func_get (int slot, const char *name);
+extern BOOL exclude_func_peek (int slot);
 extern BOOL exclude_list_free (void);
 
 extern const char *config_file_name (void);
 extern const char *get_timestamp (void);
 extern const char *get_timestamp2 (void);
+extern const char *get_hook_timestamp (void);
+extern uint64      get_hook_ticks (void);
+extern uint64      get_ts_ticks (void);
+extern BOOL        ts_is_rdtsc (void);
+extern void        ts_entry_set (void);
+extern void        ts_thread_exit (void);
 
 extern double FILETIME_to_sec        (const FILETIME *ft);
 extern int64  FILETIME_to_usec       (const FILETIME *ft);
@@ -215,8 +309,11 @@ extern uint64 FILETIME_to_unix_epoch (const FILETIME *ft);
 extern time_t FILETIME_to_time_t     (const FILETIME *ft);
 
 extern size_t write_pcap_header  (void);
-extern size_t write_pcap_packet  (SOCKET s, const void *pkt, size_t len, BOOL out);
-extern size_t write_pcap_packetv (SOCKET s, const WSABUF *bufs, DWORD num_bufs, BOOL out);
+extern void   write_pcap_exit    (void);
+extern size_t write_pcap_packet  (SOCKET s, const struct sockaddr *peer,
+                                  const void *pkt, size_t len, BOOL out);
+extern size_t write_pcap_packetv (SOCKET s, const struct sockaddr *peer,
+                                  const WSABUF *bufs, DWORD num_bufs, size_t len, BOOL out);
 
 extern CRITICAL_SECTION crit_sect;
 
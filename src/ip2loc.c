@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include <errno.h>
+#include <io.h>
 
 #include "common.h"
 #include "init.h"
@@ -42,6 +43,22 @@
   #define _byteswap_ulong(x)   swap32(x)
 #endif
 
+/**
+ * \def IP2LOC_PREFETCH
+ * Hint the CPU to fetch the next binary-search probe-rows into the cache.
+ * Prefetching an address outside the mapping does not fault.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+  #define IP2LOC_PREFETCH(p)  __builtin_prefetch ((const void*)(p))
+
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+  #include <xmmintrin.h>
+  #define IP2LOC_PREFETCH(p)  _mm_prefetch ((const char*)(p), _MM_HINT_T0)
+
+#else
+  #define IP2LOC_PREFETCH(p)  ((void)0)
+#endif
+
 /*
  * Previously ip2loc.c used the IP2Location-C-Library as a `git submodule`.
  * But now, I've simply pasted in the code from:
@@ -121,6 +138,10 @@
   #define IP2LOC_FLAGS  (FLG_COUNTRY_SHORT | FLG_REGION | FLG_CITY)
 #endif
 
+#if defined(__CYGWIN__) && !defined(_get_osfhandle)
+  #define _get_osfhandle(fd)  get_osfhandle (fd)
+#endif
+
 #define MAX_IPV4_RANGE      4294967295U /* ULONG_MAX */
 #define IPV4                0
 #define IPV6                1
@@ -131,11 +152,10 @@
  */
 typedef struct IP2Location {
         FILE       *file;         /**< The `fopen_excl()` file structure */
-        uint8_t    *sh_mem_ptr;
+        uint8_t    *sh_mem_ptr;   /**< The read-only view of the whole file */
         uint64      sh_mem_max;
         uint64      sh_mem_index_errors;
-        HANDLE      sh_mem_fd;
-        BOOL        sh_mem_already;
+        HANDLE      sh_mem_fd;    /**< The file-mapping handle */
         struct stat stat_buf;
         uint8_t     db_type;
         uint8_t     db_column;
@@ -183,7 +203,6 @@ static uint8_t REGION_POSITION[25]  = { 0, 0, 0, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3
 static uint8_t CITY_POSITION[25]    = { 0, 0, 0, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4 };
 
 static void        IP2Location_initialize (IP2Location *loc);
-static void        IP2Location_read_ipv6_addr (IP2Location *loc, uint32_t position, struct in6_addr *addr);
 static uint32_t    IP2Location_read32 (IP2Location *loc, uint32_t position);
 static uint8_t     IP2Location_read8 (IP2Location *loc, uint32_t position);
 static int32_t     IP2Location_DB_set_shared_memory (IP2Location *loc);
@@ -215,15 +234,12 @@ static IP2Location *open_file (const char *fname)
     return (NULL);
   }
 
-  IP2Location_initialize (loc);
+  /* No need to keep the file open. The file-mapping holds a reference to it.
+   */
+  fclose (loc->file);
+  loc->file = NULL;
 
-  if (!loc->sh_mem_already)
-  {
-    /* No need to keep the file open
-     */
-    fclose (loc->file);
-    loc->file = NULL;
-  }
+  IP2Location_initialize (loc);
 
   /* The IP2Loc database scheme is really strange.
    * This used to be true previously.
@@ -345,16 +361,15 @@ static void IP2Location_close (IP2Location *loc)
   if (loc)
   {
     if (loc->sh_mem_ptr)
-    {
-      UnmapViewOfFile (loc->sh_mem_ptr);
-      CloseHandle (loc->sh_mem_fd);
-    }
+       UnmapViewOfFile (loc->sh_mem_ptr);
+    if (loc->sh_mem_fd)
+       CloseHandle (loc->sh_mem_fd);
     if (loc->file)
        fclose (loc->file);
 
     loc->file       = NULL;
     loc->sh_mem_ptr = NULL;
-    loc->sh_mem_fd  = INVALID_HANDLE_VALUE;
+    loc->sh_mem_fd  = NULL;
     free (loc);
   }
 }
@@ -384,26 +399,43 @@ static void IP2Location_initialize (IP2Location *loc)
 }
 
 /**
- * Compare to IPv6 addresses
+ * Return a pointer to `len` bytes at the 1-based `position` in the mapped file.
+ * Returns NULL if the whole range is not inside the mapping.
+ * Used to do one bounds-check for a whole row in the binary-searches.
  */
-static int ipv6_compare (const struct in6_addr *addr1, const struct in6_addr *addr2)
+static __inline const uint8_t *IP2Location_row_ptr (IP2Location *loc, uint32_t position, uint32_t len)
 {
-  int i, ret = 0;
+  uint64 ofs = (uint64)position - 1;
 
-  for (i = 0 ; i < 16 ; i++)
+  if (position == 0 || ofs + len > (uint64)loc->stat_buf.st_size)
   {
-    if (addr1->u.Byte[i] > addr2->u.Byte[i])
-    {
-      ret = 1;
-      break;
-    }
-    if (addr1->u.Byte[i] < addr2->u.Byte[i])
-    {
-      ret = -1;
-      break;
-    }
+    loc->sh_mem_index_errors++;
+    return (NULL);
   }
-  return (ret);
+  return (loc->sh_mem_ptr + ofs);
+}
+
+/**
+ * An unaligned little-endian 32-bit load. The .BIN file is little-endian
+ * and so are all Windows targets.
+ */
+static __inline uint32_t IP2Location_get32 (const uint8_t *p)
+{
+  uint32_t val;
+
+  memcpy (&val, p, sizeof(val));
+  return (val);
+}
+
+/**
+ * An unaligned little-endian 64-bit load.
+ */
+static __inline uint64 IP2Location_get64 (const uint8_t *p)
+{
+  uint64 val;
+
+  memcpy (&val, p, sizeof(val));
+  return (val);
 }
 
 /**
@@ -421,6 +453,12 @@ static void IP2Location_read_str (IP2Location *loc, uint32_t position, char *ret
   }
   size = loc->sh_mem_ptr [position];
   size = min (size, (uint8_t)max_sz);
+  if ((uint64)loc->sh_mem_ptr + position + size >= loc->sh_mem_max)
+  {
+    loc->sh_mem_index_errors++;
+    *ret = '\0';
+    return;
+  }
   memcpy (ret, &loc->sh_mem_ptr[position+1], size);
 }
 
@@ -494,11 +532,24 @@ static BOOL IP2Location_get_ipv4_record (IP2Location *loc, uint32_t mode, ipv_t
 
   while (low <= high)
   {
-    uint32_t column = dbcolumn * 4;
+    uint32_t       column = dbcolumn * 4;
+    const uint8_t *row;
 
-    mid    = (uint32_t) ((low + high) >> 1);
-    ipfrom = IP2Location_read32 (loc, baseaddr + mid * column);
-    ipto   = IP2Location_read32 (loc, baseaddr + (mid + 1) * column);
+    mid = (uint32_t) ((low + high) >> 1);
+
+    /* One bounds-check for 'ipfrom' and 'ipto' in this and the next row.
+     */
+    row = IP2Location_row_ptr (loc, baseaddr + mid * column, column + 4);
+    if (!row)
+       return (FALSE);
+
+    /* Prefetch the 2 rows the next loop may probe.
+     */
+    IP2LOC_PREFETCH (loc->sh_mem_ptr + baseaddr - 1 + ((low + mid) >> 1) * column);
+    IP2LOC_PREFETCH (loc->sh_mem_ptr + baseaddr - 1 + ((mid + 1 + high) >> 1) * column);
+
+    ipfrom = IP2Location_get32 (row);
+    ipto   = IP2Location_get32 (row + column);
 
     num_4_loops++;
 
@@ -526,11 +577,21 @@ static BOOL IP2Location_get_ipv6_record (IP2Location *loc, uint32_t mode, ipv_t
   uint32_t low       = 0;
   uint32_t mid       = 0;
   uint32_t high      = loc->ipv6_db_count;
-  struct in6_addr ipfrom, ipto, ipno;
+  struct in6_addr ipno;
+  uint64   ipno_hi, ipno_lo;
 
   ipno = parsed_ipv.ipv6;
   num_6_loops = 0;
 
+  /* Swap the network-order address once into 2 host-order 64-bit halves.
+   * The rows in the .BIN file are stored as little-endian 128-bit numbers;
+   * these can then be compared as 2 plain 64-bit loads.
+   */
+  ipno_hi = ((uint64)_byteswap_ulong(IP2Location_get32(&ipno.u.Byte[0])) << 32) |
+             _byteswap_ulong(IP2Location_get32(&ipno.u.Byte[4]));
+  ipno_lo = ((uint64)_byteswap_ulong(IP2Location_get32(&ipno.u.Byte[8])) << 32) |
+             _byteswap_ulong(IP2Location_get32(&ipno.u.Byte[12]));
+
   if (!high)
       return (FALSE);
 
@@ -547,21 +608,36 @@ static BOOL IP2Location_get_ipv6_record (IP2Location *loc, uint32_t mode, ipv_t
 
   while (low <= high)
   {
-    uint32_t column = dbcolumn * 4 + 12;
+    uint32_t       column = dbcolumn * 4 + 12;
+    const uint8_t *row;
+    uint64         from_hi, from_lo, to_hi, to_lo;
+    BOOL           below_from;
 
     mid = (uint32_t) ((low + high) >> 1);
-    IP2Location_read_ipv6_addr (loc, baseaddr + mid * column, &ipfrom);
-    IP2Location_read_ipv6_addr (loc, baseaddr + (mid + 1) * column, &ipto);
+
+    row = IP2Location_row_ptr (loc, baseaddr + mid * column, column + 16);
+    if (!row)
+       return (FALSE);
+
+    IP2LOC_PREFETCH (loc->sh_mem_ptr + baseaddr - 1 + ((low + mid) >> 1) * column);
+    IP2LOC_PREFETCH (loc->sh_mem_ptr + baseaddr - 1 + ((mid + 1 + high) >> 1) * column);
+
+    from_lo = IP2Location_get64 (row);
+    from_hi = IP2Location_get64 (row + 8);
+    to_lo   = IP2Location_get64 (row + column);
+    to_hi   = IP2Location_get64 (row + column + 8);
 
     num_6_loops++;
 
-    if ((ipv6_compare(&ipno, &ipfrom) >= 0) && ipv6_compare(&ipno, &ipto) < 0)
+    below_from = (ipno_hi < from_hi || (ipno_hi == from_hi && ipno_lo < from_lo));
+
+    if (!below_from && (ipno_hi < to_hi || (ipno_hi == to_hi && ipno_lo < to_lo)))
     {
       IP2Location_read_record (loc, baseaddr + mid * column + 12, mode, out);
       return (TRUE);
     }
 
-    if (ipv6_compare(&ipno, &ipfrom) < 0)
+    if (below_from)
          high = mid - 1;
     else low = mid + 1;
   }
@@ -580,47 +656,16 @@ static const char *IP2Location_api_version_str (void)
 }
 
 /**
- * Load the DB file into shared/cache memory.
- */
-static int32_t IP2Location_DB_Load_to_mem (IP2Location *loc, HANDLE os_hnd)
-{
-  size_t read;
-
-  if (os_hnd != INVALID_HANDLE_VALUE)
-     return (0);
-
-  if (fseek(loc->file, SEEK_SET, 0) < 0)
-  {
-    TRACE (2, "fseek() failed: errno=%d\n", errno);
-    return (-1);
-  }
-
-  read = fread (loc->sh_mem_ptr, 1, loc->stat_buf.st_size, loc->file);
-  if (read != loc->stat_buf.st_size)
-  {
-    TRACE (2, "fread() failed, read=%d, loc->stat_buf.st_size=%u, errno=%d\n",
-           (int)read, (unsigned)loc->stat_buf.st_size, errno);
-    return (-1);
-  }
-  return (0);
-}
-
-/**
- * Set the DB access method as shared memory.
+ * Map the DB file read-only into memory.
+ *
+ * The file-mapping is backed by the .BIN file itself. Hence pages are
+ * loaded on demand and shared through the OS page-cache with all other
+ * processes mapping the same file. Nothing is copied at startup.
  */
 static int32_t IP2Location_DB_set_shared_memory (IP2Location *loc)
 {
-  FILE  *file = loc->file;
-  int    fd = fileno (file);
-#if 1
-  DWORD  os_prot = PAGE_READWRITE;
-  DWORD  os_map  = FILE_MAP_WRITE;
-  HANDLE os_hnd  = INVALID_HANDLE_VALUE;
-#else  /* \todo xxx */
-  DWORD  os_prot = PAGE_READONLY | SEC_LARGE_PAGES;
-  DWORD  os_map  = FILE_MAP_READ;
-  HANDLE os_hnd  = (HANDLE) _get_osfhandle (fileno(file));
-#endif
+  int    fd = fileno (loc->file);
+  HANDLE os_hnd = (HANDLE) _get_osfhandle (fd);
 
   if (fstat(fd, &loc->stat_buf) == -1)
   {
@@ -634,46 +679,35 @@ static int32_t IP2Location_DB_set_shared_memory (IP2Location *loc)
     return (-1);
   }
 
-  SetLastError (0);
-  loc->sh_mem_fd = CreateFileMapping (os_hnd, NULL, os_prot, 0,
-                                      loc->stat_buf.st_size+1, "IP2location_Shm");
+  if (os_hnd == INVALID_HANDLE_VALUE)
+  {
+    TRACE (2, "_get_osfhandle() failed: errno=%d\n", errno);
+    return (-1);
+  }
+
+  loc->sh_mem_fd = CreateFileMapping (os_hnd, NULL, PAGE_READONLY, 0, 0, NULL);
   if (!loc->sh_mem_fd)
   {
     TRACE (2, "CreateFileMapping() failed: %s\n", win_strerror(GetLastError()));
     return (-1);
   }
 
-  loc->sh_mem_already = (GetLastError() == ERROR_ALREADY_EXISTS);
-
-  loc->sh_mem_ptr = MapViewOfFile (loc->sh_mem_fd, os_map, 0, 0, 0);
-
+  loc->sh_mem_ptr = MapViewOfFile (loc->sh_mem_fd, FILE_MAP_READ, 0, 0, 0);
   if (!loc->sh_mem_ptr)
   {
     TRACE (2, "MapViewOfFile() failed: %s\n", win_strerror(GetLastError()));
+    CloseHandle (loc->sh_mem_fd);
+    loc->sh_mem_fd = NULL;
     return (-1);
   }
 
-  if (loc->sh_mem_already)
-     TRACE (2, "CreateFileMapping() already exist. Sharing 0x%p file-mapping with another process.\n",
-            loc->sh_mem_ptr);
-  else
-  {
-    if (IP2Location_DB_Load_to_mem(loc, os_hnd) == -1)
-       return (-1);
-  }
+  TRACE (3, "Mapped %s bytes read-only at 0x%p.\n",
+         dword_str(loc->stat_buf.st_size), loc->sh_mem_ptr);
 
   loc->sh_mem_max = (uint64)loc->sh_mem_ptr + loc->stat_buf.st_size;
   return (0);
 }
 
-static void IP2Location_read_ipv6_addr (IP2Location *loc, uint32_t position, struct in6_addr *addr)
-{
-  int i, j;
-
-  for (i = 0, j = 15; i < 16; i++, j--)
-      addr->u.Byte[i] = IP2Location_read8 (loc, position + j);
-}
-
 /**
  * Read a 32-bit value from shared-memory.
  */
@@ -681,7 +715,7 @@ static uint32_t IP2Location_read32 (IP2Location *loc, uint32_t position)
 {
   uint8_t byte1, byte2, byte3, byte4;
 
-  if ((uint64)loc->sh_mem_ptr + position >= loc->sh_mem_max)
+  if (position == 0 || (uint64)loc->sh_mem_ptr + position + 2 >= loc->sh_mem_max)
   {
     loc->sh_mem_index_errors++;
     return (0UL);
@@ -700,7 +734,7 @@ static uint8_t IP2Location_read8 (IP2Location *loc, uint32_t position)
 {
   uint8_t ret = 0;
 
-  if ((uint64)loc->sh_mem_ptr + position - 1 <= loc->sh_mem_max)
+  if (position > 0 && (uint64)loc->sh_mem_ptr + position - 1 < loc->sh_mem_max)
        ret = loc->sh_mem_ptr [position-1];
   else loc->sh_mem_index_errors++;
   return (ret);
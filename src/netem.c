@@ -0,0 +1,476 @@
+/**\file    netem.c
+ * \ingroup Main
+ *
+ * \brief
+ *   Network emulation for the '[netem]' section.
+ *
+ *   Each socket gets the `struct netem_params` of the first `rule` matching
+ *   it's peer (a CIDR block or a GeoIP country) or the '[netem]' defaults.
+ *   The state is kept per socket in it's `struct sock_info`; see `sock_table.c`.
+ *
+ *   Nothing sleeps while holding a lock and the real functions are not delayed
+ *   with a fixed sleep. Instead the hooks ask this module:
+ *
+ *   + Bandwidth: a token-bucket for each direction filled with `rate` bytes
+ *     per second. A receive or a non-blocking TCP send is clamped to the
+ *     tokens left. With no tokens, a non-blocking socket gets `WSAEWOULDBLOCK`
+ *     and `select()` / `WSAPoll()` does not report it ready. A blocking TCP
+ *     send sends it all and the debt is paid before the next one.
+ *
+ *   + Latency: data arriving on an idle socket is held for `delay` plus
+ *     a random `jitter` msec before it's delivered (or reported readable).
+ *     So a request / response round-trip gets the extra `delay`.
+ *
+ *   + Loss: a lost datagram (received or sent) is dropped. A lost TCP
+ *     segment stalls the data after it by a retransmission timeout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "init.h"
+#include "smartlist.h"
+#include "in_addr.h"
+#include "inet_util.h"
+#include "geoip.h"
+#include "netem.h"
+
+#define NETEM_MSS      1460    /* a receive waits for at least this many tokens */
+#define NETEM_MIN_RTO  200     /* msec; the least stall of a lost TCP segment */
+
+struct netem_rule {
+       int                  family;       /* AF_INET, AF_INET6 or 0 for a country-rule */
+       BYTE                 addr [16];
+       int                  prefix;
+       char                 country [3];
+       struct netem_params  params;
+     };
+
+static smartlist_t         *netem_rules;
+static struct netem_params  netem_default;
+static BOOL                 netem_shaped;   /* 'netem_default' does something */
+
+static BOOL netem_active (const struct netem_params *p)
+{
+  return (p->rate || p->delay || p->jitter || p->loss);
+}
+
+/*
+ * Parse the shaping values; "rate [kbit/s], delay, jitter [msec], loss [%]".
+ */
+static void netem_parse_params (const char *val, struct netem_params *p)
+{
+  unsigned long rate = 0, delay = 0, jitter = 0;
+  double        loss = 0.0;
+
+  sscanf (val, "%lu , %lu , %lu , %lf", &rate, &delay, &jitter, &loss);
+  p->rate   = (DWORD) (125 * rate);
+  p->delay  = (DWORD) delay;
+  p->jitter = (DWORD) jitter;
+  p->loss   = (DWORD) (100.0 * min(loss, 100.0));
+}
+
+/**
+ * Add a `rule = match, rate, delay, jitter, loss` from the '[netem]' section.
+ * The `match` is a CIDR block like "10.0.0.0/8" or "2001:db8::/32",
+ * or a 2-letter country-code like "CN".
+ */
+void netem_rule_add (const char *val, unsigned line)
+{
+  struct netem_rule *rule;
+  char   match [60], *slash;
+  const char *rest;
+
+  if (sscanf(val, "%59[^, \t]", match) != 1)
+     return;
+
+  rule = calloc (1, sizeof(*rule));
+  if (!rule)
+     return;
+
+  slash = strchr (match, '/');
+  if (slash)
+     *slash++ = '\0';
+
+  if (strchr(match, ':') && _wsock_trace_inet_pton(AF_INET6, match, rule->addr) == 1)
+  {
+    rule->family = AF_INET6;
+    rule->prefix = slash ? atoi (slash) : 128;
+  }
+  else if (strchr(match, '.') && _wsock_trace_inet_pton(AF_INET, match, rule->addr) == 1)
+  {
+    rule->family = AF_INET;
+    rule->prefix = slash ? atoi (slash) : 32;
+  }
+  else if (strlen(match) == 2 && !slash)
+  {
+    _strlcpy (rule->country, match, sizeof(rule->country));
+  }
+  else
+  {
+    WARNING ("[netem] line %u: Illegal rule '%s'.\n", line, val);
+    free (rule);
+    return;
+  }
+
+  rest = strchr (val, ',');
+  if (rest)
+     netem_parse_params (rest + 1, &rule->params);
+
+  if (!netem_rules)
+     netem_rules = smartlist_new();
+  smartlist_add (netem_rules, rule);
+}
+
+void netem_init (void)
+{
+  netem_default.rate   = 125 * g_cfg.netem.rate;
+  netem_default.delay  = g_cfg.netem.delay;
+  netem_default.jitter = g_cfg.netem.jitter;
+  netem_default.loss   = (DWORD) (100.0 * min(g_cfg.netem.loss, 100.0));
+  netem_shaped = netem_active (&netem_default);
+
+  TRACE (2, "netem: rate %lu bytes/s, delay %lu, jitter %lu msec, loss %lu.%02lu%%, %d rules.\n",
+         DWORD_CAST(netem_default.rate), DWORD_CAST(netem_default.delay),
+         DWORD_CAST(netem_default.jitter), DWORD_CAST(netem_default.loss / 100),
+         DWORD_CAST(netem_default.loss % 100), netem_rules ? smartlist_len(netem_rules) : 0);
+}
+
+void netem_exit (void)
+{
+  if (netem_rules)
+     smartlist_wipe (netem_rules, free);
+  smartlist_free (netem_rules);
+  netem_rules = NULL;
+}
+
+/**
+ * Return the shaping for a socket connected to `peer`.
+ * Or NULL if it's not shaped. A country-rule needs `geoip_enable = 1`.
+ * Called with the `crit_sect` held since the GeoIP lookup is not thread-safe.
+ */
+const struct netem_params *netem_lookup (const struct sockaddr *peer)
+{
+  const struct in_addr  *ia4 = NULL;
+  const struct in6_addr *ia6 = NULL;
+  const char            *country = NULL;
+  BOOL                   country_done = FALSE;
+  int                    i, max;
+
+  if (peer && peer->sa_family == AF_INET)
+     ia4 = &((const struct sockaddr_in*)peer)->sin_addr;
+  else if (peer && peer->sa_family == AF_INET6)
+     ia6 = &((const struct sockaddr_in6*)peer)->sin6_addr;
+
+  max = (netem_rules && (ia4 || ia6)) ? smartlist_len (netem_rules) : 0;
+
+  for (i = 0; i < max; i++)
+  {
+    const struct netem_rule *rule = smartlist_get (netem_rules, i);
+
+    if (rule->family == AF_INET && ia4)
+    {
+      if (INET_util_range4cmp(ia4, (const struct in_addr*)rule->addr, rule->prefix) == 0)
+         return netem_active (&rule->params) ? &rule->params : NULL;
+    }
+    else if (rule->family == AF_INET6 && ia6)
+    {
+      if (INET_util_range6cmp(ia6, (const struct in6_addr*)rule->addr, rule->prefix) == 0)
+         return netem_active (&rule->params) ? &rule->params : NULL;
+    }
+    else if (rule->family == 0)
+    {
+      if (!country_done)
+      {
+        if (g_cfg.geoip_enable && lazy_init_ready(LAZY_GEOIP))
+           country = ia4 ? geoip_get_country_by_ipv4 (ia4) : geoip_get_country_by_ipv6 (ia6);
+        country_done = TRUE;
+      }
+      if (country && !stricmp(country, rule->country))
+         return netem_active (&rule->params) ? &rule->params : NULL;
+    }
+  }
+  return (netem_shaped ? &netem_default : NULL);
+}
+
+static uint64 netem_ticks (DWORD msec)
+{
+  return ((uint64)msec * 1000 * g_cfg.ts_clocks_per_usec);
+}
+
+static DWORD netem_msec (uint64 ticks)
+{
+  return (DWORD) (ticks / (1000 * g_cfg.ts_clocks_per_usec)) + 1;
+}
+
+/*
+ * The time to get 'bytes' more tokens.
+ */
+static DWORD netem_wait (const struct netem_params *p, int64 bytes)
+{
+  return (DWORD) ((1000 * bytes) / p->rate) + 1;
+}
+
+/*
+ * A small xorshift generator for each socket. The CRT 'rand()' is not
+ * seeded here and it's state is per thread in MSVC; all threads would
+ * then get the same losses and jitter.
+ */
+static DWORD netem_rand (struct netem_sock *ns)
+{
+  DWORD x = ns->rand_state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  ns->rand_state = x;
+  return (x);
+}
+
+static BOOL netem_lost (struct netem_sock *ns)
+{
+  const struct netem_params *p = ns->params;
+
+  return (p->loss > 0 && netem_rand(ns) % 10000 < p->loss);
+}
+
+static BOOL netem_is_dgram (int type)
+{
+  return (type == SOCK_DGRAM || type == SOCK_RAW);
+}
+
+/*
+ * The tokens needed before a receive of 'len' bytes may start.
+ * A datagram cannot be split; it needs just one token and is received
+ * whole with the tokens going negative. A stream waits for a segment.
+ * 'netem_ready()' uses the same threshold with a 'len' of 'NETEM_MSS'.
+ */
+static int64 netem_recv_need (int type, int len)
+{
+  if (netem_is_dgram(type))
+     return (1);
+  return min (len, NETEM_MSS);
+}
+
+/*
+ * A socket is idle if nothing was delivered for 'delay + jitter' msec.
+ */
+static BOOL netem_idle (const struct netem_sock *ns, uint64 now)
+{
+  const struct netem_params *p = ns->params;
+
+  if (p->delay + p->jitter == 0 || ns->hold_until)
+     return (FALSE);
+  return (ns->last_recv == 0 || now - ns->last_recv > netem_ticks(p->delay + p->jitter));
+}
+
+static void netem_refill (struct netem_sock *ns, uint64 now)
+{
+  const struct netem_params *p = ns->params;
+  uint64 per_sec = 1000000 * g_cfg.ts_clocks_per_usec;
+  int64  add, burst;
+
+  if (!p->rate || now <= ns->refill)
+     return;
+
+  if (now - ns->refill >= per_sec)
+       add = p->rate;
+  else add = (int64) ((now - ns->refill) * p->rate / per_sec);
+  if (add == 0)
+     return;
+
+  /* Allow a burst of 100 msec; at least 2 segments.
+   */
+  burst = max (p->rate / 10, 2 * NETEM_MSS);
+  ns->refill     = now;
+  ns->tokens_in  = min (ns->tokens_in + add, burst);
+  ns->tokens_out = min (ns->tokens_out + add, burst);
+}
+
+/**
+ * Setup a new socket with the '[netem]' defaults.
+ */
+void netem_sock_init (struct netem_sock *ns, uint64 now)
+{
+  memset (ns, '\0', sizeof(*ns));
+  if (!netem_shaped || g_cfg.ts_clocks_per_usec == 0)
+     return;
+  ns->params     = &netem_default;
+  ns->refill     = now;
+  ns->rand_state = (DWORD)now ^ (DWORD)(now >> 32) ^ (DWORD)(ULONG_PTR)ns ^
+                   (GetCurrentProcessId() << 16) ^ GetCurrentThreadId();
+  if (ns->rand_state == 0)
+     ns->rand_state = 0x2545F491;
+  ns->tokens_in  = max (netem_default.rate / 10, 2 * NETEM_MSS);
+  ns->tokens_out = ns->tokens_in;
+}
+
+/**
+ * Return the number of bytes a receive of `len` bytes may get now.
+ * Or 0 and the msec to `*wait` before trying again.
+ * Or `NETEM_PROBE` if the socket is idle; the caller must check if there
+ * is data and call `netem_arrived()` to start the `delay`.
+ */
+int netem_recv (struct netem_sock *ns, int type, int len, uint64 now, DWORD *wait)
+{
+  const struct netem_params *p = ns->params;
+  int64  need;
+
+  if (!p)
+     return (len);
+
+  netem_refill (ns, now);
+
+  if (ns->hold_until)
+  {
+    if (now < ns->hold_until)
+    {
+      *wait = netem_msec (ns->hold_until - now);
+      return (0);
+    }
+    ns->hold_until = 0;
+    ns->last_recv  = now;
+  }
+  else if (netem_idle(ns, now))
+    return (NETEM_PROBE);
+
+  if (p->rate)
+  {
+    need = netem_recv_need (type, len);
+    if (ns->tokens_in < need)
+    {
+      *wait = netem_wait (p, need - ns->tokens_in);
+      return (0);
+    }
+    if (!netem_is_dgram(type) && len > ns->tokens_in)
+       len = (int) ns->tokens_in;
+  }
+  return (len);
+}
+
+/**
+ * Data has arrived on a socket. If it's idle, hold the data for
+ * `delay` and a random `jitter`.
+ */
+void netem_arrived (struct netem_sock *ns, uint64 now)
+{
+  const struct netem_params *p = ns->params;
+  DWORD  msec;
+
+  if (!p || !netem_idle(ns, now))
+     return;
+
+  msec = p->delay;
+  if (p->jitter)
+     msec += netem_rand (ns) % (p->jitter + 1);
+  if (msec > 0)
+       ns->hold_until = now + netem_ticks (msec);
+  else ns->last_recv  = now;
+}
+
+/**
+ * Account for `bytes` received. Returns TRUE if it was a lost
+ * datagram that must be dropped.
+ */
+BOOL netem_received (struct netem_sock *ns, int type, int bytes, uint64 now)
+{
+  const struct netem_params *p = ns->params;
+
+  if (!p || bytes <= 0)
+     return (FALSE);
+
+  ns->last_recv = now;
+  ns->tokens_in -= bytes;
+
+  if (!netem_lost(ns))
+     return (FALSE);
+
+  if (netem_is_dgram(type))
+     return (TRUE);
+
+  /* A lost TCP segment is retransmitted. The data after it is
+   * not delivered until then.
+   */
+  ns->hold_until = now + netem_ticks (max(2 * p->delay, NETEM_MIN_RTO));
+  return (FALSE);
+}
+
+/**
+ * Return the number of bytes a send of `len` bytes may send now.
+ * Or `NETEM_DROP` if the datagram is lost.
+ * Or 0 and the msec to `*wait` before trying again.
+ */
+int netem_send (struct netem_sock *ns, int type, int len, uint64 now, DWORD *wait)
+{
+  const struct netem_params *p = ns->params;
+  BOOL   dgram = netem_is_dgram (type);
+
+  if (!p)
+     return (len);
+
+  if (dgram && netem_lost(ns))
+     return (NETEM_DROP);
+
+  if (!p->rate)
+     return (len);
+
+  netem_refill (ns, now);
+
+  /* A datagram sent with the queue full is dropped.
+   */
+  if (dgram)
+     return (ns->tokens_out > 0 ? len : NETEM_DROP);
+
+  if (ns->tokens_out <= 0)
+  {
+    *wait = netem_wait (p, 1 - ns->tokens_out);
+    return (0);
+  }
+  if (ns->non_blocking && len > ns->tokens_out)
+     len = (int) ns->tokens_out;
+  return (len);
+}
+
+void netem_sent (struct netem_sock *ns, int bytes)
+{
+  if (ns->params && bytes > 0)
+     ns->tokens_out -= bytes;
+}
+
+/**
+ * Called from `select()` and `WSAPoll()` for a socket reported readable
+ * (`out == FALSE`) or writable. Return FALSE if it should not be reported
+ * ready yet and set the msec until it will be in `*wait`.
+ * A readable socket starts the `delay` if it was idle.
+ */
+BOOL netem_ready (struct netem_sock *ns, int type, BOOL out, uint64 now, DWORD *wait)
+{
+  const struct netem_params *p = ns->params;
+  int64  need;
+
+  if (!p)
+     return (TRUE);
+
+  netem_refill (ns, now);
+
+  if (out)
+  {
+    if (!p->rate || ns->tokens_out > 0)
+       return (TRUE);
+    *wait = netem_wait (p, 1 - ns->tokens_out);
+    return (FALSE);
+  }
+
+  netem_arrived (ns, now);
+  if (ns->hold_until && now < ns->hold_until)
+  {
+    *wait = netem_msec (ns->hold_until - now);
+    return (FALSE);
+  }
+  need = netem_recv_need (type, NETEM_MSS);
+  if (!p->rate || ns->tokens_in >= need)
+     return (TRUE);
+  *wait = netem_wait (p, need - ns->tokens_in);
+  return (FALSE);
+}
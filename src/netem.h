@@ -0,0 +1,52 @@
+/**\file    netem.h
+ * \ingroup Main
+ */
+#ifndef _NETEM_H
+#define _NETEM_H
+
+/*
+ * The shaping of a link. From the '[netem]' defaults or a 'rule'.
+ */
+struct netem_params {
+       DWORD  rate;       /* bytes/sec; 0 is unlimited */
+       DWORD  delay;      /* msec added before received data is delivered */
+       DWORD  jitter;     /* msec; a random 0 - 'jitter' is added to 'delay' */
+       DWORD  loss;       /* in 1/100 of a percent */
+     };
+
+/*
+ * The shaping state of a socket. Part of it's 'struct sock_info'.
+ */
+struct netem_sock {
+       const struct netem_params *params;        /* NULL if not shaped */
+       BOOL                       bound;         /* 'params' looked up for the peer */
+       BOOL                       non_blocking;
+       int64                      tokens_in;     /* bytes; negative after a blocking send */
+       int64                      tokens_out;
+       uint64                     refill;        /* 'get_ts_ticks()' at the last refill */
+       uint64                     hold_until;    /* received data is not delivered before */
+       uint64                     last_recv;
+       DWORD                      rand_state;    /* for the loss and jitter; see 'netem_rand()' */
+     };
+
+/*
+ * The return values of 'netem_recv()' and 'netem_send()' besides the byte-count.
+ */
+#define NETEM_PROBE  -1    /* idle; check if there is data to start the 'delay' */
+#define NETEM_DROP   -2    /* the datagram is lost */
+
+extern void  netem_init (void);
+extern void  netem_exit (void);
+extern void  netem_rule_add (const char *val, unsigned line);
+
+extern const struct netem_params *netem_lookup (const struct sockaddr *peer);
+
+extern void  netem_sock_init (struct netem_sock *ns, uint64 now);
+extern int   netem_recv      (struct netem_sock *ns, int type, int len, uint64 now, DWORD *wait);
+extern void  netem_arrived   (struct netem_sock *ns, uint64 now);
+extern BOOL  netem_received  (struct netem_sock *ns, int type, int bytes, uint64 now);
+extern int   netem_send      (struct netem_sock *ns, int type, int len, uint64 now, DWORD *wait);
+extern void  netem_sent      (struct netem_sock *ns, int bytes);
+extern BOOL  netem_ready     (struct netem_sock *ns, int type, BOOL out, uint64 now, DWORD *wait);
+
+#endif /* _NETEM_H */
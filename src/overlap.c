@@ -9,6 +9,11 @@
  *     `WSASend()`, `WSASendMsg()`, `WSASendTo()`, and `WSAIoctl()`.
  *
  * Allthough Wsock-Trace does support only a few of these.
+ *
+ * An operation is completed by `WSAGetOverlappedResult()`, by an event in
+ * `WSAWaitForMultipleEvents()` or by a packet dequeued from an I/O completion
+ * port in `GetQueuedCompletionStatus()` / `GetQueuedCompletionStatusEx()`.
+ * The time from issue to completion is recorded for each operation.
  */
 
 #include <stdio.h>
@@ -16,8 +21,8 @@
 
 #include "common.h"
 #include "init.h"
-#include "smartlist.h"
 #include "overlap.h"
+#include "sock_table.h"
 
 #undef  TRACE
 #define TRACE(fmt, ...)                                    \
@@ -55,25 +60,153 @@ struct overlapped {
        SOCKET         sock;
        WSAEVENT       event;
        WSAOVERLAPPED *ov;
+
+       /* The QPC-value when the operation was issued.
+        */
+       uint64         issued;
+
+       /* Links in the 'ov_hash[]' bucket for 'ov' and in the
+        * 'sock_hash[]' bucket for 'sock'.
+        * The 'ov_next' is also used for the free-list of the pool.
+        */
+       struct overlapped *ov_next, *ov_prev;
+       struct overlapped *sock_next, *sock_prev;
+     };
+
+/*
+ * The entries are keyed on the 'WSAOVERLAPPED*' value. A second table
+ * keyed on the socket makes 'overlap_remove()' cheap on 'closesocket()'.
+ * Both must be a power of 2.
+ */
+#define OV_HASH_SIZE    4096
+#define SOCK_HASH_SIZE  1024
+
+/*
+ * The entries are allocated in chunks of this many entries
+ * and recycled via 'ov_free_list'.
+ */
+#define OV_POOL_CHUNK   256
+
+struct overlap_pool {
+       struct overlap_pool *next;
+       struct overlapped    entries [OV_POOL_CHUNK];
      };
 
-static smartlist_t *ov_list;
-static DWORD        num_overlaps;
+static struct overlapped   *ov_hash [OV_HASH_SIZE];
+static struct overlapped   *sock_hash [SOCK_HASH_SIZE];
+static struct overlapped   *ov_free_list;
+static struct overlap_pool *ov_pool;
+static DWORD                num_overlaps;
+static DWORD                num_active;
 
-void overlap_exit (void)
+/*
+ * Issue-to-completion latency for overlapped receives [0] and sends [1].
+ */
+static struct ov_latency {
+       DWORD  num;
+       uint64 sum, min, max;   /* in usec */
+     } ov_latency [2];
+
+static __inline unsigned ov_hash_index (const WSAOVERLAPPED *o)
+{
+  UINT_PTR val = (UINT_PTR) o;
+
+  /* An 'WSAOVERLAPPED' is at least 8-byte aligned; drop the low bits first.
+   */
+  return (unsigned) (((val >> 3) * 2654435761UL) >> 7) & (OV_HASH_SIZE - 1);
+}
+
+static __inline unsigned sock_hash_index (SOCKET s)
+{
+  /* Socket handles are a multiple of 4.
+   */
+  return (unsigned) (s >> 2) & (SOCK_HASH_SIZE - 1);
+}
+
+static struct overlapped *overlap_alloc (void)
 {
   struct overlapped *ov;
-  int    i, max = smartlist_len (ov_list);
 
-  if (max >= 1)
+  if (!ov_free_list)
   {
-    TRACE ("%d overlapped transfers not completed:\n", max);
-    for (i = 0; i < max; i++)
+    struct overlap_pool *pool = calloc (1, sizeof(*pool));
+    int    i;
+
+    if (!pool)
+       return (NULL);
+
+    for (i = 0; i < OV_POOL_CHUNK; i++)
     {
-      ov = smartlist_get (ov_list, i);
-      TRACE ("  o: 0x%p, event: 0x%p, sock: %u, is_recv: %d, bytes: %lu\n",
-             ov->ov, ov->event, SOCKET_CAST(ov->sock), ov->is_recv, DWORD_CAST(ov->bytes));
+      pool->entries[i].ov_next = ov_free_list;
+      ov_free_list = pool->entries + i;
     }
+    pool->next = ov_pool;
+    ov_pool = pool;
+  }
+  ov = ov_free_list;
+  ov_free_list = ov->ov_next;
+  return (ov);
+}
+
+static void overlap_link (struct overlapped *ov)
+{
+  struct overlapped **head = ov_hash + ov_hash_index (ov->ov);
+
+  ov->ov_prev = NULL;
+  ov->ov_next = *head;
+  if (*head)
+     (*head)->ov_prev = ov;
+  *head = ov;
+
+  head = sock_hash + sock_hash_index (ov->sock);
+  ov->sock_prev = NULL;
+  ov->sock_next = *head;
+  if (*head)
+     (*head)->sock_prev = ov;
+  *head = ov;
+  num_active++;
+}
+
+/*
+ * Unlink 'ov' from both tables and return it to the free-list.
+ */
+static void overlap_unlink (struct overlapped *ov)
+{
+  if (ov->ov_prev)
+       ov->ov_prev->ov_next = ov->ov_next;
+  else ov_hash [ov_hash_index(ov->ov)] = ov->ov_next;
+  if (ov->ov_next)
+     ov->ov_next->ov_prev = ov->ov_prev;
+
+  if (ov->sock_prev)
+       ov->sock_prev->sock_next = ov->sock_next;
+  else sock_hash [sock_hash_index(ov->sock)] = ov->sock_next;
+  if (ov->sock_next)
+     ov->sock_next->sock_prev = ov->sock_prev;
+
+  ov->ov_next = ov_free_list;
+  ov_free_list = ov;
+  num_active--;
+}
+
+static void overlap_trace (const struct overlapped *ov)
+{
+  TRACE ("o: 0x%p, is_recv: %d, event: 0x%p, sock: %u\n",
+         ov->ov, ov->is_recv, ov->event, SOCKET_CAST(ov->sock));
+}
+
+void overlap_exit (void)
+{
+  struct overlapped *ov;
+  int    i;
+
+  if (num_active >= 1)
+  {
+    TRACE ("%lu overlapped transfers not completed:\n", DWORD_CAST(num_active));
+    for (i = 0; i < OV_HASH_SIZE; i++)
+        for (ov = ov_hash[i]; ov; ov = ov->ov_next)
+            TRACE ("  o: 0x%p, event: 0x%p, sock: %u, is_recv: %d, bytes: %lu\n",
+                   ov->ov, ov->event, SOCKET_CAST(ov->sock), ov->is_recv, DWORD_CAST(ov->bytes));
   }
   else if (num_overlaps)
   {
@@ -81,67 +214,113 @@ void overlap_exit (void)
      */
     TRACE ("All overlapped transfers completed.\n");
   }
-  num_overlaps = 0;
-  smartlist_wipe (ov_list, free);
-  ov_list = NULL;
+  num_overlaps = num_active = 0;
+
+  while (ov_pool)
+  {
+    struct overlap_pool *next = ov_pool->next;
+
+    free (ov_pool);
+    ov_pool = next;
+  }
+  ov_free_list = NULL;
+  memset (&ov_hash, '\0', sizeof(ov_hash));
+  memset (&sock_hash, '\0', sizeof(sock_hash));
 }
 
 void overlap_init (void)
 {
-  ov_list = smartlist_new();
+  num_overlaps = num_active = 0;
+  memset (&ov_latency, '\0', sizeof(ov_latency));
 }
 
-static void overlap_trace (int i, const struct overlapped *ov)
+/*
+ * Called from 'trace_report()'.
+ */
+void overlap_report (void)
 {
-  if (i == -1)
+  int i;
+
+  for (i = 0; i < DIM(ov_latency); i++)
   {
-    int max = smartlist_len (ov_list);
+    const struct ov_latency *lat = ov_latency + i;
 
-    for (i = 0; i < max; i++)
-    {
-      ov = smartlist_get (ov_list, i);
-      TRACE ("ov_list[%d]: is_recv: %d, event: 0x%p, sock: %u\n",
-             i, ov->is_recv, ov->event, (unsigned)ov->sock);
-    }
+    if (lat->num == 0)
+       continue;
+    trace_printf ("    Overlapped %s: %10s, latency avg: %s, min: %s, max: %s usec.\n",
+                  i == 0 ? "recv" : "send", dword_str(lat->num),
+                  qword_str(lat->sum / lat->num), qword_str(lat->min), qword_str(lat->max));
   }
-  else
-    TRACE ("ov_list[%d]: is_recv: %d, event: 0x%p, sock: %u\n",
-           i, ov->is_recv, ov->event, SOCKET_CAST(ov->sock));
 }
 
 void overlap_store (SOCKET s, WSAOVERLAPPED *o, DWORD num_bytes, BOOL is_recv)
 {
-  struct overlapped *ov = NULL;
-  int    i, max = smartlist_len (ov_list);
-  BOOL   modify = FALSE;
+  struct overlapped *ov;
+  LARGE_INTEGER      ticks;
 
   TRACE ("o: 0x%p, event: 0x%p, sock: %u\n",
          o, o ? o->hEvent : NULL, SOCKET_CAST(s));
 
-  for (i = 0; i < max; i++)
-  {
-    ov = smartlist_get (ov_list, i);
-    if (ov->ov == o && ov->sock == s && ov->is_recv == is_recv)
-    {
-      modify = TRUE;
-      break;
-    }
-  }
+  for (ov = ov_hash[ov_hash_index(o)]; ov; ov = ov->ov_next)
+      if (ov->ov == o && ov->sock == s && ov->is_recv == is_recv)
+         break;
 
-  if (!modify)
+  if (!ov)
   {
-    ov = malloc (sizeof(*ov));
+    ov = overlap_alloc();
     if (!ov)
        return;
+
     ov->is_recv = is_recv;
     ov->sock    = s;
     ov->ov      = o;
-    smartlist_add (ov_list, ov);
+    QueryPerformanceCounter (&ticks);
+    ov->issued = ticks.QuadPart;
+    overlap_link (ov);
     num_overlaps++;
   }
   ov->event = o ? o->hEvent : NULL;
   ov->bytes = num_bytes;
-  overlap_trace (-1, NULL);
+  overlap_trace (ov);
+}
+
+/*
+ * Update the 'g_cfg.counts.recv_bytes' or 'g_cfg.counts.send_bytes'
+ * statistics for a completed 'ov' and forget it.
+ */
+static void overlap_complete (struct overlapped *ov, DWORD bytes)
+{
+  struct ov_latency *lat = ov_latency + (ov->is_recv ? 0 : 1);
+  LARGE_INTEGER      ticks;
+  uint64             usec = 0;
+
+  QueryPerformanceCounter (&ticks);
+  if (g_cfg.clocks_per_usec && (uint64)ticks.QuadPart > ov->issued)
+     usec = ((uint64)ticks.QuadPart - ov->issued) / g_cfg.clocks_per_usec;
+
+  if (lat->num == 0 || usec < lat->min)
+     lat->min = usec;
+  if (usec > lat->max)
+     lat->max = usec;
+  lat->sum += usec;
+  lat->num++;
+
+  TRACE ("o: 0x%p, completed after %s usec.\n", ov->ov, qword_str(usec));
+  sock_table_count (ov->sock, bytes, !ov->is_recv, FALSE);
+
+  if (ov->is_recv)
+  {
+    g_cfg.counts.recv_bytes += bytes;
+    TRACE ("o: 0x%p, room for %lu bytes, got %lu bytes.\n",
+           ov->ov, DWORD_CAST(ov->bytes), DWORD_CAST(bytes));
+  }
+  else
+  {
+    g_cfg.counts.send_bytes += bytes;
+    TRACE ("o: 0x%p, sent %lu bytes, actual sent %lu bytes.\n",
+           ov->ov, DWORD_CAST(ov->bytes), DWORD_CAST(bytes));
+  }
+  overlap_unlink (ov);
 }
 
 /*
@@ -151,30 +330,31 @@ void overlap_recall_all (const WSAEVENT *event)
 {
   int i;
 
-  for (i = 0; i < smartlist_len(ov_list); i++)
+  if (!p_WSAGetOverlappedResult || num_active == 0)
+     return;
+
+  for (i = 0; i < OV_HASH_SIZE; i++)
   {
-    const struct overlapped *ov = smartlist_get (ov_list, i);
-    DWORD bytes = 0;
-    BOOL  rc    = FALSE;
+    struct overlapped *ov, *next;
 
-    if (p_WSAGetOverlappedResult && ov->event == event)
+    for (ov = ov_hash[i]; ov; ov = next)
     {
+      DWORD bytes = 0;
+      BOOL  rc;
+
+      next = ov->ov_next;
+      if (ov->event != event)
+         continue;
+
       ENTER_CRIT();
       rc = (*p_WSAGetOverlappedResult) (ov->sock, ov->ov, &bytes, 0, NULL);
       LEAVE_CRIT();
 
+      TRACE ("o: 0x%p, event: 0x%p, is_recv: %d, rc: %d, got %lu bytes.\n",
+             ov->ov, ov->event, ov->is_recv, rc, DWORD_CAST(bytes));
       if (rc)
-      {
-        /* This could reduce 'smartlist_len(ov_list)' by 1.
-         */
-        overlap_recall (ov->sock, ov->ov, bytes);
-      }
+         overlap_complete (ov, bytes);
     }
-    if (i < smartlist_len(ov_list))
-       TRACE ("ov_list[%d]: event: 0x%p, is_recv: %d, rc: %d, got %lu bytes.\n",
-              i, ov->event, ov->is_recv, rc, DWORD_CAST(bytes));
-    else
-      TRACE ("ov_list[%d]: is_recv: %d, was recalled.\n", i, ov->is_recv);
   }
 }
 
@@ -185,60 +365,57 @@ void overlap_recall_all (const WSAEVENT *event)
  */
 void overlap_recall (SOCKET s, const WSAOVERLAPPED *o, DWORD bytes)
 {
-  int i, max = smartlist_len (ov_list);
+  struct overlapped *ov;
 
-  for (i = 0; i < max; i++)
+  for (ov = ov_hash[ov_hash_index(o)]; ov; ov = ov->ov_next)
   {
-    struct overlapped *ov = smartlist_get (ov_list, i);
-
-    overlap_trace (i, ov);
-
     if (ov->ov != o || ov->sock != s)
        continue;
 
-    if (ov->is_recv)
-    {
-      g_cfg.counts.recv_bytes += bytes;
-      TRACE ("ov_list[%d]: room for %lu bytes, got %lu bytes.\n",
-             i, DWORD_CAST(ov->bytes), DWORD_CAST(bytes));
-    }
-    else
-    {
-      g_cfg.counts.send_bytes += bytes;
-      TRACE ("ov_list[%d]: sent %lu bytes, actual sent %lu bytes.\n",
-             i, DWORD_CAST(ov->bytes), DWORD_CAST(bytes));
-    }
-    free (ov);
-    smartlist_del (ov_list, i);
+    overlap_trace (ov);
+    overlap_complete (ov, bytes);
     break;
   }
 }
 
 /*
- * Remove an overlap entry matching socket 's'.
+ * Match a completion-packet dequeued from an I/O completion port.
+ * Such a packet carries no socket; only the 'o' pointer.
+ * Returns TRUE if 'o' was a stored overlapped operation.
  */
-void overlap_remove (SOCKET s)
+BOOL overlap_recall_ov (const WSAOVERLAPPED *o, DWORD bytes)
 {
-  int i, max;
+  struct overlapped *ov;
 
-  /* This if-test should not be needed. It would mean 'closesocket()' was called
-   * after 'wsock_trace_exit()'.
-   */
-  if (!ov_list)
-     return;
+  if (!o)
+     return (FALSE);
 
-  max = smartlist_len (ov_list);
-  for (i = 0; i < max; i++)
+  for (ov = ov_hash[ov_hash_index(o)]; ov; ov = ov->ov_next)
   {
-    struct overlapped *ov = smartlist_get (ov_list, i);
+    if (ov->ov != o)
+       continue;
+
+    overlap_trace (ov);
+    overlap_complete (ov, bytes);
+    return (TRUE);
+  }
+  return (FALSE);
+}
 
+/*
+ * Remove all overlap entries matching socket 's'.
+ */
+void overlap_remove (SOCKET s)
+{
+  struct overlapped *ov, *next;
+
+  for (ov = sock_hash[sock_hash_index(s)]; ov; ov = next)
+  {
+    next = ov->sock_next;
     if (ov->sock != s)
        continue;
 
-    free (ov);
-    smartlist_del (ov_list, i);
-    max--;
-    i--;
+    overlap_trace (ov);
+    overlap_unlink (ov);
   }
-  overlap_trace (-1, NULL);
 }
@@ -18,7 +18,9 @@ extern void overlap_exit (void);
 
 extern void overlap_store (SOCKET s, WSAOVERLAPPED *ov, DWORD num_bytes, BOOL is_recv);
 extern void overlap_recall (SOCKET s, const WSAOVERLAPPED *ov, DWORD bytes);
+extern BOOL overlap_recall_ov (const WSAOVERLAPPED *ov, DWORD bytes);
 extern void overlap_recall_all (const WSAEVENT *ev);
 extern void overlap_remove (SOCKET s);
+extern void overlap_report (void);
 
 #endif /* _OVERLAP_H */
@@ -0,0 +1,150 @@
+/**\file    shm_stats.c
+ * \ingroup Main
+ *
+ * \brief
+ *   Live statistics in a named shared memory block (`shm_stats = 1`).
+ *
+ *   The block is named by our PID; `"Global\\wsock_trace-stats-<pid>"` if
+ *   we have the rights to create a global object (e.g. in a service),
+ *   otherwise `"Local\\wsock_trace-stats-<pid>"`. See shm_stats.h for the
+ *   versioned layout.
+ *
+ *   For each function, `latency_end()` counts the call and the bucket of
+ *   it's latency-histogram. The recv / send hooks also count the bytes
+ *   and errors. All counters are updated with interlocked adds and no
+ *   lock. So a monitor program can poll them at any rate without
+ *   disturbing the traced program.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "init.h"
+#include "cpu.h"
+#include "wsock_trace.h"
+#include "shm_stats.h"
+
+static HANDLE                   shm_map  = NULL;
+static struct shm_stats_header *shm_hdr  = NULL;
+static struct shm_stats_func   *shm_func = NULL;
+static int                      shm_num_funcs = 0;
+
+void shm_stats_init (void)
+{
+  char   name [60];
+  DWORD  size, pid = GetCurrentProcessId();
+  BOOL   exists = FALSE;
+  int    i;
+  MEMORY_BASIC_INFORMATION mbi;
+
+  shm_num_funcs = ws2_func_num();
+  size = sizeof(*shm_hdr) + shm_num_funcs * sizeof(*shm_func);
+
+  snprintf (name, sizeof(name), "Global\\wsock_trace-stats-%lu", DWORD_CAST(pid));
+  shm_map = CreateFileMappingA (INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, size, name);
+  if (!shm_map)
+  {
+    snprintf (name, sizeof(name), "Local\\wsock_trace-stats-%lu", DWORD_CAST(pid));
+    shm_map = CreateFileMappingA (INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, size, name);
+  }
+  if (shm_map)
+  {
+    exists  = (GetLastError() == ERROR_ALREADY_EXISTS);
+    shm_hdr = MapViewOfFile (shm_map, FILE_MAP_WRITE, 0, 0, 0);
+  }
+
+  if (!shm_hdr)
+  {
+    TRACE (1, "Failed to create the shared memory \"%s\": %s.\n",
+           name, win_strerror(GetLastError()));
+    shm_stats_exit();
+    g_cfg.shm_stats = FALSE;
+    return;
+  }
+
+  /* A monitor can keep the block of an earlier process with the same PID open.
+   * Then we get that block; it's size is not ours. Reuse it only if large
+   * enough and clear the old counters. A fresh mapping is zero-filled.
+   */
+  if (exists)
+  {
+    if (!VirtualQuery(shm_hdr, &mbi, sizeof(mbi)) || mbi.RegionSize < size)
+    {
+      TRACE (1, "The shared memory \"%s\" already exists and is too small.\n", name);
+      shm_stats_exit();
+      g_cfg.shm_stats = FALSE;
+      return;
+    }
+    InterlockedExchange ((volatile LONG*)&shm_hdr->magic, 0);
+    memset (shm_hdr, '\0', size);
+    TRACE (2, "Reusing the existing shared memory \"%s\".\n", name);
+  }
+
+  shm_func = (struct shm_stats_func*) (shm_hdr + 1);
+  for (i = 0; i < shm_num_funcs; i++)
+      _strlcpy (shm_func[i].name, ws2_func_name(i), sizeof(shm_func[i].name));
+
+  shm_hdr->header_size     = sizeof(*shm_hdr);
+  shm_hdr->func_size       = sizeof(*shm_func);
+  shm_hdr->num_funcs       = shm_num_funcs;
+  shm_hdr->num_buckets     = LAT_BUCKETS;
+  shm_hdr->sub_bits        = LAT_SUB_BITS;
+  shm_hdr->pid             = pid;
+  shm_hdr->clocks_per_usec = g_cfg.clocks_per_usec;
+  shm_hdr->start_ticks     = g_cfg.start_ticks;
+  shm_hdr->version         = SHM_STATS_VERSION;
+
+  /* Set the 'magic' last; a monitor must not use the block before.
+   */
+  InterlockedExchange ((volatile LONG*)&shm_hdr->magic, SHM_STATS_MAGIC);
+  TRACE (2, "Live statistics in \"%s\", %lu bytes.\n", name, DWORD_CAST(size));
+}
+
+void shm_stats_exit (void)
+{
+  if (shm_hdr)
+     UnmapViewOfFile (shm_hdr);
+  if (shm_map)
+     CloseHandle (shm_map);
+  shm_hdr  = NULL;
+  shm_func = NULL;
+  shm_map  = NULL;
+}
+
+/*
+ * Called from 'latency_end()' for each call of the function at 'slot'.
+ */
+void shm_stats_latency (int slot, unsigned bucket)
+{
+  struct shm_stats_func *f;
+
+  if (!shm_func || slot < 0 || slot >= shm_num_funcs || bucket >= LAT_BUCKETS)
+     return;
+
+  f = shm_func + slot;
+  InterlockedIncrement (&f->calls);
+  InterlockedIncrement (&f->buckets[bucket]);
+}
+
+/*
+ * Count 'bytes' transferred or an 'error' for the function at 'slot'.
+ */
+void shm_stats_xfer (int slot, DWORD bytes, BOOL error)
+{
+  struct shm_stats_func *f;
+  DWORD  old;
+
+  if (!shm_func || slot < 0 || slot >= shm_num_funcs)
+     return;
+
+  f = shm_func + slot;
+  if (error)
+     InterlockedIncrement (&f->errors);
+  else if (bytes > 0)
+  {
+    old = (DWORD) InterlockedExchangeAdd (&f->bytes.lo, (LONG)bytes);
+    if (old + bytes < old)
+       InterlockedIncrement (&f->bytes.hi);
+  }
+}
@@ -0,0 +1,55 @@
+/**\file    shm_stats.h
+ * \ingroup Main
+ *
+ * The layout of the shared memory block with live statistics.
+ * A monitor program opens `"Global\\wsock_trace-stats-<pid>"` (or
+ * `"Local\\wsock_trace-stats-<pid>"`) read-only and checks `magic`
+ * and `version` before using it.
+ */
+#ifndef _SHM_STATS_H
+#define _SHM_STATS_H
+
+#define SHM_STATS_MAGIC    0x53545357   /* "WSTS" */
+#define SHM_STATS_VERSION  1
+
+/*
+ * A 64-bit counter updated with 32-bit atomics; the 'hi' part is
+ * incremented when 'lo' wraps. A reader should read 'hi', 'lo' and
+ * 'hi' again and retry if 'hi' changed.
+ */
+struct shm_counter64 {
+       volatile LONG  lo;
+       volatile LONG  hi;
+     };
+
+/*
+ * One for each WinSock function we hook. The counters only
+ * increments (and wrap), so a monitor should use the deltas.
+ */
+struct shm_stats_func {
+       char                  name [32];
+       volatile LONG         calls;
+       volatile LONG         errors;     /* only for the recv / send functions */
+       struct shm_counter64  bytes;      /* ditto */
+       volatile LONG         buckets [LAT_BUCKETS];
+     };
+
+struct shm_stats_header {
+       DWORD                 magic;
+       DWORD                 version;
+       DWORD                 header_size;     /* sizeof(struct shm_stats_header) */
+       DWORD                 func_size;       /* sizeof(struct shm_stats_func) */
+       DWORD                 num_funcs;       /* number of 'struct shm_stats_func' following */
+       DWORD                 num_buckets;     /* LAT_BUCKETS */
+       DWORD                 sub_bits;        /* LAT_SUB_BITS */
+       DWORD                 pid;
+       uint64                clocks_per_usec; /* to convert the bucket values to usec */
+       uint64                start_ticks;     /* QPC when the DLL was loaded */
+     };
+
+extern void shm_stats_init    (void);
+extern void shm_stats_exit    (void);
+extern void shm_stats_latency (int slot, unsigned bucket);
+extern void shm_stats_xfer    (int slot, DWORD bytes, BOOL error);
+
+#endif /* _SHM_STATS_H */
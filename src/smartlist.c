@@ -578,13 +578,11 @@ void *smartlist_bsearch (const smartlist_t *sl, const void *key,
 }
 
 /**
- * Open a text-file and return parsed lines as a smartlist.
- *
- * Leading white-space is stripped off and lines then starting with
- * a `;` or a `#` is considered comment-lines and are not given to the
- * parser function.
+ * The common worker for `smartlist_read_file()` and `smartlist_read_file_arg()`.
+ * Exactly one of `parse` and `parse_arg` is set.
  */
-smartlist_t *smartlist_read_file (const char *file, smartlist_parse_func parse)
+static smartlist_t *read_file (const char *file, smartlist_parse_func parse,
+                               smartlist_parse_arg_func parse_arg, void *arg)
 {
   smartlist_t *sl;
   FILE *f = fopen (file, "r");
@@ -604,9 +602,34 @@ smartlist_t *smartlist_read_file (const char *file, smartlist_parse_func parse)
     str_rip (buf);
     p = str_ltrim (buf);
     if (*p && *p != '#' && *p != ';')
-       (*parse) (sl, p);
+    {
+      if (parse)
+           (*parse) (sl, p);
+      else (*parse_arg) (sl, p, arg);
+    }
   }
   fclose (f);
   return (sl);
 }
 
+/**
+ * Open a text-file and return parsed lines as a smartlist.
+ *
+ * Leading white-space is stripped off and lines then starting with
+ * a `;` or a `#` is considered comment-lines and are not given to the
+ * parser function.
+ */
+smartlist_t *smartlist_read_file (const char *file, smartlist_parse_func parse)
+{
+  return read_file (file, parse, NULL, NULL);
+}
+
+/**
+ * As `smartlist_read_file()`, but `arg` is given to the parser function
+ * for each line. E.g. the arena the parser should allocate from.
+ */
+smartlist_t *smartlist_read_file_arg (const char *file, smartlist_parse_arg_func parse, void *arg)
+{
+  return read_file (file, NULL, parse, arg);
+}
+
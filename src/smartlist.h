@@ -39,6 +39,12 @@ typedef int (MS_CDECL *smartlist_sort_func) (const void **a, const void **b);
  */
 typedef void (MS_CDECL *smartlist_parse_func) (smartlist_t *sl, const char *line);
 
+/**\typedef smartlist_parse_arg_func
+ * As `smartlist_parse_func` but with an extra argument passed through
+ * from `smartlist_read_file_arg()`.
+ */
+typedef void (MS_CDECL *smartlist_parse_arg_func) (smartlist_t *sl, const char *line, void *arg);
+
 #if defined(_CRTDBG_MAP_ALLOC)
   extern smartlist_t *_smartlist_new (const char *file, unsigned line);
   extern void          smartlist_leak_check (void);
@@ -62,6 +68,7 @@ extern void         smartlist_sort (smartlist_t *sl, smartlist_sort_func compare
 extern int          smartlist_duplicates (smartlist_t *sl, smartlist_sort_func compare);
 extern int          smartlist_make_uniq (smartlist_t *sl, smartlist_sort_func compare, void (*free_fn)(void *a));
 extern smartlist_t *smartlist_read_file (const char *file, smartlist_parse_func parse);
+extern smartlist_t *smartlist_read_file_arg (const char *file, smartlist_parse_arg_func parse, void *arg);
 
 extern int   smartlist_bsearch_idx (const smartlist_t *sl, const void *key,
                                     int (*compare)(const void *key, const void **member),
@@ -70,4 +77,141 @@ extern int   smartlist_bsearch_idx (const smartlist_t *sl, const void *key,
 extern void *smartlist_bsearch (const smartlist_t *sl, const void *key,
                                 int (*compare)(const void *key, const void **member));
 
+/*
+ * The layout of a smartlist for the inline accessors below.
+ * Must match the exposed `smartlist_t` above.
+ */
+#if !defined(EXPOSE_SMARTLIST_DETAILS) && !defined(__DOXYGEN__)
+  struct smartlist_internal {
+         void **list;
+         int    num_used;
+         int    capacity;
+       };
+#endif
+
+/**
+ * Inline versions of `smartlist_len()` and `smartlist_get()` for hot loops.
+ * In `_DEBUG` and `_CRTDBG_MAP_ALLOC` builds, these are the checked functions.
+ */
+#if defined(_DEBUG) || defined(_CRTDBG_MAP_ALLOC)
+  #define smartlist_len_fast(sl)       smartlist_len (sl)
+  #define smartlist_get_fast(sl, idx)  smartlist_get (sl, idx)
+#else
+  static __inline int smartlist_len_fast (const smartlist_t *sl)
+  {
+    return (sl->num_used);
+  }
+  static __inline void *smartlist_get_fast (const smartlist_t *sl, int idx)
+  {
+    return (sl->list[idx]);
+  }
+#endif
+
+/**
+ * \def SMARTLIST_BSEARCH_FUNC
+ * Define a typed binary search function:
+ *  ```
+ *   scope type *name (const smartlist_t *sl, const key_type *key);
+ *  ```
+ * `compare` is a function (or macro) `int compare (const key_type *key, const type *member)`.
+ * Since it's not called through a pointer, the compiler can inline it.
+ */
+#define SMARTLIST_BSEARCH_FUNC(scope, name, type, key_type, compare)  \
+        scope type *name (const smartlist_t *sl, const key_type *key) \
+        {                                                             \
+          int lo = 0, hi = smartlist_len_fast (sl) - 1;               \
+                                                                      \
+          while (lo <= hi)                                            \
+          {                                                           \
+            int   mid = lo + (hi - lo) / 2;                           \
+            type *m   = (type*) smartlist_get_fast (sl, mid);         \
+            int   cmp = compare (key, m);                             \
+                                                                      \
+            if (cmp == 0)                                             \
+               return (m);                                            \
+            if (cmp < 0)                                              \
+                 hi = mid - 1;                                        \
+            else lo = mid + 1;                                        \
+          }                                                           \
+          return (NULL);                                              \
+        }
+
+/**
+ * \def SMARTLIST_SORT_FUNC
+ * Define a typed sort function:
+ *  ```
+ *   scope void name (smartlist_t *sl);
+ *  ```
+ * `compare` is a function (or macro) `int compare (const type *a, const type *b)`.
+ * A non-recursive quick-sort (median of 3) with an insertion-sort for small ranges.
+ * Like `qsort()`, it is not stable.
+ */
+#define SMARTLIST_SORT_FUNC(scope, name, type, compare)                         \
+        scope void name (smartlist_t *sl)                                       \
+        {                                                                       \
+          void **v = sl->list;                                                  \
+          void  *pivot, *t;                                                     \
+          int    stack [64], sp = 0;                                            \
+          int    i, j, mid, lo = 0, hi = smartlist_len_fast (sl) - 1;           \
+                                                                                \
+          if (hi < 1)                                                           \
+             return;                                                            \
+          for (;;)                                                              \
+          {                                                                     \
+            if (hi - lo < 16)                                                   \
+            {                                                                   \
+              for (i = lo + 1; i <= hi; i++)                                    \
+              {                                                                 \
+                t = v[i];                                                       \
+                for (j = i; j > lo && compare((const type*)v[j-1], (const type*)t) > 0; j--) \
+                    v[j] = v[j-1];                                              \
+                v[j] = t;                                                       \
+              }                                                                 \
+              if (sp == 0)                                                      \
+                 break;                                                         \
+              hi = stack [--sp];                                                \
+              lo = stack [--sp];                                                \
+              continue;                                                         \
+            }                                                                   \
+            mid = lo + (hi - lo) / 2;                                           \
+            if (compare((const type*)v[mid], (const type*)v[lo]) < 0)           \
+               t = v[mid], v[mid] = v[lo], v[lo] = t;                           \
+            if (compare((const type*)v[hi], (const type*)v[mid]) < 0)           \
+            {                                                                   \
+              t = v[hi], v[hi] = v[mid], v[mid] = t;                            \
+              if (compare((const type*)v[mid], (const type*)v[lo]) < 0)         \
+                 t = v[mid], v[mid] = v[lo], v[lo] = t;                         \
+            }                                                                   \
+            pivot = v[mid];                                                     \
+            i = lo;                                                             \
+            j = hi;                                                             \
+            while (i <= j)                                                      \
+            {                                                                   \
+              while (compare((const type*)v[i], (const type*)pivot) < 0)        \
+                 i++;                                                           \
+              while (compare((const type*)v[j], (const type*)pivot) > 0)        \
+                 j--;                                                           \
+              if (i <= j)                                                       \
+              {                                                                 \
+                t = v[i], v[i] = v[j], v[j] = t;                                \
+                i++;                                                            \
+                j--;                                                            \
+              }                                                                 \
+            }                                                                   \
+            /* Push the larger part, continue with the smaller one */          \
+            if (j - lo > hi - i)                                                \
+            {                                                                   \
+              stack [sp++] = lo;                                                \
+              stack [sp++] = j;                                                 \
+              lo = i;                                                           \
+            }                                                                   \
+            else                                                                \
+            {                                                                   \
+              stack [sp++] = i;                                                 \
+              stack [sp++] = hi;                                                \
+              hi = j;                                                           \
+            }                                                                   \
+          }                                                                     \
+        }
+
 #endif  /* _SMARTLIST_H */
@@ -0,0 +1,1085 @@
+/**\file    sock_table.c
+ * \ingroup Main
+ *
+ * \brief
+ *   A table of the sockets the traced program has open.
+ *
+ *   Keyed on the `SOCKET` value in an open-addressing hash-table. The
+ *   table is split in `SOCK_SHARDS` shards with a lock each, so threads
+ *   working on different sockets rarely wait for each other.
+ *
+ *   An entry is added in `socket()`, `WSASocketA/W()` and `accept()` and
+ *   updated in `bind()` and `connect()`. A socket we did not see created
+ *   is added on first use. The entry is removed in `closesocket()`.
+ *
+ *   Each entry has it's own byte and error counters. When a socket is
+ *   closed, it is kept in `sock_top[]` if it is among the top talkers.
+ *   `sock_table_report()` lists these together with the still open sockets.
+ *
+ *   An entry also has the state for `trace_first` and `trace_rate` and
+ *   counts the calls not traced. See `sock_table_suppress()`.
+ *
+ *   With `flow_enable = 1`, an entry also has the lifetime, number of calls,
+ *   connect-latency and the largest stall between receives. One flow-record
+ *   is written for it when the socket is closed (or at exit). See `flow_write()`.
+ *
+ *   With `[netem] enable = 1`, an entry also has it's shaping state.
+ *   The `sock_table_netem_x()` functions call the `netem_x()` functions
+ *   in `netem.c` with the shard locked.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "init.h"
+#include "wsock_trace.h"
+#include "geoip.h"
+#include "dnsbl.h"
+#include "sock_table.h"
+
+#define SOCK_SHARDS     16      /* must be a power of 2 */
+#define SOCK_MIN_SLOTS  64      /* initial slots in a shard; a power of 2 */
+#define SOCK_TOP_MAX    10      /* number of top talkers to report */
+
+/*
+ * A slot is NULL (never used), 'SLOT_DELETED' or a live entry.
+ */
+#define SLOT_DELETED    ((struct sock_info*) 1)
+
+struct sock_shard {
+       CRITICAL_SECTION   lock;
+       struct sock_info **slots;
+       DWORD              size;     /* number of slots; a power of 2 */
+       DWORD              used;     /* number of live entries */
+       DWORD              deleted;  /* number of 'SLOT_DELETED' slots */
+     };
+
+static struct sock_shard shards [SOCK_SHARDS];
+static struct sock_info  sock_top [SOCK_TOP_MAX];
+static int               num_top;
+static CRITICAL_SECTION  top_lock;
+static BOOL              table_active = FALSE;
+
+/*
+ * Socket-values are multiples of 4. The top bits of the
+ * hash selects the shard and the low bits the slot.
+ */
+static __inline DWORD sock_hash (SOCKET s)
+{
+  return (DWORD) ((UINT_PTR)s >> 2) * 2654435761U;
+}
+
+static __inline struct sock_shard *sock_shard (DWORD hash)
+{
+  return (shards + (hash >> 28) % SOCK_SHARDS);
+}
+
+/*
+ * Return the slot with 's' or NULL if not found.
+ * The shard must be locked.
+ */
+static struct sock_info **slot_find (const struct sock_shard *sh, SOCKET s, DWORD hash)
+{
+  DWORD i, mask = sh->size - 1;
+
+  if (!sh->slots)
+     return (NULL);
+
+  for (i = hash & mask; sh->slots[i]; i = (i + 1) & mask)
+  {
+    struct sock_info *si = sh->slots[i];
+
+    if (si != SLOT_DELETED && si->s == s)
+       return (sh->slots + i);
+  }
+  return (NULL);
+}
+
+/*
+ * Rehash a shard into 'new_size' slots. This also drops the 'SLOT_DELETED' slots.
+ */
+static BOOL shard_resize (struct sock_shard *sh, DWORD new_size)
+{
+  struct sock_info **slots = calloc (new_size, sizeof(*slots));
+  DWORD  i, j, mask = new_size - 1;
+
+  if (!slots)
+     return (FALSE);
+
+  for (i = 0; i < sh->size; i++)
+  {
+    struct sock_info *si = sh->slots[i];
+
+    if (!si || si == SLOT_DELETED)
+       continue;
+    for (j = sock_hash(si->s) & mask; slots[j]; j = (j + 1) & mask)
+        ;
+    slots[j] = si;
+  }
+  free (sh->slots);
+  sh->slots   = slots;
+  sh->size    = new_size;
+  sh->deleted = 0;
+  return (TRUE);
+}
+
+/*
+ * Return the entry for 's'. Add a new one if not found.
+ * The shard must be locked.
+ */
+static struct sock_info *sock_get (struct sock_shard *sh, SOCKET s, DWORD hash)
+{
+  struct sock_info **slot = slot_find (sh, s, hash);
+  struct sock_info  *si;
+  DWORD  i, mask;
+
+  if (slot)
+     return (*slot);
+
+  /* Keep the load (incl. the deleted slots) below 50%.
+   */
+  if (2 * (sh->used + sh->deleted + 1) > sh->size)
+  {
+    DWORD new_size = sh->size ? sh->size : SOCK_MIN_SLOTS;
+
+    while (4 * (sh->used + 1) > new_size)
+       new_size *= 2;
+    if (!shard_resize(sh, new_size))
+       return (NULL);
+  }
+
+  si = calloc (1, sizeof(*si));
+  if (!si)
+     return (NULL);
+
+  si->s = s;
+  si->seq_out = si->seq_in = 1;
+  if (g_cfg.flow.enable)
+     si->flow_start = get_ts_ticks();
+  if (g_cfg.netem.enable)
+     netem_sock_init (&si->netem, get_ts_ticks());
+
+  mask = sh->size - 1;
+  for (i = hash & mask; sh->slots[i] && sh->slots[i] != SLOT_DELETED; i = (i + 1) & mask)
+      ;
+  if (sh->slots[i] == SLOT_DELETED)
+     sh->deleted--;
+  sh->slots[i] = si;
+  sh->used++;
+  return (si);
+}
+
+/*
+ * Insert 'si' into the 'top[]' array of 'max' entries sorted on
+ * the number of bytes sent and received.
+ */
+static void top_insert (struct sock_info *top, int *num, int max, const struct sock_info *si)
+{
+  uint64 total = si->bytes_sent + si->bytes_recv;
+  int    i;
+
+  if (total == 0)
+     return;
+
+  for (i = *num; i > 0; i--)
+  {
+    if (top[i-1].bytes_sent + top[i-1].bytes_recv >= total)
+       break;
+    if (i < max)
+       top[i] = top[i-1];
+  }
+  if (i >= max)
+     return;
+  top[i] = *si;
+  if (*num < max)
+     (*num)++;
+}
+
+/*
+ * Lock and return the shard for 's'.
+ */
+static struct sock_shard *shard_lock (SOCKET s, DWORD *hash)
+{
+  struct sock_shard *sh;
+
+  *hash = sock_hash (s);
+  sh = sock_shard (*hash);
+  EnterCriticalSection (&sh->lock);
+  return (sh);
+}
+
+/*
+ * The flow-records of 'flow_enable = 1'.
+ */
+#define FLOW_CSV_HEADER  "socket,proto,local,peer,country,dnsbl,lifetime_ms,bytes_sent,bytes_recv," \
+                         "calls,errors,connect_ms,max_stall_ms,end\n"
+
+static double flow_msec (uint64 ticks)
+{
+  if (g_cfg.ts_clocks_per_usec == 0)
+     return (0.0);
+  return ((double)ticks / (double)g_cfg.ts_clocks_per_usec / 1000.0);
+}
+
+static const char *flow_proto (const struct sock_info *si)
+{
+  if (si->type == SOCK_STREAM)
+     return ("TCP");
+  if (si->type == SOCK_DGRAM)
+     return ("UDP");
+  if (si->type == SOCK_RAW)
+     return ("RAW");
+  return ("?");
+}
+
+static const char *flow_addr (const struct sockaddr_storage *ss, char *buf, size_t size)
+{
+  int len = sizeof(*ss);
+
+  if (ss->ss_family != AF_INET && ss->ss_family != AF_INET6)
+     return ("-");
+  return sockaddr_str2_r ((const struct sockaddr*)ss, &len, buf, size);
+}
+
+/*
+ * Look up the country and DNSBL status of the peer once for the flow.
+ * Not if these tables are still being loaded by 'lazy_init = 1'.
+ */
+static void flow_enrich (const struct sockaddr_storage *peer, char *country, size_t size,
+                         const char **sbl_ref, BOOL *listed)
+{
+  const struct in_addr  *ia4 = NULL;
+  const struct in6_addr *ia6 = NULL;
+  const char            *cc  = NULL;
+
+  strcpy (country, "-");
+  *sbl_ref = NULL;
+  *listed  = FALSE;
+
+  if (peer->ss_family == AF_INET)
+     ia4 = &((const struct sockaddr_in*)peer)->sin_addr;
+  else if (peer->ss_family == AF_INET6)
+     ia6 = &((const struct sockaddr_in6*)peer)->sin6_addr;
+  else
+     return;
+
+  if (g_cfg.geoip_enable && lazy_init_ready(LAZY_GEOIP))
+     cc = ia4 ? geoip_get_country_by_ipv4 (ia4) : geoip_get_country_by_ipv6 (ia6);
+  if (cc && cc[0] != '-' && cc[0] != '\0')
+     _strlcpy (country, cc, size);
+
+  if (g_cfg.DNSBL.enable && lazy_init_ready(LAZY_DNSBL))
+     *listed = ia4 ? DNSBL_check_ipv4 (ia4, sbl_ref) : DNSBL_check_ipv6 (ia6, sbl_ref);
+}
+
+/*
+ * Write the flow-record for a closed socket or one still open at exit.
+ * Sockets never connected and with no data are skipped.
+ * Called with the 'crit_sect' held (or at exit) since the
+ * GeoIP lookup is not thread-safe.
+ */
+static void flow_write (const struct sock_info *si, uint64 now, const char *end)
+{
+  char        local [SOCKADDR_STR_SZ], peer [SOCKADDR_STR_SZ];
+  char        country [10], connect [20], buf [500];
+  const char *l_str, *p_str, *sbl_ref, *dnsbl;
+  BOOL        listed;
+  double      life, stall;
+
+  if (si->peer.ss_family == 0 && si->bytes_sent + si->bytes_recv == 0)
+     return;
+
+  l_str = flow_addr (&si->local, local, sizeof(local));
+  p_str = flow_addr (&si->peer, peer, sizeof(peer));
+  flow_enrich (&si->peer, country, sizeof(country), &sbl_ref, &listed);
+  dnsbl = !listed ? "-" : sbl_ref ? sbl_ref : "listed";
+
+  life  = flow_msec (now > si->flow_start ? now - si->flow_start : 0);
+  stall = flow_msec (si->flow_max_stall);
+  if (si->flow_connected)
+       snprintf (connect, sizeof(connect), "%.3f", flow_msec(si->flow_connect));
+  else strcpy (connect, "-");
+
+  switch (g_cfg.flow.format)
+  {
+    case FLOW_CSV:
+         snprintf (buf, sizeof(buf),
+                   "%u,%s,%s,%s,%s,%s,%.3f,%" U64_FMT ",%" U64_FMT ",%lu,%lu,%s,%.3f,%s\n",
+                   SOCKET_CAST(si->s), flow_proto(si), l_str, p_str, country, dnsbl,
+                   life, si->bytes_sent, si->bytes_recv, DWORD_CAST(si->flow_calls),
+                   DWORD_CAST(si->num_errors), connect, stall, end);
+         break;
+
+    case FLOW_JSON:
+         snprintf (buf, sizeof(buf),
+                   "{\"socket\":%u,\"proto\":\"%s\",\"local\":\"%s\",\"peer\":\"%s\","
+                   "\"country\":\"%s\",\"dnsbl\":\"%s\",\"lifetime_ms\":%.3f,"
+                   "\"bytes_sent\":%" U64_FMT ",\"bytes_recv\":%" U64_FMT ",\"calls\":%lu,"
+                   "\"errors\":%lu,\"connect_ms\":%s,\"max_stall_ms\":%.3f,\"end\":\"%s\"}\n",
+                   SOCKET_CAST(si->s), flow_proto(si), l_str, p_str, country, dnsbl,
+                   life, si->bytes_sent, si->bytes_recv, DWORD_CAST(si->flow_calls),
+                   DWORD_CAST(si->num_errors), si->flow_connected ? connect : "null", stall, end);
+         break;
+
+    default:
+         snprintf (buf, sizeof(buf),
+                   "flow socket %u: %s %s -> %s, country %s, DNSBL %s, %.3f sec, "
+                   "sent %s, recv %s, %lu calls, %lu errors, connect %s ms, max-stall %.3f ms (%s).\n",
+                   SOCKET_CAST(si->s), flow_proto(si), l_str, p_str, country, dnsbl,
+                   life / 1000.0, qword_str(si->bytes_sent), qword_str(si->bytes_recv),
+                   DWORD_CAST(si->flow_calls), DWORD_CAST(si->num_errors), connect, stall, end);
+         break;
+  }
+  buf [sizeof(buf)-1] = '\0';
+
+  if (g_cfg.flow.stream)
+  {
+    fputs (buf, g_cfg.flow.stream);
+    fflush (g_cfg.flow.stream);
+  }
+  else
+  {
+    trace_indent (g_cfg.trace_indent+2);
+    trace_printf ("~4%s~0", buf);
+  }
+}
+
+/*
+ * Open the 'flow_file' for appending. Add the CSV header to a new file.
+ * Without a 'flow_file', the records goes to the 'trace_file'.
+ */
+static void flow_open (void)
+{
+  FILE *f;
+
+  if (!g_cfg.flow.file)
+  {
+    if (g_cfg.trace_level <= 0)
+       WARNING ("No 'trace_file' with 'trace_level = 0'. Set a 'flow_file' to get the flow-records.\n");
+    return;
+  }
+
+  f = fopen_excl (g_cfg.flow.file, "at");
+  if (!f)
+  {
+    WARNING ("Failed to open 'flow_file = %s'. Writing flow-records to the 'trace_file'.\n",
+             g_cfg.flow.file);
+    return;
+  }
+  fseek (f, 0, SEEK_END);
+  if (g_cfg.flow.format == FLOW_CSV && ftell(f) == 0)
+     fputs (FLOW_CSV_HEADER, f);
+  g_cfg.flow.stream = f;
+}
+
+void sock_table_init (void)
+{
+  int i;
+
+  for (i = 0; i < SOCK_SHARDS; i++)
+  {
+    memset (shards + i, '\0', sizeof(shards[i]));
+    InitializeCriticalSection (&shards[i].lock);
+  }
+  InitializeCriticalSection (&top_lock);
+  num_top = 0;
+  table_active = TRUE;
+  if (g_cfg.flow.enable)
+     flow_open();
+}
+
+/*
+ * Print the summary-line for the calls on a socket that were not traced.
+ */
+static void print_suppressed (SOCKET s, DWORD recvs, uint64 recv_bytes, DWORD sends, uint64 send_bytes)
+{
+  trace_indent (g_cfg.trace_indent+2);
+  trace_printf ("~4socket %u: %s recv (%s bytes), ", SOCKET_CAST(s), dword_str(recvs), qword_str(recv_bytes));
+  trace_printf ("%s send (%s bytes) not traced.~0\n", dword_str(sends), qword_str(send_bytes));
+}
+
+/**
+ * Print the pending summary-line of each socket with calls not traced.
+ * Without this, a socket that goes quiet after a burst of suppressed calls
+ * gets it's line only when closed; which can be after the `trace_report()`.
+ *
+ * Takes the `crit_sect` like a hook does around it's trace-lines.
+ * The lock-order is `crit_sect` then a shard-lock.
+ */
+void sock_table_flush_suppressed (void)
+{
+  int   i;
+  DWORD j;
+
+  if (!table_active)
+     return;
+
+  ENTER_CRIT();
+  for (i = 0; i < SOCK_SHARDS; i++)
+  {
+    struct sock_shard *sh = shards + i;
+
+    EnterCriticalSection (&sh->lock);
+    for (j = 0; j < sh->size; j++)
+    {
+      struct sock_info *si = sh->slots[j];
+
+      if (!si || si == SLOT_DELETED || si->supp_recvs + si->supp_sends == 0)
+         continue;
+
+      print_suppressed (si->s, si->supp_recvs, si->supp_recv_bytes,
+                        si->supp_sends, si->supp_send_bytes);
+      si->supp_recvs = si->supp_sends = 0;
+      si->supp_recv_bytes = si->supp_send_bytes = 0;
+      si->trace_summary = 0;
+    }
+    LeaveCriticalSection (&sh->lock);
+  }
+  LEAVE_CRIT();
+}
+
+void sock_table_exit (void)
+{
+  int    i;
+  DWORD  j;
+  uint64 now = 0;
+
+  if (!table_active)
+     return;
+
+  if (g_cfg.flow.enable)
+     now = get_ts_ticks();
+
+  table_active = FALSE;
+  for (i = 0; i < SOCK_SHARDS; i++)
+  {
+    struct sock_shard *sh = shards + i;
+
+    for (j = 0; j < sh->size; j++)
+    {
+      struct sock_info *si = sh->slots[j];
+
+      if (!si || si == SLOT_DELETED)
+         continue;
+
+      /* The calls not traced since the last summary-line.
+       */
+      if (si->supp_recvs + si->supp_sends > 0)
+         print_suppressed (si->s, si->supp_recvs, si->supp_recv_bytes,
+                           si->supp_sends, si->supp_send_bytes);
+      if (g_cfg.flow.enable)
+         flow_write (si, now, "exit");
+      free (si);
+    }
+    free (sh->slots);
+    sh->slots = NULL;
+    sh->size = sh->used = sh->deleted = 0;
+    DeleteCriticalSection (&sh->lock);
+  }
+  DeleteCriticalSection (&top_lock);
+
+  if (g_cfg.flow.stream)
+     fclose (g_cfg.flow.stream);
+  g_cfg.flow.stream = NULL;
+}
+
+void sock_table_add (SOCKET s, int family, int type, int protocol)
+{
+  struct sock_shard *sh;
+  struct sock_info  *si;
+  DWORD  hash;
+
+  if (!table_active || s == INVALID_SOCKET)
+     return;
+
+  sh = shard_lock (s, &hash);
+  si = sock_get (sh, s, hash);
+  if (si)
+  {
+    si->family   = family;
+    si->type     = type;
+    si->protocol = protocol;
+  }
+  LeaveCriticalSection (&sh->lock);
+}
+
+/*
+ * Called from 'closesocket()'. Keep the counters if it
+ * was one of the top talkers and write the flow-record.
+ */
+void sock_table_remove (SOCKET s)
+{
+  struct sock_shard *sh;
+  struct sock_info **slot;
+  struct sock_info   supp;
+  DWORD  hash;
+  BOOL   found = FALSE;
+  uint64 now = 0;
+
+  if (!table_active)
+     return;
+
+  if (g_cfg.flow.enable)
+     now = get_ts_ticks();
+
+  supp.supp_recvs = supp.supp_sends = 0;
+
+  sh = shard_lock (s, &hash);
+  slot = slot_find (sh, s, hash);
+  if (slot)
+  {
+    struct sock_info *si = *slot;
+
+    *slot = SLOT_DELETED;
+    sh->used--;
+    sh->deleted++;
+
+    EnterCriticalSection (&top_lock);
+    top_insert (sock_top, &num_top, SOCK_TOP_MAX, si);
+    LeaveCriticalSection (&top_lock);
+    supp = *si;
+    found = TRUE;
+    free (si);
+  }
+  LeaveCriticalSection (&sh->lock);
+
+  if (supp.supp_recvs + supp.supp_sends > 0)
+     print_suppressed (s, supp.supp_recvs, supp.supp_recv_bytes,
+                       supp.supp_sends, supp.supp_send_bytes);
+
+  if (found && g_cfg.flow.enable)
+     flow_write (&supp, now, "close");
+}
+
+static void sock_set_addr (SOCKET s, const struct sockaddr *sa, int sa_len, BOOL local)
+{
+  const struct netem_params *params = NULL;
+  struct sock_shard *sh;
+  struct sock_info  *si;
+  DWORD  hash;
+
+  if (!table_active || !sa || sa_len <= 0)
+     return;
+
+  if (sa_len > (int)sizeof(si->local))
+     sa_len = sizeof(si->local);
+
+  /* The peer selects the '[netem]' rule. Lookup before locking the shard
+   * since a country-rule needs the 'crit_sect'.
+   */
+  if (!local && g_cfg.netem.enable)
+     params = netem_lookup (sa);
+
+  sh = shard_lock (s, &hash);
+  si = sock_get (sh, s, hash);
+  if (si)
+  {
+    memcpy (local ? &si->local : &si->peer, sa, sa_len);
+    if (!si->family)
+       si->family = sa->sa_family;
+    if (!local && g_cfg.netem.enable && !si->netem.bound)
+    {
+      si->netem.params = params;
+      si->netem.bound  = TRUE;
+    }
+  }
+  LeaveCriticalSection (&sh->lock);
+}
+
+void sock_table_set_local (SOCKET s, const struct sockaddr *sa, int sa_len)
+{
+  sock_set_addr (s, sa, sa_len, TRUE);
+}
+
+void sock_table_set_peer (SOCKET s, const struct sockaddr *sa, int sa_len)
+{
+  sock_set_addr (s, sa, sa_len, FALSE);
+}
+
+/*
+ * Update the flow-state for a successful transfer at 'now'.
+ * The first one completes a non-blocking 'connect()'.
+ * The shard must be locked.
+ */
+static void flow_update (struct sock_info *si, uint64 now, BOOL out)
+{
+  if (si->flow_connecting)
+  {
+    si->flow_connect    = (now > si->flow_connect) ? now - si->flow_connect : 0;
+    si->flow_connecting = FALSE;
+    si->flow_connected  = TRUE;
+  }
+  if (out)
+     return;
+
+  if (si->flow_last_recv && now > si->flow_last_recv &&
+      now - si->flow_last_recv > si->flow_max_stall)
+     si->flow_max_stall = now - si->flow_last_recv;
+  si->flow_last_recv = now;
+}
+
+/*
+ * Called from 'connect()' with the 'get_ts_ticks()' before the call
+ * and it's result. The latency of a non-blocking 'connect()' is the time
+ * until the first successful transfer; we do not see when 'select()' or
+ * 'WSAPoll()' reports it connected.
+ */
+void sock_table_connect (SOCKET s, uint64 start, int rc)
+{
+  struct sock_shard *sh;
+  struct sock_info  *si;
+  DWORD  hash;
+  uint64 now;
+  int    err = 0;
+
+  if (!table_active || !g_cfg.flow.enable || s == INVALID_SOCKET)
+     return;
+
+  now = get_ts_ticks();
+  if (rc != 0)
+  {
+    err = WSAERROR_PUSH();
+    WSAERROR_POP();
+  }
+
+  sh = shard_lock (s, &hash);
+  si = sock_get (sh, s, hash);
+  if (si)
+  {
+    si->flow_calls++;
+    if (rc == 0)
+    {
+      si->flow_connect    = (now > start) ? now - start : 0;
+      si->flow_connecting = FALSE;
+      si->flow_connected  = TRUE;
+    }
+    else if (err == WSAEWOULDBLOCK)
+    {
+      si->flow_connect    = start;
+      si->flow_connecting = TRUE;
+      si->flow_connected  = FALSE;
+    }
+  }
+  LeaveCriticalSection (&sh->lock);
+}
+
+/*
+ * Count 'bytes' sent ('out == TRUE') or received on socket 's'.
+ */
+void sock_table_count (SOCKET s, DWORD bytes, BOOL out, BOOL error)
+{
+  struct sock_shard *sh;
+  struct sock_info  *si;
+  DWORD  hash;
+  uint64 now = 0;
+
+  if (!table_active || s == INVALID_SOCKET)
+     return;
+
+  if (g_cfg.flow.enable)
+     now = get_ts_ticks();
+
+  sh = shard_lock (s, &hash);
+  si = sock_get (sh, s, hash);
+  if (si)
+  {
+    si->flow_calls++;
+    if (now && !error)
+       flow_update (si, now, out);
+
+    if (error)
+       si->num_errors++;
+    else if (out)
+    {
+      si->bytes_sent += bytes;
+      si->num_sends++;
+    }
+    else
+    {
+      si->bytes_recv += bytes;
+      si->num_recvs++;
+    }
+  }
+  LeaveCriticalSection (&sh->lock);
+}
+
+/*
+ * Return a copy of what we know about socket 's'.
+ * If the type or local address is not known, ask Winsock once.
+ * The local address is not known before a 'bind()' or 'connect()'.
+ */
+BOOL sock_table_get (SOCKET s, struct sock_info *info)
+{
+  struct sock_shard *sh;
+  struct sock_info  *si;
+  DWORD  hash;
+
+  if (!table_active || s == INVALID_SOCKET)
+     return (FALSE);
+
+  sh = shard_lock (s, &hash);
+  si = sock_get (sh, s, hash);
+  if (si && !si->looked_up)
+  {
+    struct sockaddr_storage local, peer;
+    int    type;
+
+    if (ws_sock_info(s, &type, &local, &peer))
+    {
+      si->type = type;
+      memcpy (&si->local, &local, sizeof(local));
+      if (peer.ss_family != 0)
+         memcpy (&si->peer, &peer, sizeof(peer));
+      if (local.ss_family != 0)
+      {
+        si->family = local.ss_family;
+        si->looked_up = TRUE;
+      }
+    }
+  }
+  if (si)
+     *info = *si;
+  LeaveCriticalSection (&sh->lock);
+  return (si != NULL);
+}
+
+/*
+ * Return the TCP sequence and acknowledge numbers for a segment of 'len'
+ * bytes and advance the sequence-number of that direction.
+ */
+void sock_table_tcp_seq (SOCKET s, DWORD len, BOOL out, DWORD *seq, DWORD *ack)
+{
+  struct sock_shard *sh;
+  struct sock_info  *si;
+  DWORD  hash;
+
+  *seq = *ack = 0;
+  if (!table_active)
+     return;
+
+  sh = shard_lock (s, &hash);
+  si = sock_get (sh, s, hash);
+  if (si)
+  {
+    *seq = out ? si->seq_out : si->seq_in;
+    *ack = out ? si->seq_in  : si->seq_out;
+    if (out)
+         si->seq_out += len;
+    else si->seq_in  += len;
+  }
+  LeaveCriticalSection (&sh->lock);
+}
+
+/*
+ * Called from 'trace_report()'. Print the top talkers among the
+ * closed and the still open sockets.
+ */
+void sock_table_report (void)
+{
+  struct sock_info top [SOCK_TOP_MAX];
+  int    i, num = 0;
+  DWORD  j, open = 0;
+
+  if (!table_active)
+     return;
+
+  EnterCriticalSection (&top_lock);
+  for (i = 0; i < num_top; i++)
+      top_insert (top, &num, SOCK_TOP_MAX, sock_top + i);
+  LeaveCriticalSection (&top_lock);
+
+  for (i = 0; i < SOCK_SHARDS; i++)
+  {
+    struct sock_shard *sh = shards + i;
+
+    EnterCriticalSection (&sh->lock);
+    for (j = 0; j < sh->size; j++)
+    {
+      const struct sock_info *si = sh->slots[j];
+
+      if (si && si != SLOT_DELETED)
+         top_insert (top, &num, SOCK_TOP_MAX, si);
+    }
+    open += sh->used;
+    LeaveCriticalSection (&sh->lock);
+  }
+
+  trace_printf ("    Open sockets: %15s\n", dword_str(open));
+  if (num == 0)
+     return;
+
+  trace_puts ("    Top talkers:\n");
+  for (i = 0; i < num; i++)
+  {
+    const struct sock_info *si = top + i;
+    int   len = sizeof(si->peer);
+
+    trace_printf ("      socket %5u: sent %15s, recv %15s, errors %5lu",
+                  SOCKET_CAST(si->s), qword_str(si->bytes_sent),
+                  qword_str(si->bytes_recv), DWORD_CAST(si->num_errors));
+    if (si->peer.ss_family == AF_INET || si->peer.ss_family == AF_INET6)
+       trace_printf (", peer %s", sockaddr_str2((const struct sockaddr*)&si->peer, &len));
+    trace_putc ('\n');
+  }
+}
+
+/*
+ * Decide if a successful call on 's' transferring 'bytes' should not be
+ * traced. It is not if 'sampled_out' (by the 1-in-N 'trace_sample'), if
+ * 's' had more than 'trace_first' such calls or if the 'trace_rate'
+ * token-bucket for 's' is empty. The bucket holds 'trace_rate' calls and
+ * is filled with 'trace_rate' calls per second.
+ *
+ * The calls not traced are counted and printed as one summary-line
+ * every 'trace_summary' seconds and in 'closesocket()'.
+ * Returns TRUE if this call should not be traced.
+ */
+BOOL sock_table_suppress (SOCKET s, DWORD bytes, BOOL out, BOOL sampled_out)
+{
+  struct sock_shard *sh;
+  struct sock_info  *si;
+  struct sock_info   supp;
+  DWORD  hash, now, rate, burst;
+  BOOL   suppress = sampled_out;
+  BOOL   summary = FALSE;
+
+  if (!table_active || s == INVALID_SOCKET)
+     return (sampled_out);
+
+  now = GetTickCount();
+
+  sh = shard_lock (s, &hash);
+  si = sock_get (sh, s, hash);
+  if (!si)
+  {
+    LeaveCriticalSection (&sh->lock);
+    return (sampled_out);
+  }
+
+  si->trace_calls++;
+  if (!suppress && g_cfg.trace_first > 0 && si->trace_calls > g_cfg.trace_first)
+     suppress = TRUE;
+
+  if (!suppress && g_cfg.trace_rate > 0)
+  {
+    rate  = g_cfg.trace_rate;
+    burst = 1000 * rate;
+    if (si->trace_refill == 0 || now - si->trace_refill >= 1000)
+       si->trace_tokens = burst;
+    else
+    {
+      si->trace_tokens += (now - si->trace_refill) * rate;
+      if (si->trace_tokens > burst)
+         si->trace_tokens = burst;
+    }
+    si->trace_refill = now;
+
+    if (si->trace_tokens >= 1000)
+         si->trace_tokens -= 1000;
+    else suppress = TRUE;
+  }
+
+  if (suppress)
+  {
+    if (out)
+    {
+      si->supp_sends++;
+      si->supp_send_bytes += bytes;
+    }
+    else
+    {
+      si->supp_recvs++;
+      si->supp_recv_bytes += bytes;
+    }
+    if (si->trace_summary == 0)
+       si->trace_summary = now;
+    else if (now - si->trace_summary >= 1000 * g_cfg.trace_summary)
+    {
+      supp = *si;
+      summary = TRUE;
+      si->supp_recvs = si->supp_sends = 0;
+      si->supp_recv_bytes = si->supp_send_bytes = 0;
+      si->trace_summary = now;
+    }
+  }
+  LeaveCriticalSection (&sh->lock);
+
+  if (summary)
+     print_suppressed (s, supp.supp_recvs, supp.supp_recv_bytes,
+                       supp.supp_sends, supp.supp_send_bytes);
+  return (suppress);
+}
+
+/*
+ * Lock the shard for 's' and return it's entry if 's' is shaped.
+ * Otherwise return NULL with the shard unlocked.
+ */
+static struct sock_info *netem_lock (SOCKET s, struct sock_shard **sh)
+{
+  struct sock_info *si;
+  DWORD  hash;
+
+  if (!table_active || !g_cfg.netem.enable || s == INVALID_SOCKET)
+     return (NULL);
+
+  *sh = shard_lock (s, &hash);
+  si = sock_get (*sh, s, hash);
+  if (si && si->netem.params)
+     return (si);
+  LeaveCriticalSection (&(*sh)->lock);
+  return (NULL);
+}
+
+/*
+ * Return the number of bytes a 'recv()' of 'len' bytes may get now.
+ * Or 0 with the msec to wait for. Or 'NETEM_PROBE'; see 'netem_recv()'.
+ */
+int sock_table_netem_recv (SOCKET s, int len, DWORD *wait, BOOL *non_blocking)
+{
+  struct sock_shard *sh;
+  struct sock_info  *si = netem_lock (s, &sh);
+
+  *wait = 0;
+  *non_blocking = FALSE;
+  if (!si)
+     return (len);
+
+  len = netem_recv (&si->netem, si->type, len, get_ts_ticks(), wait);
+  *non_blocking = si->netem.non_blocking;
+  LeaveCriticalSection (&sh->lock);
+  return (len);
+}
+
+void sock_table_netem_arrived (SOCKET s)
+{
+  struct sock_shard *sh;
+  struct sock_info  *si = netem_lock (s, &sh);
+
+  if (si)
+  {
+    netem_arrived (&si->netem, get_ts_ticks());
+    LeaveCriticalSection (&sh->lock);
+  }
+}
+
+/*
+ * Account for 'bytes' received. Returns TRUE if it was a lost datagram.
+ */
+BOOL sock_table_netem_received (SOCKET s, int bytes, BOOL *non_blocking)
+{
+  struct sock_shard *sh;
+  struct sock_info  *si = netem_lock (s, &sh);
+  BOOL   lost;
+
+  *non_blocking = FALSE;
+  if (!si)
+     return (FALSE);
+
+  lost = netem_received (&si->netem, si->type, bytes, get_ts_ticks());
+  *non_blocking = si->netem.non_blocking;
+  LeaveCriticalSection (&sh->lock);
+  return (lost);
+}
+
+/*
+ * Return the number of bytes a 'send()' of 'len' bytes may send now.
+ * Or 0 with the msec to wait for. Or 'NETEM_DROP'.
+ */
+int sock_table_netem_send (SOCKET s, int len, DWORD *wait, BOOL *non_blocking)
+{
+  struct sock_shard *sh;
+  struct sock_info  *si = netem_lock (s, &sh);
+
+  *wait = 0;
+  *non_blocking = FALSE;
+  if (!si)
+     return (len);
+
+  len = netem_send (&si->netem, si->type, len, get_ts_ticks(), wait);
+  *non_blocking = si->netem.non_blocking;
+  LeaveCriticalSection (&sh->lock);
+  return (len);
+}
+
+void sock_table_netem_sent (SOCKET s, int bytes)
+{
+  struct sock_shard *sh;
+  struct sock_info  *si = netem_lock (s, &sh);
+
+  if (si)
+  {
+    netem_sent (&si->netem, bytes);
+    LeaveCriticalSection (&sh->lock);
+  }
+}
+
+/*
+ * Called from 'select()' and 'WSAPoll()'. Return FALSE if 's' should not
+ * be reported readable ('out == FALSE') or writable yet. Then lower
+ * '*wait' to the msec until it will be.
+ */
+BOOL sock_table_netem_ready (SOCKET s, BOOL out, DWORD *wait)
+{
+  struct sock_shard *sh;
+  struct sock_info  *si = netem_lock (s, &sh);
+  DWORD  msec = INFINITE;
+  BOOL   ready;
+
+  if (!si)
+     return (TRUE);
+
+  ready = netem_ready (&si->netem, si->type, out, get_ts_ticks(), &msec);
+  if (!ready && msec < *wait)
+     *wait = msec;
+  LeaveCriticalSection (&sh->lock);
+  return (ready);
+}
+
+/*
+ * Called from 'ioctlsocket (s, FIONBIO, ..)', 'WSAEventSelect()' and
+ * 'WSAAsyncSelect()'. A deferred receive or send on a non-blocking socket
+ * fails with 'WSAEWOULDBLOCK' instead of waiting.
+ */
+void sock_table_netem_nonblock (SOCKET s, BOOL on)
+{
+  struct sock_shard *sh;
+  struct sock_info  *si;
+  DWORD  hash;
+
+  if (!table_active || !g_cfg.netem.enable || s == INVALID_SOCKET)
+     return;
+
+  sh = shard_lock (s, &hash);
+  si = sock_get (sh, s, hash);
+  if (si)
+     si->netem.non_blocking = on;
+  LeaveCriticalSection (&sh->lock);
+}
+
+/*
+ * Called from 'accept()'. The accepted socket 's' has the same properties
+ * as the 'listener'; including it's non-blocking mode and the events set by
+ * 'WSAEventSelect()' or 'WSAAsyncSelect()'.
+ * The 2 sockets may be in different shards; take one lock at a time.
+ */
+void sock_table_netem_accept (SOCKET listener, SOCKET s)
+{
+  struct sock_shard *sh;
+  struct sock_info  *si;
+  DWORD  hash;
+  BOOL   on = FALSE;
+
+  if (!table_active || !g_cfg.netem.enable || listener == INVALID_SOCKET)
+     return;
+
+  /* The listener has no peer and may not be shaped itself.
+   */
+  sh = shard_lock (listener, &hash);
+  si = sock_get (sh, listener, hash);
+  if (si)
+     on = si->netem.non_blocking;
+  LeaveCriticalSection (&sh->lock);
+  if (on)
+     sock_table_netem_nonblock (s, on);
+}
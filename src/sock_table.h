@@ -0,0 +1,69 @@
+/**\file    sock_table.h
+ * \ingroup Main
+ */
+#ifndef _SOCK_TABLE_H
+#define _SOCK_TABLE_H
+
+#include "netem.h"
+
+/*
+ * What we know about an open socket.
+ */
+struct sock_info {
+       SOCKET                  s;
+       int                     family;      /* AF_INET, AF_INET6 etc. or 0 if unknown */
+       int                     type;        /* SOCK_STREAM, SOCK_DGRAM etc. or 0 if unknown */
+       int                     protocol;
+       BOOL                    looked_up;   /* 'ws_sock_info()' gave a local address */
+       struct sockaddr_storage local;
+       struct sockaddr_storage peer;
+       uint64                  bytes_sent;
+       uint64                  bytes_recv;
+       DWORD                   num_sends;
+       DWORD                   num_recvs;
+       DWORD                   num_errors;
+       DWORD                   seq_out;     /* the faked TCP sequence-numbers in the pcap-file */
+       DWORD                   seq_in;
+       DWORD                   trace_calls;      /* successful calls seen by 'sock_table_suppress()' */
+       DWORD                   trace_tokens;     /* 1/1000 calls left for 'trace_rate' */
+       DWORD                   trace_refill;     /* 'GetTickCount()' at the last refill */
+       DWORD                   trace_summary;    /* 'GetTickCount()' at the last summary-line */
+       DWORD                   supp_recvs;       /* calls not traced since the last summary-line */
+       DWORD                   supp_sends;
+       uint64                  supp_recv_bytes;
+       uint64                  supp_send_bytes;
+       uint64                  flow_start;       /* 'get_ts_ticks()' when added. For 'flow_enable' */
+       uint64                  flow_connect;     /* ticks at 'connect()'. Then the ticks it took */
+       uint64                  flow_last_recv;   /* ticks at the last receive */
+       uint64                  flow_max_stall;   /* largest ticks between 2 receives */
+       DWORD                   flow_calls;
+       BOOL                    flow_connecting;  /* a non-blocking 'connect()' not completed */
+       BOOL                    flow_connected;   /* 'flow_connect' is the latency */
+       struct netem_sock       netem;            /* the '[netem]' shaping */
+     };
+
+extern void sock_table_init   (void);
+extern void sock_table_exit   (void);
+extern void sock_table_report (void);
+extern void sock_table_flush_suppressed (void);
+
+extern void sock_table_add       (SOCKET s, int family, int type, int protocol);
+extern void sock_table_remove    (SOCKET s);
+extern void sock_table_set_local (SOCKET s, const struct sockaddr *sa, int sa_len);
+extern void sock_table_set_peer  (SOCKET s, const struct sockaddr *sa, int sa_len);
+extern void sock_table_count     (SOCKET s, DWORD bytes, BOOL out, BOOL error);
+extern void sock_table_connect   (SOCKET s, uint64 start, int rc);
+extern BOOL sock_table_get       (SOCKET s, struct sock_info *info);
+extern void sock_table_tcp_seq   (SOCKET s, DWORD len, BOOL out, DWORD *seq, DWORD *ack);
+extern BOOL sock_table_suppress  (SOCKET s, DWORD bytes, BOOL out, BOOL sampled_out);
+
+extern int  sock_table_netem_recv     (SOCKET s, int len, DWORD *wait, BOOL *non_blocking);
+extern void sock_table_netem_arrived  (SOCKET s);
+extern BOOL sock_table_netem_received (SOCKET s, int bytes, BOOL *non_blocking);
+extern int  sock_table_netem_send     (SOCKET s, int len, DWORD *wait, BOOL *non_blocking);
+extern void sock_table_netem_sent     (SOCKET s, int bytes);
+extern BOOL sock_table_netem_ready    (SOCKET s, BOOL out, DWORD *wait);
+extern void sock_table_netem_nonblock (SOCKET s, BOOL on);
+extern void sock_table_netem_accept   (SOCKET listener, SOCKET s);
+
+#endif /* _SOCK_TABLE_H */
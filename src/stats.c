@@ -0,0 +1,238 @@
+/**\file    stats.c
+ * \ingroup Main
+ *
+ * \brief
+ *   The counters of the statistics-only mode (`stats_only = 1`).
+ *
+ *   In this mode the hot hooks (`recv()`, `send()`, `select()` etc.)
+ *   return right after the real function. They take no global lock,
+ *   format nothing and only update the counters of the calling thread.
+ *
+ *   Each thread counts into it's own `struct stats_thread` (found via
+ *   TLS). Besides a `struct statistics`, it has a small hash-table of the
+ *   peer addresses seen. A block left by a dead thread is reused by a new
+ *   thread.
+ *
+ *   `stats_merge()` adds what the threads counted since the last merge to
+ *   `g_cfg.counts`. And with `geoip_enable = 1`, it looks up the country
+ *   of each peer address once and adds it's count to the GeoIP statistics.
+ *   It is called from `trace_report()`, but could be called at any time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "init.h"
+#include "geoip.h"
+#include "stats.h"
+
+#define STATS_PEERS  256    /* slots in a thread's peer-table; a power of 2 */
+
+struct stats_peer {
+       volatile LONG  family;   /* AF_INET, AF_INET6 or 0 if the slot is free */
+       BYTE           addr [16];
+       DWORD          count;
+       DWORD          merged;   /* 'count' at the last 'stats_merge()' */
+     };
+
+struct stats_thread {
+       struct stats_thread *next;
+       volatile LONG        owner;    /* thread-id using this block or 0 */
+       struct statistics    counts;
+       struct statistics    merged;   /* 'counts' at the last 'stats_merge()' */
+       DWORD                peers_lost;
+       struct stats_peer    peers [STATS_PEERS];
+     };
+
+static struct stats_thread *volatile stats_list = NULL;
+static DWORD stats_tls    = TLS_OUT_OF_INDEXES;
+static BOOL  stats_active = FALSE;
+
+/*
+ * Get the block of this thread. A reused block keeps the counts of
+ * the thread that exited.
+ */
+static struct stats_thread *stats_get (void)
+{
+  if (!stats_active)
+     return (NULL);
+  return tls_block_get (stats_tls, (void*volatile*)&stats_list, sizeof(struct stats_thread), NULL);
+}
+
+void stats_init (void)
+{
+  stats_tls = TlsAlloc();
+  stats_active = (stats_tls != TLS_OUT_OF_INDEXES);
+  if (!stats_active)
+     g_cfg.stats_only = FALSE;
+}
+
+void stats_exit (void)
+{
+  struct stats_thread *t, *next;
+
+  if (!stats_active)
+     return;
+
+  stats_active = FALSE;
+  for (t = stats_list; t; t = next)
+  {
+    next = t->next;
+    free (t);
+  }
+  stats_list = NULL;
+  TlsFree (stats_tls);
+  stats_tls = TLS_OUT_OF_INDEXES;
+}
+
+/*
+ * Called from DllMain(): dwReason == DLL_THREAD_DETACH.
+ * Let another thread reuse this block.
+ */
+void stats_thread_exit (void)
+{
+  if (!stats_active)
+     return;
+
+  tls_block_release (stats_tls);
+}
+
+/*
+ * Count the result 'rc' of a 'recv()' like function.
+ */
+void stats_recv (int rc, BOOL peeked)
+{
+  struct stats_thread *t = stats_get();
+
+  if (!t)
+     return;
+
+  if (rc < 0)
+       t->counts.recv_errors++;
+  else if (peeked)
+       t->counts.recv_peeked += rc;
+  else t->counts.recv_bytes += rc;
+}
+
+/*
+ * Count the result 'rc' of a 'send()' like function.
+ */
+void stats_send (int rc)
+{
+  struct stats_thread *t = stats_get();
+
+  if (!t)
+     return;
+
+  if (rc < 0)
+       t->counts.send_errors++;
+  else t->counts.send_bytes += rc;
+}
+
+/*
+ * Count an IPv4 or IPv6 peer-address in the peer-table of this thread.
+ * If the table is full, the address is only counted as lost.
+ */
+void stats_peer (const struct sockaddr *sa)
+{
+  struct stats_thread *t;
+  struct stats_peer   *p;
+  const BYTE *addr;
+  size_t      len;
+  DWORD       hash, i;
+
+  if (!sa || !g_cfg.geoip_enable)
+     return;
+
+  if (sa->sa_family == AF_INET)
+  {
+    addr = (const BYTE*) &((const struct sockaddr_in*)sa)->sin_addr;
+    len  = sizeof(struct in_addr);
+  }
+  else if (sa->sa_family == AF_INET6)
+  {
+    addr = (const BYTE*) &((const struct sockaddr_in6*)sa)->sin6_addr;
+    len  = sizeof(struct in6_addr);
+  }
+  else
+    return;
+
+  t = stats_get();
+  if (!t)
+     return;
+
+  for (i = 0, hash = 2166136261UL; i < len; i++)  /* FNV-1a */
+      hash = (hash ^ addr[i]) * 16777619UL;
+
+  for (i = 0; i < STATS_PEERS; i++)
+  {
+    p = t->peers + ((hash + i) & (STATS_PEERS - 1));
+    if (p->family == 0)
+    {
+      /* Publish the slot to 'stats_merge()' after the address is written.
+       */
+      memcpy (p->addr, addr, len);
+      p->count = 1;
+      InterlockedExchange (&p->family, sa->sa_family);
+      return;
+    }
+    if (p->family == sa->sa_family && !memcmp(p->addr, addr, len))
+    {
+      p->count++;
+      return;
+    }
+  }
+  t->peers_lost++;
+}
+
+#define MERGE(field)  do {                                         \
+                        uint64 now = t->counts.field;              \
+                        g_cfg.counts.field += now - t->merged.field; \
+                        t->merged.field = now;                     \
+                      } while (0)
+
+/*
+ * Add what all the threads counted since the last call to 'g_cfg.counts'
+ * and the GeoIP statistics. The threads may still be counting; every
+ * counter is read once, so nothing is counted twice.
+ */
+void stats_merge (void)
+{
+  struct stats_thread *t;
+  struct stats_peer   *p;
+  DWORD  i, now, lost = 0;
+  LONG   family;
+
+  if (!stats_active)
+     return;
+
+  for (t = stats_list; t; t = t->next)
+  {
+    MERGE (recv_bytes);
+    MERGE (recv_peeked);
+    MERGE (recv_errors);
+    MERGE (send_bytes);
+    MERGE (send_errors);
+
+    lost += t->peers_lost;
+
+    for (i = 0, p = t->peers; i < STATS_PEERS; i++, p++)
+    {
+      /* Read the 'family' before the address and count it publishes.
+       */
+      family = InterlockedCompareExchange (&p->family, 0, 0);
+      if (family == 0)
+         continue;
+      now = p->count;
+      if (now == p->merged)
+         continue;
+      geoip_stats_add_addr (family, p->addr, now - p->merged);
+      p->merged = now;
+    }
+  }
+
+  if (lost > 0)
+     TRACE (1, "%lu peer-addresses not counted; the per-thread tables were full.\n",
+            DWORD_CAST(lost));
+}
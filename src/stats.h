@@ -0,0 +1,16 @@
+/**\file    stats.h
+ * \ingroup Main
+ */
+#ifndef _STATS_H
+#define _STATS_H
+
+extern void stats_init        (void);
+extern void stats_exit        (void);
+extern void stats_thread_exit (void);
+extern void stats_merge       (void);
+
+extern void stats_recv (int rc, BOOL peeked);
+extern void stats_send (int rc);
+extern void stats_peer (const struct sockaddr *sa);
+
+#endif /* _STATS_H */
@@ -89,9 +89,15 @@ static DWORD        g_proc_id;
 static char         g_module [_MAX_PATH];  /* The .exe we're linked to */
 static smartlist_t *g_modules_list;        /* List of all modules in our program */
 static smartlist_t *g_symbols_list;
+static smartlist_t *g_modules_sorted;      /* 'g_modules_list' sorted on 'base_addr' */
+static DWORD        g_modules_loaded;      /* number of modules with symbols loaded */
+static struct arena *g_frames_arena;       /* for 'FrameEntry::str' */
 static int          g_quit_count = 0;
 static DWORD        g_num_compares;
 
+static int  find_module_index   (const char *module, ULONG64 base_addr);
+static void module_load_symbols (struct ModuleEntry *me);
+
 #if USE_SymEnumSymbolsEx
   static BOOL  g_long_CPP_syms = FALSE;
   static DWORD enum_module_symbols (smartlist_t *sl, const char *module, BOOL is_last, BOOL verbose);
@@ -518,12 +524,13 @@ static const char *sym_tag_decode (unsigned tag)
  */
 static void modules_list_add (const char *module, ULONG_PTR base_addr, DWORD size)
 {
-  struct ModuleEntry *me = malloc (sizeof(*me) + strlen(module) + 1);
+  struct ModuleEntry *me = calloc (1, sizeof(*me) + strlen(module) + 1);
 
+  if (!me)
+     return;
   me->module_name = strcpy ((char*)(me+1), module);
   me->base_addr   = base_addr;
   me->size        = size;
-  memset (&me->stat, '\0', sizeof(me->stat));
   smartlist_add (g_modules_list, me);
 }
 
@@ -535,8 +542,10 @@ static void module_free (void *m)
   struct ModuleEntry *me = (struct ModuleEntry*) m;
 
 #ifdef USE_BFD
-  BFD_unload_debug_symbols (me->module_mame);
+  if (me->sym_loaded)
+     BFD_unload_debug_symbols (me->module_name);
 #endif
+  free (me->frames);
   free (me);
 }
 
@@ -545,9 +554,13 @@ static void module_free (void *m)
  */
 static void modules_list_free (void)
 {
+  smartlist_free (g_modules_sorted);
   if (g_modules_list)
      smartlist_wipe (g_modules_list, module_free);
-  g_modules_list = NULL;
+  arena_free (g_frames_arena);
+  g_modules_list   = g_modules_sorted = NULL;
+  g_frames_arena   = NULL;
+  g_modules_loaded = 0;
 }
 
 /*
@@ -578,11 +591,17 @@ static DWORD enum_and_load_symbols (const char *module)
   const struct ModuleEntry *me;
   DWORD num;
   BOOL  is_last = FALSE;
-  int   mod_len, sym_len;
+  int   idx, mod_len, sym_len;
 
   mod_len = smartlist_len (g_modules_list);
   sym_len = smartlist_len (g_symbols_list);
 
+  /* 'SymEnumSymbolsEx()' needs the module loaded.
+   */
+  idx = find_module_index (module, 0);
+  if (idx >= 0)
+     module_load_symbols (smartlist_get(g_modules_list, idx));
+
   me      = smartlist_get (g_modules_list, mod_len-1);
   is_last = (stricmp(module,me->module_name) == 0);
   num     = enum_module_symbols (g_symbols_list, module, is_last, g_cfg.pdb_report == 0);
@@ -970,6 +989,151 @@ static BOOL check_quit (void)
 }
 #endif /* USE_SymEnumSymbolsEx */
 
+/*
+ * Load the symbols for a module the first time an address in it is seen.
+ * Unless 'g_cfg.pdb_report' or 'trace_level >= 4'; then all modules are
+ * loaded in 'enum_and_load_modules()'.
+ */
+static void module_load_symbols (struct ModuleEntry *me)
+{
+  if (me->sym_loaded)
+     return;
+
+  me->sym_loaded = TRUE;
+  g_modules_loaded++;
+  (*p_SymLoadModule64) (g_proc, 0, me->module_name, me->module_name,
+                        me->base_addr, me->size);
+
+#ifdef USE_BFD
+  BFD_load_debug_symbols (me->module_name, me->base_addr, me->size);
+#endif
+
+  TRACE (3, "Loaded symbols for %s (%lu of %d modules).\n",
+         me->module_name, DWORD_CAST(g_modules_loaded), smartlist_len(g_modules_list));
+}
+
+/*
+ * Helpers for the 'g_modules_sorted' list.
+ */
+static __inline int compare_module_base (const struct ModuleEntry *a, const struct ModuleEntry *b)
+{
+  if (a->base_addr < b->base_addr)
+     return (-1);
+  if (a->base_addr > b->base_addr)
+     return (1);
+  return (0);
+}
+
+static __inline int compare_module_addr (const ULONG_PTR *addr, const struct ModuleEntry *me)
+{
+  if (*addr < me->base_addr)
+     return (-1);
+  if (*addr >= me->base_addr + me->size)
+     return (1);
+  return (0);
+}
+
+SMARTLIST_SORT_FUNC (static, modules_sort, struct ModuleEntry, compare_module_base)
+SMARTLIST_BSEARCH_FUNC (static, modules_bsearch, struct ModuleEntry, ULONG_PTR, compare_module_addr)
+
+/*
+ * Return the module containing 'addr' and load it's symbols if not done already.
+ * Returns NULL if 'addr' is not in a module known at 'StackWalkInit()'.
+ */
+static struct ModuleEntry *module_from_addr (DWORD64 addr)
+{
+  ULONG_PTR           a = (ULONG_PTR) addr;
+  struct ModuleEntry *me;
+
+  if (!g_modules_sorted)
+     return (NULL);
+
+  me = modules_bsearch (g_modules_sorted, &a);
+  if (me)
+     module_load_symbols (me);
+  return (me);
+}
+
+/*
+ * The callbacks for 'StackWalk64()'.
+ * Since 'SYMOPT_DEFERRED_LOADS' is not used, dbghelp.dll knows only about
+ * the modules we have loaded symbols for.
+ */
+static PVOID WINAPI function_table_access (HANDLE proc, DWORD64 addr)
+{
+  module_from_addr (addr);
+  return (*p_SymFunctionTableAccess64) (proc, addr);
+}
+
+static DWORD64 WINAPI get_module_base (HANDLE proc, DWORD64 addr)
+{
+  const struct ModuleEntry *me = module_from_addr (addr);
+
+  if (me)
+     return (me->base_addr);
+  return (*p_SymGetModuleBase64) (proc, addr);
+}
+
+/*
+ * A resolved caller-address in a module. Kept sorted on 'addr' in
+ * 'ModuleEntry::frames[]'. The 'str' is allocated from 'g_frames_arena'.
+ */
+struct FrameEntry {
+       ULONG_PTR  addr;
+       DWORD      err;    /* the return value from 'decode_frame_addr()' */
+       char      *str;    /* the result for 'ret_buf[]' */
+     };
+
+/*
+ * Binary search for 'addr' in the 'me->frames[]'.
+ * If not found, '*idx' is where to insert it.
+ */
+static struct FrameEntry *frame_lookup (const struct ModuleEntry *me, ULONG_PTR addr, DWORD *idx)
+{
+  DWORD lo = 0, hi = me->num_frames;
+
+  while (lo < hi)
+  {
+    DWORD mid = lo + (hi - lo) / 2;
+
+    if (me->frames[mid].addr == addr)
+       return (me->frames + mid);
+    if (me->frames[mid].addr < addr)
+         lo = mid + 1;
+    else hi = mid;
+  }
+  *idx = lo;
+  return (NULL);
+}
+
+static void frame_add (struct ModuleEntry *me, DWORD idx, ULONG_PTR addr, DWORD err, const char *str)
+{
+  struct FrameEntry *fe;
+  char  *copy;
+
+  if (me->num_frames == me->max_frames)
+  {
+    DWORD max = me->max_frames ? 2 * me->max_frames : 16;
+
+    fe = realloc (me->frames, max * sizeof(*fe));
+    if (!fe)
+       return;
+    me->frames     = fe;
+    me->max_frames = max;
+  }
+
+  copy = arena_strdup (g_frames_arena, str);
+  if (!copy)
+     return;
+
+  fe = me->frames + idx;
+  memmove (fe + 1, fe, (me->num_frames - idx) * sizeof(*fe));
+  fe->addr = addr;
+  fe->err  = err;
+  fe->str  = copy;
+  me->num_frames++;
+}
+
 static void enum_and_load_modules (void)
 {
   struct ModuleEntry *me;
@@ -985,11 +1149,16 @@ static void enum_and_load_modules (void)
 
   g_quit_count = 0;
 
+  /* The symbols of a module are loaded by 'module_from_addr()' the first time
+   * a caller-address is in it. Unless all symbols are to be enumerated below.
+   */
+  g_modules_sorted = smartlist_new();
+  smartlist_append (g_modules_sorted, g_modules_list);
+  modules_sort (g_modules_sorted);
+
   for (i = 0; i < max && g_quit_count == 0; i++)
   {
     me = smartlist_get (g_modules_list, i);
-    (*p_SymLoadModule64) (g_proc, 0, me->module_name, me->module_name,
-                          me->base_addr, me->size);
 
     if (!stricmp(g_module,me->module_name))
     {
@@ -997,10 +1166,6 @@ static void enum_and_load_modules (void)
       ws_trace_base = (HINSTANCE) me->base_addr;
     }
 
-#ifdef USE_BFD
-    BFD_load_debug_symbols (me->module_name, me->base_addr, me->size);
-#endif
-
 #if USE_SymEnumSymbolsEx
     if (g_cfg.pdb_report || g_cfg.trace_level >= 4)
        enum_and_load_symbols (me->module_name);
@@ -1564,6 +1729,7 @@ BOOL StackWalkInit (void)
 
   g_modules_list = smartlist_new();
   g_symbols_list = smartlist_new();
+  g_frames_arena = arena_new ("frames", 16*1024);
 
   g_proc    = GetCurrentProcess();
   g_proc_id = GetCurrentProcessId();
@@ -1612,8 +1778,11 @@ BOOL StackWalkInit (void)
 
 static char ret_buf [MAX_NAMELEN+100];
 
-static DWORD decode_one_stack_frame (HANDLE thread, DWORD image_type,
-                                     STACKFRAME64 *stk, CONTEXT *ctx)
+/*
+ * Look up the symbol, file and line for 'addr' via dbghelp.dll (or BFD)
+ * and format it into 'str'.
+ */
+static DWORD decode_frame_addr (DWORD64 addr, BOOL have_PDB_info, char *str, size_t left)
 {
   struct {
 #if USE_SymFromAaddr
@@ -1636,20 +1805,10 @@ static DWORD decode_one_stack_frame (HANDLE thread, DWORD image_type,
   DWORD   temp_disp       = 0;
   DWORD   max_displ       = 100;
   DWORD   flags           = UNDNAME_NAME_ONLY;  /* show procedure info */
-  DWORD64 addr;
   DWORD64 ofs_from_symbol = 0;                  /* How far from the symbol we were */
   DWORD   ofs_from_line   = 0;                  /* How far from the line we were */
-  size_t  left            = sizeof(ret_buf);
-  char   *str             = ret_buf;
   char   *p, *end         = str + left;
 
-  /* Assume the module is MSVC/clang-cl compiled. Call 'p_SymFromAddr' and
-   * 'p_SymGetLineFromAddr64()' if this is the case. If the '<module>.pdb'
-   * is present while running a MinGW compiled program, this just returns
-   * wrong information from dbghelp.dll.
-   */
-  BOOL have_PDB_info = TRUE;
-
   if (g_cfg.max_displacement > 0)
      max_displ = g_cfg.max_displacement;
 
@@ -1658,40 +1817,6 @@ static DWORD decode_one_stack_frame (HANDLE thread, DWORD image_type,
 
   undec_name[0] = '\0';
 
-  /* Get next stack frame (StackWalk64(), SymFunctionTableAccess64(), SymGetModuleBase64()).
-   * if this returns ERROR_INVALID_ADDRESS (487) or ERROR_NOACCESS (998), you can
-   * assume that either you are done, or that the stack is so hosed that the next
-   * deeper frame could not be found.
-   * CONTEXT need not to be supplied if image_type is IMAGE_FILE_MACHINE_I386!
-   */
-  if (!(*p_StackWalk64)(image_type, g_proc, thread, stk, ctx, NULL,
-                        p_SymFunctionTableAccess64, p_SymGetModuleBase64, NULL))
-     return (1);
-
-  addr = stk->AddrPC.Offset;
-
-  if (addr == 0)    /* If we are here, we have no valid callstack entry! */
-     return (2);
-
-#if !defined(_MSC_VER) && !defined(__clang__)
-  {
-    DWORD64 base = (*p_SymGetModuleBase64) (g_proc, addr);
-    char    path [MAX_PATH] = { '\0' };
-
-    if (GetModuleFileName((HANDLE)(uintptr_t)base, path, sizeof(path)) &&
-        !stricmp(g_module,path))
-       have_PDB_info = FALSE;
-  }
-  /* otherwise the module can be a MSVC/clang-cl compiled module in a MinGW program.
-   */
-#endif
-
-  /* 'addr' is address of the returning location. Subtracting the address-width
-   * (width of the address bus) will give a more precise location of the address
-   * we were called *from*.
-   */
-  addr -= sizeof(void*);
-
 #ifdef USE_BFD
   if (BFD_get_function_name(addr, str, left) != 0)
      return (3);
@@ -1767,9 +1892,81 @@ static DWORD decode_one_stack_frame (HANDLE thread, DWORD image_type,
     snprintf (str, left, "+%" U64_FMT ")", ofs_from_symbol);
   }
 #endif          /* USE_BFD */
+
+  ARGSUSED (have_PDB_info);
   return (0);   /* Okay */
 }
 
+static DWORD decode_one_stack_frame (HANDLE thread, DWORD image_type,
+                                     STACKFRAME64 *stk, CONTEXT *ctx)
+{
+  struct ModuleEntry *me;
+  struct FrameEntry  *fe;
+  DWORD64 addr;
+  DWORD   err, idx = 0;
+
+  /* Assume the module is MSVC/clang-cl compiled. Call 'p_SymFromAddr' and
+   * 'p_SymGetLineFromAddr64()' if this is the case. If the '<module>.pdb'
+   * is present while running a MinGW compiled program, this just returns
+   * wrong information from dbghelp.dll.
+   */
+  BOOL have_PDB_info = TRUE;
+
+  /* Get next stack frame (StackWalk64(), SymFunctionTableAccess64(), SymGetModuleBase64()).
+   * if this returns ERROR_INVALID_ADDRESS (487) or ERROR_NOACCESS (998), you can
+   * assume that either you are done, or that the stack is so hosed that the next
+   * deeper frame could not be found.
+   * CONTEXT need not to be supplied if image_type is IMAGE_FILE_MACHINE_I386!
+   *
+   * The callbacks loads the symbols of a module the first time it is walked.
+   */
+  if (!(*p_StackWalk64)(image_type, g_proc, thread, stk, ctx, NULL,
+                        function_table_access, get_module_base, NULL))
+     return (1);
+
+  addr = stk->AddrPC.Offset;
+
+  if (addr == 0)    /* If we are here, we have no valid callstack entry! */
+     return (2);
+
+#if !defined(_MSC_VER) && !defined(__clang__)
+  {
+    DWORD64 base = get_module_base (g_proc, addr);
+    char    path [MAX_PATH] = { '\0' };
+
+    if (GetModuleFileName((HANDLE)(uintptr_t)base, path, sizeof(path)) &&
+        !stricmp(g_module,path))
+       have_PDB_info = FALSE;
+  }
+  /* otherwise the module can be a MSVC/clang-cl compiled module in a MinGW program.
+   */
+#endif
+
+  /* 'addr' is address of the returning location. Subtracting the address-width
+   * (width of the address bus) will give a more precise location of the address
+   * we were called *from*.
+   */
+  addr -= sizeof(void*);
+
+  /* A caller-address already resolved is a binary search in it's module.
+   */
+  me = module_from_addr (addr);
+  if (me)
+  {
+    fe = frame_lookup (me, (ULONG_PTR)addr, &idx);
+    if (fe)
+    {
+      _strlcpy (ret_buf, fe->str, sizeof(ret_buf));
+      return (fe->err);
+    }
+  }
+
+  err = decode_frame_addr (addr, have_PDB_info, ret_buf, sizeof(ret_buf));
+  if (me)
+     frame_add (me, idx, (ULONG_PTR)addr, err, err == 0 ? ret_buf : "");
+  return (err);
+}
+
 char *StackWalkShow (HANDLE thread, CONTEXT *ctx)
 {
   DWORD        image_type;
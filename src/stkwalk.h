@@ -24,11 +24,17 @@ typedef struct ModuleSymbolStats {
         DWORD  num_syms_lines;
       } ModuleSymbolStats;
 
+struct FrameEntry;
+
 typedef struct ModuleEntry {
-        char             *module_name;   /* fully qualified name of module */
-        ULONG_PTR         base_addr;
-        DWORD             size;
-        ModuleSymbolStats stat;
+        char              *module_name;   /* fully qualified name of module */
+        ULONG_PTR          base_addr;
+        DWORD              size;
+        ModuleSymbolStats  stat;
+        BOOL               sym_loaded;    /* 'SymLoadModule64()' was called for it */
+        struct FrameEntry *frames;        /* resolved caller-addresses sorted on address */
+        DWORD              num_frames;
+        DWORD              max_frames;
       } ModuleEntry;
 
 typedef struct SymbolEntry {
@@ -717,10 +717,494 @@ static int thread_test (int num_threads)
   return (0);
 }
 
+/*
+ * The hook-overhead benchmark for 'test.exe -b [N]'.
+ *
+ * Each config in 'bench_configs[]' runs this program again as 'test.exe -B<N>'
+ * with '%WSOCK_TRACE%' pointing to a config-file made from the normal one
+ * and the settings in the table. The child runs each test in 'bench_tests[]'
+ * with <N> threads over loopback and prints a CSV-line:
+ *   config,module,test,threads,calls,ns_per_call,calls_per_sec
+ *
+ * The "none" config calls the functions in 'ws2_32.dll' directly; that is
+ * what a program not linked with wsock_trace would spend.
+ */
+#define BENCH_LOOPS    10000
+#define BENCH_WARMUP   100
+#define BENCH_DATA_SZ  64
+
+typedef int  (WSAAPI *func_send) (SOCKET s, const char *buf, int len, int flags);
+typedef int  (WSAAPI *func_recv) (SOCKET s, char *buf, int len, int flags);
+typedef int  (WSAAPI *func_select) (int nfds, fd_set *rd, fd_set *wr, fd_set *ex, const struct timeval *tv);
+typedef int  (WSAAPI *func_getaddrinfo) (const char *host, const char *serv,
+                                         const struct addrinfo *hints, struct addrinfo **res);
+typedef void (WSAAPI *func_freeaddrinfo) (struct addrinfo *ai);
+typedef int  (WSAAPI *func_WSASend) (SOCKET s, WSABUF *bufs, DWORD num_bufs, DWORD *sent, DWORD flags,
+                                     WSAOVERLAPPED *ov, LPWSAOVERLAPPED_COMPLETION_ROUTINE func);
+#if USE_WSAPoll
+typedef int  (WSAAPI *func_WSAPoll) (WSAPOLLFD *fds, ULONG num, INT timeout);
+#endif
+
+struct bench_funcs {
+       func_send          send;
+       func_recv          recv;
+       func_select        select;
+       func_getaddrinfo   getaddrinfo;
+       func_freeaddrinfo  freeaddrinfo;
+       func_WSASend       WSASend;
+#if USE_WSAPoll
+       func_WSAPoll       WSAPoll;
+#endif
+     };
+
+struct bench_thread {
+       const struct bench_funcs *f;
+       const struct bench_test  *test;
+       SOCKET                    s, peer;
+       HANDLE                    t_hnd, start;
+       DWORD                     t_id;
+       DWORD                     calls;
+       DWORD                     errors;
+       LARGE_INTEGER             elapsed;
+     };
+
+/*
+ * One iteration of a test. Returns the number of Winsock calls done.
+ */
+typedef DWORD (*bench_func) (struct bench_thread *bt);
+
+struct bench_test {
+       const char *name;
+       bench_func  func;
+     };
+
+struct bench_config {
+       const char *name;
+       const char *settings;
+     };
+
+static struct bench_funcs bench_hooked, bench_raw;
+
+static DWORD bench_recv_all (struct bench_thread *bt, char *buf)
+{
+  DWORD calls = 0;
+  int   rc, got = 0;
+
+  while (got < BENCH_DATA_SZ)
+  {
+    rc = (*bt->f->recv) (bt->peer, buf + got, BENCH_DATA_SZ - got, 0);
+    calls++;
+    if (rc <= 0)
+    {
+      bt->errors++;
+      break;
+    }
+    got += rc;
+  }
+  return (calls);
+}
+
+static DWORD bench_send_recv (struct bench_thread *bt)
+{
+  char buf [BENCH_DATA_SZ];
+
+  memset (buf, 'x', sizeof(buf));
+  if ((*bt->f->send)(bt->s, buf, sizeof(buf), 0) != sizeof(buf))
+     bt->errors++;
+  return (1 + bench_recv_all(bt, buf));
+}
+
+static DWORD bench_WSASend (struct bench_thread *bt)
+{
+  char   buf [BENCH_DATA_SZ];
+  WSABUF wb;
+  DWORD  sent = 0;
+
+  memset (buf, 'x', sizeof(buf));
+  wb.buf = buf;
+  wb.len = sizeof(buf);
+  if ((*bt->f->WSASend)(bt->s, &wb, 1, &sent, 0, NULL, NULL) != 0 || sent != sizeof(buf))
+     bt->errors++;
+  return (1 + bench_recv_all(bt, buf));
+}
+
+/*
+ * A 'select()' on a socket with nothing to read; returns at once.
+ */
+static DWORD bench_select (struct bench_thread *bt)
+{
+  struct timeval tv = { 0, 0 };
+  fd_set fd;
+
+  FD_ZERO (&fd);
+  FD_SET (bt->s, &fd);
+  if ((*bt->f->select)(0, &fd, NULL, NULL, &tv) < 0)
+     bt->errors++;
+  return (1);
+}
+
+#if USE_WSAPoll
+static DWORD bench_WSAPoll (struct bench_thread *bt)
+{
+  WSAPOLLFD pfd;
+
+  pfd.fd      = bt->s;
+  pfd.events  = POLLIN;
+  pfd.revents = 0;
+  if ((*bt->f->WSAPoll)(&pfd, 1, 0) < 0)
+     bt->errors++;
+  return (1);
+}
+#endif
+
+/*
+ * A numeric 'getaddrinfo()' so we do not measure the DNS-server.
+ */
+static DWORD bench_getaddrinfo (struct bench_thread *bt)
+{
+  struct addrinfo hints, *res = NULL;
+
+  memset (&hints, 0, sizeof(hints));
+  hints.ai_family   = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags    = AI_NUMERICHOST;
+
+  if ((*bt->f->getaddrinfo)("127.0.0.1", "80", &hints, &res) != 0 || !res)
+  {
+    bt->errors++;
+    return (1);
+  }
+  (*bt->f->freeaddrinfo) (res);
+  return (2);
+}
+
+static const struct bench_test bench_tests[] = {
+                  { "send_recv",   bench_send_recv   },
+                  { "WSASend",     bench_WSASend     },
+                  { "select",      bench_select      },
+#if USE_WSAPoll
+                  { "WSAPoll",     bench_WSAPoll     },
+#endif
+                  { "getaddrinfo", bench_getaddrinfo }
+                };
+
+static const struct bench_config bench_configs[] = {
+                  { "none",           "" },
+                  { "trace_level=0",  "[core]\ntrace_level = 0\n" },
+                  { "default",        "" },
+                  { "dump_data=1",    "[core]\ndump_data = 1\n" },
+                  { "callee_level=3", "[core]\ncallee_level = 3\n" },
+                  { "trace_ring=1",   "[core]\ntrace_ring = 1\n" },
+                  { "pcap_enable=1",  "[core]\npcap_enable = 1\npcap_dump = %TEMP%\\wstrace-bench.pcap\n" },
+                  { "geoip_enable=1", "[geoip]\nenable = 1\n" }
+                };
+
+/*
+ * The functions as linked (hooked by wsock_trace) and as in 'ws2_32.dll'.
+ */
+static BOOL bench_init_funcs (void)
+{
+  HMODULE mod = LoadLibraryA ("ws2_32.dll");
+
+  bench_hooked.send         = (func_send) send;
+  bench_hooked.recv         = (func_recv) recv;
+  bench_hooked.select       = (func_select) select;
+  bench_hooked.getaddrinfo  = (func_getaddrinfo) getaddrinfo;
+  bench_hooked.freeaddrinfo = (func_freeaddrinfo) freeaddrinfo;
+  bench_hooked.WSASend      = (func_WSASend) WSASend;
+#if USE_WSAPoll
+  bench_hooked.WSAPoll      = (func_WSAPoll) WSAPoll;
+#endif
+
+  if (!mod)
+     return (FALSE);
+
+  bench_raw.send         = (func_send) GetProcAddress (mod, "send");
+  bench_raw.recv         = (func_recv) GetProcAddress (mod, "recv");
+  bench_raw.select       = (func_select) GetProcAddress (mod, "select");
+  bench_raw.getaddrinfo  = (func_getaddrinfo) GetProcAddress (mod, "getaddrinfo");
+  bench_raw.freeaddrinfo = (func_freeaddrinfo) GetProcAddress (mod, "freeaddrinfo");
+  bench_raw.WSASend      = (func_WSASend) GetProcAddress (mod, "WSASend");
+#if USE_WSAPoll
+  bench_raw.WSAPoll      = (func_WSAPoll) GetProcAddress (mod, "WSAPoll");
+  if (!bench_raw.WSAPoll)
+     return (FALSE);
+#endif
+  return (bench_raw.send && bench_raw.recv && bench_raw.select &&
+          bench_raw.getaddrinfo && bench_raw.freeaddrinfo && bench_raw.WSASend);
+}
+
+/*
+ * Return the name of the module the function 'addr' is in.
+ * "ws2_32.dll" or the wsock_trace DLL we're linked with.
+ */
+static const char *bench_module (const void *addr)
+{
+  static char name [MAX_PATH];
+  MEMORY_BASIC_INFORMATION mbi;
+  const char *p;
+
+  if (!VirtualQuery(addr, &mbi, sizeof(mbi)) ||
+      !GetModuleFileNameA((HMODULE)mbi.AllocationBase, name, sizeof(name)))
+     return ("?");
+  p = strrchr (name, '\\');
+  return (p ? p+1 : name);
+}
+
+/*
+ * Make a connected TCP-pair over loopback.
+ */
+static BOOL bench_socket_pair (SOCKET *s, SOCKET *peer)
+{
+  struct sockaddr_in sa;
+  int    len = sizeof(sa);
+  BOOL   on = TRUE;
+  SOCKET l = socket (AF_INET, SOCK_STREAM, 0);
+
+  *s = *peer = INVALID_SOCKET;
+  if (l == INVALID_SOCKET)
+     return (FALSE);
+
+  memset (&sa, 0, sizeof(sa));
+  sa.sin_family      = AF_INET;
+  sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  if (bind(l, (struct sockaddr*)&sa, sizeof(sa)) == 0 && listen(l, 1) == 0 &&
+      getsockname(l, (struct sockaddr*)&sa, &len) == 0)
+  {
+    *s = socket (AF_INET, SOCK_STREAM, 0);
+    if (*s != INVALID_SOCKET && connect(*s, (struct sockaddr*)&sa, sizeof(sa)) == 0)
+       *peer = accept (l, NULL, NULL);
+  }
+  closesocket (l);
+
+  if (*peer == INVALID_SOCKET)
+  {
+    if (*s != INVALID_SOCKET)
+       closesocket (*s);
+    *s = INVALID_SOCKET;
+    return (FALSE);
+  }
+  setsockopt (*s, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+  return (TRUE);
+}
+
+static DWORD WINAPI bench_worker (void *arg)
+{
+  struct bench_thread *bt = (struct bench_thread*) arg;
+  LARGE_INTEGER start, end;
+  int   i;
+
+  WaitForSingleObject (bt->start, INFINITE);
+
+  for (i = 0; i < BENCH_WARMUP; i++)
+      (*bt->test->func) (bt);
+
+  bt->calls = bt->errors = 0;
+  QueryPerformanceCounter (&start);
+  for (i = 0; i < BENCH_LOOPS; i++)
+      bt->calls += (*bt->test->func) (bt);
+  QueryPerformanceCounter (&end);
+  bt->elapsed.QuadPart = end.QuadPart - start.QuadPart;
+  return (0);
+}
+
+/*
+ * Run all 'bench_tests[]' with 'num_threads' threads.
+ * Called in the child started by 'bench_main()'.
+ */
+static int bench_run (const char *config, int num_threads)
+{
+  struct bench_thread *bt;
+  const struct bench_funcs *f;
+  LARGE_INTEGER freq, start, end;
+  HANDLE        hnd [MAXIMUM_WAIT_OBJECTS];
+  HANDLE        start_ev;
+  WSADATA       wsa;
+  double        ns, wall;
+  DWORD         calls, errors;
+  int           i, t;
+
+  num_threads = max (1, min(num_threads, MAXIMUM_WAIT_OBJECTS));
+
+  if (WSAStartup(MAKEWORD(2,2), &wsa) != 0 || !bench_init_funcs())
+  {
+    fprintf (stderr, "%s: failed to load the Winsock functions.\n", program_name);
+    return (1);
+  }
+
+  /* A program not linked with wsock_trace calls 'ws2_32.dll' directly.
+   */
+  f = strcmp(config, "none") ? &bench_hooked : &bench_raw;
+
+  bt = calloc (num_threads, sizeof(*bt));
+  start_ev = CreateEvent (NULL, TRUE, FALSE, NULL);
+  QueryPerformanceFrequency (&freq);
+
+  for (i = 0; i < num_threads; i++)
+  {
+    if (!bench_socket_pair(&bt[i].s, &bt[i].peer))
+    {
+      fprintf (stderr, "%s: failed to make a loopback socket-pair: %d.\n",
+               program_name, WSAGetLastError());
+      return (1);
+    }
+    bt[i].f     = f;
+    bt[i].start = start_ev;
+  }
+
+  for (t = 0; t < DIM(bench_tests); t++)
+  {
+    ResetEvent (start_ev);
+    for (i = 0; i < num_threads; i++)
+    {
+      bt[i].test  = bench_tests + t;
+      bt[i].t_hnd = hnd[i] = CreateThread (NULL, 0, bench_worker, bt+i, 0, &bt[i].t_id);
+    }
+
+    QueryPerformanceCounter (&start);
+    SetEvent (start_ev);
+    WaitForMultipleObjects (num_threads, hnd, TRUE, INFINITE);
+    QueryPerformanceCounter (&end);
+
+    calls = errors = 0;
+    ns = 0.0;
+    for (i = 0; i < num_threads; i++)
+    {
+      CloseHandle (bt[i].t_hnd);
+      calls  += bt[i].calls;
+      errors += bt[i].errors;
+      ns     += 1E9 * (double)bt[i].elapsed.QuadPart / (double)freq.QuadPart;
+    }
+    wall = (double)(end.QuadPart - start.QuadPart) / (double)freq.QuadPart;
+
+    printf ("%s,%s,%s,%d,%lu,%.1f,%.0f\n",
+            config, bench_module((const void*)f->send), bench_tests[t].name, num_threads,
+            DWORD_CAST(calls), calls ? ns / calls : 0.0, wall > 0.0 ? calls / wall : 0.0);
+    if (errors)
+       fprintf (stderr, "%s: %s: %lu errors.\n", config, bench_tests[t].name, DWORD_CAST(errors));
+  }
+
+  for (i = 0; i < num_threads; i++)
+  {
+    closesocket (bt[i].s);
+    closesocket (bt[i].peer);
+  }
+  CloseHandle (start_ev);
+  free (bt);
+  WSACleanup();
+  return (0);
+}
+
+/*
+ * Find the config-file the same way wsock_trace does.
+ */
+static FILE *bench_open_base_config (void)
+{
+  char  fname [MAX_PATH];
+  const char *env = getenv ("WSOCK_TRACE");
+  FILE *fil;
+
+  if (env)
+     return fopen (env, "r");
+
+  fil = fopen ("wsock_trace", "r");
+  if (!fil)
+  {
+    env = getenv ("APPDATA");
+    if (!env)
+       env = getenv ("HOME");
+    if (env)
+    {
+      snprintf (fname, sizeof(fname), "%s\\wsock_trace", env);
+      fil = fopen (fname, "r");
+    }
+  }
+  return (fil);
+}
+
+/*
+ * Write a config-file with the normal settings followed by the
+ * settings of one 'bench_configs[]'. Later keys win.
+ * The trace goes to a file so it does not mix with the CSV on stdout.
+ */
+static BOOL bench_write_config (const char *fname, const struct bench_config *cfg)
+{
+  char  buf [1024];
+  FILE *in, *out = fopen (fname, "w");
+
+  if (!out)
+     return (FALSE);
+
+  in = bench_open_base_config();
+  if (in)
+  {
+    while (fgets(buf, sizeof(buf), in))
+       fputs (buf, out);
+    fclose (in);
+  }
+  fputs ("\n[core]\n"
+         "trace_level  = 1\n"
+         "trace_file   = %TEMP%\\wstrace-bench.log\n"
+         "trace_report = 0\n", out);
+  fputs (cfg->settings, out);
+  fclose (out);
+  return (TRUE);
+}
+
+/*
+ * The 'test.exe -b [N]' driver. Run ourself once for each 'bench_configs[]'.
+ */
+static int bench_main (int num_threads)
+{
+  char  exe [MAX_PATH], cfg [MAX_PATH], cmd [MAX_PATH+20];
+  const struct bench_config *c = bench_configs;
+  STARTUPINFOA        si;
+  PROCESS_INFORMATION pi;
+  int   i, rc = 0;
+
+  if (!GetModuleFileNameA(NULL, exe, sizeof(exe)) || !GetTempPathA(sizeof(cfg)-20, cfg))
+     return (1);
+
+  strcat (cfg, "wstrace-bench.cfg");
+  snprintf (cmd, sizeof(cmd), "\"%s\" -B%d", exe, num_threads);
+
+  puts ("config,module,test,threads,calls,ns_per_call,calls_per_sec");
+
+  for (i = 0; i < DIM(bench_configs); i++, c++)
+  {
+    if (!bench_write_config(cfg, c))
+    {
+      fprintf (stderr, "%s: failed to write '%s'.\n", program_name, cfg);
+      rc = 1;
+      break;
+    }
+    SetEnvironmentVariableA ("WSOCK_TRACE", cfg);
+    SetEnvironmentVariableA ("WSOCK_TRACE_BENCH", c->name);
+
+    memset (&si, 0, sizeof(si));
+    si.cb = sizeof(si);
+    fflush (stdout);
+    if (!CreateProcessA(NULL, cmd, NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi))
+    {
+      fprintf (stderr, "%s: CreateProcess() failed: %lu.\n", program_name, DWORD_CAST(GetLastError()));
+      rc = 1;
+      break;
+    }
+    WaitForSingleObject (pi.hProcess, INFINITE);
+    CloseHandle (pi.hProcess);
+    CloseHandle (pi.hThread);
+  }
+  DeleteFileA (cfg);
+  return (rc);
+}
+
 static int show_help (void)
 {
-  puts ("Usage: test [-h] [-d] [-f] [-l] [-t] [test-wildcard]  (default = '*')");
+  puts ("Usage: test [-h] [-b] [-d] [-f] [-l] [-t] [test-wildcard]  (default = '*')");
   puts ("       -h:     this help.");
+  puts ("       -b [N]: run the hook-overhead benchmark with <N> threads for each config.\n"
+        "               Prints CSV-lines with ns/call and calls/sec on stdout.");
   puts ("       -d:     increase verbosity.");
   puts ("       -f:     Firewall event monitoring calling 'test_select3()' for 100 sec.\n"
         "               Similar to 'firewall_test.exe' but monitors events together with 'wsock_trace.dll'.");
@@ -755,10 +1239,11 @@ static void MS_CDECL quit (int sig)
 int MS_CDECL main (int argc, char **argv)
 {
   int i, c, num = 0;
+  const char *config;
 
   signal (SIGINT, quit);
 
-  while ((c = getopt (argc, argv, "h?fdlt::")) != EOF)
+  while ((c = getopt (argc, argv, "h?fdlt::b::B::")) != EOF)
     switch (c)
     {
       case '?':
@@ -781,6 +1266,15 @@ int MS_CDECL main (int argc, char **argv)
            else num = 1;
            exit (thread_test(num));
            break;
+      case 'b':
+           num = optarg ? atoi (optarg) : 1;
+           exit (bench_main(num));
+           break;
+      case 'B':      /* started by 'bench_main()' */
+           num = optarg ? atoi (optarg) : 1;
+           config = getenv ("WSOCK_TRACE_BENCH");
+           exit (bench_run(config ? config : "default", num));
+           break;
       case 'd':
            chatty++;
            break;
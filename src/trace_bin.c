@@ -0,0 +1,679 @@
+/**\file    trace_bin.c
+ * \ingroup Main
+ *
+ * \brief
+ *  Writer for the compact binary trace-format used with `trace_binary = 1`.
+ *
+ *  Instead of formatting a text-line for each traced call, a fixed-size
+ *  `struct trace_bin_record` is written to the `trace_file`. This costs
+ *  very little in the traced program.
+ *  The records are turned into text later by `trace_bin.exe`; i.e. this file
+ *  compiled with `-DTEST_TRACE_BIN`.
+ *
+ *  With `trace_file_split = 2`, each thread writes to it's own file with
+ *  "-<pid>-<tid>" put before the extension of the `trace_file`. E.g.
+ *  "wstrace-1234-5678.bin". `trace_bin.exe` given several files merges
+ *  their records on the time-stamps into one trace.
+ *  A thread's file is closed when the thread exits. So the CRT limit of
+ *  512 open streams (`_getmaxstdio()`) is only a limit on the number of
+ *  threads tracing at the same time. A thread past it writes no records.
+ */
+
+/* Because of warning "Use WSAAddressToStringW() instead" ...
+ */
+#ifndef _WINSOCK_DEPRECATED_NO_WARNINGS
+#define _WINSOCK_DEPRECATED_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "init.h"
+#include "smartlist.h"
+#include "wsock_trace.h"
+#include "trace_bin.h"
+
+#define TRACE_BIN_BUF_SIZE  (64*1024)
+
+#if !defined(TEST_TRACE_BIN)
+
+static FILE *bin_file;
+static char *bin_buf;
+
+/*
+ * The file of a thread with 'trace_file_split = 2'.
+ * A block of an exited thread is reused by a new thread with a new file.
+ */
+struct bin_thread {
+       struct bin_thread *next;
+       volatile LONG      owner;    /* thread-id using this block or 0 */
+       FILE              *file;
+       char              *buf;
+       BOOL               opened;   /* tried to open 'file'; maybe failed */
+     };
+
+static struct bin_thread *volatile bin_threads = NULL;
+static DWORD bin_tls = TLS_OUT_OF_INDEXES;
+
+/*
+ * Write the header and function-name table to 'file'.
+ */
+static BOOL bin_write_header (FILE *file)
+{
+  struct trace_bin_header hdr;
+  char   name [TRACE_BIN_NAME_LEN];
+  int    i, num = ws2_func_num();
+
+  memset (&hdr, '\0', sizeof(hdr));
+  hdr.magic           = TRACE_BIN_MAGIC;
+  hdr.version         = TRACE_BIN_VERSION;
+  hdr.rec_size        = sizeof(struct trace_bin_record);
+  hdr.pid             = GetCurrentProcessId();
+  hdr.num_funcs       = num;
+  hdr.start_ticks     = g_cfg.ts_start_ticks;
+  hdr.clocks_per_usec = g_cfg.ts_clocks_per_usec;
+  hdr.clock_source    = ts_is_rdtsc() ? TRACE_BIN_CLOCK_TSC : TRACE_BIN_CLOCK_QPC;
+  GetSystemTimeAsFileTime (&hdr.start_time);
+  _strlcpy (hdr.prog, curr_prog, sizeof(hdr.prog));
+
+  if (fwrite(&hdr, sizeof(hdr), 1, file) != 1)
+     return (FALSE);
+
+  for (i = 0; i < num; i++)
+  {
+    memset (&name, '\0', sizeof(name));
+    _strlcpy (name, ws2_func_name(i), sizeof(name));
+    if (fwrite(&name, sizeof(name), 1, file) != 1)
+       return (FALSE);
+  }
+  return (TRUE);
+}
+
+/**
+ * Take over the `file` and write the header and function-name table.
+ * Or with a NULL `file`, open a file for each thread on it's first record.
+ * The caller must have called `init_timestamp()` first.
+ */
+BOOL trace_bin_init (FILE *file)
+{
+  if (!file)
+  {
+    bin_tls = TlsAlloc();
+    if (bin_tls == TLS_OUT_OF_INDEXES)
+       return (FALSE);
+    TRACE (2, "Writing binary trace-records of %u bytes to a file per thread.\n",
+           (unsigned)sizeof(struct trace_bin_record));
+    return (TRUE);
+  }
+
+  bin_buf = malloc (TRACE_BIN_BUF_SIZE);
+  if (bin_buf)
+     setvbuf (file, bin_buf, _IOFBF, TRACE_BIN_BUF_SIZE);
+
+  if (!bin_write_header(file))
+  {
+    fclose (file);
+    free (bin_buf);
+    bin_buf = NULL;
+    return (FALSE);
+  }
+  bin_file = file;
+  TRACE (2, "Writing binary trace-records of %u bytes.\n", (unsigned)sizeof(struct trace_bin_record));
+  return (TRUE);
+}
+
+static void bin_thread_close (struct bin_thread *bt)
+{
+  if (bt->file)
+     fclose (bt->file);
+  bt->file   = NULL;
+  bt->opened = FALSE;
+}
+
+void trace_bin_exit (void)
+{
+  struct bin_thread *bt, *next;
+
+  if (bin_file)
+     fclose (bin_file);
+  bin_file = NULL;
+  free (bin_buf);
+  bin_buf = NULL;
+
+  for (bt = bin_threads; bt; bt = next)
+  {
+    next = bt->next;
+    bin_thread_close (bt);
+    free (bt->buf);
+    free (bt);
+  }
+  bin_threads = NULL;
+
+  if (bin_tls != TLS_OUT_OF_INDEXES)
+     TlsFree (bin_tls);
+  bin_tls = TLS_OUT_OF_INDEXES;
+}
+
+/*
+ * Return the file of the calling thread. Open it on first use.
+ * A thread-id can be reused by a later thread; hence a "-<n>" is added
+ * to the name of a file that already exists.
+ * Called inside the 'ENTER_CRIT()' / 'LEAVE_CRIT()' of a hook.
+ */
+static FILE *bin_thread_file (void)
+{
+  struct bin_thread *bt;
+  char   name [_MAX_PATH], base [_MAX_PATH];
+  DWORD  i;
+
+  bt = tls_block_get (bin_tls, (void*volatile*)&bin_threads, sizeof(*bt), NULL);
+  if (!bt)
+     return (NULL);
+
+  if (bt->opened)
+     return (bt->file);
+
+  /* Remember a failed open too; do not retry for each record.
+   */
+  bt->opened = TRUE;
+
+  get_split_name (g_cfg.trace_file, GetCurrentThreadId(), base, sizeof(base));
+  _strlcpy (name, base, sizeof(name));
+  for (i = 2; file_exists(name) && i < 100; i++)
+      get_split_name (base, i, name, sizeof(name));
+
+  bt->file = fopen_excl (name, "ab");
+  if (!bt->file)
+     return (NULL);
+
+  if (!bt->buf)
+     bt->buf = malloc (TRACE_BIN_BUF_SIZE);
+  if (bt->buf)
+     setvbuf (bt->file, bt->buf, _IOFBF, TRACE_BIN_BUF_SIZE);
+  if (!bin_write_header(bt->file))
+     bin_thread_close (bt);
+  bt->opened = TRUE;
+  return (bt->file);
+}
+
+/**
+ * Called from `DllMain()`: `dwReason == DLL_THREAD_DETACH`.
+ * Close the file of this thread and let a new thread reuse the block.
+ * This is done under the loader-lock; so take no lock of our own.
+ * The block is owned by this thread only.
+ */
+void trace_bin_thread_exit (void)
+{
+  struct bin_thread *bt;
+
+  if (bin_tls == TLS_OUT_OF_INDEXES)
+     return;
+
+  bt = TlsGetValue (bin_tls);
+  if (!bt)
+     return;
+
+  bin_thread_close (bt);
+  tls_block_release (bin_tls);
+}
+
+/**
+ * Write one record. Called inside the `ENTER_CRIT()` / `LEAVE_CRIT()` of a hook.
+ * The `wsa_error` is stored as given; 0 if the call did not fail.
+ */
+void trace_bin_write (int func_id, SOCKET s, int rc, DWORD wsa_error,
+                      DWORD bytes, const struct sockaddr *sa)
+{
+  struct trace_bin_record rec;
+  FILE  *file = bin_file;
+
+  if (bin_tls != TLS_OUT_OF_INDEXES)
+     file = bin_thread_file();
+  if (!file)
+     return;
+
+  rec.ticks     = get_hook_ticks();
+  rec.socket    = (unsigned __int64) s;
+  rec.rc        = rc;
+  rec.wsa_error = wsa_error;
+  rec.bytes     = bytes;
+  rec.thread_id = GetCurrentThreadId();
+  rec.func_id   = (func_id < 0) ? 0xFFFF : (WORD) func_id;
+  rec.family    = 0;
+  rec.port      = 0;
+  rec.reserved  = 0;
+  memset (&rec.addr, '\0', sizeof(rec.addr));
+
+  if (sa && sa->sa_family == AF_INET)
+  {
+    const struct sockaddr_in *sa4 = (const struct sockaddr_in*) sa;
+
+    rec.family = AF_INET;
+    rec.port   = sa4->sin_port;
+    memcpy (&rec.addr, &sa4->sin_addr, sizeof(sa4->sin_addr));
+  }
+  else if (sa && sa->sa_family == AF_INET6)
+  {
+    const struct sockaddr_in6 *sa6 = (const struct sockaddr_in6*) sa;
+
+    rec.family = AF_INET6;
+    rec.port   = sa6->sin6_port;
+    memcpy (&rec.addr, &sa6->sin6_addr, sizeof(sa6->sin6_addr));
+  }
+  fwrite (&rec, sizeof(rec), 1, file);
+}
+
+#else  /* TEST_TRACE_BIN */
+
+#include "getopt.h"
+
+/* For getopt.c.
+ */
+const char *program_name = "trace_bin.exe";
+
+struct config_table g_cfg;
+
+/*
+ * One binary trace-file given on the command-line.
+ */
+struct bin_input {
+       FILE                    *file;
+       struct trace_bin_header  hdr;
+       char                    *func_names;
+       struct trace_bin_record  rec;          /* the next record to print */
+       BOOL                     have_rec;
+       double                   start_usec;   /* it's start after the earliest file */
+     };
+
+static struct trace_bin_header hdr;      /* of the earliest file */
+static BOOL   same_clock;                /* all files have the same clock; compare the ticks */
+
+void set_color (const WORD *col)
+{
+  ARGSUSED (col);
+}
+
+void ws_sema_wait (void)
+{
+}
+
+void ws_sema_release (void)
+{
+}
+
+void usage (const char *argv0)
+{
+  printf ("%s [-t absolute | relative | delta | none] binary-trace-file(s)\n"
+          "   -t select the time-stamp format (default: relative)\n"
+          "   Several files (or a wildcard like \"wstrace-*.bin\") are merged on the time-stamps.\n",
+          argv0);
+  exit (0);
+}
+
+static const char *func_name (const struct bin_input *in, WORD func_id)
+{
+  static char buf [20];
+
+  if (func_id < in->hdr.num_funcs)
+     return (in->func_names + func_id * TRACE_BIN_NAME_LEN);
+  snprintf (buf, sizeof(buf), "<func %u>", func_id);
+  return (buf);
+}
+
+static unsigned __int64 filetime_u64 (const FILETIME *ft)
+{
+  ULARGE_INTEGER ul;
+
+  ul.LowPart  = ft->dwLowDateTime;
+  ul.HighPart = ft->dwHighDateTime;
+  return (ul.QuadPart);
+}
+
+/*
+ * Return the usec of the next record in 'in' after the start of the earliest file.
+ * The QPC-clock and an invariant TSC are system-wide. So with the same clock
+ * in all files, compare the ticks at the rate of the earliest file.
+ * Otherwise rely on the start-time of each file.
+ */
+static double rec_usec (const struct bin_input *in)
+{
+  if (same_clock)
+     return (double) (int64) (in->rec.ticks - hdr.start_ticks) / (double) hdr.clocks_per_usec;
+
+  return in->start_usec +
+         (double) (int64) (in->rec.ticks - in->hdr.start_ticks) / (double) in->hdr.clocks_per_usec;
+}
+
+static const char *time_str (double usec, TS_TYPE ts_type)
+{
+  static char   buf [40];
+  static double last = 0.0;
+
+  if (ts_type == TS_RELATIVE)
+     snprintf (buf, sizeof(buf), "%.3f msec: ", usec / 1000.0);
+
+  else if (ts_type == TS_DELTA)
+     snprintf (buf, sizeof(buf), "%.3f msec: ", (usec - last) / 1000.0);
+
+  else if (ts_type == TS_ABSOLUTE)
+  {
+    ULARGE_INTEGER ul;
+    FILETIME       ft, loc_time;
+    SYSTEMTIME     sys_time;
+
+    ul.QuadPart = filetime_u64 (&hdr.start_time) + (unsigned __int64) (10.0 * usec);   /* 100 nsec units */
+    ft.dwLowDateTime  = ul.LowPart;
+    ft.dwHighDateTime = ul.HighPart;
+    FileTimeToLocalFileTime (&ft, &loc_time);
+    FileTimeToSystemTime (&loc_time, &sys_time);
+    snprintf (buf, sizeof(buf), "%02u:%02u:%02u.%03u: ",
+              sys_time.wHour, sys_time.wMinute, sys_time.wSecond, sys_time.wMilliseconds);
+  }
+  else
+    buf[0] = '\0';
+
+  last = usec;
+  return (buf);
+}
+
+static const char *addr_str (const struct trace_bin_record *rec)
+{
+  static char buf [100];
+  char   addr [INET6_ADDRSTRLEN+10];
+  DWORD  len = sizeof(addr);
+  struct sockaddr_in6 sa;
+
+  memset (&sa, '\0', sizeof(sa));
+  if (rec->family == AF_INET)
+  {
+    struct sockaddr_in *sa4 = (struct sockaddr_in*) &sa;
+
+    sa4->sin_family = AF_INET;
+    memcpy (&sa4->sin_addr, &rec->addr, sizeof(sa4->sin_addr));
+    sa4->sin_port = rec->port;
+  }
+  else if (rec->family == AF_INET6)
+  {
+    sa.sin6_family = AF_INET6;
+    memcpy (&sa.sin6_addr, &rec->addr, sizeof(sa.sin6_addr));
+    sa.sin6_port = rec->port;
+  }
+  else
+    return ("");
+
+  if (WSAAddressToStringA((struct sockaddr*)&sa, sizeof(sa), NULL, addr, &len) != 0)
+     strcpy (addr, "??");
+  snprintf (buf, sizeof(buf), ", %s", addr);
+  return (buf);
+}
+
+static const char *rc_str (const struct trace_bin_record *rec)
+{
+  static char buf [150];
+
+  /* 'getaddrinfo()' and 'getnameinfo()' returns an 'EAI_x' code > 0.
+   */
+  if (rec->rc < 0 || rec->wsa_error)
+     return ws_strerror (rec->wsa_error, buf, sizeof(buf));
+
+  if (rec->bytes)
+       snprintf (buf, sizeof(buf), "%lu bytes", DWORD_CAST(rec->bytes));
+  else snprintf (buf, sizeof(buf), "%d", rec->rc);
+  return (buf);
+}
+
+/*
+ * Open 'name' and read it's header, function-names and first record.
+ */
+static struct bin_input *open_input (const char *name)
+{
+  struct bin_input *in;
+  char     start [50];
+  SYSTEMTIME sys_time;
+  FILETIME loc_time;
+
+  in = calloc (1, sizeof(*in));
+  if (!in)
+     return (NULL);
+
+  in->file = fopen (name, "rb");
+  if (!in->file)
+  {
+    printf ("Failed to open '%s'.\n", name);
+    goto fail;
+  }
+
+  /* A version 1 header is the same without the 'clock_source'.
+   */
+  if (fread(&in->hdr, TRACE_BIN_HEADER_V1_SIZE, 1, in->file) != 1 ||
+      in->hdr.magic != TRACE_BIN_MAGIC ||
+      (in->hdr.version != 1 && in->hdr.version != TRACE_BIN_VERSION) ||
+      (in->hdr.version >= 2 &&
+       fread(&in->hdr.clock_source, sizeof(in->hdr.clock_source), 1, in->file) != 1))
+  {
+    printf ("%s: Not a binary trace-file.\n", name);
+    goto fail;
+  }
+  if (in->hdr.rec_size != sizeof(in->rec) || in->hdr.clocks_per_usec == 0)
+  {
+    printf ("%s: Unsupported record-size %u.\n", name, in->hdr.rec_size);
+    goto fail;
+  }
+
+  in->func_names = calloc (in->hdr.num_funcs, TRACE_BIN_NAME_LEN);
+  if (!in->func_names ||
+      fread(in->func_names, TRACE_BIN_NAME_LEN, in->hdr.num_funcs, in->file) != in->hdr.num_funcs)
+  {
+    printf ("%s: Failed to read the function-names.\n", name);
+    goto fail;
+  }
+
+  FileTimeToLocalFileTime (&in->hdr.start_time, &loc_time);
+  FileTimeToSystemTime (&loc_time, &sys_time);
+  snprintf (start, sizeof(start), "%04u-%02u-%02u %02u:%02u:%02u",
+            sys_time.wYear, sys_time.wMonth, sys_time.wDay,
+            sys_time.wHour, sys_time.wMinute, sys_time.wSecond);
+
+  printf ("\n------- Trace started at %s ------- %.*s, PID %lu.\n",
+          start, (int)sizeof(in->hdr.prog), in->hdr.prog, DWORD_CAST(in->hdr.pid));
+
+  in->have_rec = (fread(&in->rec, sizeof(in->rec), 1, in->file) == 1);
+  return (in);
+
+fail:
+  if (in->file)
+     fclose (in->file);
+  free (in->func_names);
+  free (in);
+  return (NULL);
+}
+
+static void close_input (void *_in)
+{
+  struct bin_input *in = _in;
+
+  fclose (in->file);
+  free (in->func_names);
+  free (in);
+}
+
+/*
+ * Add the file 'arg' or the files matching a wildcard in 'arg'.
+ */
+static void add_inputs (smartlist_t *inputs, const char *arg)
+{
+  struct bin_input *in;
+  WIN32_FIND_DATAA  fd;
+  HANDLE  hnd;
+  char    path [_MAX_PATH];
+  const char *slash, *bslash;
+  int     dir_len;
+
+  if (!strpbrk(arg, "*?"))
+  {
+    in = open_input (arg);
+    if (in)
+       smartlist_add (inputs, in);
+    return;
+  }
+
+  slash  = strrchr (arg, '/');
+  bslash = strrchr (arg, '\\');
+  if (bslash > slash)
+     slash = bslash;
+  dir_len = slash ? (int) (slash - arg + 1) : 0;
+
+  hnd = FindFirstFileA (arg, &fd);
+  if (hnd == INVALID_HANDLE_VALUE)
+  {
+    printf ("No files matching '%s'.\n", arg);
+    return;
+  }
+  do
+  {
+    if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+       continue;
+    snprintf (path, sizeof(path), "%.*s%s", dir_len, arg, fd.cFileName);
+    in = open_input (path);
+    if (in)
+       smartlist_add (inputs, in);
+  }
+  while (FindNextFileA(hnd, &fd));
+  FindClose (hnd);
+}
+
+/*
+ * Print the records of all 'inputs' ordered on their time-stamps.
+ * With several files, each record gets the PID of it's file.
+ */
+static int decode_files (smartlist_t *inputs, TS_TYPE ts_type)
+{
+  struct bin_input *in, *next;
+  const struct bin_input *first;
+  double   usec, best;
+  DWORD    num = 0;
+  int      i, max = smartlist_len (inputs);
+
+  if (max == 0)
+     return (1);
+
+  /* Find the earliest start and check if all files have the same clock.
+   * Each process calibrates the TSC-rate itself; they can differ a bit.
+   * But the TSC is the same clock; so use the rate of the earliest file.
+   * A version 1 file has no 'clock_source'; then the rates must match.
+   */
+  first = smartlist_get (inputs, 0);
+  same_clock = TRUE;
+  for (i = 1; i < max; i++)
+  {
+    in = smartlist_get (inputs, i);
+    if (in->hdr.clock_source != first->hdr.clock_source ||
+        (in->hdr.clock_source == TRACE_BIN_CLOCK_UNKNOWN &&
+         in->hdr.clocks_per_usec != first->hdr.clocks_per_usec))
+       same_clock = FALSE;
+  }
+  for (i = 1; i < max; i++)
+  {
+    in = smartlist_get (inputs, i);
+    if (filetime_u64(&in->hdr.start_time) < filetime_u64(&first->hdr.start_time))
+       first = in;
+  }
+  hdr = first->hdr;
+
+  if (!same_clock)
+     printf ("Warning: the files do not have the same clock. Merging on the start-time "
+             "of each file; the order of close records can be wrong.\n");
+
+  for (i = 0; i < max; i++)
+  {
+    in = smartlist_get (inputs, i);
+    in->start_usec = (double) (filetime_u64(&in->hdr.start_time) - filetime_u64(&hdr.start_time)) / 10.0;
+  }
+
+  while (1)
+  {
+    next = NULL;
+    best = 0.0;
+    for (i = 0; i < max; i++)
+    {
+      in = smartlist_get (inputs, i);
+      if (!in->have_rec)
+         continue;
+      usec = rec_usec (in);
+      if (!next || usec < best)
+      {
+        next = in;
+        best = usec;
+      }
+    }
+    if (!next)
+       break;
+
+    printf ("  * %s%s (", time_str(best, ts_type), func_name(next, next->rec.func_id));
+    if (next->rec.socket != (unsigned __int64) INVALID_SOCKET)
+         printf ("%" U64_FMT "%s", next->rec.socket, addr_str(&next->rec));
+    else printf ("%s", addr_str(&next->rec));
+
+    if (max > 1)
+         printf (") --> %s, PID %lu, thread %lu.\n", rc_str(&next->rec),
+                 DWORD_CAST(next->hdr.pid), DWORD_CAST(next->rec.thread_id));
+    else printf (") --> %s, thread %lu.\n", rc_str(&next->rec), DWORD_CAST(next->rec.thread_id));
+
+    next->have_rec = (fread(&next->rec, sizeof(next->rec), 1, next->file) == 1);
+    num++;
+  }
+  if (max > 1)
+       printf ("%lu records from %d files.\n", DWORD_CAST(num), max);
+  else printf ("%lu records.\n", DWORD_CAST(num));
+  return (0);
+}
+
+int main (int argc, char **argv)
+{
+  const char  *my_name = argv[0];
+  TS_TYPE      ts_type = TS_RELATIVE;
+  WSADATA      wsa;
+  smartlist_t *inputs;
+  int          ch, rc;
+
+  while ((ch = getopt(argc, argv, "t:h?")) != EOF)
+     switch (ch)
+     {
+       case 't':
+            if (!stricmp(optarg, "absolute"))
+               ts_type = TS_ABSOLUTE;
+            else if (!stricmp(optarg, "relative"))
+               ts_type = TS_RELATIVE;
+            else if (!stricmp(optarg, "delta"))
+               ts_type = TS_DELTA;
+            else if (!stricmp(optarg, "none"))
+               ts_type = TS_NONE;
+            else
+              usage (my_name);
+            break;
+       case '?':
+       case 'h':
+       default:
+            usage (my_name);
+            break;
+  }
+
+  argc -= optind;
+  argv += optind;
+  if (!*argv)
+     usage (my_name);
+
+  inputs = smartlist_new();
+  for ( ; *argv; argv++)
+      add_inputs (inputs, *argv);
+
+  WSAStartup (MAKEWORD(2,2), &wsa);
+  g_cfg.trace_stream = stdout;
+  rc = decode_files (inputs, ts_type);
+  smartlist_wipe (inputs, close_input);
+  smartlist_free (inputs);
+  WSACleanup();
+  return (rc);
+}
+#endif  /* TEST_TRACE_BIN */
@@ -0,0 +1,81 @@
+/**\file    trace_bin.h
+ * \ingroup Main
+ *
+ * \brief
+ *  The compact binary trace-format written when `trace_binary = 1`.
+ *  Decoded later by `trace_bin.exe`.
+ */
+#ifndef _TRACE_BIN_H
+#define _TRACE_BIN_H
+
+#define TRACE_BIN_MAGIC     0x4E425357   /* "WSBN" */
+#define TRACE_BIN_VERSION   2
+#define TRACE_BIN_NAME_LEN  32
+
+/*
+ * The 'clock_source' of the ticks in a file. A version 1 file has
+ * no 'clock_source'; it is read as 'TRACE_BIN_CLOCK_UNKNOWN'.
+ */
+#define TRACE_BIN_CLOCK_UNKNOWN  0
+#define TRACE_BIN_CLOCK_QPC      1
+#define TRACE_BIN_CLOCK_TSC      2
+
+#if defined(_MSC_VER) || defined(__CYGWIN__)
+  #pragma pack(push,1)
+#else
+  #pragma pack(1)
+#endif
+
+/*
+ * Written once at the start of each trace-session.
+ * Followed by 'num_funcs' names of 'TRACE_BIN_NAME_LEN' bytes each.
+ * A record's 'func_id' is an index into this table.
+ */
+struct trace_bin_header {
+       DWORD            magic;
+       WORD             version;
+       WORD             rec_size;
+       DWORD            pid;
+       DWORD            num_funcs;
+       unsigned __int64 start_ticks;       /* QPC- or TSC-value at start */
+       unsigned __int64 clocks_per_usec;
+       FILETIME         start_time;        /* UTC time at start */
+       char             prog [64];
+       DWORD            clock_source;      /* TRACE_BIN_CLOCK_x; new in version 2 */
+     };
+
+/*
+ * The size of a version 1 header; without the 'clock_source'.
+ */
+#define TRACE_BIN_HEADER_V1_SIZE  (sizeof(struct trace_bin_header) - sizeof(DWORD))
+
+/*
+ * One fixed-size record for each traced call.
+ */
+struct trace_bin_record {
+       unsigned __int64 ticks;         /* QPC- or TSC-value at the call */
+       unsigned __int64 socket;
+       int              rc;
+       DWORD            wsa_error;     /* 'WSAGetLastError()' if 'rc < 0', an 'EAI_x' code or 0 */
+       DWORD            bytes;         /* bytes sent or received */
+       DWORD            thread_id;
+       WORD             func_id;
+       WORD             family;        /* AF_INET, AF_INET6 or 0 */
+       WORD             port;          /* on network order */
+       WORD             reserved;
+       BYTE             addr [16];
+     };
+
+#if defined(_MSC_VER) || defined(__CYGWIN__)
+  #pragma pack(pop)
+#else
+  #pragma pack()
+#endif
+
+extern BOOL trace_bin_init  (FILE *file);
+extern void trace_bin_exit  (void);
+extern void trace_bin_thread_exit (void);
+extern void trace_bin_write (int func_id, SOCKET s, int rc, DWORD wsa_error,
+                             DWORD bytes, const struct sockaddr *sa);
+
+#endif
@@ -0,0 +1,293 @@
+/**\file    trace_etw.c
+ * \ingroup Main
+ *
+ * \brief
+ *  An ETW (Event Tracing for Windows) sink used with `trace_etw = 1`.
+ *
+ *  Instead of formatting a text-line for each traced call, a structured
+ *  TraceLogging event is written to the ETW sessions enabling the
+ *  `"wsock_trace"` provider. The events are buffered in the kernel and
+ *  costs next to nothing when no session is listening. Record with e.g.:
+ *  ```
+ *   wpr -start wsock_trace.wprp
+ *   xperf -start wstrace -on *wsock_trace -f wstrace.etl
+ *   tracelog -start wstrace -guid *wsock_trace -f wstrace.etl
+ *  ```
+ *  and view the `.etl` file in WPA together with kernel network events.
+ *
+ *  The TraceLogging metadata is built here by hand since `<TraceLoggingProvider.h>`
+ *  is not available for all our compilers. The ETW functions in `advapi32.dll`
+ *  are loaded dynamically.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "init.h"
+#include "wsock_trace.h"
+#include "trace_etw.h"
+
+/*
+ * Our versions of 'EVENT_DESCRIPTOR' and 'EVENT_DATA_DESCRIPTOR' in <evntprov.h>.
+ */
+struct etw_event_descriptor {
+       USHORT    Id;
+       UCHAR     Version;
+       UCHAR     Channel;
+       UCHAR     Level;
+       UCHAR     Opcode;
+       USHORT    Task;
+       ULONGLONG Keyword;
+     };
+
+struct etw_data_descriptor {
+       ULONGLONG Ptr;
+       ULONG     Size;
+       UCHAR     Type;       /* 'EVENT_DATA_DESCRIPTOR_TYPE_x' */
+       UCHAR     Reserved1;
+       USHORT    Reserved2;
+     };
+
+#define ETW_DESC_TYPE_EVENT_METADATA     1
+#define ETW_DESC_TYPE_PROVIDER_METADATA  2
+#define ETW_CHANNEL_TRACELOGGING         11
+#define ETW_LEVEL_WARNING                3
+#define ETW_LEVEL_INFO                   4
+#define ETW_PROVIDER_SET_TRAITS          2  /* 'EventProviderSetTraits' */
+
+/*
+ * The TraceLogging in-types and out-types we use.
+ */
+#define TLG_IN_ANSISTRING      2
+#define TLG_IN_INT32           7
+#define TLG_IN_UINT32          8
+#define TLG_IN_UINT64          10
+#define TLG_IN_BINARY          14
+#define TLG_IN_HEXINT64        21
+#define TLG_IN_CHAIN           0x80  /* an out-type byte follows */
+#define TLG_OUT_SOCKETADDRESS  10
+#define TLG_OUT_WIN32ERROR     13
+
+typedef void (WINAPI *ETW_ENABLE_CALLBACK) (const GUID *source, ULONG is_enabled, UCHAR level,
+                                            ULONGLONG match_any, ULONGLONG match_all,
+                                            void *filter, void *ctx);
+
+typedef ULONG (WINAPI *func_EventRegister) (const GUID *provider, ETW_ENABLE_CALLBACK callback,
+                                            void *ctx, ULONGLONG *handle);
+
+typedef ULONG (WINAPI *func_EventUnregister) (ULONGLONG handle);
+
+typedef ULONG (WINAPI *func_EventWriteTransfer) (ULONGLONG handle,
+                                                 const struct etw_event_descriptor *desc,
+                                                 const GUID *activity_id,
+                                                 const GUID *related_id,
+                                                 ULONG count,
+                                                 struct etw_data_descriptor *data);
+
+typedef ULONG (WINAPI *func_EventSetInformation) (ULONGLONG handle, int info_class,
+                                                  void *info, ULONG size);
+
+static func_EventRegister       p_EventRegister = NULL;
+static func_EventUnregister     p_EventUnregister = NULL;
+static func_EventWriteTransfer  p_EventWriteTransfer = NULL;
+static func_EventSetInformation p_EventSetInformation = NULL;
+
+#define ADD_VALUE(opt, func)  { opt, NULL, "advapi32.dll", #func, (void**)&p_##func }
+
+static struct LoadTable etw_funcs [] = {
+              ADD_VALUE (0, EventRegister),
+              ADD_VALUE (0, EventUnregister),
+              ADD_VALUE (0, EventWriteTransfer),
+              ADD_VALUE (1, EventSetInformation)
+            };
+
+/*
+ * {1D1A8F83-DA18-5DDD-4266-D04BE40760DD} == TRACE_ETW_GUID.
+ */
+static const GUID etw_guid = { 0x1D1A8F83, 0xDA18, 0x5DDD,
+                               { 0x42, 0x66, 0xD0, 0x4B, 0xE4, 0x07, 0x60, 0xDD }
+                             };
+
+static ULONGLONG     etw_handle;
+static volatile LONG etw_listening;    /* set by 'etw_enable_callback()' */
+static DWORD         etw_events, etw_errors;
+
+/*
+ * The provider traits and the metadata for our one "WinsockCall" event.
+ * Built once in 'trace_etw_init()'.
+ */
+static BYTE  etw_traits [2+sizeof(TRACE_ETW_PROVIDER)];
+static BYTE  etw_meta [200];
+static ULONG etw_meta_len;
+
+static const struct etw_event_descriptor etw_event = {
+                    0, 0, ETW_CHANNEL_TRACELOGGING, ETW_LEVEL_INFO, 0, 0, 0
+                  };
+
+static const struct etw_event_descriptor etw_event_err = {
+                    0, 0, ETW_CHANNEL_TRACELOGGING, ETW_LEVEL_WARNING, 0, 0, 0
+                  };
+
+static void WINAPI etw_enable_callback (const GUID *source, ULONG is_enabled, UCHAR level,
+                                        ULONGLONG match_any, ULONGLONG match_all,
+                                        void *filter, void *ctx)
+{
+  InterlockedExchange (&etw_listening, is_enabled ? 1 : 0);
+  ARGSUSED (source);
+  ARGSUSED (level);
+  ARGSUSED (match_any);
+  ARGSUSED (match_all);
+  ARGSUSED (filter);
+  ARGSUSED (ctx);
+}
+
+/*
+ * Add a field to the event metadata: the name, the in-type and
+ * optionally an out-type.
+ */
+static void etw_meta_field (const char *name, BYTE in_type, BYTE out_type)
+{
+  size_t len = strlen (name) + 1;
+
+  if (etw_meta_len + len + 2 > sizeof(etw_meta))
+     return;
+
+  memcpy (etw_meta + etw_meta_len, name, len);
+  etw_meta_len += (ULONG) len;
+  if (out_type)
+  {
+    etw_meta [etw_meta_len++] = in_type | TLG_IN_CHAIN;
+    etw_meta [etw_meta_len++] = out_type;
+  }
+  else
+    etw_meta [etw_meta_len++] = in_type;
+}
+
+static void etw_build_metadata (void)
+{
+  static const char name[] = "WinsockCall";
+  WORD   size = sizeof(etw_traits);
+
+  memcpy (etw_traits, &size, 2);
+  memcpy (etw_traits+2, TRACE_ETW_PROVIDER, sizeof(TRACE_ETW_PROVIDER));
+
+  etw_meta_len = 2;         /* the total size goes here */
+  etw_meta [etw_meta_len++] = 0;   /* no tags */
+  memcpy (etw_meta + etw_meta_len, name, sizeof(name));
+  etw_meta_len += sizeof(name);
+
+  etw_meta_field ("Function", TLG_IN_ANSISTRING, 0);
+  etw_meta_field ("Socket",   TLG_IN_UINT64, 0);
+  etw_meta_field ("Result",   TLG_IN_INT32, 0);
+  etw_meta_field ("Error",    TLG_IN_UINT32, TLG_OUT_WIN32ERROR);
+  etw_meta_field ("Bytes",    TLG_IN_UINT32, 0);
+  etw_meta_field ("Caller",   TLG_IN_HEXINT64, 0);
+  etw_meta_field ("Address",  TLG_IN_BINARY, TLG_OUT_SOCKETADDRESS);
+
+  size = (WORD) etw_meta_len;
+  memcpy (etw_meta, &size, 2);
+}
+
+/**
+ * Load the ETW functions and register our provider.
+ */
+BOOL trace_etw_init (void)
+{
+  ULONG rc;
+
+  if (load_dynamic_table(etw_funcs, DIM(etw_funcs)) < (int)DIM(etw_funcs))
+  {
+    unload_dynamic_table (etw_funcs, DIM(etw_funcs));
+    WARNING ("'trace_etw = 1' needs ETW in advapi32.dll. Tracing as text.\n");
+    return (FALSE);
+  }
+
+  etw_build_metadata();
+
+  rc = (*p_EventRegister) (&etw_guid, etw_enable_callback, NULL, &etw_handle);
+  if (rc != ERROR_SUCCESS)
+  {
+    unload_dynamic_table (etw_funcs, DIM(etw_funcs));
+    WARNING ("EventRegister() failed: %s. Tracing as text.\n", win_strerror(rc));
+    return (FALSE);
+  }
+
+  /* Let ETW know the name of the provider.
+   */
+  if (p_EventSetInformation)
+     (*p_EventSetInformation) (etw_handle, ETW_PROVIDER_SET_TRAITS, etw_traits, sizeof(etw_traits));
+
+  TRACE (2, "Registered the ETW provider \"%s\" %s.\n", TRACE_ETW_PROVIDER, TRACE_ETW_GUID);
+  return (TRUE);
+}
+
+void trace_etw_exit (void)
+{
+  if (etw_handle)
+  {
+    TRACE (2, "Wrote %lu ETW events, %lu failed.\n",
+           DWORD_CAST(etw_events), DWORD_CAST(etw_errors));
+    (*p_EventUnregister) (etw_handle);
+    unload_dynamic_table (etw_funcs, DIM(etw_funcs));
+  }
+  etw_handle    = 0;
+  etw_listening = 0;
+}
+
+/**
+ * Return TRUE if an ETW session is listening to our provider.
+ */
+BOOL trace_etw_enabled (void)
+{
+  return (etw_handle && etw_listening);
+}
+
+static __inline void etw_data (struct etw_data_descriptor *d, const void *ptr, ULONG size)
+{
+  d->Ptr       = (ULONGLONG) (ULONG_PTR) ptr;
+  d->Size      = size;
+  d->Type      = 0;
+  d->Reserved1 = 0;
+  d->Reserved2 = 0;
+}
+
+/**
+ * Write one event. Unlike `trace_bin_write()` this needs no locking.
+ * The `wsa_error` is stored as given; 0 if the call did not fail.
+ */
+void trace_etw_write (int func_id, SOCKET s, int rc, DWORD wsa_error,
+                      DWORD bytes, const struct sockaddr *sa, ULONG_PTR caller)
+{
+  struct etw_data_descriptor data [10];
+  const char *func = (func_id < 0) ? "?" : ws2_func_name (func_id);
+  ULONGLONG   sock = (ULONGLONG) s;
+  ULONGLONG   ret_addr = (ULONGLONG) caller;
+  DWORD       err = wsa_error;
+  WORD        sa_len = 0;
+
+  if (!trace_etw_enabled())
+     return;
+
+  if (sa && sa->sa_family == AF_INET)
+     sa_len = sizeof(struct sockaddr_in);
+  else if (sa && sa->sa_family == AF_INET6)
+     sa_len = sizeof(struct sockaddr_in6);
+
+  etw_data (data+0, etw_traits, sizeof(etw_traits));
+  data[0].Type = ETW_DESC_TYPE_PROVIDER_METADATA;
+  etw_data (data+1, etw_meta, etw_meta_len);
+  data[1].Type = ETW_DESC_TYPE_EVENT_METADATA;
+  etw_data (data+2, func, (ULONG)strlen(func) + 1);
+  etw_data (data+3, &sock, sizeof(sock));
+  etw_data (data+4, &rc, sizeof(rc));
+  etw_data (data+5, &err, sizeof(err));
+  etw_data (data+6, &bytes, sizeof(bytes));
+  etw_data (data+7, &ret_addr, sizeof(ret_addr));
+  etw_data (data+8, &sa_len, sizeof(sa_len));
+  etw_data (data+9, sa, sa_len);
+
+  if ((*p_EventWriteTransfer)(etw_handle, (rc < 0 || err) ? &etw_event_err : &etw_event,
+                              NULL, NULL, DIM(data), data) == ERROR_SUCCESS)
+       etw_events++;
+  else etw_errors++;
+}
@@ -0,0 +1,24 @@
+/**\file    trace_etw.h
+ * \ingroup Main
+ *
+ * \brief
+ *  The ETW (Event Tracing for Windows) sink used with `trace_etw = 1`.
+ */
+#ifndef _TRACE_ETW_H
+#define _TRACE_ETW_H
+
+/*
+ * The TraceLogging provider-name. An ETW session enables it with
+ * "*wsock_trace" or the GUID below (derived from the name the same
+ * way as for an EventSource).
+ */
+#define TRACE_ETW_PROVIDER  "wsock_trace"
+#define TRACE_ETW_GUID      "{1D1A8F83-DA18-5DDD-4266-D04BE40760DD}"
+
+extern BOOL trace_etw_init    (void);
+extern void trace_etw_exit    (void);
+extern BOOL trace_etw_enabled (void);
+extern void trace_etw_write   (int func_id, SOCKET s, int rc, DWORD wsa_error,
+                               DWORD bytes, const struct sockaddr *sa, ULONG_PTR caller);
+
+#endif
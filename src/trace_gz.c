@@ -0,0 +1,321 @@
+/**\file    trace_gz.c
+ * \ingroup Main
+ *
+ * \brief
+ *  Streaming gzip output using the bundled miniz deflater.
+ *  Used with `trace_compress = N` and `pcap_compress = N` (N = level 1 - 9).
+ *
+ *  A `trace_gz_write()` only copies the data into the block being filled.
+ *  A full block (or one older than `TRACE_GZ_FLUSH_MSEC`) is handed to a
+ *  background thread which deflates it and writes it as a complete gzip-member.
+ *  Concatenated members is a valid gzip-file (RFC-1952), so a crash leaves
+ *  a file readable by `gzip -d` or `zcat` up to the last member written.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "init.h"
+#include "trace_gz.h"
+
+#define MINIZ_NO_STDIO
+#define MINIZ_NO_TIME
+#define MINIZ_NO_ARCHIVE_APIS
+#define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
+
+/*
+ * And turn off some warnings in the miniz code:
+ */
+#if defined(__GNUC__) || defined(__clang__)
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored     "-Wunused-function"
+  #if defined(__clang__)
+    #pragma clang diagnostic ignored "-Wunknown-warning-option"
+  #endif
+  #pragma GCC diagnostic ignored     "-Wmisleading-indentation"
+
+#elif defined(_MSC_VER)
+  #pragma warning (push)
+  #pragma warning (disable: 4244 4505)
+#endif
+
+#include "miniz.c"
+
+#if defined(__GNUC__) || defined(__clang__)
+  #pragma GCC diagnostic pop
+#elif defined(_MSC_VER)
+  #pragma warning (pop)
+#endif
+
+/*
+ * A 'trace_file' or 'pcap_dump' can grow beyond 2 GByte. So use 64-bit
+ * offsets where the CRT has them. Watcom, VC6 and CygWin are limited
+ * to a 'long' offset.
+ */
+#if (defined(_MSC_VER) && (_MSC_VER >= 1400)) || defined(__MINGW64_VERSION_MAJOR)
+  #define GZ_FTELL(f)         _ftelli64 (f)
+  #define GZ_FSEEK(f, ofs)    _fseeki64 (f, ofs, SEEK_SET)
+  #define GZ_CHSIZE(fd, size) _chsize_s (fd, size)
+#else
+  #define GZ_FTELL(f)         (int64) ftell (f)
+  #define GZ_FSEEK(f, ofs)    fseek (f, (long)(ofs), SEEK_SET)
+  #define GZ_CHSIZE(fd, size) _chsize (fd, (long)(size))
+#endif
+
+struct trace_gz {
+       FILE              *file;
+       const char        *what;        /* "trace_file" or "pcap_dump" */
+       mz_uint            flags;       /* the 'tdefl_init()' flags for the level */
+       tdefl_compressor  *comp;
+       CRITICAL_SECTION   lock;        /* for the below 'fill*' and 'work_len' */
+       BYTE              *fill;        /* the block being filled by 'trace_gz_write()' */
+       size_t             fill_len;
+       DWORD              fill_start;  /* 'GetTickCount()' at the first byte in 'fill' */
+       BYTE              *work;        /* the block being compressed by 'gz_thread()' */
+       size_t             work_len;    /* 0 when 'work' is free */
+       volatile LONG      writing;     /* 'gz_thread()' is writing a member from 'work' */
+       int64              member_start;  /* file offset of the member being written */
+       HANDLE             event, done, thread;
+       volatile LONG      stop;
+       uint64             bytes_in;
+       uint64             bytes_out;
+       DWORD              members;
+       DWORD              waits;       /* times 'trace_gz_write()' waited for 'gz_thread()' */
+     };
+
+static mz_bool gz_put_buf (const void *buf, int len, void *arg)
+{
+  struct trace_gz *gz = (struct trace_gz*) arg;
+
+  gz->bytes_out += len;
+  return (fwrite(buf, 1, len, gz->file) == (size_t)len);
+}
+
+/*
+ * Write 'len' bytes at 'data' as one gzip-member.
+ * Only called by the thread owning 'gz->work' (or the block).
+ * Must not 'TRACE()' since the 'trace_file' could be what we're writing.
+ */
+static void gz_write_member (struct trace_gz *gz, const BYTE *data, size_t len)
+{
+  static const BYTE header[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0x0B };  /* OS = NTFS */
+  BYTE     trailer[8];
+  mz_ulong crc = mz_crc32 (MZ_CRC32_INIT, data, len);
+  DWORD    size = (DWORD) len;
+  int      i;
+
+  gz->member_start = GZ_FTELL (gz->file);
+  gz->writing = 1;
+  fwrite (header, 1, sizeof(header), gz->file);
+  tdefl_init (gz->comp, gz_put_buf, gz, (int)gz->flags);
+  tdefl_compress_buffer (gz->comp, data, len, TDEFL_FINISH);
+
+  for (i = 0; i < 4; i++)
+  {
+    trailer[i]   = (BYTE) (crc >> (8*i));
+    trailer[4+i] = (BYTE) (size >> (8*i));
+  }
+  fwrite (trailer, 1, sizeof(trailer), gz->file);
+  fflush (gz->file);
+
+  gz->bytes_in  += len;
+  gz->bytes_out += sizeof(header) + sizeof(trailer);
+  gz->members++;
+}
+
+/*
+ * Hand the 'fill' block to 'gz_thread()'. With 'gz->lock' held.
+ * Returns FALSE if the thread is still busy with the previous block.
+ */
+static BOOL gz_swap (struct trace_gz *gz)
+{
+  BYTE *p;
+
+  if (gz->work_len > 0)
+     return (FALSE);
+
+  p             = gz->work;
+  gz->work      = gz->fill;
+  gz->work_len  = gz->fill_len;
+  gz->fill      = p;
+  gz->fill_len  = 0;
+  SetEvent (gz->event);
+  return (TRUE);
+}
+
+static DWORD WINAPI gz_thread (void *arg)
+{
+  struct trace_gz *gz = (struct trace_gz*) arg;
+  size_t len;
+
+  while (!gz->stop)
+  {
+    WaitForSingleObject (gz->event, 500);
+
+    EnterCriticalSection (&gz->lock);
+    if (gz->fill_len > 0 && GetTickCount() - gz->fill_start >= TRACE_GZ_FLUSH_MSEC)
+       gz_swap (gz);
+    len = gz->work_len;
+    LeaveCriticalSection (&gz->lock);
+
+    if (len > 0)
+    {
+      gz_write_member (gz, gz->work, len);
+      EnterCriticalSection (&gz->lock);
+      gz->work_len = 0;
+      gz->writing  = 0;
+      LeaveCriticalSection (&gz->lock);
+    }
+  }
+  SetEvent (gz->done);
+  return (0);
+}
+
+/**
+ * Take over the `file` (opened in binary mode) and start the thread
+ * compressing to it.
+ */
+struct trace_gz *trace_gz_open (FILE *file, int level, const char *what)
+{
+  struct trace_gz *gz = calloc (1, sizeof(*gz));
+  DWORD  tid;
+
+  if (!gz)
+     return (NULL);
+
+  if (level < 1 || level > 9)
+     level = MZ_DEFAULT_LEVEL;
+
+  gz->file  = file;
+  gz->what  = what;
+  gz->flags = tdefl_create_comp_flags_from_zip_params (level, -MZ_DEFAULT_WINDOW_BITS,
+                                                       MZ_DEFAULT_STRATEGY);
+  gz->comp  = malloc (sizeof(*gz->comp));
+  gz->fill  = malloc (TRACE_GZ_BLOCK_SIZE);
+  gz->work  = malloc (TRACE_GZ_BLOCK_SIZE);
+  if (!gz->comp || !gz->fill || !gz->work)
+  {
+    free (gz->comp);
+    free (gz->fill);
+    free (gz->work);
+    free (gz);
+    return (NULL);
+  }
+
+  InitializeCriticalSection (&gz->lock);
+  gz->event = CreateEvent (NULL, FALSE, FALSE, NULL);
+  gz->done  = CreateEvent (NULL, TRUE, FALSE, NULL);
+  if (gz->event && gz->done)
+     gz->thread = CreateThread (NULL, 0, gz_thread, gz, 0, &tid);
+
+  /* Without the thread, a full block is compressed in 'trace_gz_write()'.
+   * No 'TRACE()' here; the caller has not yet hooked 'gz' into the 'trace_file'.
+   */
+  return (gz);
+}
+
+/**
+ * Add `len` bytes to the block being filled.
+ * If the `gz_thread()` has not finished the previous block yet, wait for it.
+ */
+size_t trace_gz_write (struct trace_gz *gz, const void *buf, size_t len)
+{
+  const BYTE *p = (const BYTE*) buf;
+  size_t      n, total = len;
+
+  while (len > 0)
+  {
+    EnterCriticalSection (&gz->lock);
+
+    if (gz->fill_len == TRACE_GZ_BLOCK_SIZE)
+    {
+      if (!gz->thread)
+      {
+        gz_write_member (gz, gz->fill, gz->fill_len);
+        gz->fill_len = 0;
+      }
+      else if (!gz_swap(gz))
+      {
+        LeaveCriticalSection (&gz->lock);
+        gz->waits++;
+        SetEvent (gz->event);
+        Sleep (1);
+        continue;
+      }
+    }
+
+    n = min (len, TRACE_GZ_BLOCK_SIZE - gz->fill_len);
+    if (gz->fill_len == 0)
+       gz->fill_start = GetTickCount();
+    memcpy (gz->fill + gz->fill_len, p, n);
+    gz->fill_len += n;
+    p   += n;
+    len -= n;
+
+    if (gz->fill_len == TRACE_GZ_BLOCK_SIZE && gz->thread)
+       gz_swap (gz);
+    LeaveCriticalSection (&gz->lock);
+  }
+  return (total);
+}
+
+/**
+ * Stop the thread, write the remaining blocks and free `gz`.
+ * The caller closes the file.
+ *
+ * Since this is called from `DllMain()`, we cannot wait for the thread
+ * handle. Wait for `gz->done` instead. At process exit, the thread could
+ * already be killed; then the blocks are written here.
+ *
+ * If it was killed while writing a member, that member is rewritten from
+ * it's start and the file is truncated after it.
+ * If the thread is still running after the wait, `gz` is leaked.
+ */
+void trace_gz_close (struct trace_gz *gz)
+{
+  DWORD code;
+  BOOL  rewrite = FALSE;
+
+  if (!gz)
+     return;
+
+  /* This could be the last thing compressed into the 'trace_file'.
+   */
+  TRACE (2, "Closing '%s': %s bytes in, %s bytes written in %lu gzip-members (%lu waits).\n",
+         gz->what, qword_str(gz->bytes_in + gz->work_len + gz->fill_len),
+         qword_str(gz->bytes_out), DWORD_CAST(gz->members), DWORD_CAST(gz->waits));
+
+  if (gz->thread)
+  {
+    gz->stop = 1;
+    SetEvent (gz->event);
+    if (GetExitCodeThread(gz->thread, &code) && code != STILL_ACTIVE)
+       rewrite = gz->writing;
+    else if (WaitForSingleObject(gz->done, 2000) != WAIT_OBJECT_0)
+    {
+      if (!GetExitCodeThread(gz->thread, &code) || code == STILL_ACTIVE)
+         return;
+      rewrite = gz->writing;
+    }
+    CloseHandle (gz->thread);
+  }
+
+  if (rewrite)
+     GZ_FSEEK (gz->file, gz->member_start);
+  if (gz->work_len > 0)
+     gz_write_member (gz, gz->work, gz->work_len);
+  if (rewrite)
+     GZ_CHSIZE (_fileno(gz->file), GZ_FTELL(gz->file));
+  if (gz->fill_len > 0)
+     gz_write_member (gz, gz->fill, gz->fill_len);
+
+  if (gz->event)
+     CloseHandle (gz->event);
+  if (gz->done)
+     CloseHandle (gz->done);
+  DeleteCriticalSection (&gz->lock);
+  free (gz->comp);
+  free (gz->fill);
+  free (gz->work);
+  free (gz);
+}
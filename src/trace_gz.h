@@ -0,0 +1,28 @@
+/**\file    trace_gz.h
+ * \ingroup Main
+ *
+ * \brief
+ *  Streaming gzip output for the `trace_file` and `pcap_dump` files.
+ */
+#ifndef _TRACE_GZ_H
+#define _TRACE_GZ_H
+
+/*
+ * The input is compressed in blocks of this size. Each block is
+ * written as a complete gzip-member.
+ */
+#define TRACE_GZ_BLOCK_SIZE  (1024*1024)
+
+/*
+ * A partially filled block is compressed and written after this many
+ * msec. So at most this much of the trace is lost in a crash.
+ */
+#define TRACE_GZ_FLUSH_MSEC  5000
+
+struct trace_gz;
+
+extern struct trace_gz *trace_gz_open  (FILE *file, int level, const char *what);
+extern size_t           trace_gz_write (struct trace_gz *gz, const void *buf, size_t len);
+extern void             trace_gz_close (struct trace_gz *gz);
+
+#endif
@@ -40,9 +40,16 @@
 #include "stkwalk.h"
 #include "overlap.h"
 #include "dump.h"
+#include "geoip.h"
 #include "firewall.h"
 #include "wsock_trace_lua.h"
 #include "wsock_trace.h"
+#include "trace_bin.h"
+#include "trace_etw.h"
+#include "sock_table.h"
+#include "stats.h"
+#include "dns_stats.h"
+#include "shm_stats.h"
 
 /* Keep track of number of calls to WSAStartup() and WSACleanup().
  */
@@ -63,11 +70,84 @@ static const char *get_caller (ULONG_PTR ret_addr, ULONG_PTR ebp);
  * and 'p_function' is not NULL.
 */
 #if defined(USE_DETOURS)   /* \todo */
-  #define INIT_PTR(ptr)    /* */
+  #define INIT_PTR(ptr)    do {                                        \
+                             LATENCY_START();                          \
+                             TS_ENTRY();                               \
+                           } while (0)
 #else
-  #define INIT_PTR(ptr) init_ptr ((const void**)&ptr, #ptr)
+  #define INIT_PTR(ptr)    do {                                        \
+                             init_ptr ((const void**)&ptr, #ptr);      \
+                             LATENCY_START();                          \
+                             TS_ENTRY();                               \
+                           } while (0)
 #endif
 
+/*
+ * With 'trace_tsc = 1', keep the time-stamp of the hook entry for
+ * 'get_hook_timestamp()' or 'trace_bin_write()'.
+ */
+#define TS_ENTRY()                                               \
+        do {                                                     \
+          if (g_cfg.trace_tsc)                                   \
+             ts_entry_set();                                     \
+        } while (0)
+
+/*
+ * Do not trace a successful data-transfer call if 'sock_table_suppress()'
+ * says so ('trace_sample', 'trace_first' and 'trace_rate'). The 'calls'
+ * counter gives the 1-in-N sampling per function. Errors are always traced.
+ */
+#define SAMPLE_THIS(s, bytes, out, ok)                           \
+        do {                                                     \
+          static DWORD calls = 0;                                \
+                                                                 \
+          if (!exclude_this && g_cfg.trace_sampling && (ok))     \
+          {                                                      \
+            BOOL sampled_out = (g_cfg.trace_sample > 1 &&        \
+                                calls++ % g_cfg.trace_sample);   \
+            exclude_this = sock_table_suppress (s, bytes, out,   \
+                                                sampled_out);    \
+          }                                                      \
+        } while (0)
+
+/*
+ * With 'latency_stats = 1', time the real 'p_function' from 'INIT_PTR()'
+ * (or a later 'LATENCY_START()') to 'LATENCY_END()' right after it returns.
+ */
+#define LATENCY_START()                                          \
+        do {                                                     \
+          if (g_cfg.latency_stats)                               \
+             latency_start();                                    \
+        } while (0)
+
+#define LATENCY_END(ptr)                                         \
+        do {                                                     \
+          static int slot = -2;                                  \
+                                                                 \
+          if (g_cfg.latency_stats)                               \
+          {                                                      \
+            if (slot == -2)                                      \
+               slot = ws2_func_slot (#ptr + 2);                  \
+            latency_end (slot);                                  \
+          }                                                      \
+        } while (0)
+
+/*
+ * With 'shm_stats = 1', count the bytes or an error of a
+ * recv / send function in the shared memory block.
+ */
+#define SHM_XFER(ptr, bytes, error)                              \
+        do {                                                     \
+          static int slot = -2;                                  \
+                                                                 \
+          if (g_cfg.shm_stats)                                   \
+          {                                                      \
+            if (slot == -2)                                      \
+               slot = ws2_func_slot (#ptr + 2);                  \
+            shm_stats_xfer (slot, bytes, error);                 \
+          }                                                      \
+        } while (0)
+
 /*
  * A WSTRACE() macro for the WinSock calls we support.
  * This macro is used like 'WSTRACE ("WSAStartup (%u.%u) --> %s", args).'
@@ -75,27 +155,114 @@ static const char *get_caller (ULONG_PTR ret_addr, ULONG_PTR ebp);
  *   Do NOT add a trailing ".~0\n"; it's done in this macro.
  *
  * If "g_cfg.trace_caller == 0" or "WSAStartup" is in the
- * 'exclude_list' smartlist, the '!exclude_list_get("WSAStartup...", EXCL_FUNCTION)'
- * returns FALSE.
+ * 'exclude_list' smartlist, the '!exclude_func_get(slot, "WSAStartup...")'
+ * returns FALSE. The 'dyn_funcs[]' slot of the function is looked up
+ * once for each call-site; after that it's a single bit-test.
  */
 #define WSTRACE(fmt, ...)                                        \
         do {                                                     \
+          static int slot = -2;                                  \
+                                                                 \
           exclude_this = TRUE;                                   \
-          if (g_cfg.trace_level > 0 &&                           \
-              !exclude_list_get(fmt, EXCL_FUNCTION))             \
+          if (g_cfg.trace_level > 0 && !g_cfg.trace_binary)      \
           {                                                      \
-            exclude_this = FALSE;                                \
-            wstrace_printf (TRUE, "~1* ~3%s~5%s: ~1",            \
-                            get_timestamp(),                     \
-                            get_caller (GET_RET_ADDR(),          \
-                                        get_EBP()) );            \
-            wstrace_printf (FALSE, fmt ".~0\n", ## __VA_ARGS__); \
+            if (slot == -2)                                      \
+               slot = ws2_func_slot (fmt);                       \
+            if (!exclude_func_get(slot, fmt))                    \
+            {                                                    \
+              exclude_this = FALSE;                              \
+              WSTRACE_PRINT (fmt, ## __VA_ARGS__);               \
+            }                                                    \
           }                                                      \
         } while (0)
 
+/*
+ * The printing part of 'WSTRACE()'. Used in hooks that already did
+ * 'EXCLUDE_THIS()' and are inside a 'if (!exclude_this)' block.
+ */
+#define WSTRACE_PRINT(fmt, ...)                                  \
+        do {                                                     \
+          wstrace_printf (TRUE, "~1* ~3%s~5%s: ~1",              \
+                          get_hook_timestamp(),                  \
+                          get_caller (GET_RET_ADDR(),            \
+                                      get_EBP()) );              \
+          wstrace_printf (FALSE, fmt ".~0\n", ## __VA_ARGS__);   \
+        } while (0)
+
+/*
+ * Like 'WSTRACE_PRINT()', but for the fixed-shape lines of the
+ * send / recv hooks. See 'wstrace_fast()' for the 'types'.
+ */
+#define WSTRACE_FAST(func, types, ...)                           \
+        wstrace_fast (get_hook_timestamp(),                      \
+                      get_caller (GET_RET_ADDR(), get_EBP()),    \
+                      func, types, ## __VA_ARGS__)
+
+/*
+ * Set the global 'exclude_this' for the function 'name' in hooks that
+ * must know it before calling 'WSTRACE_PRINT()'.
+ */
+#define EXCLUDE_THIS(name)                                       \
+        do {                                                     \
+          static int slot = -2;                                  \
+                                                                 \
+          if (slot == -2)                                        \
+             slot = ws2_func_slot (name);                        \
+          exclude_this = (g_cfg.trace_level == 0 ||              \
+                          exclude_func_get(slot, name));         \
+        } while (0)
+
+
+/*
+ * With 'g_cfg.trace_binary', the above 'WSTRACE()' macro does nothing.
+ * Instead this macro writes a fixed-size record to the binary trace-file.
+ * Or with 'g_cfg.trace_etw' (which also sets 'trace_binary'), an ETW event.
+ * The 'dyn_funcs[]' slot of 'name' is looked up once for each call-site.
+ *
+ * Since it sets 'exclude_this = TRUE', no text-dumps follows a record.
+ *
+ * The error stored is 'WSAGetLastError()' if 'rc < 0'. Otherwise 0.
+ * For 'getaddrinfo()' and 'getnameinfo()', use 'WSTRACE_BIN_EAI()' since
+ * these returns an 'EAI_x' code (> 0) and not 'SOCKET_ERROR'.
+ */
+#define WSTRACE_BIN(name, s, rc, bytes, sa)                                \
+        WSTRACE_BIN_ERR (name, s, rc,                                      \
+                         ((int)(rc) < 0) ? (*p_WSAGetLastError)() : 0,     \
+                         bytes, sa)
+
+#define WSTRACE_BIN_EAI(name, rc, sa)                                      \
+        WSTRACE_BIN_ERR (name, INVALID_SOCKET, rc, (DWORD)(rc), 0, sa)
+
+#define WSTRACE_BIN_ERR(name, s, rc, err, bytes, sa)                       \
+        do {                                                               \
+          static int slot = -2;                                            \
+                                                                           \
+          if (g_cfg.trace_binary && g_cfg.trace_level > 0)                 \
+          {                                                                \
+            if (slot == -2)                                                \
+               slot = ws2_func_slot (name);                                \
+            if (exclude_func_get(slot, name))                              \
+               ;                                                           \
+            else if (g_cfg.trace_etw)                                      \
+               trace_etw_write (slot, (SOCKET)(s), (int)(rc),              \
+                                (DWORD)(err), (DWORD)(bytes),              \
+                                (const struct sockaddr*)(sa),              \
+                                GET_RET_ADDR());                           \
+            else                                                           \
+               trace_bin_write (slot, (SOCKET)(s), (int)(rc),              \
+                                (DWORD)(err), (DWORD)(bytes),              \
+                                (const struct sockaddr*)(sa));             \
+            exclude_this = TRUE;                                           \
+          }                                                                \
+        } while (0)
 
 #if defined(__GNUC__) || defined(__clang__)
   #define GET_RET_ADDR()  (ULONG_PTR)__builtin_return_address (0)
+
+#elif defined(_MSC_VER) && (_MSC_VER >= 1400)
+  #include <intrin.h>
+  #pragma intrinsic (_ReturnAddress)
+  #define GET_RET_ADDR()  (ULONG_PTR)_ReturnAddress()
 #else
   #define GET_RET_ADDR()  0
 #endif
@@ -141,6 +308,9 @@ static void wstrace_printf (BOOL first_line,
                             _Printf_format_string_ const char *fmt, ...)
                             ATTR_PRINTF (2,3);
 
+static void wstrace_fast (const char *ts, const char *caller,
+                          const char *func, const char *types, ...);
+
 /*
  * Hooking and tracing of Winsock extension functions returned in
  * 'WSAIoctl (s, SIO_GET_EXTENSION_FUNCTION_POINTER,...)'.
@@ -391,6 +561,43 @@ DEF_FUNC (DWORD, WaitForMultipleObjectsEx, (DWORD         num_ev,
                                             DWORD         timeout,
                                             BOOL          alertable));
 
+/*
+ * I/O completion port functions in kernel32.dll.
+ * Hooked to match completions to the stored overlapped operations.
+ */
+DEF_FUNC (BOOL, GetQueuedCompletionStatus, (HANDLE      port,
+                                            DWORD      *bytes,
+                                            ULONG_PTR  *key,
+                                            OVERLAPPED **ov,
+                                            DWORD       timeout));
+
+#if defined(__WATCOMC__)
+  /*
+   * The Watcom SDK-headers lacks this Vista+ structure. The hook is still
+   * needed since 'wsock_trace.def' exports it for all targets.
+   */
+  typedef struct ws_OVERLAPPED_ENTRY {
+          ULONG_PTR   lpCompletionKey;
+          OVERLAPPED *lpOverlapped;
+          ULONG_PTR   Internal;
+          DWORD       dwNumberOfBytesTransferred;
+        } ws_OVERLAPPED_ENTRY;
+
+  #define OVERLAPPED_ENTRY ws_OVERLAPPED_ENTRY
+#endif
+
+DEF_FUNC (BOOL, GetQueuedCompletionStatusEx, (HANDLE            port,
+                                              OVERLAPPED_ENTRY *entries,
+                                              ULONG             count,
+                                              ULONG            *removed,
+                                              DWORD             timeout,
+                                              BOOL              alertable));
+
+DEF_FUNC (BOOL, PostQueuedCompletionStatus, (HANDLE      port,
+                                             DWORD       bytes,
+                                             ULONG_PTR   key,
+                                             OVERLAPPED *ov));
+
 DEF_FUNC (int, WSACancelBlockingCall, (void));
 
 DEF_FUNC (int, WSCGetProviderPath, (GUID    *provider_id,
@@ -491,6 +698,9 @@ static struct LoadTable dyn_funcs [] = {
               ADD_VALUE (1, "ws2_32.dll", inet_ntop),
               ADD_VALUE (0, "ntdll.dll",  RtlCaptureStackBackTrace),
            // ADD_VALUE (1, "kernel32.dll", WaitForMultipleObjectsEx),
+              ADD_VALUE (1, "kernel32.dll", GetQueuedCompletionStatus),
+              ADD_VALUE (1, "kernel32.dll", GetQueuedCompletionStatusEx),  /* Windows Vista+ */
+              ADD_VALUE (1, "kernel32.dll", PostQueuedCompletionStatus),
 
              /* Allthough 'WSASendMsg()' seems to be an 'extension-function'
               * accessible only (?) via the 'WSAID_WSASENDMSG' GUID, it is present in
@@ -521,13 +731,49 @@ const struct LoadTable *find_ws2_func_by_name (const char *func)
   return find_dynamic_table (dyn_funcs, DIM(dyn_funcs), func);
 }
 
-static void wstrace_printf (BOOL first_line, const char *fmt, ...)
+/*
+ * Return the slot of the function 'name' in 'dyn_funcs[]' or -1 if not found.
+ * 'name' can also be a 'WSTRACE()' format-string like "recv (%s, ...".
+ * "FD_ISSET" is an alias for "__WSAFDIsSet".
+ */
+int ws2_func_slot (const char *name)
 {
-  DWORD   err = GetLastError();   /* save error status */
-  va_list args;
+  size_t len = strcspn (name, " (");
+  int    i;
 
-  va_start (args, fmt);
+  if (len == sizeof("FD_ISSET")-1 && !strncmp(name, "FD_ISSET", len))
+  {
+    name = "__WSAFDIsSet";
+    len  = strlen (name);
+  }
+
+  for (i = 0; i < DIM(dyn_funcs); i++)
+  {
+    const char *func = dyn_funcs[i].func_name;
+
+    if (!strncmp(func, name, len) && func[len] == '\0')
+       return (i);
+  }
+  return (-1);
+}
+
+/*
+ * Return the name of the function in 'slot' or NULL if not a legal slot.
+ */
+const char *ws2_func_name (int slot)
+{
+  if (slot < 0 || slot >= DIM(dyn_funcs))
+     return (NULL);
+  return (dyn_funcs[slot].func_name);
+}
+
+int ws2_func_num (void)
+{
+  return DIM(dyn_funcs);
+}
 
+static void wstrace_line_start (BOOL first_line)
+{
   if (first_line)
   {
     /* If stdout or stderr is redirected, we cannot get the cursor column.
@@ -547,6 +793,15 @@ static void wstrace_printf (BOOL first_line, const char *fmt, ...)
     trace_putc ('\n');
     trace_indent (g_cfg.trace_indent+2);
   }
+}
+
+static void wstrace_printf (BOOL first_line, const char *fmt, ...)
+{
+  DWORD   err = GetLastError();   /* save error status */
+  va_list args;
+
+  va_start (args, fmt);
+  wstrace_line_start (first_line);
 
 #if 0
   if (first_line && g_cfg.trace_time_format != TS_NONE)
@@ -599,32 +854,71 @@ static const char *get_error (SOCK_RC_TYPE rc)
  * WSAAddressToStringA() returns the address AND the port in the 'buf'.
  * Like: 127.0.0.1:1234
  */
-const char *sockaddr_str (const struct sockaddr *sa, const int *sa_len)
+const char *sockaddr_str_r (const struct sockaddr *sa, const int *sa_len, char *buf, size_t size)
 {
-  static char buf [MAX_IP6_SZ+MAX_PORT_SZ+1];
-  DWORD  size = sizeof(buf);
-  DWORD  len  = sa_len ? *(DWORD*)sa_len : (DWORD)sizeof(*sa);
+  DWORD  _size = (DWORD) size;
+  DWORD  len   = sa_len ? *(DWORD*)sa_len : (DWORD)sizeof(*sa);
 
   WSAERROR_PUSH();
-  if ((*p_WSAAddressToStringA)((SOCKADDR*)sa, len, NULL, buf, &size))
-     strcpy (buf, "??");
+  if ((*p_WSAAddressToStringA)((SOCKADDR*)sa, len, NULL, buf, &_size))
+     _strlcpy (buf, "??", size);
   WSAERROR_POP();
   return (buf);
 }
 
+const char *sockaddr_str (const struct sockaddr *sa, const int *sa_len)
+{
+  static char buf [SOCKADDR_STR_SZ];
+
+  return sockaddr_str_r (sa, sa_len, buf, sizeof(buf));
+}
+
+/*
+ * Get the type and the local and peer addresses of socket 's' using the
+ * real functions. Used by the pcap-writer in init.c. The WSA error-state
+ * is kept.
+ */
+BOOL ws_sock_info (SOCKET s, int *type, struct sockaddr_storage *local, struct sockaddr_storage *peer)
+{
+  int len, rc;
+
+  if (!p_getsockopt || !p_getsockname || !p_getpeername)
+     return (FALSE);
+
+  memset (local, '\0', sizeof(*local));
+  memset (peer, '\0', sizeof(*peer));
+
+  WSAERROR_PUSH();
+  len = sizeof(*type);
+  rc  = (*p_getsockopt) (s, SOL_SOCKET, SO_TYPE, (char*)type, &len);
+  len = sizeof(*local);
+  (*p_getsockname) (s, (struct sockaddr*)local, &len);
+  len = sizeof(*peer);
+  (*p_getpeername) (s, (struct sockaddr*)peer, &len);
+  WSAERROR_POP();
+  return (rc == 0);
+}
+
 /*
  * Don't call the above 'WSAAddressToStringA()' for AF_INET/AF_INET6 addresses.
  * We do it ourself using the below sockaddr_str_port().
  */
-const char *sockaddr_str2 (const struct sockaddr *sa, const int *sa_len)
+const char *sockaddr_str2_r (const struct sockaddr *sa, const int *sa_len, char *buf, size_t size)
 {
-  const char *p = sockaddr_str_port (sa, sa_len);
+  const char *p = sockaddr_str_port_r (sa, sa_len, buf, size);
 
   if (!p)
-     return sockaddr_str (sa, sa_len);
+     return sockaddr_str_r (sa, sa_len, buf, size);
   return (p);
 }
 
+const char *sockaddr_str2 (const struct sockaddr *sa, const int *sa_len)
+{
+  static char buf [SOCKADDR_STR_SZ];
+
+  return sockaddr_str2_r (sa, sa_len, buf, sizeof(buf));
+}
+
 /*
  * This is in <afunix.h> on recent SDK's.
  */
@@ -643,32 +937,31 @@ struct fake_sockaddr_un {
  * Like: "127.0.0.1:1234"  for an AF_INET sockaddr. And
  *       "[0F::80::]:1234" for an AF_INET6 sockaddr.
  */
-const char *sockaddr_str_port (const struct sockaddr *sa, const int *sa_len)
+const char *sockaddr_str_port_r (const struct sockaddr *sa, const int *sa_len, char *buf, size_t size)
 {
   const struct sockaddr_in  *sa4 = (const struct sockaddr_in*) sa;
   const struct sockaddr_in6 *sa6 = (const struct sockaddr_in6*) sa;
   const struct sockaddr_un  *su  = (const struct sockaddr_un*) sa;
-  static char buf [MAX_IP6_SZ+MAX_PORT_SZ+3];
-  char       *end;
+  char  *end;
 
   if (!sa4)
      return ("<NULL>");
 
   if (sa4->sin_family == AF_INET)
   {
-    snprintf (buf, sizeof(buf), "%u.%u.%u.%u:%d",
-              sa4->sin_addr.S_un.S_un_b.s_b1,
-              sa4->sin_addr.S_un.S_un_b.s_b2,
-              sa4->sin_addr.S_un.S_un_b.s_b3,
-              sa4->sin_addr.S_un.S_un_b.s_b4,
-              swap16(sa4->sin_port));
+    if (size < MAX_IP4_SZ + MAX_PORT_SZ + 1 || !wsock_trace_inet_ntop4((const u_char*)&sa4->sin_addr, buf, size))
+       return _strlcpy (buf, "??", size);
+    end = strchr (buf, '\0');
+    *end++ = ':';
+    _itoa (swap16(sa4->sin_port), end, 10);
     return (buf);
   }
 
   if (sa4->sin_family == AF_INET6)
   {
+    if (size < SOCKADDR_STR_SZ || !wsock_trace_inet_ntop6((const u_char*)&sa6->sin6_addr, buf+1, size-1))
+       return _strlcpy (buf, "??", size);
     buf[0] = '[';
-    wsock_trace_inet_ntop6 ((const u_char*)&sa6->sin6_addr, buf+1, sizeof(buf)-1);
     end = strchr (buf, '\0');
     *end++ = ']';
     *end++ = ':';
@@ -681,11 +974,11 @@ const char *sockaddr_str_port (const struct sockaddr *sa, const int *sa_len)
     const wchar_t *path = (const wchar_t*) &su->sun_path;
 
     if (!su->sun_path[0])
-         strcpy (buf, "abstract");
+         _strlcpy (buf, "abstract", size);
     else if (su->sun_path[0] && su->sun_path[1])
-         _strlcpy (buf, su->sun_path, sizeof(buf));
-    else if (WideCharToMultiByte(CP_ACP, 0, path, wcslen(path), buf, sizeof(buf), NULL, NULL) == 0)
-         strcpy (buf, "??");
+         _strlcpy (buf, su->sun_path, size);
+    else if (WideCharToMultiByte(CP_ACP, 0, path, wcslen(path), buf, (int)size, NULL, NULL) == 0)
+         _strlcpy (buf, "??", size);
     return (buf);
   }
 
@@ -693,18 +986,21 @@ const char *sockaddr_str_port (const struct sockaddr *sa, const int *sa_len)
   return (NULL);
 }
 
-static const char *inet_ntop2 (const char *addr, int family)
+const char *sockaddr_str_port (const struct sockaddr *sa, const int *sa_len)
 {
-  static char buf [MAX_IP6_SZ+1];
-  PCSTR  rc;
+  static char buf [SOCKADDR_STR_SZ];
 
-  WSAERROR_PUSH();
-
-  rc = (*p_inet_ntop) (family, (void*)addr, buf, sizeof(buf));
-  if (!rc)
-     strcpy (buf, "??");
+  return sockaddr_str_port_r (sa, sa_len, buf, sizeof(buf));
+}
 
-  WSAERROR_POP();
+/*
+ * Print the address for 'gethostbyaddr()'. Our own 'inet_ntop()' is used since
+ * it sets no WSA-error and formats into the caller's 'buf'.
+ */
+static const char *inet_ntop2_r (const char *addr, int family, char *buf, size_t size)
+{
+  if (!addr || !_wsock_trace_inet_ntop(family, addr, buf, size))
+     _strlcpy (buf, "??", size);
   return (buf);
 }
 
@@ -759,6 +1055,211 @@ static const char *socket_number (SOCKET s)
   return (buf);
 }
 
+/*
+ * The integer to text routines of 'wstrace_fast()'.
+ * They format into 'p' and return the new end.
+ */
+static const char digits100[] =
+  "00010203040506070809101112131415161718192021222324"
+  "25262728293031323334353637383940414243444546474849"
+  "50515253545556575859606162636465666768697071727374"
+  "75767778798081828384858687888990919293949596979899";
+
+static __inline char *fast_utoa (char *p, DWORD val)
+{
+  char   tmp [12];
+  char  *t = tmp + sizeof(tmp);
+  size_t len;
+
+  while (val >= 100)
+  {
+    unsigned idx = 2 * (val % 100);
+
+    val /= 100;
+    *--t = digits100 [idx+1];
+    *--t = digits100 [idx];
+  }
+  if (val >= 10)
+  {
+    *--t = digits100 [2*val+1];
+    *--t = digits100 [2*val];
+  }
+  else
+    *--t = (char) ('0' + val);
+
+  len = tmp + sizeof(tmp) - t;
+  memcpy (p, t, len);
+  return (p + len);
+}
+
+static __inline char *fast_itoa (char *p, int val)
+{
+  if (val < 0)
+  {
+    *p++ = '-';
+    return fast_utoa (p, 0U - (DWORD)val);
+  }
+  return fast_utoa (p, (DWORD)val);
+}
+
+static __inline char *fast_strcpy (char *p, const char *str, size_t len)
+{
+  memcpy (p, str, len);
+  return (p + len);
+}
+
+#define FAST_ROOM  (2 + 2*sizeof(UINT_PTR) + 10)   /* room for any number and a ", " */
+
+/*
+ * A fast formatter for the fixed-shape lines of the send / recv hooks.
+ *
+ * It writes the same text as 'WSTRACE_PRINT()', but the call-part
+ * is formatted straight into the trace-buffer using 'trace_reserve()'.
+ * The colour-changes are done by 'trace_color()', so only the caller
+ * (which has it's own '~' escapes) is parsed by 'trace_putc()'.
+ * No 'vsnprintf()' and no heap is used.
+ *
+ * The 'types' are:
+ *   's': a 'SOCKET'.
+ *   'p': a pointer; like "0x%p".
+ *   'd': an 'int'.
+ *   'u': a 'DWORD'.
+ *   'n': a 'DWORD*'. The value or "??" if NULL.
+ *   'S': a string.
+ *   'F': a string inside "<>".
+ *   'B': an 'int' return-value; "N bytes" or the error.
+ *   'E': an 'int' return-value; always the 'get_error()' string.
+ *
+ * The last type is the result printed after the " --> ".
+ */
+static void wstrace_fast (const char *ts, const char *caller,
+                          const char *func, const char *types, ...)
+{
+  DWORD       err = GetLastError();   /* save error status */
+  const char *str;
+  char       *p, *end;
+  size_t      len;
+  int         val;
+  va_list     args;
+
+  wstrace_line_start (TRUE);
+  trace_color (1);
+  trace_puts_raw ("* ");
+  trace_color (3);
+  trace_puts_raw (ts);
+  trace_color (5);
+  trace_puts (caller);
+  trace_puts_raw (": ");
+  trace_color (1);
+  wstrace_line_start (FALSE);
+
+  len = strlen (func);
+  p = trace_reserve (len + 2 + FAST_ROOM);
+  if (!p)
+     goto quit;
+
+  end = p + len + 2 + FAST_ROOM;
+  p = fast_strcpy (p, func, len);
+  *p++ = ' ';
+  *p++ = '(';
+
+  va_start (args, types);
+  for ( ; *types; types++)
+  {
+    str = NULL;
+    if (types[1] == '\0')
+    {
+      p[-2] = ')';       /* replace the ", " */
+      p[-1] = ' ';
+      p = fast_strcpy (p, "--> ", 4);
+    }
+
+    if (p + FAST_ROOM > end)
+    {
+      trace_commit (p);
+      p = trace_reserve (FAST_ROOM);
+      if (!p)
+         break;
+      end = p + FAST_ROOM;
+    }
+
+    switch (*types)
+    {
+      case 's':
+           p = fast_itoa (p, (int) va_arg(args, SOCKET));
+           break;
+      case 'p':
+           uint_ptr_hexval ((UINT_PTR) va_arg(args, const void*), p);
+           p += 2 + 2*sizeof(UINT_PTR);
+           break;
+      case 'd':
+           p = fast_itoa (p, va_arg(args, int));
+           break;
+      case 'u':
+           p = fast_utoa (p, va_arg(args, DWORD));
+           break;
+      case 'n':
+           {
+             const DWORD *num = va_arg (args, const DWORD*);
+
+             if (num)
+                  p = fast_utoa (p, *num);
+             else p = fast_strcpy (p, "??", 2);
+           }
+           break;
+      case 'S':
+      case 'F':
+           str = va_arg (args, const char*);
+           break;
+      case 'B':
+           val = va_arg (args, int);
+           if (val >= 0)
+           {
+             p = fast_itoa (p, val);
+             p = fast_strcpy (p, " bytes", 6);
+           }
+           else
+             str = get_error (val);
+           break;
+      case 'E':
+           str = get_error (va_arg(args, int));
+           break;
+    }
+
+    if (str)
+    {
+      len = strlen (str);
+      if (len > 1000)
+         len = 1000;
+      trace_commit (p);
+      p = trace_reserve (len + 2 + FAST_ROOM);
+      if (!p)
+         break;
+      end = p + len + 2 + FAST_ROOM;
+      if (*types == 'F')
+         *p++ = '<';
+      p = fast_strcpy (p, str, len);
+      if (*types == 'F')
+         *p++ = '>';
+    }
+    if (types[1])
+    {
+      *p++ = ',';
+      *p++ = ' ';
+    }
+  }
+  va_end (args);
+
+  if (p)
+     trace_commit (p);
+
+quit:
+  trace_putc ('.');
+  trace_color (0);
+  trace_putc ('\n');
+  SetLastError (err);  /* restore error status */
+}
+
 /*
  * The actual Winsock functions we trace.
  */
@@ -769,6 +1270,7 @@ EXPORT int WINAPI WSAStartup (WORD ver, WSADATA *data)
 
   INIT_PTR (p_WSAStartup);
   rc = (*p_WSAStartup) (ver, data);
+  LATENCY_END (p_WSAStartup);
 
   cleaned_up = 0;
 
@@ -784,10 +1286,11 @@ EXPORT int WINAPI WSAStartup (WORD ver, WSADATA *data)
 #endif
 
   ENTER_CRIT();
+  WSTRACE_BIN ("WSAStartup", INVALID_SOCKET, rc, 0, NULL);
   WSTRACE ("WSAStartup (%u.%u) --> %s",
            loBYTE(data->wVersion), hiBYTE(data->wVersion), get_error(rc));
 
-  WSLUA_HOOK (rc, wslua_WSAStartup(ver,data));
+  WSLUA_HOOK (WSAStartup, rc, INVALID_SOCKET, 0, NULL);
   LEAVE_CRIT();
   return (rc);
 }
@@ -798,8 +1301,10 @@ EXPORT int WINAPI WSACleanup (void)
 
   INIT_PTR (p_WSACleanup);
   rc = (*p_WSACleanup)();
+  LATENCY_END (p_WSACleanup);
 
   ENTER_CRIT();
+  WSTRACE_BIN ("WSACleanup", INVALID_SOCKET, rc, 0, NULL);
   WSTRACE ("WSACleanup() --> %s", get_error(rc));
 
   if (startup_count > 0)
@@ -808,7 +1313,7 @@ EXPORT int WINAPI WSACleanup (void)
     cleaned_up = (startup_count == 0);
   }
 
-  WSLUA_HOOK (rc, wslua_WSACleanup());
+  WSLUA_HOOK (WSACleanup, rc, INVALID_SOCKET, 0, NULL);
   LEAVE_CRIT();
 
   return (rc);
@@ -820,8 +1325,13 @@ EXPORT int WINAPI WSAGetLastError (void)
 
   INIT_PTR (p_WSAGetLastError);
   rc = (*p_WSAGetLastError)();
+  LATENCY_END (p_WSAGetLastError);
+
+  if (g_cfg.stats_only)
+     return (rc);
 
   ENTER_CRIT();
+  WSTRACE_BIN ("WSAGetLastError", INVALID_SOCKET, rc, 0, NULL);
   WSTRACE ("WSAGetLastError() --> %s", get_error(rc));
   LEAVE_CRIT();
   return (rc);
@@ -831,8 +1341,13 @@ EXPORT void WINAPI WSASetLastError (int err)
 {
   INIT_PTR (p_WSASetLastError);
   (*p_WSASetLastError)(err);
+  LATENCY_END (p_WSASetLastError);
+
+  if (g_cfg.stats_only)
+     return;
 
   ENTER_CRIT();
+  WSTRACE_BIN ("WSASetLastError", INVALID_SOCKET, err, 0, NULL);
   WSTRACE ("WSASetLastError (%s%s)",
            err ? "" : "0: ", get_error(err));
   LEAVE_CRIT();
@@ -846,14 +1361,23 @@ EXPORT SOCKET WINAPI WSASocketA (int af, int type, int protocol,
 
   INIT_PTR (p_WSASocketA);
   rc = (*p_WSASocketA) (af, type, protocol, proto_info, group, flags);
+  LATENCY_END (p_WSASocketA);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("WSASocketA", rc, rc, 0, NULL);
   WSTRACE ("WSASocketA (%s, %s, %s, 0x%p, %d, %s) --> %s",
            socket_family(af), socket_type(type), protocol_name(protocol),
            proto_info, group, wsasocket_flags_decode(flags),
            socket_or_error(rc));
 
+  if (rc != INVALID_SOCKET)
+  {
+    if (proto_info && af == 0)
+         sock_table_add (rc, proto_info->iAddressFamily, proto_info->iSocketType, proto_info->iProtocol);
+    else sock_table_add (rc, af, type, protocol);
+  }
+
   if (!exclude_this && g_cfg.dump_wsaprotocol_info)
      dump_wsaprotocol_info ('A', proto_info, p_WSCGetProviderPath);
 
@@ -869,14 +1393,23 @@ EXPORT SOCKET WINAPI WSASocketW (int af, int type, int protocol,
 
   INIT_PTR (p_WSASocketW);
   rc = (*p_WSASocketW) (af, type, protocol, proto_info, group, flags);
+  LATENCY_END (p_WSASocketW);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("WSASocketW", rc, rc, 0, NULL);
   WSTRACE ("WSASocketW (%s, %s, %s, 0x%p, %d, %s) --> %s",
            socket_family(af), socket_type(type), protocol_name(protocol),
            proto_info, group, wsasocket_flags_decode(flags),
            socket_or_error(rc));
 
+  if (rc != INVALID_SOCKET)
+  {
+    if (proto_info && af == 0)
+         sock_table_add (rc, proto_info->iAddressFamily, proto_info->iSocketType, proto_info->iProtocol);
+    else sock_table_add (rc, af, type, protocol);
+  }
+
   if (!exclude_this && g_cfg.dump_wsaprotocol_info)
      dump_wsaprotocol_info ('W', proto_info, p_WSCGetProviderPath);
 
@@ -890,9 +1423,11 @@ EXPORT int WINAPI WSADuplicateSocketA (SOCKET s, DWORD process_id, WSAPROTOCOL_I
 
   INIT_PTR (p_WSADuplicateSocketA);
   rc = (*p_WSADuplicateSocketA) (s, process_id, proto_info);
+  LATENCY_END (p_WSADuplicateSocketA);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("WSADuplicateSocketA", s, rc, 0, NULL);
   WSTRACE ("WSADuplicateSocketA (%s, proc-ID %lu, ...) --> %s",
            socket_number(s), DWORD_CAST(process_id), get_error(rc));
 
@@ -909,9 +1444,11 @@ EXPORT int WINAPI WSADuplicateSocketW (SOCKET s, DWORD process_id, WSAPROTOCOL_I
 
   INIT_PTR (p_WSADuplicateSocketW);
   rc = (*p_WSADuplicateSocketW) (s, process_id, proto_info);
+  LATENCY_END (p_WSADuplicateSocketW);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("WSADuplicateSocketW", s, rc, 0, NULL);
   WSTRACE ("WSADuplicateSocketW (%s, proc-ID %lu, ...) --> %s",
             socket_number(s), DWORD_CAST(process_id), get_error(rc));
 
@@ -933,8 +1470,10 @@ EXPORT INT WINAPI WSAAddressToStringA (SOCKADDR          *address,
   INIT_PTR (p_WSAAddressToStringA);
   rc = (*p_WSAAddressToStringA) (address, address_len, proto_info,
                                  result_string, result_string_len);
+  LATENCY_END (p_WSAAddressToStringA);
   ENTER_CRIT();
 
+  WSTRACE_BIN ("WSAAddressToStringA", INVALID_SOCKET, rc, 0, address);
   WSTRACE ("WSAAddressToStringA(). --> %s", rc == 0 ? result_string : get_error(rc));
 
   if (!exclude_this && g_cfg.dump_wsaprotocol_info)
@@ -955,8 +1494,11 @@ EXPORT INT WINAPI WSAAddressToStringW (SOCKADDR          *address,
   INIT_PTR (p_WSAAddressToStringW);
   rc = (*p_WSAAddressToStringW) (address, address_len, proto_info,
                                  result_string, result_string_len);
+  LATENCY_END (p_WSAAddressToStringW);
   ENTER_CRIT();
 
+  WSTRACE_BIN ("WSAAddressToStringW", INVALID_SOCKET, rc, 0, address);
+
   if (rc == 0)
        WSTRACE ("WSAAddressToStringW(). --> %" WCHAR_FMT, result_string);
   else WSTRACE ("WSAAddressToStringW(). --> %s", get_error(rc));
@@ -978,8 +1520,10 @@ EXPORT INT WINAPI WSAStringToAddressA (char              *address_str,
 
   INIT_PTR (p_WSAStringToAddressA);
   rc = (*p_WSAStringToAddressA) (address_str, address_fam, protocol_info, address, address_len);
+  LATENCY_END (p_WSAStringToAddressA);
 
   ENTER_CRIT();
+  WSTRACE_BIN ("WSAStringToAddressA", INVALID_SOCKET, rc, 0, rc == 0 ? address : NULL);
   WSTRACE ("WSAStringToAddressA (\"%s\"). --> %s", address_str, get_error(rc));
   LEAVE_CRIT();
   return (rc);
@@ -995,8 +1539,10 @@ EXPORT INT WINAPI WSAStringToAddressW (wchar_t           *address_str,
 
   INIT_PTR (p_WSAStringToAddressW);
   rc = (*p_WSAStringToAddressW) (address_str, address_fam, protocol_info, address, address_len);
+  LATENCY_END (p_WSAStringToAddressW);
 
   ENTER_CRIT();
+  WSTRACE_BIN ("WSAStringToAddressW", INVALID_SOCKET, rc, 0, rc == 0 ? address : NULL);
   WSTRACE ("WSAStringToAddressW (L\"%S\"). --> %s", address_str, get_error(rc));
   LEAVE_CRIT();
   return (rc);
@@ -1012,6 +1558,7 @@ EXPORT int WINAPI WSAIoctl (SOCKET s, DWORD code, void *vals, DWORD size_in,
 
   INIT_PTR (p_WSAIoctl);
   rc = (*p_WSAIoctl) (s, code, vals, size_in, out_buf, out_size, size_ret, ov, func);
+  LATENCY_END (p_WSAIoctl);
 
   ENTER_CRIT();
 
@@ -1024,6 +1571,7 @@ EXPORT int WINAPI WSAIoctl (SOCKET s, DWORD code, void *vals, DWORD size_in,
   else if (code & IOC_VOID)
     in_out = " (N)";
 
+  WSTRACE_BIN ("WSAIoctl", s, rc, (rc == 0 && size_ret) ? *size_ret : 0, NULL);
   WSTRACE ("WSAIoctl (%s, %s%s, ...) --> %s",
            socket_number(s), get_sio_name(code), in_out, socket_or_error(rc));
 
@@ -1055,15 +1603,21 @@ EXPORT int WINAPI WSAIoctl (SOCKET s, DWORD code, void *vals, DWORD size_in,
 EXPORT int WINAPI WSAConnect (SOCKET s, const struct sockaddr *name, int namelen,
                               WSABUF *caller_data, WSABUF *callee_data, QOS *SQOS, QOS *GQOS)
 {
-  int rc;
+  int    rc;
+  char   addr_buf [SOCKADDR_STR_SZ];
+  uint64 start;
 
   INIT_PTR (p_WSAConnect);
+  start = g_cfg.flow.enable ? get_ts_ticks() : 0;
   rc = (*p_WSAConnect) (s, name, namelen, caller_data, callee_data, SQOS, GQOS);
+  LATENCY_END (p_WSAConnect);
+  sock_table_connect (s, start, rc);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("WSAConnect", s, rc, 0, name);
   WSTRACE ("WSAConnect (%s, %s, 0x%p, 0x%p, ...) --> %s",
-           socket_number(s), sockaddr_str2(name,&namelen),
+           socket_number(s), sockaddr_str2_r(name,&namelen,addr_buf,sizeof(addr_buf)),
            caller_data, callee_data, socket_or_error(rc));
 
 #if 0
@@ -1094,10 +1648,13 @@ EXPORT BOOL WINAPI WSAConnectByNameA (SOCKET         s,
   INIT_PTR (p_WSAConnectByNameA);
   rc = (*p_WSAConnectByNameA) (s, node_name, service_name, local_addr_len, local_addr,
                                remote_addr_len, remote_addr, tv, reserved);
+  LATENCY_END (p_WSAConnectByNameA);
 
   ENTER_CRIT();
 
-  exclude_this = (g_cfg.trace_level == 0 || exclude_list_get("WSAConnectByNameA", EXCL_FUNCTION));
+  EXCLUDE_THIS ("WSAConnectByNameA");
+  WSTRACE_BIN ("WSAConnectByNameA", s, rc ? 0 : -1, 0, rc ? remote_addr : NULL);
+
   if (!exclude_this)
   {
     if (!tv)
@@ -1105,7 +1662,7 @@ EXPORT BOOL WINAPI WSAConnectByNameA (SOCKET         s,
     else snprintf (tv_buf, sizeof(tv_buf), "tv=%ld.%06lds",
                    LONG_CAST(tv->tv_sec), LONG_CAST(tv->tv_usec));
 
-    WSTRACE ("WSAConnectByNameA (%s, %s, %s, %s, ...) --> %s",
+    WSTRACE_PRINT ("WSAConnectByNameA (%s, %s, %s, %s, ...) --> %s",
              socket_number(s), node_name, service_name, tv_buf, get_error(rc));
   }
   LEAVE_CRIT();
@@ -1128,10 +1685,13 @@ EXPORT BOOL WINAPI WSAConnectByNameW (SOCKET         s,
   INIT_PTR (p_WSAConnectByNameW);
   rc = (*p_WSAConnectByNameW) (s, node_name, service_name, local_addr_len, local_addr,
                                remote_addr_len, remote_addr, tv, reserved);
+  LATENCY_END (p_WSAConnectByNameW);
 
   ENTER_CRIT();
 
-  exclude_this = (g_cfg.trace_level == 0 || exclude_list_get("WSAConnectByNameW", EXCL_FUNCTION));
+  EXCLUDE_THIS ("WSAConnectByNameW");
+  WSTRACE_BIN ("WSAConnectByNameW", s, rc ? 0 : -1, 0, rc ? remote_addr : NULL);
+
   if (!exclude_this)
   {
     if (!tv)
@@ -1139,7 +1699,7 @@ EXPORT BOOL WINAPI WSAConnectByNameW (SOCKET         s,
     else snprintf (tv_buf, sizeof(tv_buf), "tv=%ld.%06lds",
                    LONG_CAST(tv->tv_sec), LONG_CAST(tv->tv_usec));
 
-    WSTRACE ("WSAConnectByNameW (%s, %" WCHAR_FMT ", %" WCHAR_FMT ", %s, ...) --> %s",
+    WSTRACE_PRINT ("WSAConnectByNameW (%s, %" WCHAR_FMT ", %" WCHAR_FMT ", %s, ...) --> %s",
              socket_number(s), node_name, service_name, tv_buf, get_error(rc));
   }
   LEAVE_CRIT();
@@ -1161,10 +1721,13 @@ EXPORT BOOL WINAPI WSAConnectByList (SOCKET               s,
   INIT_PTR (p_WSAConnectByList);
   rc = (*p_WSAConnectByList) (s, socket_addr_list, local_addr_len, local_addr,
                               remote_addr_len, remote_addr, tv, reserved);
+  LATENCY_END (p_WSAConnectByList);
 
   ENTER_CRIT();
 
-  exclude_this = (g_cfg.trace_level == 0 || exclude_list_get("WSAConnectByList", EXCL_FUNCTION));
+  EXCLUDE_THIS ("WSAConnectByList");
+  WSTRACE_BIN ("WSAConnectByList", s, rc ? 0 : -1, 0, rc ? remote_addr : NULL);
+
   if (!exclude_this)
   {
     if (!tv)
@@ -1172,7 +1735,7 @@ EXPORT BOOL WINAPI WSAConnectByList (SOCKET               s,
     else snprintf (tv_buf, sizeof(tv_buf), "tv=%ld.%06lds",
                    LONG_CAST(tv->tv_sec), LONG_CAST(tv->tv_usec));
 
-    WSTRACE ("WSAConnectByList (%s, %s, ...) --> %s",
+    WSTRACE_PRINT ("WSAConnectByList (%s, %s, ...) --> %s",
              socket_number(s), tv_buf, get_error(rc));
   }
   LEAVE_CRIT();
@@ -1185,9 +1748,11 @@ EXPORT WSAEVENT WINAPI WSACreateEvent (void)
 
   INIT_PTR (p_WSACreateEvent);
   ev = (*p_WSACreateEvent)();
+  LATENCY_END (p_WSACreateEvent);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("WSACreateEvent", INVALID_SOCKET, ev ? 0 : -1, 0, NULL);
   WSTRACE ("WSACreateEvent() --> 0x%" ADDR_FMT, ADDR_CAST(ev));
 
   LEAVE_CRIT();
@@ -1200,9 +1765,11 @@ EXPORT BOOL WINAPI WSASetEvent (WSAEVENT ev)
 
   INIT_PTR (p_WSASetEvent);
   rc = (*p_WSASetEvent) (ev);
+  LATENCY_END (p_WSASetEvent);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("WSASetEvent", INVALID_SOCKET, rc ? 0 : -1, 0, NULL);
   WSTRACE ("WSASetEvent (0x%" ADDR_FMT ") -> %s", ADDR_CAST(ev), get_error(rc));
 
   LEAVE_CRIT();
@@ -1215,9 +1782,11 @@ EXPORT BOOL WINAPI WSACloseEvent (WSAEVENT ev)
 
   INIT_PTR (p_WSACloseEvent);
   rc = (*p_WSACloseEvent) (ev);
+  LATENCY_END (p_WSACloseEvent);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("WSACloseEvent", INVALID_SOCKET, rc ? 0 : -1, 0, NULL);
   WSTRACE ("WSACloseEvent (0x%" ADDR_FMT ") -> %s", ADDR_CAST(ev), get_error(rc));
 
   LEAVE_CRIT();
@@ -1230,9 +1799,11 @@ EXPORT BOOL WINAPI WSAResetEvent (WSAEVENT ev)
 
   INIT_PTR (p_WSAResetEvent);
   rc = (*p_WSAResetEvent) (ev);
+  LATENCY_END (p_WSAResetEvent);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("WSAResetEvent", INVALID_SOCKET, rc ? 0 : -1, 0, NULL);
   WSTRACE ("WSAResetEvent (0x%" ADDR_FMT ") -> %s", ADDR_CAST(ev), get_error(rc));
 
   LEAVE_CRIT();
@@ -1245,9 +1816,17 @@ EXPORT int WINAPI WSAEventSelect (SOCKET s, WSAEVENT ev, __LONG32 net_ev)
 
   INIT_PTR (p_WSAEventSelect);
   rc = (*p_WSAEventSelect) (s, ev, net_ev);
+  LATENCY_END (p_WSAEventSelect);
+
+  if (rc == 0)
+     sock_table_netem_nonblock (s, TRUE);
+
+  if (g_cfg.stats_only)
+     return (rc);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("WSAEventSelect", s, rc, 0, NULL);
   WSTRACE ("WSAEventSelect (%s, 0x%" ADDR_FMT ", %s) -> %s",
            socket_number(s), ADDR_CAST(ev), event_bits_decode(net_ev), get_error(rc));
 
@@ -1261,9 +1840,14 @@ EXPORT int WINAPI WSAAsyncSelect (SOCKET s, HWND wnd, unsigned int msg, __LONG32
 
   INIT_PTR (p_WSAAsyncSelect);
   rc = (*p_WSAAsyncSelect) (s, wnd, msg, net_ev);
+  LATENCY_END (p_WSAAsyncSelect);
+
+  if (rc == 0)
+     sock_table_netem_nonblock (s, TRUE);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("WSAAsyncSelect", s, rc, 0, NULL);
   WSTRACE ("WSAAsyncSelect (%s, 0x%" ADDR_FMT ", %u, %s) -> %s",
            socket_number(s), ADDR_CAST(wnd), msg, event_bits_decode(net_ev), get_error(rc));
 
@@ -1282,9 +1866,29 @@ int WINAPI __WSAFDIsSet (SOCKET s, fd_set *fd)
 
   INIT_PTR (p___WSAFDIsSet);
   rc = (*p___WSAFDIsSet) (s, fd);
+  LATENCY_END (p___WSAFDIsSet);
+
+  if (g_cfg.stats_only)
+     return (rc);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("FD_ISSET", s, rc, 0, NULL);
+
+  /* With 'dump_select = 2', 'select()' already printed the ready sockets.
+   * Only trace if the set was changed since.
+   */
+  if (g_cfg.dump_select >= 2 && fd && (fd == last_rd_fd || fd == last_wr_fd || fd == last_ex_fd))
+  {
+    int which = (fd == last_rd_fd) ? 0 : (fd == last_wr_fd) ? 1 : 2;
+
+    if ((rc != 0) == select_was_ready(which, s))
+    {
+      LEAVE_CRIT();
+      return (rc);
+    }
+  }
+
   if (fd == last_rd_fd)
        WSTRACE ("FD_ISSET (%u, \"rd fd_set\") --> %d", _s, rc);
   else if (fd == last_wr_fd)
@@ -1300,21 +1904,38 @@ int WINAPI __WSAFDIsSet (SOCKET s, fd_set *fd)
 EXPORT SOCKET WINAPI accept (SOCKET s, struct sockaddr *addr, int *addr_len)
 {
   SOCKET rc;
+  char   addr_buf [SOCKADDR_STR_SZ];
 
   INIT_PTR (p_accept);
   rc = (*p_accept) (s, addr, addr_len);
+  LATENCY_END (p_accept);
+
+  if (g_cfg.stats_only)
+  {
+    if (rc != INVALID_SOCKET)
+       stats_peer (addr);
+    return (rc);
+  }
 
+  LAZY_INIT_WAIT (LAZY_GEOIP | LAZY_DNSBL);
   ENTER_CRIT();
 
+  WSTRACE_BIN ("accept", s, rc, 0, addr);
   WSTRACE ("accept (%s, %s) --> %s",
-           socket_number(s), sockaddr_str2(addr,addr_len), socket_or_error(rc));
+           socket_number(s), sockaddr_str2_r(addr,addr_len,addr_buf,sizeof(addr_buf)), socket_or_error(rc));
+
+  if (rc != INVALID_SOCKET)
+  {
+    sock_table_add (rc, addr ? addr->sa_family : 0, SOCK_STREAM, IPPROTO_TCP);
+    if (addr && addr_len)
+       sock_table_set_peer (rc, addr, *addr_len);
+    sock_table_netem_accept (s, rc);
+  }
 
   if (!exclude_this)
   {
-    if (g_cfg.geoip_enable)
-       dump_countries_sockaddr (addr);
-    if (g_cfg.DNSBL.enable)
-       dump_DNSBL_sockaddr (addr);
+    if (g_cfg.geoip_enable || g_cfg.DNSBL.enable)
+       dump_sockaddr_notes (addr);
   }
 
   LEAVE_CRIT();
@@ -1323,22 +1944,27 @@ EXPORT SOCKET WINAPI accept (SOCKET s, struct sockaddr *addr, int *addr_len)
 
 EXPORT int WINAPI bind (SOCKET s, const struct sockaddr *addr, int addr_len)
 {
-  int rc;
+  int  rc;
+  char addr_buf [SOCKADDR_STR_SZ];
 
   INIT_PTR (p_bind);
   rc = (*p_bind) (s, addr, addr_len);
+  LATENCY_END (p_bind);
 
+  LAZY_INIT_WAIT (LAZY_GEOIP | LAZY_DNSBL);
   ENTER_CRIT();
 
+  WSTRACE_BIN ("bind", s, rc, 0, addr);
   WSTRACE ("bind (%s, %s) --> %s",
-           socket_number(s), sockaddr_str2(addr,&addr_len), get_error(rc));
+           socket_number(s), sockaddr_str2_r(addr,&addr_len,addr_buf,sizeof(addr_buf)), get_error(rc));
+
+  if (rc == 0)
+     sock_table_set_local (s, addr, addr_len);
 
   if (!exclude_this)
   {
-    if (g_cfg.geoip_enable)
-       dump_countries_sockaddr (addr);
-    if (g_cfg.DNSBL.enable)
-       dump_DNSBL_sockaddr (addr);
+    if (g_cfg.geoip_enable || g_cfg.DNSBL.enable)
+       dump_sockaddr_notes (addr);
   }
 
   LEAVE_CRIT();
@@ -1351,11 +1977,14 @@ EXPORT int WINAPI closesocket (SOCKET s)
 
   INIT_PTR (p_closesocket);
   rc = (*p_closesocket) (s);
+  LATENCY_END (p_closesocket);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("closesocket", s, rc, 0, NULL);
   WSTRACE ("closesocket (%s) --> %s", socket_number(s), get_error(rc));
   overlap_remove (s);
+  sock_table_remove (s);
 
   LEAVE_CRIT();
   return (rc);
@@ -1369,22 +1998,45 @@ EXPORT int WINAPI connect (SOCKET s, const struct sockaddr *addr, int addr_len)
    */
   const struct sockaddr_in *sa = (const struct sockaddr_in*)addr;
   int   rc;
+  char  addr_buf [SOCKADDR_STR_SZ];
+  uint64 start;
 
   INIT_PTR (p_connect);
+
+  if (g_cfg.stats_only)
+  {
+    rc = (*p_connect) (s, addr, addr_len);
+    LATENCY_END (p_connect);
+    stats_peer (addr);
+    return (rc);
+  }
+
+  LAZY_INIT_WAIT (LAZY_GEOIP | LAZY_DNSBL);
   ENTER_CRIT();
 
+  LATENCY_START();
+  start = g_cfg.flow.enable ? get_ts_ticks() : 0;
   rc = (*p_connect) (s, addr, addr_len);
+  LATENCY_END (p_connect);
+  sock_table_connect (s, start, rc);
+
+  EXCLUDE_THIS ("connect");
+  WSLUA_HOOK (connect, rc, s, 0, addr);
 
-  WSTRACE ("connect (%s, %s, fam %s) --> %s",
-           socket_number(s), sockaddr_str2(addr, &addr_len),
-           socket_family(sa->sin_family), get_error(rc));
+  WSTRACE_BIN ("connect", s, rc, 0, addr);
+
+  /* Also for a non-blocking connect() in progress.
+   */
+  sock_table_set_peer (s, addr, addr_len);
 
   if (!exclude_this)
   {
-    if (g_cfg.geoip_enable)
-       dump_countries_sockaddr (addr);
-    if (g_cfg.DNSBL.enable)
-       dump_DNSBL_sockaddr (addr);
+    WSTRACE_PRINT ("connect (%s, %s, fam %s) --> %s",
+                   socket_number(s), sockaddr_str2_r(addr,&addr_len,addr_buf,sizeof(addr_buf)),
+                   socket_family(sa->sin_family), get_error(rc));
+
+    if (g_cfg.geoip_enable || g_cfg.DNSBL.enable)
+       dump_sockaddr_notes (addr);
   }
   LEAVE_CRIT();
   return (rc);
@@ -1397,12 +2049,20 @@ EXPORT int WINAPI ioctlsocket (SOCKET s, __LONG32 opt, __ms_u_long *argp)
 
   INIT_PTR (p_ioctlsocket);
   rc = (*p_ioctlsocket) (s, opt, argp);
+  LATENCY_END (p_ioctlsocket);
+
+  if (rc == 0 && opt == FIONBIO && argp)
+     sock_table_netem_nonblock (s, *argp != 0);
+
+  if (g_cfg.stats_only)
+     return (rc);
 
   ENTER_CRIT();
 
   if (argp)
      _itoa (*argp, arg, 10);
 
+  WSTRACE_BIN ("ioctlsocket", s, rc, 0, NULL);
   WSTRACE ("ioctlsocket (%s, %s, %s) --> %s",
            socket_number(s), ioctlsocket_cmd_name(opt), arg, get_error(rc));
 
@@ -1412,49 +2072,141 @@ EXPORT int WINAPI ioctlsocket (SOCKET s, __LONG32 opt, __ms_u_long *argp)
 
 #define FD_INPUT   "fd_input  ->"
 #define FD_OUTPUT  "fd_output ->"
+#define FD_READY   "fd_ready  ->"
+#define FD_DELTA   "fd_delta  ->"
 
-EXPORT int WINAPI select (int nfds, fd_set *rd_fd, fd_set *wr_fd, fd_set *ex_fd, CONST_PTIMEVAL tv)
+/*
+ * With '[netem] enable = 1', remove the sockets in 'fd' that are not
+ * to be reported readable ('out == FALSE') or writable yet.
+ * Returns the number removed and lowers '*wait' to the msec until
+ * the first of these will be ready.
+ */
+static int netem_select_filter (fd_set *fd, BOOL out, DWORD *wait)
 {
-  fd_set *rd_copy = NULL;
-  fd_set *wr_copy = NULL;
-  fd_set *ex_copy = NULL;
-  char    rc_buf [20];
-  char    tv_buf [50];
-  char    ts_buf [40] = "";  /* timestamp at start of select() */
-  int     rc;
-  size_t  sz;
-  BOOL    _exclude_this;
+  u_int i = 0;
+  int   removed = 0;
 
-  INIT_PTR (p_select);
-  ENTER_CRIT();
-
-  /* Set the global and local 'exclude_this' values
-   */
-  exclude_this = (g_cfg.trace_level == 0 || exclude_list_get("select", EXCL_FUNCTION));
-  _exclude_this = exclude_this;
+  if (!fd)
+     return (0);
 
-  if (!_exclude_this)
+  while (i < fd->fd_count)
   {
-    strcpy (ts_buf, get_timestamp());
+    if (sock_table_netem_ready(fd->fd_array[i], out, wait))
+    {
+      i++;
+      continue;
+    }
+    memmove (fd->fd_array + i, fd->fd_array + i + 1, (fd->fd_count - i - 1) * sizeof(SOCKET));
+    fd->fd_count--;
+    removed++;
+  }
+  return (removed);
+}
+
+/*
+ * The '[netem]' ticks until a 'select()' or 'WSAPoll()' timeout of 'usec'.
+ */
+static uint64 netem_deadline (uint64 usec)
+{
+  return (get_ts_ticks() + usec * g_cfg.ts_clocks_per_usec);
+}
+
+/*
+ * Return the usec left until 'deadline' or 0 if passed.
+ */
+static uint64 netem_usec_left (uint64 deadline)
+{
+  uint64 now = get_ts_ticks();
+
+  if (now >= deadline || g_cfg.ts_clocks_per_usec == 0)
+     return (0);
+  return ((deadline - now) / g_cfg.ts_clocks_per_usec);
+}
+
+/*
+ * All ready sockets were held back by '[netem]'. So wait for the first
+ * to become ready (or the timeout) as the real function would have done.
+ * Returns FALSE if the timeout is passed; a real timeout.
+ * Otherwise the caller restores the sets and calls the real function again
+ * with '*left' usec (if it had a timeout).
+ */
+static BOOL netem_wait_ready (DWORD wait, BOOL timed, uint64 deadline, uint64 *left)
+{
+  if (wait == INFINITE || wait == 0)
+     wait = 1;
+
+  if (timed)
+  {
+    *left = netem_usec_left (deadline);
+    if (*left == 0)
+       return (FALSE);
+    if (*left / 1000 + 1 < wait)
+       wait = (DWORD) (*left / 1000) + 1;
+  }
+  SleepEx (wait, FALSE);
+  if (timed)
+     *left = netem_usec_left (deadline);
+  return (TRUE);
+}
+
+EXPORT int WINAPI select (int nfds, fd_set *rd_fd, fd_set *wr_fd, fd_set *ex_fd, CONST_PTIMEVAL tv)
+{
+  fd_set *rd_copy = NULL;
+  fd_set *wr_copy = NULL;
+  fd_set *ex_copy = NULL;
+  char    rc_buf [20];
+  char    tv_buf [50];
+  char    ts_buf [40] = "";  /* timestamp at start of select() */
+  u_int   in_count [3];      /* for 'dump_select = 2' */
+  ULONG   poll_fds = 0;      /* for 'poll_stats = 1' */
+  LARGE_INTEGER poll_start;
+  int     rc;
+  BOOL    _exclude_this;
+  fd_set *netem_rd = NULL;   /* for '[netem]'; the sets given */
+  fd_set *netem_wr = NULL;
+  fd_set *netem_ex = NULL;
+  BOOL    netem_copied = FALSE;
+  uint64  deadline = 0, left;
+  DWORD   wait;
+  struct timeval  tv_left;
+  CONST_PTIMEVAL  tv_p = tv;
+
+  INIT_PTR (p_select);
+
+  if (g_cfg.stats_only)
+  {
+    rc = (*p_select) (nfds, rd_fd, wr_fd, ex_fd, tv);
+    LATENCY_END (p_select);
+    return (rc);
+  }
+
+  ENTER_CRIT();
+
+  /* Set the global and local 'exclude_this' values
+   */
+  EXCLUDE_THIS ("select");
+  _exclude_this = exclude_this;
+
+  if (!_exclude_this)
+  {
+    strcpy (ts_buf, get_hook_timestamp());
 
     if (!tv)
          strcpy (tv_buf, "unspec");
     else snprintf (tv_buf, sizeof(tv_buf), "tv=%ld.%06lds",
                    LONG_CAST(tv->tv_sec), LONG_CAST(tv->tv_usec));
 
-    if (g_cfg.dump_select)
+    if (g_cfg.dump_select >= 2)
     {
-      sz = size_fd_set (rd_fd);
-      if (sz)
-         rd_copy = copy_fd_set_to (rd_fd, alloca(sz));
-
-      sz = size_fd_set (wr_fd);
-      if (sz)
-         wr_copy = copy_fd_set_to (wr_fd, alloca(sz));
-
-      sz = size_fd_set (ex_fd);
-      if (sz)
-         ex_copy = copy_fd_set_to (ex_fd, alloca(sz));
+      in_count[0] = rd_fd ? rd_fd->fd_count : 0;
+      in_count[1] = wr_fd ? wr_fd->fd_count : 0;
+      in_count[2] = ex_fd ? ex_fd->fd_count : 0;
+    }
+    else if (g_cfg.dump_select)
+    {
+      rd_copy = copy_fd_set_buf (rd_fd, FD_COPY_DUMP+0);
+      wr_copy = copy_fd_set_buf (wr_fd, FD_COPY_DUMP+1);
+      ex_copy = copy_fd_set_buf (ex_fd, FD_COPY_DUMP+2);
     }
   }
 
@@ -1464,16 +2216,73 @@ EXPORT int WINAPI select (int nfds, fd_set *rd_fd, fd_set *wr_fd, fd_set *ex_fd,
    * threads can call us. Therefore we must not be in a critical section
    * while 'select()' is blocking.
    */
-  rc = (*p_select) (nfds, rd_fd, wr_fd, ex_fd, tv);
+  if (g_cfg.poll_stats)
+  {
+    poll_fds = (rd_fd ? rd_fd->fd_count : 0) +
+               (wr_fd ? wr_fd->fd_count : 0) +
+               (ex_fd ? ex_fd->fd_count : 0);
+    QueryPerformanceCounter (&poll_start);
+  }
+
+  /* With '[netem]', keep the sets given for another call of 'select()'
+   * if all the ready sockets are held back.
+   */
+  if (g_cfg.netem.enable)
+  {
+    netem_rd = copy_fd_set_buf (rd_fd, FD_COPY_NETEM+0);
+    netem_wr = copy_fd_set_buf (wr_fd, FD_COPY_NETEM+1);
+    netem_ex = copy_fd_set_buf (ex_fd, FD_COPY_NETEM+2);
+    netem_copied = (!!netem_rd == (size_fd_set(rd_fd) > 0) &&
+                    !!netem_wr == (size_fd_set(wr_fd) > 0) &&
+                    !!netem_ex == (size_fd_set(ex_fd) > 0));
+    if (tv)
+       deadline = netem_deadline ((uint64)tv->tv_sec * 1000000 + tv->tv_usec);
+  }
+
+  LATENCY_START();
+  while (1)
+  {
+    rc = (*p_select) (nfds, rd_fd, wr_fd, ex_fd, tv_p);
+    if (!g_cfg.netem.enable || rc <= 0)
+       break;
+
+    wait = INFINITE;
+    rc -= netem_select_filter (rd_fd, FALSE, &wait);
+    rc -= netem_select_filter (wr_fd, TRUE, &wait);
+    if (rc > 0 || !netem_copied || !netem_wait_ready(wait, tv != NULL, deadline, &left))
+       break;
+
+    if (netem_rd)
+       copy_fd_set_to (netem_rd, rd_fd);
+    if (netem_wr)
+       copy_fd_set_to (netem_wr, wr_fd);
+    if (netem_ex)
+       copy_fd_set_to (netem_ex, ex_fd);
+    if (tv)
+    {
+      tv_left.tv_sec  = (long) (left / 1000000);
+      tv_left.tv_usec = (long) (left % 1000000);
+      tv_p = &tv_left;
+    }
+  }
+  LATENCY_END (p_select);
 
   ENTER_CRIT();
 
+  if (g_cfg.poll_stats)
+     poll_stats_add (POLL_SELECT, &poll_start, poll_fds, rc);
+
   /* Remember last 'fd_set' for printing their types in FD_ISSET().
    */
   last_rd_fd = rd_fd;
   last_wr_fd = wr_fd;
   last_ex_fd = ex_fd;
 
+  if (!_exclude_this)
+     WSTRACE_BIN ("select", INVALID_SOCKET, rc, 0, NULL);
+  if (g_cfg.trace_binary)
+     _exclude_this = TRUE;
+
   if (!_exclude_this)
   {
     /* We want the timestamp for when select() was called.
@@ -1490,7 +2299,14 @@ EXPORT int WINAPI select (int nfds, fd_set *rd_fd, fd_set *wr_fd, fd_set *ex_fd,
                     ex_fd ? "ex" : "NULL",
                     tv_buf, rc, rc > 0 ? _itoa(rc,rc_buf,10) : get_error(rc));
 
-    if (g_cfg.dump_select)
+    if (g_cfg.dump_select >= 2 && rc >= 0)
+    {
+      trace_indent (g_cfg.trace_indent+2);
+      trace_puts ("~4" FD_READY);
+      dump_select_ready (rd_fd, wr_fd, ex_fd, in_count, g_cfg.trace_indent + 1 + sizeof(FD_READY));
+      trace_puts ("~0");
+    }
+    else if (g_cfg.dump_select == 1)
     {
       trace_indent (g_cfg.trace_indent+2);
       trace_puts ("~4" FD_INPUT);
@@ -1502,6 +2318,8 @@ EXPORT int WINAPI select (int nfds, fd_set *rd_fd, fd_set *wr_fd, fd_set *ex_fd,
       trace_puts ("~0");
     }
   }
+  else if (g_cfg.dump_select >= 2 && rc >= 0)
+    select_ready_update (rd_fd, wr_fd, ex_fd);
 
   LEAVE_CRIT();
 
@@ -1517,9 +2335,11 @@ EXPORT int WINAPI gethostname (char *buf, int buf_len)
 
   INIT_PTR (p_gethostname);
   rc = (*p_gethostname) (buf, buf_len);
+  LATENCY_END (p_gethostname);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("gethostname", INVALID_SOCKET, rc, 0, NULL);
   WSTRACE ("gethostname (->%.*s) --> %s", buf_len, buf, get_error(rc));
 
   LEAVE_CRIT();
@@ -1532,25 +2352,156 @@ EXPORT int WINAPI listen (SOCKET s, int backlog)
 
   INIT_PTR (p_listen);
   rc = (*p_listen) (s, backlog);
+  LATENCY_END (p_listen);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("listen", s, rc, 0, NULL);
   WSTRACE ("listen (%s, %d) --> %s", socket_number(s), backlog, get_error(rc));
 
   LEAVE_CRIT();
   return (rc);
 }
 
+/*
+ * The '[netem]' shaping of 'recv()', 'recvfrom()', 'send()' and 'sendto()'.
+ *
+ * Return the number of bytes a receive may ask for now. Or -1 with
+ * 'WSAEWOULDBLOCK' if nothing is to be delivered yet on a non-blocking
+ * socket. A blocking socket waits here (with no lock held) as the real
+ * function would have done.
+ */
+static int netem_recv_len (SOCKET s, int len, int flags)
+{
+  DWORD wait;
+  BOOL  non_blocking;
+  char  c;
+  int   allow, rc;
+
+  if (!g_cfg.netem.enable || (flags & MSG_PEEK) || len <= 0)
+     return (len);
+
+  while (1)
+  {
+    allow = sock_table_netem_recv (s, len, &wait, &non_blocking);
+    if (allow > 0)
+       return (allow);
+
+    if (allow == NETEM_PROBE)
+    {
+      /* The socket is idle. Check for (or wait for) new data to hold back.
+       * A datagram larger than 1 byte gives 'WSAEMSGSIZE'.
+       * Let the real function return an EOF or any other error.
+       */
+      rc = (*p_recv) (s, &c, 1, MSG_PEEK);
+      if (rc == 0 || (rc < 0 && (*p_WSAGetLastError)() != WSAEMSGSIZE))
+         return (len);
+      sock_table_netem_arrived (s);
+      continue;
+    }
+
+    if (non_blocking)
+    {
+      (*p_WSASetLastError) (WSAEWOULDBLOCK);
+      return (-1);
+    }
+    SleepEx (wait, FALSE);
+  }
+}
+
+/*
+ * Account for the '*rc' bytes received. Returns TRUE if a lost datagram was
+ * dropped and a blocking socket must receive again. On a non-blocking socket,
+ * '*rc' is then set to 'SOCKET_ERROR' with 'WSAEWOULDBLOCK'.
+ */
+static BOOL netem_recv_done (SOCKET s, int *rc, int flags)
+{
+  BOOL non_blocking;
+
+  if (!g_cfg.netem.enable || (flags & MSG_PEEK) || *rc <= 0)
+     return (FALSE);
+
+  if (!sock_table_netem_received(s, *rc, &non_blocking))
+     return (FALSE);
+
+  if (!non_blocking)
+     return (TRUE);
+
+  *rc = SOCKET_ERROR;
+  (*p_WSASetLastError) (WSAEWOULDBLOCK);
+  return (FALSE);
+}
+
+/*
+ * Return the number of bytes a send may send now. Or 'NETEM_DROP' for a
+ * lost datagram. Or -1 with 'WSAEWOULDBLOCK' on a non-blocking socket.
+ */
+static int netem_send_len (SOCKET s, int len)
+{
+  DWORD wait;
+  BOOL  non_blocking;
+  int   allow;
+
+  if (!g_cfg.netem.enable || len <= 0)
+     return (len);
+
+  while (1)
+  {
+    allow = sock_table_netem_send (s, len, &wait, &non_blocking);
+    if (allow != 0)
+       return (allow);
+
+    if (non_blocking)
+    {
+      (*p_WSASetLastError) (WSAEWOULDBLOCK);
+      return (-1);
+    }
+    SleepEx (wait, FALSE);
+  }
+}
+
+/*
+ * Do the real send of 'len' bytes from 'netem_send_len()'.
+ * A dropped datagram looks like it was sent.
+ */
+#define NETEM_SEND(len, real_send)                       \
+        do {                                             \
+          if ((len) == NETEM_DROP)                       \
+               rc = buf_len;                             \
+          else if ((len) < 0)                            \
+               rc = SOCKET_ERROR;                        \
+          else rc = real_send;                           \
+          if (g_cfg.netem.enable && (len) > 0 && rc > 0) \
+             sock_table_netem_sent (s, rc);              \
+        } while (0)
+
 EXPORT int WINAPI recv (SOCKET s, char *buf, int buf_len, int flags)
 {
-  int rc;
+  int rc, len;
 
   INIT_PTR (p_recv);
-  rc = (*p_recv) (s, buf, buf_len, flags);
+  do
+  {
+    len = netem_recv_len (s, buf_len, flags);
+    rc  = (len < 0) ? SOCKET_ERROR : (*p_recv) (s, buf, len, flags);
+  }
+  while (netem_recv_done(s, &rc, flags));
+  LATENCY_END (p_recv);
+  SHM_XFER (p_recv, rc > 0 ? rc : 0, rc < 0);
+
+  if (g_cfg.stats_only)
+  {
+    stats_recv (rc, (flags & MSG_PEEK) != 0);
+    return (rc);
+  }
+
+  WSLUA_HOOK_NOLOCK (recv, rc, s, rc > 0 ? rc : 0, NULL);
 
   ENTER_CRIT();
 
-  exclude_this = (g_cfg.trace_level == 0 || exclude_list_get("recv", EXCL_FUNCTION));
+  EXCLUDE_THIS ("recv");
+  SAMPLE_THIS (s, rc, FALSE, rc >= 0);
+  WSLUA_HOOK (recv, rc, s, rc > 0 ? rc : 0, NULL);
 
   if (rc >= 0)
   {
@@ -1561,23 +2512,21 @@ EXPORT int WINAPI recv (SOCKET s, char *buf, int buf_len, int flags)
   else
     g_cfg.counts.recv_errors++;
 
-  if (!exclude_this)
-  {
-    char res[100];
+  if (rc < 0 || !(flags & MSG_PEEK))
+     sock_table_count (s, rc > 0 ? rc : 0, FALSE, rc < 0);
 
-    if (rc >= 0)
-        sprintf (res, "%d bytes", rc);
-    else strcpy (res, get_error(rc));
+  WSTRACE_BIN ("recv", s, rc, rc > 0 ? rc : 0, NULL);
 
-    WSTRACE ("recv (%s, 0x%p, %d, %s) --> %s",
-             socket_number(s), buf, buf_len, socket_flags(flags), res);
+  if (!exclude_this)
+  {
+    WSTRACE_FAST ("recv", "spdSB", s, buf, buf_len, socket_flags(flags), rc);
 
     if (rc > 0 && g_cfg.dump_data)
        dump_data (buf, rc);
   }
 
-  if (g_cfg.pcap.enable)
-     write_pcap_packet (s, buf, buf_len, FALSE);
+  if (g_cfg.pcap.enable && rc > 0)
+     write_pcap_packet (s, NULL, buf, rc, FALSE);
 
   LEAVE_CRIT();
 
@@ -1589,14 +2538,38 @@ EXPORT int WINAPI recv (SOCKET s, char *buf, int buf_len, int flags)
 
 EXPORT int WINAPI recvfrom (SOCKET s, char *buf, int buf_len, int flags, struct sockaddr *from, int *from_len)
 {
-  int rc;
+  int  rc, len;
+  int  from_size = from_len ? *from_len : 0;
+  char addr_buf [SOCKADDR_STR_SZ];
 
   INIT_PTR (p_recvfrom);
-  rc = (*p_recvfrom) (s, buf, buf_len, flags, from, from_len);
+  do
+  {
+    if (from_len)
+       *from_len = from_size;
+    len = netem_recv_len (s, buf_len, flags);
+    rc  = (len < 0) ? SOCKET_ERROR : (*p_recvfrom) (s, buf, len, flags, from, from_len);
+  }
+  while (netem_recv_done(s, &rc, flags));
+  LATENCY_END (p_recvfrom);
+  SHM_XFER (p_recvfrom, rc > 0 ? rc : 0, rc < 0);
+
+  if (g_cfg.stats_only)
+  {
+    stats_recv (rc, (flags & MSG_PEEK) != 0);
+    if (rc >= 0)
+       stats_peer (from);
+    return (rc);
+  }
+
+  WSLUA_HOOK_NOLOCK (recvfrom, rc, s, rc > 0 ? rc : 0, rc >= 0 ? from : NULL);
 
+  LAZY_INIT_WAIT (LAZY_GEOIP | LAZY_DNSBL);
   ENTER_CRIT();
 
-  exclude_this = (g_cfg.trace_level == 0 || exclude_list_get("recvfrom", EXCL_FUNCTION));
+  EXCLUDE_THIS ("recvfrom");
+  SAMPLE_THIS (s, rc, FALSE, rc >= 0);
+  WSLUA_HOOK (recvfrom, rc, s, rc > 0 ? rc : 0, rc >= 0 ? from : NULL);
 
   if (rc >= 0)
   {
@@ -1607,34 +2580,28 @@ EXPORT int WINAPI recvfrom (SOCKET s, char *buf, int buf_len, int flags, struct
   else
     g_cfg.counts.recv_errors++;
 
+  if (rc < 0 || !(flags & MSG_PEEK))
+     sock_table_count (s, rc > 0 ? rc : 0, FALSE, rc < 0);
+
+  WSTRACE_BIN ("recvfrom", s, rc, rc > 0 ? rc : 0, rc >= 0 ? from : NULL);
+
   if (!exclude_this)
   {
-    char res[100];
-
-    if (rc >= 0)
-       sprintf (res, "%d bytes", rc);
-    else
-    {
-      strcpy (res, get_error(rc));
-      if (rc == WSAEWOULDBLOCK)
-         g_cfg.counts.recv_EWOULDBLOCK++;
-    }
+    if (rc == SOCKET_ERROR && (*p_WSAGetLastError)() == WSAEWOULDBLOCK)
+       g_cfg.counts.recv_EWOULDBLOCK++;
 
-    WSTRACE ("recvfrom (%s, 0x%p, %d, %s, %s) --> %s",
-             socket_number(s), buf, buf_len, socket_flags(flags),
-             sockaddr_str2(from,from_len), res);
+    WSTRACE_FAST ("recvfrom", "spdSSB", s, buf, buf_len, socket_flags(flags),
+                  sockaddr_str2_r(from,from_len,addr_buf,sizeof(addr_buf)), rc);
 
     if (rc > 0 && g_cfg.dump_data)
        dump_data (buf, rc);
 
-    if (g_cfg.geoip_enable)
-       dump_countries_sockaddr (from);
-    if (g_cfg.DNSBL.enable)
-       dump_DNSBL_sockaddr (from);
+    if (g_cfg.geoip_enable || g_cfg.DNSBL.enable)
+       dump_sockaddr_notes (from);
   }
 
-  if (g_cfg.pcap.enable)
-     write_pcap_packet (s, buf, buf_len, FALSE);
+  if (g_cfg.pcap.enable && rc > 0)
+     write_pcap_packet (s, from, buf, rc, FALSE);
 
   LEAVE_CRIT();
 
@@ -1646,36 +2613,46 @@ EXPORT int WINAPI recvfrom (SOCKET s, char *buf, int buf_len, int flags, struct
 
 EXPORT int WINAPI send (SOCKET s, const char *buf, int buf_len, int flags)
 {
-  int rc;
+  int rc, len;
 
   INIT_PTR (p_send);
-  rc = (*p_send) (s, buf, buf_len, flags);
+  len = netem_send_len (s, buf_len);
+  NETEM_SEND (len, (*p_send) (s, buf, len, flags));
+  LATENCY_END (p_send);
+  SHM_XFER (p_send, rc > 0 ? rc : 0, rc < 0);
+
+  if (g_cfg.stats_only)
+  {
+    stats_send (rc);
+    return (rc);
+  }
+
+  WSLUA_HOOK_NOLOCK (send, rc, s, rc > 0 ? rc : 0, NULL);
 
   ENTER_CRIT();
 
-  exclude_this = (g_cfg.trace_level == 0 || exclude_list_get("send", EXCL_FUNCTION));
+  EXCLUDE_THIS ("send");
+  SAMPLE_THIS (s, rc, TRUE, rc >= 0);
+  WSLUA_HOOK (send, rc, s, rc > 0 ? rc : 0, NULL);
 
   if (rc >= 0)
        g_cfg.counts.send_bytes += rc;
   else g_cfg.counts.send_errors++;
 
-  if (!exclude_this)
-  {
-    char res[100];
+  sock_table_count (s, rc > 0 ? rc : 0, TRUE, rc < 0);
 
-    if (rc >= 0)
-         sprintf (res, "%d bytes", rc);
-    else strcpy (res, get_error(rc));
+  WSTRACE_BIN ("send", s, rc, rc > 0 ? rc : 0, NULL);
 
-    WSTRACE ("send (%s, 0x%p, %d, %s) --> %s",
-             socket_number(s), buf, buf_len, socket_flags(flags), res);
+  if (!exclude_this)
+  {
+    WSTRACE_FAST ("send", "spdSB", s, buf, buf_len, socket_flags(flags), rc);
 
     if (g_cfg.dump_data)
        dump_data (buf, buf_len);
   }
 
-  if (g_cfg.pcap.enable)
-     write_pcap_packet (s, buf, buf_len, TRUE);
+  if (g_cfg.pcap.enable && rc > 0)
+     write_pcap_packet (s, NULL, buf, rc, TRUE);
 
   LEAVE_CRIT();
 
@@ -1687,43 +2664,53 @@ EXPORT int WINAPI send (SOCKET s, const char *buf, int buf_len, int flags)
 
 EXPORT int WINAPI sendto (SOCKET s, const char *buf, int buf_len, int flags, const struct sockaddr *to, int to_len)
 {
-  int rc;
+  int  rc, len;
+  char addr_buf [SOCKADDR_STR_SZ];
 
   INIT_PTR (p_sendto);
-  rc = (*p_sendto) (s, buf, buf_len, flags, to, to_len);
+  len = netem_send_len (s, buf_len);
+  NETEM_SEND (len, (*p_sendto) (s, buf, len, flags, to, to_len));
+  LATENCY_END (p_sendto);
+  SHM_XFER (p_sendto, rc > 0 ? rc : 0, rc < 0);
 
+  if (g_cfg.stats_only)
+  {
+    stats_send (rc);
+    stats_peer (to);
+    return (rc);
+  }
+
+  WSLUA_HOOK_NOLOCK (sendto, rc, s, rc > 0 ? rc : 0, to);
+
+  LAZY_INIT_WAIT (LAZY_GEOIP | LAZY_DNSBL);
   ENTER_CRIT();
 
-  exclude_this = (g_cfg.trace_level == 0 || exclude_list_get("sendto", EXCL_FUNCTION));
+  EXCLUDE_THIS ("sendto");
+  SAMPLE_THIS (s, rc, TRUE, rc >= 0);
+  WSLUA_HOOK (sendto, rc, s, rc > 0 ? rc : 0, to);
 
   if (rc >= 0)
        g_cfg.counts.send_bytes += rc;
   else g_cfg.counts.send_errors++;
 
-  if (!exclude_this)
-  {
-    char res[100];
+  sock_table_count (s, rc > 0 ? rc : 0, TRUE, rc < 0);
 
-    if (rc >= 0)
-         sprintf (res, "%d bytes", rc);
-    else strcpy (res, get_error(rc));
+  WSTRACE_BIN ("sendto", s, rc, rc > 0 ? rc : 0, to);
 
-    WSTRACE ("sendto (%s, 0x%p, %d, %s, %s) --> %s",
-             socket_number(s), buf, buf_len, socket_flags(flags),
-             sockaddr_str2(to,&to_len), res);
+  if (!exclude_this)
+  {
+    WSTRACE_FAST ("sendto", "spdSSB", s, buf, buf_len, socket_flags(flags),
+                  sockaddr_str2_r(to,&to_len,addr_buf,sizeof(addr_buf)), rc);
 
     if (g_cfg.dump_data)
        dump_data (buf, buf_len);
 
-    if (g_cfg.geoip_enable)
-       dump_countries_sockaddr (to);
-
-    if (g_cfg.DNSBL.enable)
-       dump_DNSBL_sockaddr (to);
+    if (g_cfg.geoip_enable || g_cfg.DNSBL.enable)
+       dump_sockaddr_notes (to);
   }
 
-  if (g_cfg.pcap.enable)
-     write_pcap_packet (s, buf, buf_len, TRUE);
+  if (g_cfg.pcap.enable && rc > 0)
+     write_pcap_packet (s, to, buf, rc, TRUE);
 
   LEAVE_CRIT();
 
@@ -1756,10 +2743,26 @@ EXPORT int WINAPI WSARecv (SOCKET s, WSABUF *bufs, DWORD num_bufs, DWORD *num_by
 
   INIT_PTR (p_WSARecv);
   rc = (*p_WSARecv) (s, bufs, num_bufs, num_bytes, flags, ov, func);
+  LATENCY_END (p_WSARecv);
+  SHM_XFER (p_WSARecv, (rc == 0 && num_bytes) ? *num_bytes : 0,
+            rc != 0 && (*p_WSAGetLastError)() != WSA_IO_PENDING);
+
+  if (g_cfg.stats_only)
+  {
+    /* A pending overlapped transfer is not counted in this mode.
+     */
+    if (rc == NO_ERROR)
+         stats_recv (num_bytes ? (int)*num_bytes : 0, FALSE);
+    else if ((*p_WSAGetLastError)() != WSA_IO_PENDING)
+         stats_recv (SOCKET_ERROR, FALSE);
+    return (rc);
+  }
 
   ENTER_CRIT();
 
-  exclude_this = (g_cfg.trace_level == 0 || exclude_list_get("WSARecv", EXCL_FUNCTION));
+  EXCLUDE_THIS ("WSARecv");
+  SAMPLE_THIS (s, (rc == 0 && num_bytes) ? *num_bytes : 0, FALSE,
+               rc == 0 || (*p_WSAGetLastError)() == WSA_IO_PENDING);
   size = bufs->len * num_bufs;
 
   if (rc == NO_ERROR)
@@ -1768,28 +2771,30 @@ EXPORT int WINAPI WSARecv (SOCKET s, WSABUF *bufs, DWORD num_bufs, DWORD *num_by
      * updated in 'WSAGetOverlappedResult()'
      */
     g_cfg.counts.recv_bytes += size;
+    sock_table_count (s, num_bytes ? *num_bytes : 0, FALSE, FALSE);
+  }
+  else if (ov && (*p_WSAGetLastError)() == WSA_IO_PENDING)
+  {
+    /* A pending overlapped transfer. Counted when completed.
+     */
+    overlap_store (s, ov, size, TRUE);
   }
 
+  WSTRACE_BIN ("WSARecv", s, rc, (rc == 0 && num_bytes) ? *num_bytes : 0, NULL);
+
   if (!exclude_this)
   {
-    char        res[100];
     const char *flg = flags ? socket_flags(*flags) : "NULL";
 
-    strcpy (res, get_error(rc));
-
-    WSTRACE ("WSARecv (%s, 0x%p, %lu, %lu, <%s>, 0x%p, 0x%p) --> %s",
-             socket_number(s), bufs, DWORD_CAST(num_bufs),
-             DWORD_CAST(*num_bytes), flg, ov, func, res);
+    WSTRACE_FAST ("WSARecv", "spunFppE", s, bufs, num_bufs, num_bytes,
+                  flg, ov, func, rc);
 
     if (g_cfg.dump_data)
        dump_wsabuf (bufs, num_bufs);
-
-    if (ov)
-       overlap_store (s, ov, size, TRUE);
   }
 
-  if (g_cfg.pcap.enable)
-     write_pcap_packetv (s, bufs, num_bufs, FALSE);
+  if (g_cfg.pcap.enable && rc == 0 && num_bytes)
+     write_pcap_packetv (s, NULL, bufs, num_bufs, *num_bytes, FALSE);
 
   LEAVE_CRIT();
 
@@ -1805,13 +2810,33 @@ EXPORT int WINAPI WSARecvFrom (SOCKET s, WSABUF *bufs, DWORD num_bufs, DWORD *nu
 {
   DWORD size;
   int   rc;
+  char  addr_buf [SOCKADDR_STR_SZ];
 
   INIT_PTR (p_WSARecvFrom);
   rc = (*p_WSARecvFrom) (s, bufs, num_bufs, num_bytes, flags, from, from_len, ov, func);
+  LATENCY_END (p_WSARecvFrom);
+  SHM_XFER (p_WSARecvFrom, (rc == 0 && num_bytes) ? *num_bytes : 0,
+            rc != 0 && (*p_WSAGetLastError)() != WSA_IO_PENDING);
 
+  if (g_cfg.stats_only)
+  {
+    /* A pending overlapped transfer is not counted in this mode.
+     */
+    if (rc == NO_ERROR)
+         stats_recv (num_bytes ? (int)*num_bytes : 0, FALSE);
+    else if ((*p_WSAGetLastError)() != WSA_IO_PENDING)
+         stats_recv (SOCKET_ERROR, FALSE);
+    if (rc == NO_ERROR)
+       stats_peer (from);
+    return (rc);
+  }
+
+  LAZY_INIT_WAIT (LAZY_GEOIP | LAZY_DNSBL);
   ENTER_CRIT();
 
-  exclude_this = (g_cfg.trace_level == 0 || exclude_list_get("WSARecvFrom", EXCL_FUNCTION));
+  EXCLUDE_THIS ("WSARecvFrom");
+  SAMPLE_THIS (s, (rc == 0 && num_bytes) ? *num_bytes : 0, FALSE,
+               rc == 0 || (*p_WSAGetLastError)() == WSA_IO_PENDING);
   size = bufs->len * num_bufs;
 
   if (rc == NO_ERROR)
@@ -1820,8 +2845,17 @@ EXPORT int WINAPI WSARecvFrom (SOCKET s, WSABUF *bufs, DWORD num_bufs, DWORD *nu
      * updated in 'WSAGetOverlappedResult()'
      */
     g_cfg.counts.recv_bytes += size;
+    sock_table_count (s, num_bytes ? *num_bytes : 0, FALSE, FALSE);
+  }
+  else if (ov && (*p_WSAGetLastError)() == WSA_IO_PENDING)
+  {
+    /* A pending overlapped transfer. Counted when completed.
+     */
+    overlap_store (s, ov, size, TRUE);
   }
 
+  WSTRACE_BIN ("WSARecvFrom", s, rc, (rc == 0 && num_bytes) ? *num_bytes : 0, rc == 0 ? from : NULL);
+
   if (!exclude_this)
   {
     char        res[100];
@@ -1834,25 +2868,19 @@ EXPORT int WINAPI WSARecvFrom (SOCKET s, WSABUF *bufs, DWORD num_bufs, DWORD *nu
 
     strcpy (res, get_error(rc));
 
-    WSTRACE ("WSARecvFrom (%s, 0x%p, %lu, %s, <%s>, %s, 0x%p, 0x%p) --> %s",
+    WSTRACE_PRINT ("WSARecvFrom (%s, 0x%p, %lu, %s, <%s>, %s, 0x%p, 0x%p) --> %s",
              socket_number(s), bufs, DWORD_CAST(num_bufs), nbytes, flg,
-             sockaddr_str2(from,from_len), ov, func, res);
+             sockaddr_str2_r(from,from_len,addr_buf,sizeof(addr_buf)), ov, func, res);
 
     if (rc > 0 && g_cfg.dump_data)
        dump_wsabuf (bufs, num_bufs);
 
-    if (g_cfg.geoip_enable)
-       dump_countries_sockaddr (from);
-
-    if (g_cfg.DNSBL.enable)
-       dump_DNSBL_sockaddr (from);
-
-    if (ov)
-       overlap_store (s, ov, size, TRUE);
+    if (g_cfg.geoip_enable || g_cfg.DNSBL.enable)
+       dump_sockaddr_notes (from);
   }
 
-  if (g_cfg.pcap.enable)
-     write_pcap_packetv (s, bufs, num_bufs, FALSE);
+  if (g_cfg.pcap.enable && rc == 0 && num_bytes)
+     write_pcap_packetv (s, from, bufs, num_bufs, *num_bytes, FALSE);
 
   LEAVE_CRIT();
 
@@ -1868,15 +2896,28 @@ EXPORT int WINAPI WSARecvEx (SOCKET s, char *buf, int buf_len, int *flags)
 
   INIT_PTR (p_WSARecvEx);
   rc = (*p_WSARecvEx) (s, buf, buf_len, flags);
+  LATENCY_END (p_WSARecvEx);
+  SHM_XFER (p_WSARecvEx, rc > 0 ? rc : 0, rc < 0);
+
+  if (g_cfg.stats_only)
+  {
+    stats_recv (rc, FALSE);
+    return (rc);
+  }
 
   ENTER_CRIT();
 
-  exclude_this = (g_cfg.trace_level == 0 || exclude_list_get("WSARecvEx", EXCL_FUNCTION));
+  EXCLUDE_THIS ("WSARecvEx");
+  SAMPLE_THIS (s, rc, FALSE, rc >= 0);
 
   if (rc >= 0)
        g_cfg.counts.recv_bytes += rc;
   else g_cfg.counts.recv_errors++;
 
+  sock_table_count (s, rc > 0 ? rc : 0, FALSE, rc < 0);
+
+  WSTRACE_BIN ("WSARecvEx", s, rc, rc > 0 ? rc : 0, NULL);
+
   if (!exclude_this)
   {
     char res[100];
@@ -1886,15 +2927,15 @@ EXPORT int WINAPI WSARecvEx (SOCKET s, char *buf, int buf_len, int *flags)
          strcpy (res, get_error(rc));
     else sprintf (res, "%d bytes", rc);
 
-    WSTRACE ("WSARecvEx (%s, 0x%p, %d, <%s>) --> %s",
+    WSTRACE_PRINT ("WSARecvEx (%s, 0x%p, %d, <%s>) --> %s",
              socket_number(s), buf, buf_len, flg, res);
 
     if (rc > 0 && g_cfg.dump_data)
        dump_data (buf, rc);
   }
 
-  if (g_cfg.pcap.enable)
-     write_pcap_packet (s, buf, buf_len, FALSE);
+  if (g_cfg.pcap.enable && rc > 0)
+     write_pcap_packet (s, NULL, buf, rc, FALSE);
 
   LEAVE_CRIT();
 
@@ -1910,9 +2951,11 @@ EXPORT int WINAPI WSARecvDisconnect (SOCKET s, WSABUF *disconnect_data)
 
   INIT_PTR (p_WSARecvDisconnect);
   rc = (*p_WSARecvDisconnect) (s, disconnect_data);
+  LATENCY_END (p_WSARecvDisconnect);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("WSARecvDisconnect", s, rc, 0, NULL);
   WSTRACE ("WSARecvDisconnect (%s, 0x%p) --> %s",
            socket_number(s), disconnect_data, get_error(rc));
 
@@ -1934,6 +2977,20 @@ EXPORT int WINAPI WSASend (SOCKET s, WSABUF *bufs, DWORD num_bufs, DWORD *num_by
 
   INIT_PTR (p_WSASend);
   rc = (*p_WSASend) (s, bufs, num_bufs, num_bytes, flags, ov, func);
+  LATENCY_END (p_WSASend);
+  SHM_XFER (p_WSASend, (rc == 0 && num_bytes) ? *num_bytes : 0,
+            rc != 0 && (*p_WSAGetLastError)() != WSA_IO_PENDING);
+
+  if (g_cfg.stats_only)
+  {
+    /* A pending overlapped transfer is not counted in this mode.
+     */
+    if (rc == NO_ERROR)
+         stats_send (num_bytes ? (int)*num_bytes : 0);
+    else if ((*p_WSAGetLastError)() != WSA_IO_PENDING)
+         stats_send (SOCKET_ERROR);
+    return (rc);
+  }
 
   ENTER_CRIT();
 
@@ -1943,34 +3000,32 @@ EXPORT int WINAPI WSASend (SOCKET s, WSABUF *bufs, DWORD num_bufs, DWORD *num_by
      * updated in 'WSAGetOverlappedResult()'
      */
     g_cfg.counts.send_bytes += count_wsabuf (bufs, num_bufs);
+    sock_table_count (s, num_bytes ? *num_bytes : 0, TRUE, FALSE);
   }
-
-  exclude_this = (g_cfg.trace_level == 0 || exclude_list_get("WSASend", EXCL_FUNCTION));
-
-  if (!exclude_this)
+  else if (ov && (*p_WSAGetLastError)() == WSA_IO_PENDING)
   {
-    char res[100];
-    char nbytes[20];
+    /* A pending overlapped transfer. Counted when completed.
+     */
+    overlap_store (s, ov, count_wsabuf(bufs, num_bufs), FALSE);
+  }
 
-    if (num_bytes)
-         _itoa (*num_bytes, nbytes, 10);
-    else strcpy (nbytes, "??");
+  EXCLUDE_THIS ("WSASend");
+  SAMPLE_THIS (s, (rc == 0 && num_bytes) ? *num_bytes : 0, TRUE,
+               rc == 0 || (*p_WSAGetLastError)() == WSA_IO_PENDING);
 
-    strcpy (res, get_error(rc));
+  WSTRACE_BIN ("WSASend", s, rc, (rc == 0 && num_bytes) ? *num_bytes : 0, NULL);
 
-    WSTRACE ("WSASend (%s, 0x%p, %lu, %s, <%s>, 0x%p, 0x%p) --> %s",
-             socket_number(s), bufs, DWORD_CAST(num_bufs), nbytes,
-             socket_flags(flags), ov, func, res);
+  if (!exclude_this)
+  {
+    WSTRACE_FAST ("WSASend", "spunFppE", s, bufs, num_bufs, num_bytes,
+                  socket_flags(flags), ov, func, rc);
 
     if (g_cfg.dump_data)
        dump_wsabuf (bufs, num_bufs);
-
-    if (ov)
-       overlap_store (s, ov, count_wsabuf(bufs, num_bufs), FALSE);
   }
 
-  if (g_cfg.pcap.enable)
-     write_pcap_packetv (s, bufs, num_bufs, TRUE);
+  if (g_cfg.pcap.enable && rc == 0 && num_bytes)
+     write_pcap_packetv (s, NULL, bufs, num_bufs, *num_bytes, TRUE);
 
   LEAVE_CRIT();
 
@@ -1984,11 +3039,28 @@ EXPORT int WINAPI WSASendTo (SOCKET s, WSABUF *bufs, DWORD num_bufs, DWORD *num_
                              DWORD flags, const struct sockaddr *to, int to_len,
                              WSAOVERLAPPED *ov, LPWSAOVERLAPPED_COMPLETION_ROUTINE func)
 {
-  int rc;
+  int  rc;
+  char addr_buf [SOCKADDR_STR_SZ];
 
   INIT_PTR (p_WSASendTo);
   rc = (*p_WSASendTo) (s, bufs, num_bufs, num_bytes, flags, to, to_len, ov, func);
+  LATENCY_END (p_WSASendTo);
+  SHM_XFER (p_WSASendTo, (rc == 0 && num_bytes) ? *num_bytes : 0,
+            rc != 0 && (*p_WSAGetLastError)() != WSA_IO_PENDING);
+
+  if (g_cfg.stats_only)
+  {
+    /* A pending overlapped transfer is not counted in this mode.
+     */
+    if (rc == NO_ERROR)
+         stats_send (num_bytes ? (int)*num_bytes : 0);
+    else if ((*p_WSAGetLastError)() != WSA_IO_PENDING)
+         stats_send (SOCKET_ERROR);
+    stats_peer (to);
+    return (rc);
+  }
 
+  LAZY_INIT_WAIT (LAZY_GEOIP | LAZY_DNSBL);
   ENTER_CRIT();
 
   if (rc == NO_ERROR)
@@ -1997,9 +3069,20 @@ EXPORT int WINAPI WSASendTo (SOCKET s, WSABUF *bufs, DWORD num_bufs, DWORD *num_
      * updated in 'WSAGetOverlappedResult()'
      */
     g_cfg.counts.send_bytes += count_wsabuf (bufs, num_bufs);
+    sock_table_count (s, num_bytes ? *num_bytes : 0, TRUE, FALSE);
   }
+  else if (ov && (*p_WSAGetLastError)() == WSA_IO_PENDING)
+  {
+    /* A pending overlapped transfer. Counted when completed.
+     */
+    overlap_store (s, ov, count_wsabuf(bufs, num_bufs), FALSE);
+  }
+
+  EXCLUDE_THIS ("WSASendTo");
+  SAMPLE_THIS (s, (rc == 0 && num_bytes) ? *num_bytes : 0, TRUE,
+               rc == 0 || (*p_WSAGetLastError)() == WSA_IO_PENDING);
 
-  exclude_this = (g_cfg.trace_level == 0 || exclude_list_get("WSASendTo", EXCL_FUNCTION));
+  WSTRACE_BIN ("WSASendTo", s, rc, (rc == 0 && num_bytes) ? *num_bytes : 0, to);
 
   if (!exclude_this)
   {
@@ -2012,25 +3095,19 @@ EXPORT int WINAPI WSASendTo (SOCKET s, WSABUF *bufs, DWORD num_bufs, DWORD *num_
 
     strcpy (res, get_error(rc));
 
-    WSTRACE ("WSASendTo (%s, 0x%p, %lu, %s, <%s>, %s, 0x%p, 0x%p) --> %s",
+    WSTRACE_PRINT ("WSASendTo (%s, 0x%p, %lu, %s, <%s>, %s, 0x%p, 0x%p) --> %s",
              socket_number(s), bufs, DWORD_CAST(num_bufs), nbytes, socket_flags(flags),
-             sockaddr_str2(to,&to_len), ov, func, res);
+             sockaddr_str2_r(to,&to_len,addr_buf,sizeof(addr_buf)), ov, func, res);
 
     if (g_cfg.dump_data)
        dump_wsabuf (bufs, num_bufs);
 
-    if (g_cfg.geoip_enable)
-       dump_countries_sockaddr (to);
-
-    if (g_cfg.DNSBL.enable)
-       dump_DNSBL_sockaddr (to);
-
-    if (ov)
-       overlap_store (s, ov, count_wsabuf(bufs, num_bufs), FALSE);
+    if (g_cfg.geoip_enable || g_cfg.DNSBL.enable)
+       dump_sockaddr_notes (to);
   }
 
-  if (g_cfg.pcap.enable)
-     write_pcap_packetv (s, bufs, num_bufs, TRUE);
+  if (g_cfg.pcap.enable && rc == 0 && num_bytes)
+     write_pcap_packetv (s, to, bufs, num_bufs, *num_bytes, TRUE);
 
   LEAVE_CRIT();
 
@@ -2047,10 +3124,13 @@ EXPORT int WINAPI WSASendMsg (SOCKET s, WSAMSG *msg, DWORD flags, DWORD *num_byt
 
   INIT_PTR (p_WSASendMsg);
   rc = (*p_WSASendMsg) (s, msg, flags, num_bytes_sent, ov, func);
+  LATENCY_END (p_WSASendMsg);
 
   ENTER_CRIT();
 
-  exclude_this = (g_cfg.trace_level == 0 || exclude_list_get("WSASendMsg", EXCL_FUNCTION));
+  EXCLUDE_THIS ("WSASendMsg");
+
+  WSTRACE_BIN ("WSASendMsg", s, rc, (rc == 0 && num_bytes_sent) ? *num_bytes_sent : 0, NULL);
 
   if (!exclude_this)
   {
@@ -2058,7 +3138,7 @@ EXPORT int WINAPI WSASendMsg (SOCKET s, WSAMSG *msg, DWORD flags, DWORD *num_byt
 
     strcpy (res, get_error(rc));
 
-    WSTRACE ("WSASendMsg (%s, 0x%p, ...) --> %s", socket_number(s), msg, res);
+    WSTRACE_PRINT ("WSASendMsg (%s, 0x%p, ...) --> %s", socket_number(s), msg, res);
   }
 
   LEAVE_CRIT();
@@ -2075,6 +3155,7 @@ EXPORT BOOL WINAPI WSAGetOverlappedResult (SOCKET s, WSAOVERLAPPED *ov, DWORD *t
 
   INIT_PTR (p_WSAGetOverlappedResult);
   rc = (*p_WSAGetOverlappedResult) (s, ov, &bytes, wait, flags);
+  LATENCY_END (p_WSAGetOverlappedResult);
 
   ENTER_CRIT();
 
@@ -2087,6 +3168,7 @@ EXPORT BOOL WINAPI WSAGetOverlappedResult (SOCKET s, WSAOVERLAPPED *ov, DWORD *t
   if (flags)
      flg = wsasocket_flags_decode (*flags);
 
+  WSTRACE_BIN ("WSAGetOverlappedResult", s, rc ? 0 : -1, bytes, NULL);
   WSTRACE ("WSAGetOverlappedResult (%s, 0x%p, %s, %d, %s) --> %s",
            socket_number(s), ov, xfer, wait, flg, get_error(rc));
 
@@ -2114,9 +3196,14 @@ EXPORT int WINAPI WSAEnumNetworkEvents (SOCKET s, WSAEVENT ev, WSANETWORKEVENTS
 
   INIT_PTR (p_WSAEnumNetworkEvents);
   rc = (*p_WSAEnumNetworkEvents) (s, ev, events);
+  LATENCY_END (p_WSAEnumNetworkEvents);
+
+  if (g_cfg.stats_only)
+     return (rc);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("WSAEnumNetworkEvents", s, rc, 0, NULL);
   WSTRACE ("WSAEnumNetworkEvents (%s, 0x%" ADDR_FMT ", 0x%" ADDR_FMT ") --> %s",
            socket_number(s), ADDR_CAST(ev), ADDR_CAST(events), get_error(rc));
 
@@ -2141,6 +3228,7 @@ EXPORT int WINAPI WSAEnumProtocolsA (int *protocols, WSAPROTOCOL_INFOA *proto_in
 
   INIT_PTR (p_WSAEnumProtocolsA);
   rc = (*p_WSAEnumProtocolsA) (protocols, proto_info, buf_len);
+  LATENCY_END (p_WSAEnumProtocolsA);
 
   ENTER_CRIT();
 
@@ -2151,6 +3239,7 @@ EXPORT int WINAPI WSAEnumProtocolsA (int *protocols, WSAPROTOCOL_INFOA *proto_in
     else p = (char*) get_error (rc);
   }
 
+  WSTRACE_BIN ("WSAEnumProtocolsA", INVALID_SOCKET, rc, 0, NULL);
   WSTRACE ("WSAEnumProtocolsA() --> %s", p);
 
   if (do_it && rc != SOCKET_ERROR && rc > 0 && !exclude_this)
@@ -2174,6 +3263,7 @@ EXPORT int WINAPI WSAEnumProtocolsW (int *protocols, WSAPROTOCOL_INFOW *proto_in
 
   INIT_PTR (p_WSAEnumProtocolsW);
   rc = (*p_WSAEnumProtocolsW) (protocols, proto_info, buf_len);
+  LATENCY_END (p_WSAEnumProtocolsW);
 
   ENTER_CRIT();
 
@@ -2184,6 +3274,7 @@ EXPORT int WINAPI WSAEnumProtocolsW (int *protocols, WSAPROTOCOL_INFOW *proto_in
     else p = (char*) get_error (rc);
   }
 
+  WSTRACE_BIN ("WSAEnumProtocolsW", INVALID_SOCKET, rc, 0, NULL);
   WSTRACE ("WSAEnumProtocolsW() --> %s", p);
 
   if (do_it && rc != SOCKET_ERROR && rc > 0 && !exclude_this)
@@ -2206,30 +3297,72 @@ EXPORT int WINAPI WSACancelBlockingCall (void)
 
   INIT_PTR (p_WSACancelBlockingCall);
   rc = (*p_WSACancelBlockingCall)();
+  LATENCY_END (p_WSACancelBlockingCall);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("WSACancelBlockingCall", INVALID_SOCKET, rc, 0, NULL);
   WSTRACE ("WSACancelBlockingCall() --> %s", get_error(rc));
 
   LEAVE_CRIT();
   return (rc);
 }
 
+/*
+ * With '[netem] enable = 1', clear the 'POLLRDNORM' and 'POLLWRNORM' bits
+ * of sockets not to be reported ready yet. Returns the number of sockets
+ * with no 'revents' left and lowers '*wait' as 'netem_select_filter()'.
+ */
+static int netem_poll_filter (WSAPOLLFD *fd_array, ULONG fds, DWORD *wait)
+{
+  ULONG i;
+  int   removed = 0;
+
+  for (i = 0; i < fds; i++)
+  {
+    WSAPOLLFD *pfd = fd_array + i;
+
+    if (!pfd->revents)
+       continue;
+
+    if ((pfd->revents & POLLRDNORM) && !sock_table_netem_ready(pfd->fd, FALSE, wait))
+       pfd->revents &= ~POLLRDNORM;
+    if ((pfd->revents & POLLWRNORM) && !sock_table_netem_ready(pfd->fd, TRUE, wait))
+       pfd->revents &= ~POLLWRNORM;
+    if (!pfd->revents)
+       removed++;
+  }
+  return (removed);
+}
+
 EXPORT int WINAPI WSAPoll (LPWSAPOLLFD fd_array, ULONG fds, int timeout)
 {
   int        rc;
   WSAPOLLFD *fd_in = NULL;
+  ULONG      changed = 0;      /* for 'dump_wsapoll = 2' */
+  LARGE_INTEGER poll_start;
+  uint64     deadline = 0, left;
+  DWORD      wait;
+  BOOL       _exclude_this;
+  int        timeout_left = timeout;
 
   INIT_PTR (p_WSAPoll);
 
   if (!p_WSAPoll)
      return (0);
 
+  if (g_cfg.stats_only)
+  {
+    rc = (*p_WSAPoll) (fd_array, fds, timeout);
+    LATENCY_END (p_WSAPoll);
+    return (rc);
+  }
+
   ENTER_CRIT();
 
-  exclude_this = (g_cfg.trace_level == 0 || exclude_list_get("WSAPoll", EXCL_FUNCTION));
+  EXCLUDE_THIS ("WSAPoll");
 
-  if (!exclude_this && fd_array)
+  if (!exclude_this && fd_array && g_cfg.dump_wsapoll == 1)
   {
     size_t size = fds * sizeof(*fd_in);
 
@@ -2237,7 +3370,57 @@ EXPORT int WINAPI WSAPoll (LPWSAPOLLFD fd_array, ULONG fds, int timeout)
     memcpy (fd_in, fd_array, size);
   }
 
-  rc = (*p_WSAPoll) (fd_array, fds, timeout);
+  if (g_cfg.poll_stats)
+     QueryPerformanceCounter (&poll_start);
+
+  if (g_cfg.netem.enable && timeout >= 0)
+     deadline = netem_deadline ((uint64)timeout * 1000);
+
+  LATENCY_START();
+  while (1)
+  {
+    rc = (*p_WSAPoll) (fd_array, fds, timeout_left);
+    if (!g_cfg.netem.enable || !fd_array || rc <= 0)
+       break;
+
+    /* If '[netem]' held back all the ready sockets, wait for the first
+     * (with no lock held) and poll again. The real 'WSAPoll()' sets all
+     * 'revents'; nothing to restore.
+     */
+    wait = INFINITE;
+    rc -= netem_poll_filter (fd_array, fds, &wait);
+    if (rc > 0)
+       break;
+
+    _exclude_this = exclude_this;
+    LEAVE_CRIT();
+    if (!netem_wait_ready(wait, timeout >= 0, deadline, &left))
+    {
+      ENTER_CRIT();
+      exclude_this = _exclude_this;
+      break;
+    }
+    ENTER_CRIT();
+    exclude_this = _exclude_this;
+    if (timeout >= 0)
+       timeout_left = (int) ((left + 999) / 1000);
+  }
+  LATENCY_END (p_WSAPoll);
+
+  if (g_cfg.poll_stats)
+     poll_stats_add (POLL_WSAPOLL, &poll_start, fds, rc);
+
+  WSTRACE_BIN ("WSAPoll", INVALID_SOCKET, rc, 0, NULL);
+
+  /* With 'dump_wsapoll = 2', a call where no socket was added, removed or
+   * got other 'revents' than in the last traced call, is not printed.
+   */
+  if (!exclude_this && g_cfg.dump_wsapoll == 2 && fd_array && rc >= 0)
+  {
+    changed = wsapoll_delta_count (fd_array, fds);
+    if (changed == 0)
+       exclude_this = TRUE;
+  }
 
   if (!exclude_this)
   {
@@ -2249,21 +3432,33 @@ EXPORT int WINAPI WSAPoll (LPWSAPOLLFD fd_array, ULONG fds, int timeout)
          strcpy (tbuf, "return imm.");
     else strcpy (tbuf, "wait indef.");
 
-    WSTRACE ("WSAPoll (0x%" ADDR_FMT ", %lu, %s) -> %s",
+    WSTRACE_PRINT ("WSAPoll (0x%" ADDR_FMT ", %lu, %s) -> %s",
              ADDR_CAST(fd_array), DWORD_CAST(fds), tbuf, socket_or_error(rc));
 
-    trace_indent (g_cfg.trace_indent+2);
-    trace_puts ("~4" FD_INPUT " ");
-    if (fd_in)
-         dump_wsapollfd (fd_in, fds, g_cfg.trace_indent + 2 + sizeof(FD_INPUT));
-    else trace_puts ("None!\n");
+    if (g_cfg.dump_wsapoll == 2)
+    {
+      trace_indent (g_cfg.trace_indent+2);
+      trace_puts ("~4" FD_DELTA " ");
+      if (fd_array && rc >= 0)
+           dump_wsapoll_delta (fd_array, fds, rc, changed, g_cfg.trace_indent + 2 + sizeof(FD_DELTA));
+      else trace_puts ("None!\n");
+      trace_puts ("~0");
+    }
+    else if (g_cfg.dump_wsapoll)
+    {
+      trace_indent (g_cfg.trace_indent+2);
+      trace_puts ("~4" FD_INPUT " ");
+      if (fd_in)
+           dump_wsapollfd (fd_in, fds, g_cfg.trace_indent + 2 + sizeof(FD_INPUT));
+      else trace_puts ("None!\n");
 
-    trace_indent (g_cfg.trace_indent+2);
-    trace_puts (FD_OUTPUT " ");
-    if (fd_array)
-         dump_wsapollfd (fd_array, fds, g_cfg.trace_indent + 2 + sizeof(FD_OUTPUT));
-    else trace_puts ("None!\n");
-    trace_puts ("~0");
+      trace_indent (g_cfg.trace_indent+2);
+      trace_puts (FD_OUTPUT " ");
+      if (fd_array)
+           dump_wsapollfd (fd_array, fds, g_cfg.trace_indent + 2 + sizeof(FD_OUTPUT));
+      else trace_puts ("None!\n");
+      trace_puts ("~0");
+    }
   }
 
   LEAVE_CRIT();
@@ -2293,6 +3488,10 @@ EXPORT DWORD WINAPI WSAWaitForMultipleEvents (DWORD           num_ev,
                                               BOOL            alertable)
 {
   DWORD rc;
+  LARGE_INTEGER poll_start;
+
+  if (g_cfg.poll_stats)
+     QueryPerformanceCounter (&poll_start);
 
   if (p_WSAWaitForMultipleEvents == NULL)
   {
@@ -2304,11 +3503,37 @@ EXPORT DWORD WINAPI WSAWaitForMultipleEvents (DWORD           num_ev,
   {
     INIT_PTR (p_WSAWaitForMultipleEvents);
     rc = (*p_WSAWaitForMultipleEvents) (num_ev, ev, wait_all, timeout, alertable);
+    LATENCY_END (p_WSAWaitForMultipleEvents);
   }
 
   ENTER_CRIT();
 
-  exclude_this = (g_cfg.trace_level == 0 || exclude_list_get("WSAWaitForMultipleEvents", EXCL_FUNCTION));
+  if (g_cfg.poll_stats)
+  {
+    int ready = 0;
+
+    if (rc == WSA_WAIT_FAILED)
+         ready = -1;
+    else if (rc >= WSA_WAIT_EVENT_0 && rc < (WSA_WAIT_EVENT_0 + num_ev))
+         ready = wait_all ? (int)num_ev : 1;
+    poll_stats_add (POLL_WSAWAIT, &poll_start, num_ev, ready);
+  }
+
+  EXCLUDE_THIS ("WSAWaitForMultipleEvents");
+
+  WSTRACE_BIN ("WSAWaitForMultipleEvents", INVALID_SOCKET, rc == WSA_WAIT_FAILED ? -1 : (int)rc, 0, NULL);
+
+  /* With 'dump_wsapoll = 2', print only when the events or the result
+   * differs from the last traced call. But always update the overlapped
+   * operations. The binary trace above gets every call.
+   */
+  if (!exclude_this && g_cfg.dump_wsapoll == 2 && !wsawait_delta(num_ev, ev, rc))
+  {
+    if (rc >= WSA_WAIT_EVENT_0 && rc < (WSA_WAIT_EVENT_0 + num_ev))
+       overlap_recall_all (ev);
+    LEAVE_CRIT();
+    return (rc);
+  }
 
   if (!exclude_this)
   {
@@ -2333,7 +3558,7 @@ EXPORT DWORD WINAPI WSAWaitForMultipleEvents (DWORD           num_ev,
     if (timeout != WSA_INFINITE)
        snprintf (time, sizeof(time), "%lu ms", DWORD_CAST(timeout));
 
-    WSTRACE ("WSAWaitForMultipleEvents (%lu, 0x%p, %s, %s, %sALERTABLE) --> %s",
+    WSTRACE_PRINT ("WSAWaitForMultipleEvents (%lu, 0x%p, %s, %s, %sALERTABLE) --> %s",
              DWORD_CAST(num_ev), ev, wait_all ? "TRUE" : "FALSE",
              time, alertable ? "" : "not ", err);
 
@@ -2347,6 +3572,146 @@ EXPORT DWORD WINAPI WSAWaitForMultipleEvents (DWORD           num_ev,
   return (rc);
 }
 
+/*
+ * The I/O completion port functions are declared 'dllimport' in <winbase.h>.
+ * Defining them here gives an harmless "inconsistent DLL linkage" warning.
+ */
+#if defined(_MSC_VER)
+  #pragma warning (disable: 4273)
+#endif
+
+static const char *iocp_timeout (DWORD timeout, char *buf, size_t size)
+{
+  if (timeout == INFINITE)
+     return ("INFINITE");
+  snprintf (buf, size, "%lu ms", DWORD_CAST(timeout));
+  return (buf);
+}
+
+static const char *iocp_result (BOOL rc, DWORD err)
+{
+  if (rc)
+     return ("TRUE");
+  if (err == WAIT_TIMEOUT)
+     return ("WAIT_TIMEOUT");
+  return win_strerror (err);
+}
+
+EXPORT BOOL WINAPI GetQueuedCompletionStatus (HANDLE      port,
+                                              DWORD      *bytes,
+                                              ULONG_PTR  *key,
+                                              OVERLAPPED **ov,
+                                              DWORD       timeout)
+{
+  BOOL  rc;
+  DWORD err;
+
+  INIT_PTR (p_GetQueuedCompletionStatus);
+  rc  = (*p_GetQueuedCompletionStatus) (port, bytes, key, ov, timeout);
+  LATENCY_END (p_GetQueuedCompletionStatus);
+  err = rc ? 0 : GetLastError();
+
+  ENTER_CRIT();
+
+  /* A failed overlapped operation also dequeues a packet; with '*ov != NULL'.
+   */
+  if (ov && *ov)
+     overlap_recall_ov (*ov, rc ? *bytes : 0);
+
+  EXCLUDE_THIS ("GetQueuedCompletionStatus");
+
+  WSTRACE_BIN ("GetQueuedCompletionStatus", INVALID_SOCKET, rc ? 0 : -1, rc ? *bytes : 0, NULL);
+
+  if (!exclude_this)
+  {
+    char tbuf [20];
+
+    WSTRACE_PRINT ("GetQueuedCompletionStatus (0x%p, %lu, 0x%p, 0x%p, %s) --> %s",
+                   port, DWORD_CAST(*bytes), (void*) (key ? *key : 0), ov ? *ov : NULL,
+                   iocp_timeout(timeout, tbuf, sizeof(tbuf)), iocp_result(rc, err));
+  }
+
+  LEAVE_CRIT();
+
+  if (!rc)
+     SetLastError (err);
+  return (rc);
+}
+
+EXPORT BOOL WINAPI GetQueuedCompletionStatusEx (HANDLE            port,
+                                                OVERLAPPED_ENTRY *entries,
+                                                ULONG             count,
+                                                ULONG            *removed,
+                                                DWORD             timeout,
+                                                BOOL              alertable)
+{
+  BOOL  rc;
+  DWORD err, total = 0;
+  ULONG i, num = 0;
+
+  INIT_PTR (p_GetQueuedCompletionStatusEx);
+  rc  = (*p_GetQueuedCompletionStatusEx) (port, entries, count, removed, timeout, alertable);
+  LATENCY_END (p_GetQueuedCompletionStatusEx);
+  err = rc ? 0 : GetLastError();
+
+  ENTER_CRIT();
+
+  if (rc && removed)
+  {
+    num = *removed;
+    for (i = 0; i < num; i++)
+    {
+      total += entries[i].dwNumberOfBytesTransferred;
+      overlap_recall_ov (entries[i].lpOverlapped, entries[i].dwNumberOfBytesTransferred);
+    }
+  }
+
+  EXCLUDE_THIS ("GetQueuedCompletionStatusEx");
+
+  WSTRACE_BIN ("GetQueuedCompletionStatusEx", INVALID_SOCKET, rc ? (int)num : -1, total, NULL);
+
+  if (!exclude_this)
+  {
+    char tbuf [20];
+
+    WSTRACE_PRINT ("GetQueuedCompletionStatusEx (0x%p, 0x%p, %lu, %lu, %s, %sALERTABLE) --> %s",
+                   port, entries, DWORD_CAST(count), DWORD_CAST(num),
+                   iocp_timeout(timeout, tbuf, sizeof(tbuf)), alertable ? "" : "not ",
+                   iocp_result(rc, err));
+  }
+
+  LEAVE_CRIT();
+
+  if (!rc)
+     SetLastError (err);
+  return (rc);
+}
+
+EXPORT BOOL WINAPI PostQueuedCompletionStatus (HANDLE      port,
+                                               DWORD       bytes,
+                                               ULONG_PTR   key,
+                                               OVERLAPPED *ov)
+{
+  BOOL  rc;
+  DWORD err;
+
+  INIT_PTR (p_PostQueuedCompletionStatus);
+  rc  = (*p_PostQueuedCompletionStatus) (port, bytes, key, ov);
+  LATENCY_END (p_PostQueuedCompletionStatus);
+  err = rc ? 0 : GetLastError();
+
+  ENTER_CRIT();
+
+  WSTRACE_BIN ("PostQueuedCompletionStatus", INVALID_SOCKET, rc ? 0 : -1, bytes, NULL);
+  WSTRACE ("PostQueuedCompletionStatus (0x%p, %lu, 0x%p, 0x%p) --> %s",
+           port, DWORD_CAST(bytes), (void*)key, ov, iocp_result(rc, err));
+
+  LEAVE_CRIT();
+
+  if (!rc)
+     SetLastError (err);
+  return (rc);
+}
 
 EXPORT int WINAPI setsockopt (SOCKET s, int level, int opt, const char *opt_val, int opt_len)
 {
@@ -2354,9 +3719,14 @@ EXPORT int WINAPI setsockopt (SOCKET s, int level, int opt, const char *opt_val,
 
   INIT_PTR (p_setsockopt);
   rc = (*p_setsockopt) (s, level, opt, opt_val, opt_len);
+  LATENCY_END (p_setsockopt);
+
+  if (g_cfg.stats_only)
+     return (rc);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("setsockopt", s, rc, 0, NULL);
   WSTRACE ("setsockopt (%s, %s, %s, %s, %d) --> %s",
            socket_number(s), socklevel_name(level), sockopt_name(level,opt),
            sockopt_value(opt_val,opt_len), opt_len,
@@ -2372,9 +3742,14 @@ EXPORT int WINAPI getsockopt (SOCKET s, int level, int opt, char *opt_val, int *
 
   INIT_PTR (p_getsockopt);
   rc = (*p_getsockopt) (s, level, opt, opt_val, opt_len);
+  LATENCY_END (p_getsockopt);
+
+  if (g_cfg.stats_only)
+     return (rc);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("getsockopt", s, rc, 0, NULL);
   WSTRACE ("getsockopt (%s, %s, %s, %s, %d) --> %s",
            socket_number(s), socklevel_name(level), sockopt_name(level,opt),
            sockopt_value(opt_val, opt_len ? *opt_len : 0),
@@ -2400,9 +3775,11 @@ EXPORT int WINAPI shutdown (SOCKET s, int how)
 
   INIT_PTR (p_shutdown);
   rc = (*p_shutdown) (s, how);
+  LATENCY_END (p_shutdown);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("shutdown", s, rc, 0, NULL);
   WSTRACE ("shutdown (%s, %d) --> %s", socket_number(s), how, get_error(rc));
 
   LEAVE_CRIT();
@@ -2415,13 +3792,17 @@ EXPORT SOCKET WINAPI socket (int family, int type, int protocol)
 
   INIT_PTR (p_socket);
   rc = (*p_socket) (family, type, protocol);
+  LATENCY_END (p_socket);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("socket", rc, rc, 0, NULL);
   WSTRACE ("socket (%s, %s, %s) --> %s",
            socket_family(family), socket_type(type), protocol_name(protocol),
            socket_or_error(rc));
 
+  sock_table_add (rc, family, type, protocol);
+
   LEAVE_CRIT();
   return (rc);
 }
@@ -2432,9 +3813,11 @@ EXPORT struct servent *WINAPI getservbyport (int port, const char *proto)
 
   INIT_PTR (p_getservbyport);
   rc = (*p_getservbyport) (port, proto);
+  LATENCY_END (p_getservbyport);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("getservbyport", INVALID_SOCKET, rc ? 0 : -1, 0, NULL);
   WSTRACE ("getservbyport (%d, \"%s\") --> %s",
            swap16(port), proto, ptr_or_error(rc));
 
@@ -2451,9 +3834,11 @@ EXPORT struct servent *WINAPI getservbyname (const char *serv, const char *proto
 
   INIT_PTR (p_getservbyname);
   rc = (*p_getservbyname) (serv, proto);
+  LATENCY_END (p_getservbyname);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("getservbyname", INVALID_SOCKET, rc ? 0 : -1, 0, NULL);
   WSTRACE ("getservbyname (\"%s\", \"%s\") --> %s",
            serv, proto, ptr_or_error(rc));
 
@@ -2467,24 +3852,37 @@ EXPORT struct servent *WINAPI getservbyname (const char *serv, const char *proto
 EXPORT struct hostent *WINAPI gethostbyname (const char *name)
 {
   struct hostent *rc;
+  uint64          ticks;
 
   INIT_PTR (p_gethostbyname);
+  ticks = DNS_STATS_START();
   rc = (*p_gethostbyname) (name);
+  LATENCY_END (p_gethostbyname);
+  ticks = DNS_STATS_TICKS (ticks);
 
+  LAZY_INIT_WAIT (LAZY_ALL);
   ENTER_CRIT();
 
+  WSTRACE_BIN ("gethostbyname", INVALID_SOCKET, rc ? 0 : -1, 0, NULL);
   WSTRACE ("gethostbyname (\"%s\") --> %s", name, ptr_or_error(rc));
 
-  if (rc && !exclude_this && g_cfg.dump_hostent)
-     dump_hostent (name, rc);
-
   if (rc && !exclude_this)
   {
+    struct addr_notes notes;
+
+    annotate_addresses (name, rc->h_addrtype, (const char**)rc->h_addr_list, &notes);
+
+    if (g_cfg.dump_hostent)
+       dump_hostent (rc, &notes);
     if (g_cfg.geoip_enable)
-       dump_countries (rc->h_addrtype, (const char**)rc->h_addr_list);
+       dump_countries_notes (&notes);
     if (g_cfg.DNSBL.enable)
-       dump_DNSBL (rc->h_addrtype, (const char**)rc->h_addr_list);
+       dump_DNSBL_notes (&notes);
   }
+
+  if (g_cfg.dns_stats)
+     dns_stats_hostent (name, ticks, rc);
+
   LEAVE_CRIT();
   return (rc);
 }
@@ -2492,18 +3890,25 @@ EXPORT struct hostent *WINAPI gethostbyname (const char *name)
 EXPORT struct hostent *WINAPI gethostbyaddr (const char *addr, int len, int type)
 {
   struct hostent *rc;
+  char            addr_buf [SOCKADDR_STR_SZ];
+  uint64          ticks;
 
   INIT_PTR (p_gethostbyaddr);
+  ticks = DNS_STATS_START();
   rc = (*p_gethostbyaddr) (addr, len, type);
+  LATENCY_END (p_gethostbyaddr);
+  ticks = DNS_STATS_TICKS (ticks);
 
+  LAZY_INIT_WAIT (LAZY_ALL);
   ENTER_CRIT();
 
 #if defined(USE_BFD)
   // test_get_caller (&gethostbyaddr);
 #endif
 
+  WSTRACE_BIN ("gethostbyaddr", INVALID_SOCKET, rc ? 0 : -1, 0, NULL);
   WSTRACE ("gethostbyaddr (%s, %d, %s) --> %s",
-           inet_ntop2(addr,type), len, socket_family(type), ptr_or_error(rc));
+           inet_ntop2_r(addr,type,addr_buf,sizeof(addr_buf)), len, socket_family(type), ptr_or_error(rc));
 
 #if defined(__clang__)
   // test_get_caller (&gethostbyaddr);
@@ -2511,37 +3916,29 @@ EXPORT struct hostent *WINAPI gethostbyaddr (const char *addr, int len, int type
 
   if (!exclude_this)
   {
-    if (rc && g_cfg.dump_hostent)
-       dump_hostent (rc->h_name, rc);
+    struct addr_notes notes;
+    const char       *a[2];
 
-    if (g_cfg.geoip_enable)
+    if (rc)
+       annotate_addresses (rc->h_name, rc->h_addrtype, (const char**)rc->h_addr_list, &notes);
+    else
     {
-      if (rc)
-         dump_countries (rc->h_addrtype, (const char**)rc->h_addr_list);
-      else
-      {
-        const char *a[2];
-
-        a[0] = addr;
-        a[1] = NULL;
-        dump_countries (type, a);
-      }
+      a[0] = addr;
+      a[1] = NULL;
+      annotate_addresses (NULL, type, a, &notes);
     }
+
+    if (rc && g_cfg.dump_hostent)
+       dump_hostent (rc, &notes);
+    if (g_cfg.geoip_enable)
+       dump_countries_notes (&notes);
     if (g_cfg.DNSBL.enable)
-    {
-      if (rc)
-         dump_DNSBL (rc->h_addrtype, (const char**)rc->h_addr_list);
-      else
-      {
-        const char *a[2];
-
-        a[0] = addr;
-        a[1] = NULL;
-        dump_DNSBL (type, a);
-      }
-    }
+       dump_DNSBL_notes (&notes);
   }
 
+  if (g_cfg.dns_stats)
+     dns_stats_reverse (inet_ntop2_r(addr,type,addr_buf,sizeof(addr_buf)), ticks, rc != NULL);
+
   LEAVE_CRIT();
   return (rc);
 }
@@ -2552,8 +3949,13 @@ EXPORT u_short WINAPI htons (u_short x)
 
   INIT_PTR (p_htons);
   rc = (*p_htons) (x);
+  LATENCY_END (p_htons);
+
+  if (g_cfg.stats_only)
+     return (rc);
 
   ENTER_CRIT();
+  WSTRACE_BIN ("htons", INVALID_SOCKET, rc, 0, NULL);
   WSTRACE ("htons (%u) --> %u", x, rc);
   LEAVE_CRIT();
   return (rc);
@@ -2565,8 +3967,13 @@ EXPORT u_short WINAPI ntohs (u_short x)
 
   INIT_PTR (p_ntohs);
   rc = (*p_ntohs) (x);
+  LATENCY_END (p_ntohs);
+
+  if (g_cfg.stats_only)
+     return (rc);
 
   ENTER_CRIT();
+  WSTRACE_BIN ("ntohs", INVALID_SOCKET, rc, 0, NULL);
   WSTRACE ("ntohs (%u) --> %u", x, rc);
   LEAVE_CRIT();
   return (rc);
@@ -2578,8 +3985,13 @@ EXPORT __ms_u_long WINAPI htonl (__ms_u_long x)
 
   INIT_PTR (p_htonl);
   rc = (*p_htonl) (x);
+  LATENCY_END (p_htonl);
+
+  if (g_cfg.stats_only)
+     return (rc);
 
   ENTER_CRIT();
+  WSTRACE_BIN ("htonl", INVALID_SOCKET, rc, 0, NULL);
   WSTRACE ("htonl (%lu) --> %lu", DWORD_CAST(x), DWORD_CAST(rc));
   LEAVE_CRIT();
   return (rc);
@@ -2591,8 +4003,13 @@ EXPORT __ms_u_long WINAPI ntohl (__ms_u_long x)
 
   INIT_PTR (p_ntohl);
   rc = (*p_ntohl) (x);
+  LATENCY_END (p_ntohl);
+
+  if (g_cfg.stats_only)
+     return (rc);
 
   ENTER_CRIT();
+  WSTRACE_BIN ("ntohl", INVALID_SOCKET, rc, 0, NULL);
   WSTRACE ("ntohl (%lu) --> %lu", DWORD_CAST(x), DWORD_CAST(rc));
   LEAVE_CRIT();
   return (rc);
@@ -2604,8 +4021,10 @@ EXPORT __ULONG32 WINAPI inet_addr (const char *addr)
 
   INIT_PTR (p_inet_addr);
   rc = (*p_inet_addr) (addr);
+  LATENCY_END (p_inet_addr);
 
   ENTER_CRIT();
+  WSTRACE_BIN ("inet_addr", INVALID_SOCKET, rc, 0, NULL);
   WSTRACE ("inet_addr (\"%s\") -> %lu", addr, DWORD_CAST(rc));
   LEAVE_CRIT();
   return (rc);
@@ -2617,8 +4036,10 @@ EXPORT char * WINAPI inet_ntoa (struct in_addr addr)
 
   INIT_PTR (p_inet_ntoa);
   rc = (*p_inet_ntoa) (addr);
+  LATENCY_END (p_inet_ntoa);
 
   ENTER_CRIT();
+  WSTRACE_BIN ("inet_ntoa", INVALID_SOCKET, rc ? 0 : -1, 0, NULL);
   WSTRACE ("inet_ntoa (%u.%u.%u.%u) --> %s",
            addr.S_un.S_un_b.s_b1,
            addr.S_un.S_un_b.s_b2,
@@ -2631,22 +4052,24 @@ EXPORT char * WINAPI inet_ntoa (struct in_addr addr)
 
 EXPORT int WINAPI getpeername (SOCKET s, struct sockaddr *name, int *name_len)
 {
-  int rc;
+  int  rc;
+  char addr_buf [SOCKADDR_STR_SZ];
 
   INIT_PTR (p_getpeername);
   rc = (*p_getpeername) (s, name, name_len);
+  LATENCY_END (p_getpeername);
 
+  LAZY_INIT_WAIT (LAZY_GEOIP | LAZY_DNSBL);
   ENTER_CRIT();
 
+  WSTRACE_BIN ("getpeername", s, rc, 0, rc == 0 ? name : NULL);
   WSTRACE ("getpeername (%s, %s) --> %s",
-           socket_number(s), sockaddr_str2(name,name_len), get_error(rc));
+           socket_number(s), sockaddr_str2_r(name,name_len,addr_buf,sizeof(addr_buf)), get_error(rc));
 
   if (!exclude_this)
   {
-    if (g_cfg.geoip_enable)
-       dump_countries_sockaddr (name);
-    if (g_cfg.DNSBL.enable)
-       dump_DNSBL_sockaddr (name);
+    if (g_cfg.geoip_enable || g_cfg.DNSBL.enable)
+       dump_sockaddr_notes (name);
   }
 
   LEAVE_CRIT();
@@ -2655,22 +4078,24 @@ EXPORT int WINAPI getpeername (SOCKET s, struct sockaddr *name, int *name_len)
 
 EXPORT int WINAPI getsockname (SOCKET s, struct sockaddr *name, int *name_len)
 {
-  int rc;
+  int  rc;
+  char addr_buf [SOCKADDR_STR_SZ];
 
   INIT_PTR (p_getsockname);
   rc = (*p_getsockname) (s, name, name_len);
+  LATENCY_END (p_getsockname);
 
+  LAZY_INIT_WAIT (LAZY_GEOIP | LAZY_DNSBL);
   ENTER_CRIT();
 
+  WSTRACE_BIN ("getsockname", s, rc, 0, rc == 0 ? name : NULL);
   WSTRACE ("getsockname (%s, %s) --> %s",
-           socket_number(s), sockaddr_str2(name,name_len), get_error(rc));
+           socket_number(s), sockaddr_str2_r(name,name_len,addr_buf,sizeof(addr_buf)), get_error(rc));
 
   if (!exclude_this)
   {
-    if (g_cfg.geoip_enable)
-       dump_countries_sockaddr (name);
-    if (g_cfg.DNSBL.enable)
-       dump_DNSBL_sockaddr (name);
+    if (g_cfg.geoip_enable || g_cfg.DNSBL.enable)
+       dump_sockaddr_notes (name);
   }
 
   LEAVE_CRIT();
@@ -2683,9 +4108,11 @@ EXPORT struct protoent * WINAPI getprotobynumber (int num)
 
   INIT_PTR (p_getprotobynumber);
   rc = (*p_getprotobynumber) (num);
+  LATENCY_END (p_getprotobynumber);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("getprotobynumber", INVALID_SOCKET, rc ? 0 : -1, 0, NULL);
   WSTRACE ("getprotobynumber (%d) --> %s", num, ptr_or_error(rc));
 
   if (rc && !exclude_this && g_cfg.dump_protoent)
@@ -2701,9 +4128,11 @@ EXPORT struct protoent * WINAPI getprotobyname (const char *name)
 
   INIT_PTR (p_getprotobyname);
   rc = (*p_getprotobyname) (name);
+  LATENCY_END (p_getprotobyname);
 
   ENTER_CRIT();
 
+  WSTRACE_BIN ("getprotobyname", INVALID_SOCKET, rc ? 0 : -1, 0, NULL);
   WSTRACE ("getprotobyname (\"%s\") --> %s", name, ptr_or_error(rc));
 
   if (rc && !exclude_this && g_cfg.dump_protoent)
@@ -2717,26 +4146,44 @@ EXPORT int WINAPI getnameinfo (const struct sockaddr *sa, socklen_t sa_len,
                                char *host, DWORD host_size, char *serv_buf,
                                DWORD serv_buf_size, int flags)
 {
-  int rc;
+  int    rc;
+  char   addr_buf [SOCKADDR_STR_SZ];
+  uint64 ticks;
 
   INIT_PTR (p_getnameinfo);
+  ticks = DNS_STATS_START();
   rc = (*p_getnameinfo) (sa, sa_len, host, host_size, serv_buf, serv_buf_size, flags);
+  LATENCY_END (p_getnameinfo);
+  ticks = DNS_STATS_TICKS (ticks);
 
+  LAZY_INIT_WAIT (LAZY_GEOIP | LAZY_DNSBL);
   ENTER_CRIT();
 
+  WSTRACE_BIN_EAI ("getnameinfo", rc, sa);
   WSTRACE ("getnameinfo (%s, ..., %s) --> %s",
-           sockaddr_str2(sa,&sa_len), getnameinfo_flags_decode(flags), get_error(rc));
+           sockaddr_str2_r(sa,&sa_len,addr_buf,sizeof(addr_buf)), getnameinfo_flags_decode(flags), get_error(rc));
 
   if (!exclude_this)
   {
     if (rc == 0 && g_cfg.dump_nameinfo)
        dump_nameinfo (host, serv_buf, flags);
 
-    if (g_cfg.geoip_enable)
-       dump_countries_sockaddr (sa);
+    if (g_cfg.geoip_enable || g_cfg.DNSBL.enable)
+       dump_sockaddr_notes (sa);
+  }
 
-    if (g_cfg.DNSBL.enable)
-       dump_DNSBL_sockaddr (sa);
+  /* Only a lookup of the host-name is a reverse DNS lookup.
+   * Keyed on the address only (no port); like 'gethostbyaddr()'.
+   */
+  if (g_cfg.dns_stats && sa && host && host_size > 0 && !(flags & NI_NUMERICHOST))
+  {
+    const char *addr = NULL;
+
+    if (sa->sa_family == AF_INET)
+       addr = (const char*) &((const struct sockaddr_in*)sa)->sin_addr;
+    else if (sa->sa_family == AF_INET6)
+       addr = (const char*) &((const struct sockaddr_in6*)sa)->sin6_addr;
+    dns_stats_reverse (inet_ntop2_r(addr,sa->sa_family,addr_buf,sizeof(addr_buf)), ticks, rc == 0);
   }
 
   LEAVE_CRIT();
@@ -2746,13 +4193,19 @@ EXPORT int WINAPI getnameinfo (const struct sockaddr *sa, socklen_t sa_len,
 EXPORT int WINAPI getaddrinfo (const char *host_name, const char *serv_name,
                                const struct addrinfo *hints, struct addrinfo **res)
 {
-  int rc;
+  int    rc;
+  uint64 ticks;
 
   INIT_PTR (p_getaddrinfo);
 
+  LAZY_INIT_WAIT (LAZY_ALL);
   ENTER_CRIT();
 
+  LATENCY_START();
+  ticks = DNS_STATS_START();
   rc = (*p_getaddrinfo) (host_name, serv_name, hints, res);
+  LATENCY_END (p_getaddrinfo);
+  ticks = DNS_STATS_TICKS (ticks);
 
 #if 0
   if (rc != 0 && g_cfg.idna_enable && g_cfg.idna_helper && !IDNA_is_ASCII(host_name))
@@ -2770,6 +4223,7 @@ EXPORT int WINAPI getaddrinfo (const char *host_name, const char *serv_name,
   }
 #endif
 
+  WSTRACE_BIN_EAI ("getaddrinfo", rc, (rc == 0 && *res) ? (*res)->ai_addr : NULL);
   WSTRACE ("getaddrinfo (%s, %s, <hints>, ...) --> %s\n"
            "%*shints: %s",
            host_name, serv_name, get_error(rc),
@@ -2778,16 +4232,25 @@ EXPORT int WINAPI getaddrinfo (const char *host_name, const char *serv_name,
 
   if (rc == 0 && *res && !exclude_this)
   {
+    struct addr_notes notes;
+
+    annotate_addrinfo (host_name, *res, &notes);
+
     if (g_cfg.dump_data)
-       dump_addrinfo (host_name, *res);
+       dump_addrinfo (*res, &notes);
 
     if (g_cfg.geoip_enable)
-       dump_countries_addrinfo (*res);
+       dump_countries_notes (&notes);
 
     if (g_cfg.DNSBL.enable)
-       dump_DNSBL_addrinfo (*res);
+       dump_DNSBL_notes (&notes);
   }
 
+  /* A numeric 'host_name' is not a DNS lookup.
+   */
+  if (g_cfg.dns_stats && !(hints && (hints->ai_flags & AI_NUMERICHOST)))
+     dns_stats_addrinfo (host_name, ticks, rc == 0 ? *res : NULL);
+
   LEAVE_CRIT();
   return (rc);
 }
@@ -2796,8 +4259,10 @@ EXPORT void WINAPI freeaddrinfo (struct addrinfo *ai)
 {
   INIT_PTR (p_freeaddrinfo);
   (*p_freeaddrinfo) (ai);
+  LATENCY_END (p_freeaddrinfo);
 
   ENTER_CRIT();
+  WSTRACE_BIN ("freeaddrinfo", INVALID_SOCKET, 0, 0, NULL);
   WSTRACE ("freeaddrinfo (0x%" ADDR_FMT ")", ADDR_CAST(ai));
   LEAVE_CRIT();
 }
@@ -2850,10 +4315,96 @@ EXPORT INT WINAPI GetNameInfoW (const SOCKADDR *sockaddr,
 
 /****************** Internal utility functions **********************************/
 
+/*
+ * A cache of the strings from 'StackWalkShow()' keyed on the return-address
+ * (and the address of the caller's caller if 'g_cfg.callee_level > 1').
+ * A program normally calls Winsock from only a few places. So most calls
+ * to 'get_caller()' can skip DbgHelp / BFD.
+ *
+ * Only used within 'ENTER_CRIT()' / 'LEAVE_CRIT()'. Hence no locking.
+ */
+#define CALLER_CACHE_SIZE 512    /* must be a power of 2 */
+
+struct caller_cache {
+       ULONG_PTR  addr1;
+       ULONG_PTR  addr2;
+       char      *str;
+     };
+
+static struct caller_cache caller_cache [CALLER_CACHE_SIZE];
+static int                 caller_cache_used;
+
+static struct caller_cache *caller_cache_lookup (ULONG_PTR addr1, ULONG_PTR addr2)
+{
+  ULONG_PTR hash = (addr1 >> 2) ^ (addr1 >> 12) ^ (addr2 >> 4);
+  int       i, idx = (int) (hash & (CALLER_CACHE_SIZE-1));
+
+  for (i = 0; i < CALLER_CACHE_SIZE; i++)
+  {
+    struct caller_cache *c = caller_cache + idx;
+
+    if (!c->str || (c->addr1 == addr1 && c->addr2 == addr2))
+       return (c);
+    idx = (idx + 1) & (CALLER_CACHE_SIZE-1);
+  }
+  return (NULL);
+}
+
+static const char *caller_cache_get (ULONG_PTR addr1, ULONG_PTR addr2)
+{
+  const struct caller_cache *c = caller_cache_lookup (addr1, addr2);
+
+  if (c && c->str)
+  {
+    g_cfg.counts.caller_cache_hits++;
+    return (c->str);
+  }
+  g_cfg.counts.caller_cache_misses++;
+  return (NULL);
+}
+
+/*
+ * Add a new entry. Keep 1/4 of the cache free so the lookup stays short.
+ * When full, new callers are simply resolved every time.
+ */
+static const char *caller_cache_add (ULONG_PTR addr1, ULONG_PTR addr2, const char *str)
+{
+  struct caller_cache *c;
+
+  if (caller_cache_used >= (3*CALLER_CACHE_SIZE)/4)
+     return (str);
+
+  c = caller_cache_lookup (addr1, addr2);
+  if (!c || c->str)
+     return (str);
+
+  c->str = strdup (str);
+  if (!c->str)
+     return (str);
+  c->addr1 = addr1;
+  c->addr2 = addr2;
+  caller_cache_used++;
+  return (c->str);
+}
+
+static void caller_cache_exit (void)
+{
+  int i;
+
+  for (i = 0; i < CALLER_CACHE_SIZE; i++)
+      free (caller_cache[i].str);
+  memset (&caller_cache, '\0', sizeof(caller_cache));
+  caller_cache_used = 0;
+}
+
 static const char *get_caller (ULONG_PTR ret_addr, ULONG_PTR ebp)
 {
-  static int reentry = 0;
-  char  *ret = NULL;
+  static int  reentry = 0;
+  const char *ret = NULL;
+  ULONG_PTR   ret_addr2 = 0;
+#if !defined(USE_BFD)
+  static char buf [2*MAX_PATH];   /* 'caller_cache_add()' may return it as-is */
+#endif
 
   if (reentry++)
   {
@@ -2904,10 +4455,20 @@ static const char *get_caller (ULONG_PTR ret_addr, ULONG_PTR ebp)
     ret_addr = (ULONG_PTR) frames [2];
 #endif
 
+    if (g_cfg.callee_level > 1 && num_frames > 2)
+       ret_addr2 = (ULONG_PTR) frames [3];
+
 #else  /* USE_BFD */
     WSAERROR_PUSH();
 #endif
 
+    ret = caller_cache_get (ret_addr, ret_addr2);
+    if (ret)
+    {
+      WSAERROR_POP();
+      goto quit;
+    }
+
     /* We don't need a CONTEXT_FULL; only EIP+EBP (or RIP+RBP for x64). We want the caller's
      * address of a traced function (e.g. select()). Since we're called twice, that address
      * (for MSVC/PDB files) should be at frames[2]. For gcc, the RtlCaptureStackBackTrace()
@@ -2924,22 +4485,21 @@ static const char *get_caller (ULONG_PTR ret_addr, ULONG_PTR ebp)
     ret = StackWalkShow (thr, &ctx);
 
 #if !defined(USE_BFD)
-    if (g_cfg.callee_level > 1 && num_frames > 2 && frames[3])
+    if (ret_addr2)
     {
-      char *a, *b;
-
 #ifdef _WIN64
-      ctx.Rip = (ULONG_PTR) frames [3];
+      ctx.Rip = ret_addr2;
 #else
-      ctx.Eip = (ULONG_PTR) frames [3];
+      ctx.Eip = ret_addr2;
 #endif
 
-      a = strdup (ret);
-      b = strdup (StackWalkShow (thr, &ctx));
-      ret = malloc (strlen(a)+strlen(b)+50);
-      sprintf (ret, "%s\n               %s", a, b);
+      snprintf (buf, sizeof(buf), "%s\n               ", ret);
+      _strlcpy (strchr(buf,'\0'), StackWalkShow(thr, &ctx), sizeof(buf) - strlen(buf));
+      ret = caller_cache_add (ret_addr, ret_addr2, buf);
     }
+    else
 #endif
+      ret = caller_cache_add (ret_addr, ret_addr2, ret);
 
     WSAERROR_POP();
   }
@@ -3066,7 +4626,9 @@ BOOL WINAPI DllMain (HINSTANCE instDLL, DWORD reason, LPVOID reserved)
          tid = GetCurrentThreadId();
          reason_str = "DLL_PROCESS_ATTACH";
          crtdbg_init();
+         ws_in_process_attach = TRUE;
          wsock_trace_init();
+         ws_in_process_attach = FALSE;
 #if 0
          smartlist_add (thread_list, tid);
 #endif
@@ -3084,6 +4646,7 @@ BOOL WINAPI DllMain (HINSTANCE instDLL, DWORD reason, LPVOID reserved)
          wslua_DllMain (instDLL, reason);
 #endif
          wsock_trace_exit();
+         caller_cache_exit();
          crtdbg_exit();
          break;
 
@@ -3105,6 +4668,14 @@ BOOL WINAPI DllMain (HINSTANCE instDLL, DWORD reason, LPVOID reserved)
          tid = GetCurrentThreadId();
          g_cfg.counts.dll_detach++;
          reason_str = "DLL_THREAD_DETACH";
+         trace_ring_thread_exit();
+         latency_thread_exit();
+         ts_thread_exit();
+         trace_bin_thread_exit();
+         stats_thread_exit();
+         poll_delta_thread_exit();
+         dump_select_thread_exit();
+         geoip_cache_thread_exit();
          if (g_cfg.trace_level >= 3)
          {
            HANDLE hnd = OpenThread (THREAD_QUERY_INFORMATION, FALSE, tid);
@@ -9,14 +9,32 @@ extern int volatile startup_count;
 
 extern void                    load_ws2_funcs (void);
 extern const struct LoadTable *find_ws2_func_by_name (const char *func);
+extern int                     ws2_func_slot (const char *name);
+extern const char             *ws2_func_name (int slot);
+extern int                     ws2_func_num (void);
 
 #define WSAERROR_PUSH()  WSAError_save_restore (0)
 #define WSAERROR_POP()   WSAError_save_restore (1)
 
 extern int WSAError_save_restore (int pop);
 
+/*
+ * Size of a buffer for the '*_r()' address functions below.
+ */
+#define SOCKADDR_STR_SZ  (MAX_IP6_SZ+MAX_PORT_SZ+3)
+
 extern const char *sockaddr_str      (const struct sockaddr *sa, const int *sa_len);
 extern const char *sockaddr_str2     (const struct sockaddr *sa, const int *sa_len);
 extern const char *sockaddr_str_port (const struct sockaddr *sa, const int *sa_len);
 
+/*
+ * As above, but formats into the caller's 'buf'. No shared state.
+ */
+extern const char *sockaddr_str_r      (const struct sockaddr *sa, const int *sa_len, char *buf, size_t size);
+extern const char *sockaddr_str2_r     (const struct sockaddr *sa, const int *sa_len, char *buf, size_t size);
+extern const char *sockaddr_str_port_r (const struct sockaddr *sa, const int *sa_len, char *buf, size_t size);
+
+extern BOOL ws_sock_info (SOCKET s, int *type, struct sockaddr_storage *local,
+                          struct sockaddr_storage *peer);
+
 #endif
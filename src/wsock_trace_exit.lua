@@ -11,3 +11,11 @@ if ws.get_trace_level() >= 1 then
   ws.trace_puts (string.format("  Bye from ~1%s~0 at line %d\n", __FILE__(), __LINE__()))
 end
 
+--
+-- Collect what the hooks of all threads posted to the mailbox:
+--
+-- for i, msg in ipairs(ws.receive()) do
+--   ws.trace_puts (string.format("  %d: %s\n", i, msg))
+-- end
+-- ws.trace_puts (string.format("  Bytes sent: %d\n", ws.counter_get(0)))
+
@@ -18,8 +18,13 @@ function __FUNC__()
   return debug.getinfo(2,'n').name
 end
 
-WSAStartup = function (arg)
-  io.write (string.format("Hello from %s().\n", __FUNC__()))
+--
+-- A hook registered with 'ws.register_hook()' is called after the real
+-- function as 'handler (rc, socket, len, address)'. The 'socket' and
+-- 'address' are 'nil' when not known. Return 'false' to not trace the call.
+--
+WSAStartup = function (rc, s, len, addr)
+  ws.trace_puts (string.format("  Hello from WSAStartup(), rc: %d.\n", rc))
 end
 
 --- Try the MinGW base names first.
@@ -74,7 +79,11 @@ end
 
 who_am_I = __FILE__()
 
-if ws.get_trace_level() >= 1 then
+--
+-- With '[lua] per_thread = 1', this also runs in the state of each thread.
+-- Print the banners only once.
+--
+if not ws_per_thread and ws.get_trace_level() >= 1 then
   ws.trace_puts (string.format("  ws.get_trace_level: ~1%d~0.\n", ws.get_trace_level()))
 
   if nil then
@@ -101,6 +110,22 @@ if ws.get_trace_level() >= 1 then
   ws.trace_puts (string.format("  ws.get_builder():   ~1%s~0.\n", ws.get_builder()))
 end
 
---ws.register_hook (WSAStartup, "2")
+ws.register_hook ("WSAStartup", WSAStartup)
 
-WSAStartup()
+--
+-- E.g. do not trace a 'recv()' that returned no data:
+--
+-- ws.register_hook ("recv", function (rc, s, len, addr)
+--   return len > 0
+-- end)
+--
+-- With '[lua] per_thread = 1', this script runs in a new Lua-state for
+-- each thread calling a hook. The states share nothing but these:
+--   ws.post (string)           -- add a message to the shared mailbox
+--   ws.receive()               -- take all messages as an array
+--   ws.counter_add (idx [, n]) -- add 'n' (default 1) to counter 'idx' (0 - 63)
+--   ws.counter_get (idx)
+--
+-- ws.register_hook ("send", function (rc, s, len, addr)
+--   if rc > 0 then ws.counter_add (0, rc) end
+-- end)
@@ -9,8 +9,19 @@
 #if defined(USE_LUA)  /* Rest of file */
 
 #include "init.h"
+#include "wsock_trace.h"
 #include "wsock_trace_lua.h"
 
+/* The scripts precompiled by 'luajit -bg'. Generated by the makefiles.
+ */
+#if defined(USE_LUA_BC)
+  #include "wsock_trace_init_bc.h"
+  #include "wsock_trace_exit_bc.h"
+  #define BUILTIN_BC(x)  luaJIT_BC_##x, luaJIT_BC_##x##_SIZE
+#else
+  #define BUILTIN_BC(x)  NULL, 0
+#endif
+
 #include "lj_arch.h"
 
 #if !defined(LJ_HASFFI) || (LJ_HASFFI == 0)
@@ -33,19 +44,74 @@
         trace_printf ("~8LUA: ~9" fmt "~0", \
                       ## __VA_ARGS__)
 
-/* There is only one Lua-state variable.
+/* The Lua-state created at 'DLL_PROCESS_ATTACH'.
+ * With 'per_thread = 1', it only runs the init and exit scripts.
  */
 static lua_State *L = NULL;
 
-/* The function-signature of currently hooking function.
+/* The Lua handlers registered with 'ws.register_hook()' in 'L'.
+ * With 'per_thread = 1', a non-zero value only tells that the
+ * scripts has a handler for this function.
  */
-const char *wslua_func_sig = NULL;
+int wslua_refs [WSLUA_FUNC_MAX];
+
+/* With 'per_thread = 1', each thread running a hook gets it's own
+ * 'lua_State' (found via TLS) when it first needs one. It runs the same
+ * init script (or bytecode) as 'L'. The state is closed when the thread
+ * dies and the block is reused by a new thread.
+ */
+struct wslua_thread {
+       struct wslua_thread *next;
+       volatile LONG        owner;     /* thread-id using this block or 0 */
+       lua_State           *l;
+       BOOL                 init_ok;
+       int                  refs [WSLUA_FUNC_MAX];
+       int                  pending;   /* 1 + the 'enum wslua_func' of 'verdict' or 0 */
+       BOOL                 verdict;   /* from 'wslua_hook_nolock()' */
+     };
+
+static struct wslua_thread *volatile wslua_threads = NULL;
+static DWORD wslua_tls = TLS_OUT_OF_INDEXES;
+
+#define WSLUA_STATE_KEY  "wsock_trace.thread"
+
+/* The mailbox shared by all states. 'ws.post()' pushes a message with
+ * an 'InterlockedCompareExchangePointer()', 'ws.receive()' takes all
+ * messages with one 'InterlockedExchangePointer()'. No locks.
+ */
+struct wslua_msg {
+       struct wslua_msg *next;
+       size_t            len;
+       char              data [1];
+     };
+
+#define WSLUA_MAX_MSG       100000   /* max messages not received */
+#define WSLUA_NUM_COUNTERS  64       /* for 'ws.counter_add()' */
+
+static struct wslua_msg *volatile wslua_mailbox = NULL;
+static volatile LONG wslua_mailbox_len = 0;
+static volatile LONG wslua_counters [WSLUA_NUM_COUNTERS];
+
+static const char *wslua_func_names [WSLUA_FUNC_MAX] = {
+                  "WSAStartup",
+                  "WSACleanup",
+                  "connect",
+                  "recv",
+                  "recvfrom",
+                  "send",
+                  "sendto"
+                };
 
 static BOOL init_script_ok = FALSE;
 static BOOL open_ok        = TRUE;
 
 static void wslua_init (const char *script);
 static void wslua_exit (const char *script);
+static void wslua_thread_exit (void);
+static void print_stack (lua_State *l);
+static lua_State *wslua_new_state (struct wslua_thread *t);
+static BOOL wslua_run_script (lua_State *l, const char *script, const char *name,
+                              const unsigned char *bc, size_t bc_size);
 
 BOOL wslua_DllMain (HINSTANCE instDLL, DWORD reason)
 {
@@ -84,7 +150,7 @@ BOOL wslua_DllMain (HINSTANCE instDLL, DWORD reason)
   }
   else if (reason == DLL_THREAD_DETACH)
   {
-    /** \todo */
+    wslua_thread_exit();
   }
 
   LUA_TRACE (1, "rc: %d, dll: %s\n"
@@ -93,39 +159,158 @@ BOOL wslua_DllMain (HINSTANCE instDLL, DWORD reason)
   return (rc);
 }
 
-static const char *get_func_sig (void)
+/*
+ * Get the state of this thread. Create it and run the init script in it
+ * the first time. Returns NULL for a thread where this failed.
+ */
+static struct wslua_thread *wslua_thread_get (void)
+{
+  struct wslua_thread *t;
+  BOOL   first;
+
+  if (wslua_tls == TLS_OUT_OF_INDEXES)
+     return (NULL);
+
+  t = tls_block_get (wslua_tls, (void*volatile*)&wslua_threads, sizeof(*t), &first);
+  if (!t || !first)
+     return (t && t->init_ok ? t : NULL);
+
+  memset (t->refs, '\0', sizeof(t->refs));
+  t->pending = 0;
+  t->l = wslua_new_state (t);
+  t->init_ok = (t->l && wslua_run_script(t->l, g_cfg.lua.init_script, "=wsock_trace_init.lua",
+                                         BUILTIN_BC(wsock_trace_init)));
+  ENTER_CRIT();
+  LUA_TRACE (2, "New Lua-state for thread %ld: init_ok: %d\n", (long)t->owner, t->init_ok);
+  LEAVE_CRIT();
+  return (t->init_ok ? t : NULL);
+}
+
+/*
+ * Called on 'DLL_THREAD_DETACH'. Close the state of this thread
+ * and let another thread reuse the block.
+ */
+static void wslua_thread_exit (void)
 {
-  static char buf [100];
+  struct wslua_thread *t;
 
-  if (!wslua_func_sig)
-     return ("None");
+  if (wslua_tls == TLS_OUT_OF_INDEXES)
+     return;
 
-  strcpy (buf, wslua_func_sig);
+  t = TlsGetValue (wslua_tls);
+  if (!t)
+     return;
 
-#if !(defined(_MSC_VER) && defined(__FUNCSIG__))
-  strcat (buf, "()");
-#endif
-  return (buf);
+  if (t->l)
+     lua_close (t->l);
+  t->l = NULL;
+  t->init_ok = FALSE;
+  tls_block_release (wslua_tls);
 }
 
 /*
- * The Lua-hooks.
- * For the moment these does nothing.
+ * Call the handler of 'func' in state 'l' as 'handler (rc, socket, len, address)'.
+ * 'socket' and 'address' are 'nil' when not known. Returns FALSE if
+ * the handler returned 'false'; anything else means "trace this call".
+ *
+ * A handler that raises an error, is unregistered.
  */
-int wslua_WSAStartup (WORD ver, WSADATA *data)
+static BOOL wslua_call (lua_State *l, int *refs, enum wslua_func func,
+                        int rc, SOCKET s, int len, const struct sockaddr *sa)
 {
-  if (g_cfg.lua.enable)
-     LUA_TRACE (1, "wslua_func_sig: ~9'%s'\n", get_func_sig());
-  ARGSUSED (ver);
-  ARGSUSED (data);
-  return (0);
+  const char *msg;
+  BOOL  ret = TRUE;
+
+  lua_rawgeti (l, LUA_REGISTRYINDEX, refs[func]);
+  lua_pushinteger (l, rc);
+  if (s == INVALID_SOCKET)
+       lua_pushnil (l);
+  else lua_pushnumber (l, (lua_Number)s);
+  lua_pushinteger (l, len);
+  if (sa)
+  {
+    int sa_len = (sa->sa_family == AF_INET6) ? (int)sizeof(struct sockaddr_in6) :
+                                               (int)sizeof(struct sockaddr_in);
+    lua_pushstring (l, sockaddr_str2(sa, &sa_len));
+  }
+  else
+    lua_pushnil (l);
+
+  if (lua_pcall(l, 4, 1, 0) == 0)
+  {
+    ret = (lua_isnil(l, -1) || lua_toboolean(l, -1));
+    lua_pop (l, 1);
+  }
+  else
+  {
+    msg = lua_tostring (l, -1);
+    ENTER_CRIT();
+    LUA_WARNING ("Hook for %s() failed; removed:~0\n  %s\n",
+                 wslua_func_names[func], msg ? msg : "(error object is not a string)");
+    LEAVE_CRIT();
+    lua_pop (l, 1);
+    luaL_unref (l, LUA_REGISTRYINDEX, refs[func]);
+    refs [func] = 0;
+  }
+  return (ret);
 }
 
-int wslua_WSACleanup (void)
+/*
+ * Called from 'WSLUA_HOOK()' inside 'ENTER_CRIT()'.
+ * With 'per_thread = 1', return the verdict of a 'wslua_hook_nolock()'
+ * for the same call. Otherwise call the handler in the thread's state.
+ * The 'WSAGetLastError()' value is kept.
+ */
+BOOL wslua_hook (enum wslua_func func, int rc, SOCKET s, int len, const struct sockaddr *sa)
 {
-  if (g_cfg.lua.enable)
-     LUA_TRACE (1, "wslua_func_sig: ~9'%s'\n", get_func_sig());
-  return (0);
+  struct wslua_thread *t;
+  DWORD  err = GetLastError();
+  BOOL   ret = TRUE;
+
+  if (!g_cfg.lua.per_thread)
+  {
+    if (L && wslua_refs[func])
+       ret = wslua_call (L, wslua_refs, func, rc, s, len, sa);
+  }
+  else if ((t = wslua_thread_get()) != NULL)
+  {
+    if (t->pending == (int)func + 1)
+         ret = t->verdict;
+    else if (t->refs[func])
+         ret = wslua_call (t->l, t->refs, func, rc, s, len, sa);
+    t->pending = 0;
+  }
+  SetLastError (err);
+  return (ret);
+}
+
+/*
+ * Called from 'WSLUA_HOOK_NOLOCK()' before 'ENTER_CRIT()' with 'per_thread = 1'.
+ * Run the handler in the thread's own state and keep the verdict for the
+ * following 'WSLUA_HOOK()'. So the threads does not wait for each other.
+ */
+void wslua_hook_nolock (enum wslua_func func, int rc, SOCKET s, int len, const struct sockaddr *sa)
+{
+  struct wslua_thread *t;
+  DWORD  err = GetLastError();
+
+  t = wslua_thread_get();
+  if (t)
+  {
+    t->verdict = t->refs[func] ? wslua_call (t->l, t->refs, func, rc, s, len, sa) : TRUE;
+    t->pending = (int)func + 1;
+  }
+  SetLastError (err);
+}
+
+/*
+ * Called from 'WSLUA_HOOK_NOLOCK()'. A handler must not run for a call
+ * that 'EXCLUDE_THIS()' will drop. 'SAMPLE_THIS()' needs the lock; with
+ * sampling, 'WSLUA_HOOK()' runs the handler after it instead.
+ */
+BOOL wslua_nolock_excluded (int slot)
+{
+  return (g_cfg.trace_level == 0 || g_cfg.trace_sampling || exclude_func_peek(slot));
 }
 
 static BOOL execute_and_report (lua_State *l)
@@ -145,21 +330,37 @@ static BOOL execute_and_report (lua_State *l)
   }
 
   LUA_WARNING ("Failed to load script (rc = %d):~0\n  %s\n", rc, msg);
-  wslua_print_stack();
+  print_stack (l);
   return (FALSE);
 }
 
 /*
  * Inspired from the example in Swig:
  * <Swig-Root>/Examples/lua/embed/embed.c
+ *
+ * With 'script = builtin', run the precompiled bytecode 'bc' of size 'bc_size'
+ * instead of a file. 'bc' is NULL if not built with 'USE_LUA_BC'.
  */
-static BOOL wslua_run_script (lua_State *l, const char *script)
+static BOOL wslua_run_script (lua_State *l, const char *script, const char *name,
+                              const unsigned char *bc, size_t bc_size)
 {
-  LUA_TRACE (1, "Launching script: %s\n", script ? script : "<none>");
+  LUA_TRACE (l == L ? 1 : 3, "Launching script: %s\n", script ? script : "<none>");
 
   if (!script)
      return (FALSE);
 
+  if (!stricmp(script, "builtin"))
+  {
+    if (!bc)
+    {
+      LUA_WARNING ("No builtin %s; not built with 'USE_LUA_BC'.\n", name+1);
+      return (FALSE);
+    }
+    if (luaL_loadbuffer(l, (const char*)bc, bc_size, name) == 0)
+       return execute_and_report (l);
+    return (FALSE);
+  }
+
   if (luaL_loadfile(l, script) == 0)
      return execute_and_report (l);
   return (FALSE);
@@ -210,19 +411,153 @@ static int wslua_set_trace_level (lua_State *l)
   return (1);
 }
 
+/*
+ * 'ws.register_hook ("send", function (rc, socket, len, address) ... end)'.
+ * A 'nil' function removes the handler. The name is looked up only here;
+ * a hook calls the handler via it's slot in 'wslua_refs[]'.
+ */
 static int wslua_register_hook (lua_State *l)
 {
-  const lua_CFunction func1 = lua_tocfunction (L, LUA_ENVIRONINDEX);
-  const lua_CFunction func2 = lua_tocfunction (L, 2);
+  const char          *name = luaL_checkstring (l, 1);
+  struct wslua_thread *t;
+  int   *refs = wslua_refs;
+  int    i;
+
+  lua_getfield (l, LUA_REGISTRYINDEX, WSLUA_STATE_KEY);
+  t = lua_touserdata (l, -1);
+  lua_pop (l, 1);
+  if (t)
+     refs = t->refs;
+
+  for (i = 0; i < WSLUA_FUNC_MAX; i++)
+      if (!strcmp(name, wslua_func_names[i]))
+         break;
 
-  LUA_TRACE (1, "func1=%p, func2=%p\n", func1, func2);
-  ARGSUSED (l);
-  return (1);
+  if (i == WSLUA_FUNC_MAX)
+     return luaL_error (l, "register_hook(): no hook for '%s'", name);
+
+  if (!lua_isnil(l, 2))
+     luaL_checktype (l, 2, LUA_TFUNCTION);
+
+  if (refs[i])
+     luaL_unref (l, LUA_REGISTRYINDEX, refs[i]);
+  refs[i] = 0;
+
+  if (!lua_isnil(l, 2))
+  {
+    lua_pushvalue (l, 2);
+    refs[i] = luaL_ref (l, LUA_REGISTRYINDEX);
+  }
+
+  /* A thread's state runs the same script as 'L'. But if it registers
+   * more, 'WSLUA_HOOK()' must know.
+   */
+  if (t && refs[i])
+     wslua_refs[i] = -1;
+
+  LUA_TRACE (1, "register_hook (\"%s\"): ref %d\n", name, refs[i]);
+  return (0);
 }
 
 static int wslua_trace_puts (lua_State *l)
 {
+  ENTER_CRIT();    /* a thread's state may call us outside 'ENTER_CRIT()' */
   trace_puts (lua_tostring(l,1));
+  LEAVE_CRIT();
+  return (1);
+}
+
+/*
+ * 'ws.post (string)': add a message to the mailbox shared by all states.
+ * Returns false if the mailbox is full.
+ */
+static int wslua_post (lua_State *l)
+{
+  size_t            len;
+  const char       *str = luaL_checklstring (l, 1, &len);
+  struct wslua_msg *msg, *next;
+
+  if (InterlockedIncrement(&wslua_mailbox_len) > WSLUA_MAX_MSG ||
+      (msg = malloc(sizeof(*msg) + len)) == NULL)
+  {
+    InterlockedDecrement (&wslua_mailbox_len);
+    lua_pushboolean (l, 0);
+    return (1);
+  }
+
+  msg->len = len;
+  memcpy (msg->data, str, len);
+  msg->data [len] = '\0';
+  do
+  {
+    next = wslua_mailbox;
+    msg->next = next;
+  }
+  while (InterlockedCompareExchangePointer((void*volatile*)&wslua_mailbox, msg, next) != next);
+
+  lua_pushboolean (l, 1);
+  return (1);
+}
+
+/*
+ * 'ws.receive()': take all messages in the mailbox. Returns them as an
+ * array in the order they were posted (per thread).
+ */
+static int wslua_receive (lua_State *l)
+{
+  struct wslua_msg *msg, *prev = NULL, *next;
+  int    i = 0;
+
+  msg = InterlockedExchangePointer ((void*volatile*)&wslua_mailbox, NULL);
+
+  /* Reverse into FIFO order.
+   */
+  while (msg)
+  {
+    next = msg->next;
+    msg->next = prev;
+    prev = msg;
+    msg = next;
+  }
+
+  lua_newtable (l);
+  for (msg = prev; msg; msg = next)
+  {
+    next = msg->next;
+    lua_pushlstring (l, msg->data, msg->len);
+    lua_rawseti (l, -2, ++i);
+    free (msg);
+  }
+  InterlockedExchangeAdd (&wslua_mailbox_len, -i);
+  return (1);
+}
+
+/*
+ * 'ws.counter_add (idx, n)' and 'ws.counter_get (idx)':
+ * 'WSLUA_NUM_COUNTERS' 32-bit counters shared by all states.
+ */
+static int wslua_counter_idx (lua_State *l)
+{
+  int idx = luaL_checkint (l, 1);
+
+  luaL_argcheck (l, idx >= 0 && idx < WSLUA_NUM_COUNTERS, 1, "counter index out of range");
+  return (idx);
+}
+
+static int wslua_counter_add (lua_State *l)
+{
+  int  idx = wslua_counter_idx (l);
+  LONG n   = (LONG) luaL_optinteger (l, 2, 1);
+
+  lua_pushinteger (l, InterlockedExchangeAdd(&wslua_counters[idx], n) + n);
+  return (1);
+}
+
+static int wslua_counter_get (lua_State *l)
+{
+  int idx = wslua_counter_idx (l);
+
+  lua_pushinteger (l, wslua_counters[idx]);
   return (1);
 }
 
@@ -273,13 +608,19 @@ static int wslua_get_builder (lua_State *l)
 }
 
 void wslua_print_stack (void)
+{
+  if (L)
+     print_stack (L);
+}
+
+static void print_stack (lua_State *l)
 {
   lua_Debug ar;
   int       level = 0;
 
-  while (lua_getstack(L, level++, &ar))
+  while (lua_getstack(l, level++, &ar))
   {
-    lua_getinfo (L, "Snl", &ar);
+    lua_getinfo (l, "Snl", &ar);
     trace_printf ("  %s:", ar.short_src);
     if (ar.currentline > 0)
        trace_printf ("%d:", ar.currentline);
@@ -303,9 +644,13 @@ static int wstrace_lua_panic (lua_State *l)
   const char *msg = lua_tostring (l, 1);
 
   LUA_WARNING ("Panic: %s\n", msg);
-  wslua_print_stack();
-  lua_close (L);
-  L = NULL;
+  print_stack (l);
+  if (l == L)
+  {
+    lua_close (L);
+    L = NULL;
+    memset (wslua_refs, '\0', sizeof(wslua_refs));
+  }
   return (0);
 }
 
@@ -343,24 +688,54 @@ static void wstrace_lua_hook (lua_State *l, lua_Debug *_ld)
   trace_puts ("~0\n");
 }
 
+/*
+ * Create a new state with the Lua libraries. 't' is the block of the thread
+ * it is for, or NULL for 'L'.
+ */
+static lua_State *wslua_new_state (struct wslua_thread *t)
+{
+  lua_State *l = luaL_newstate();
+
+  if (!l)
+     return (NULL);
+
+  luaL_openlibs (l);    /* Load Lua libraries */
+
+  /* Set up the 'panic' handler, which let's us control Lua execution.
+   */
+  lua_atpanic (l, wstrace_lua_panic);
+
+  lua_pushlightuserdata (l, t);
+  lua_setfield (l, LUA_REGISTRYINDEX, WSLUA_STATE_KEY);
+
+  /* Lets the init script tell a thread's state from 'L'.
+   */
+  lua_pushboolean (l, t != NULL);
+  lua_setglobal (l, "ws_per_thread");
+
+#if 1
+  lua_pushcfunction (l, wslua_get_trace_level);
+  lua_setglobal (l, "get_trace_level");
+
+  lua_pushcfunction (l, wslua_set_trace_level);
+  lua_setglobal (l, "set_trace_level");
+#endif
+
+  if (g_cfg.lua.trace_level >= 3)
+     lua_sethook (l, wstrace_lua_hook, LUA_MASKCALL | LUA_HOOKRET | LUA_MASKLINE, 0);
+  return (l);
+}
+
 /**
  * Called from 'DllMain()' / 'DLL_PROCESS_ATTATACH' to setup Lua
  * and optionally run the given 'script'.
  *
- * \todo:
- *   Support a byte-code generated script to be generated by e.g:
- *   $(LUAJIT_ROOT)/src/luajit -b wsock_trace_init.lua wsock_trace_init.h
- *
- *   Then add:
- *     #include "wsock_trace_init.h"
+ * With 'lua_init = builtin', the script is the 'wsock_trace_init.lua'
+ * compiled into this DLL. The makefiles generates 'wsock_trace_init_bc.h'
+ * with:
+ *   $(LUAJIT_ROOT)/src/luajit -bg -n wsock_trace_init wsock_trace_init.lua wsock_trace_init_bc.h
  *
- *   here and execute 'luaL_loadstring (l, luaJIT_BC_wsock_trace_init)'
- *   here would do the same thing. But that would be another chicken
- *   and egg problem.
- *
- *   A better way is maybe to generate an .obj-file:
- *   $(LUAJIT_ROOT)/src/luajit -b wsock_trace_init.lua wsock_trace_init.obj
- *   and simply execute that.
+ * and 'luaL_loadbuffer()' loads it without parsing any Lua source.
  *
  *  \note:
  *    The 'luajit -b' command is really executed by
@@ -368,48 +743,97 @@ static void wstrace_lua_hook (lua_State *l, lua_Debug *_ld)
  *    the '$(LUAJIT_ROOT)/src' part.
  *    E.g. do a:
  *      set LUA_PATH=c:\net\wsock_trace\LuaJIT\src\?.lua;?.lua
+ *
+ * With 'per_thread = 1', the init script is also run in the state of
+ * each thread. See 'wslua_thread_get()'.
  */
 static void wslua_init (const char *script)
 {
   if (L)
      return;
 
-  L = luaL_newstate();
-  luaL_openlibs (L);    /* Load Lua libraries */
-
-  /* Set up the 'panic' handler, which let's us control Lua execution.
-   */
-  lua_atpanic (L, wstrace_lua_panic);
-
-#if 1
-  lua_pushcfunction (L, wslua_get_trace_level);
-  lua_setglobal (L, "get_trace_level");
+  L = wslua_new_state (NULL);
+  if (g_cfg.lua.per_thread)
+  {
+    wslua_tls = TlsAlloc();
+    if (wslua_tls == TLS_OUT_OF_INDEXES)
+       g_cfg.lua.per_thread = FALSE;
+  }
+  init_script_ok = wslua_run_script (L, script, "=wsock_trace_init.lua",
+                                     BUILTIN_BC(wsock_trace_init));
+}
 
-  lua_pushcfunction (L, wslua_set_trace_level);
-  lua_setglobal (L, "set_trace_level");
-#endif
+/*
+ * Return TRUE if thread 'tid' is still running. At process exit, the
+ * other threads are killed without a 'DLL_THREAD_DETACH'.
+ */
+static BOOL wslua_thread_alive (LONG tid)
+{
+  HANDLE thr;
+  DWORD  code;
+  BOOL   alive = FALSE;
 
-  if (g_cfg.lua.trace_level >= 3)
-     lua_sethook (L, wstrace_lua_hook, LUA_MASKCALL | LUA_HOOKRET | LUA_MASKLINE, 0);
+  if (tid == 0 || tid == (LONG)GetCurrentThreadId())
+     return (FALSE);
 
-  init_script_ok = wslua_run_script (L, script);
+  thr = OpenThread (THREAD_QUERY_INFORMATION, FALSE, (DWORD)tid);
+  if (thr)
+  {
+    alive = (GetExitCodeThread(thr, &code) && code == STILL_ACTIVE);
+    CloseHandle (thr);
+  }
+  return (alive);
 }
 
 /**
  * Called on 'wslua_DllMain (...DLL_PROCESS_DETACH)' to tear down
  * Lua and optionally run the 'script'.
  * Provided the 'script' in 'wslua_init()' ran okay.
+ *
+ * The script runs only in 'L'. It can collect what the threads posted
+ * with 'ws.receive()'. Then close the states of the exited threads.
+ * A state of a thread still running (after a 'FreeLibrary()') could be
+ * in a handler now; it is leaked.
  */
 static void wslua_exit (const char *script)
 {
+  struct wslua_thread *t, *next;
+  struct wslua_msg    *msg;
+
   if (!L)
      return;
 
   if (init_script_ok && open_ok)
-     wslua_run_script (L, script);
+     wslua_run_script (L, script, "=wsock_trace_exit.lua", BUILTIN_BC(wsock_trace_exit));
   lua_sethook (L, NULL, 0, 0);
+  memset (wslua_refs, '\0', sizeof(wslua_refs));
   lua_close (L);
   L = NULL;
+
+  for (t = wslua_threads; t; t = next)
+  {
+    next = t->next;
+    if (wslua_thread_alive(t->owner))
+       continue;
+    if (t->l)
+       lua_close (t->l);
+    free (t);
+  }
+  wslua_threads = NULL;
+
+  msg = InterlockedExchangePointer ((void*volatile*)&wslua_mailbox, NULL);
+  while (msg)
+  {
+    struct wslua_msg *m_next = msg->next;
+
+    free (msg);
+    msg = m_next;
+  }
+  wslua_mailbox_len = 0;
+
+  if (wslua_tls != TLS_OUT_OF_INDEXES)
+     TlsFree (wslua_tls);
+  wslua_tls = TLS_OUT_OF_INDEXES;
 }
 
 static const struct luaL_reg wslua_table[] = {
@@ -421,6 +845,10 @@ static const struct luaL_reg wslua_table[] = {
   { "get_builder",         wslua_get_builder },
   { "set_trace_level",     wslua_set_trace_level },
   { "get_trace_level",     wslua_get_trace_level },
+  { "post",                wslua_post },
+  { "receive",             wslua_receive },
+  { "counter_add",         wslua_counter_add },
+  { "counter_get",         wslua_counter_get },
   { NULL,                  NULL }
 };
 
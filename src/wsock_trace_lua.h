@@ -9,26 +9,69 @@
   #include <lualib.h>
   #include <lauxlib.h>
 
-  extern const char *wslua_func_sig;
+  /*
+   * The functions a Lua-script can hook with 'ws.register_hook()'.
+   * Keep in sync with 'wslua_func_names[]' in wsock_trace_lua.c.
+   */
+  enum wslua_func {
+       WSLUA_FUNC_WSAStartup = 0,
+       WSLUA_FUNC_WSACleanup,
+       WSLUA_FUNC_connect,
+       WSLUA_FUNC_recv,
+       WSLUA_FUNC_recvfrom,
+       WSLUA_FUNC_send,
+       WSLUA_FUNC_sendto,
+       WSLUA_FUNC_MAX
+     };
+
+  /* The registry-reference of the Lua handler for each 'enum wslua_func'.
+   * Or 0 if there is no handler.
+   */
+  extern int wslua_refs [WSLUA_FUNC_MAX];
 
   extern BOOL wslua_DllMain (HINSTANCE instDLL, DWORD reason);
   extern void wslua_print_stack (void);
+  extern BOOL wslua_hook        (enum wslua_func func, int rc, SOCKET s, int len, const struct sockaddr *sa);
+  extern void wslua_hook_nolock (enum wslua_func func, int rc, SOCKET s, int len, const struct sockaddr *sa);
+  extern BOOL wslua_nolock_excluded (int slot);
 
-  extern int wslua_WSAStartup (WORD ver, WSADATA *data);
-  extern int wslua_WSACleanup (void);
+  /*
+   * Call the Lua handler for 'func' (if there is one) in a hook that is
+   * to be traced. If the handler returns 'false', the call is not traced.
+   * A function without a handler costs only a test on 'wslua_refs[]'.
+   */
+  #define WSLUA_HOOK(func, rc, s, len, sa)                               \
+          do {                                                           \
+            if (wslua_refs[WSLUA_FUNC_##func] && !exclude_this &&        \
+                !wslua_hook(WSLUA_FUNC_##func, (int)(rc), (SOCKET)(s),   \
+                            (int)(len), (const struct sockaddr*)(sa)))   \
+               exclude_this = TRUE;                                      \
+          } while (0)
 
-  #if defined(_MSC_VER) && defined(__FUNCSIG__)
-   /*
-    * MSVC supports '__FUNCSIG__' and includes full list of arguments.
-    * E.g. in 'void foo(int bar)', __FUNCSIG__' gives "void foo(int bar)".
-    */
-    #define WSLUA_HOOK(rc, func)  wslua_func_sig = __FUNCSIG__, rc = func
-  #else
-    #define WSLUA_HOOK(rc, func)  wslua_func_sig = __FUNCTION__, rc = func
-  #endif
+  /*
+   * With '[lua] per_thread = 1', the hooks of the data functions calls
+   * this before 'ENTER_CRIT()'. The handler then runs in the state of the
+   * calling thread without any lock. The following 'WSLUA_HOOK()' uses
+   * the result. A call the 'EXCLUDE_THIS()' or 'SAMPLE_THIS()' filters
+   * could drop, is left to 'WSLUA_HOOK()'; see 'wslua_nolock_excluded()'.
+   */
+  #define WSLUA_HOOK_NOLOCK(func, rc, s, len, sa)                              \
+          do {                                                                 \
+            static int _slot = -2;                                             \
+                                                                               \
+            if (wslua_refs[WSLUA_FUNC_##func] && g_cfg.lua.per_thread)         \
+            {                                                                  \
+              if (_slot == -2)                                                 \
+                 _slot = ws2_func_slot (#func);                                \
+              if (!wslua_nolock_excluded(_slot))                               \
+                 wslua_hook_nolock (WSLUA_FUNC_##func, (int)(rc), (SOCKET)(s), \
+                                    (int)(len), (const struct sockaddr*)(sa)); \
+            }                                                                  \
+          } while (0)
 
 #else
-  #define WSLUA_HOOK(rc, func)    ((void)0)
+  #define WSLUA_HOOK(func, rc, s, len, sa)         ((void)0)
+  #define WSLUA_HOOK_NOLOCK(func, rc, s, len, sa)  ((void)0)
 #endif
 
 #endif /* USE_LUA && !_WSOCK_TRACE_LUA_H */